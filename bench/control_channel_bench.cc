@@ -0,0 +1,119 @@
+#include "htn_config.h"
+
+#include "benchmark/benchmark.h"
+#include "webrtc/base/refcount.h"
+#include "data_channel.h"
+#include "fake_data_channel.h"
+
+
+namespace hotline {
+
+namespace {
+
+// Counts the control messages a HotlineControlDataChannel parsed.
+class CountingObserver : public HotlineDataChannelObserver {
+public:
+  CountingObserver() : messages(0) {}
+
+  virtual void OnControlDataChannelOpen(rtc::scoped_refptr<HotlineDataChannel> channel, bool is_local) {}
+  virtual void OnControlDataChannelClosed(rtc::scoped_refptr<HotlineDataChannel> channel, bool is_local) {}
+  virtual void OnSocketDataChannelOpen(rtc::scoped_refptr<HotlineDataChannel> channel) {}
+  virtual void OnSocketDataChannelClosed(rtc::scoped_refptr<HotlineDataChannel> channel) {}
+
+  virtual void OnCreateChannel(rtc::SocketAddress& remote_address, cricket::ProtocolType protocol,
+                               LaneSettings& settings) { messages++; }
+  virtual void OnStopChannel(std::string& channel_name) { messages++; }
+  virtual void OnChannelCreated(LaneSettings& settings) { messages++; }
+  virtual void OnServerSideReady(std::string& channel_name) { messages++; }
+  virtual void OnDedupAck(const std::map<int, uint64_t>& decoded,
+                          const std::vector<int>& closed) { messages++; }
+  virtual void OnDedupResend(int lane, uint64 record) { messages++; }
+  virtual void OnClockProbe(uint64 sent) { messages++; }
+  virtual void OnClockReply(uint64 sent, uint64 remote) { messages++; }
+
+  size_t messages;
+};
+
+typedef rtc::RefCountedObject<FakeDataChannel> FakeChannel;
+typedef rtc::RefCountedObject<HotlineControlDataChannel> ControlChannel;
+
+LaneSettings BenchLaneSettings() {
+  LaneSettings settings;
+  settings.compress_level = 6;
+  settings.dedup_cache = 64;
+  return settings;
+}
+
+} // namespace
+
+
+static void BM_ControlEncodeCreateChannel(benchmark::State& state) {
+  rtc::scoped_refptr<FakeChannel> fake(new FakeChannel("control"));
+  rtc::scoped_refptr<ControlChannel> channel(new ControlChannel(fake, true));
+  std::string remote_address("192.168.0.10:3389");
+  LaneSettings settings = BenchLaneSettings();
+
+  for (auto _ : state) {
+    channel->CreateChannel(remote_address, cricket::PROTO_TCP, settings);
+  }
+  state.SetItemsProcessed(fake->sent_count());
+}
+BENCHMARK(BM_ControlEncodeCreateChannel);
+
+
+static void BM_ControlEncodeServerSideReady(benchmark::State& state) {
+  rtc::scoped_refptr<FakeChannel> fake(new FakeChannel("control"));
+  rtc::scoped_refptr<ControlChannel> channel(new ControlChannel(fake, true));
+  std::string channel_name("socket-1234567890");
+
+  for (auto _ : state) {
+    channel->ServerSideReady(channel_name);
+  }
+  state.SetItemsProcessed(fake->sent_count());
+}
+BENCHMARK(BM_ControlEncodeServerSideReady);
+
+
+// The server side of a CreateChannel: parse it and dispatch to the
+// observer.
+static void BM_ControlParseCreateChannel(benchmark::State& state) {
+  rtc::scoped_refptr<FakeChannel> sender_fake(new FakeChannel("control"));
+  rtc::scoped_refptr<ControlChannel> sender(new ControlChannel(sender_fake, true));
+  std::string remote_address("192.168.0.10:3389");
+  sender->CreateChannel(remote_address, cricket::PROTO_TCP, BenchLaneSettings());
+  webrtc::DataBuffer message = sender_fake->last_sent();
+
+  rtc::scoped_refptr<FakeChannel> receiver_fake(new FakeChannel("control"));
+  rtc::scoped_refptr<ControlChannel> receiver(new ControlChannel(receiver_fake, false));
+  CountingObserver observer;
+  receiver->RegisterObserver(&observer);
+  webrtc::DataChannelObserver* incoming = receiver.get();
+
+  for (auto _ : state) {
+    incoming->OnMessage(message);
+  }
+  state.SetItemsProcessed(observer.messages);
+}
+BENCHMARK(BM_ControlParseCreateChannel);
+
+
+static void BM_ControlParseChannelCreated(benchmark::State& state) {
+  rtc::scoped_refptr<FakeChannel> sender_fake(new FakeChannel("control"));
+  rtc::scoped_refptr<ControlChannel> sender(new ControlChannel(sender_fake, false));
+  sender->ChannelCreated(BenchLaneSettings());
+  webrtc::DataBuffer message = sender_fake->last_sent();
+
+  rtc::scoped_refptr<FakeChannel> receiver_fake(new FakeChannel("control"));
+  rtc::scoped_refptr<ControlChannel> receiver(new ControlChannel(receiver_fake, true));
+  CountingObserver observer;
+  receiver->RegisterObserver(&observer);
+  webrtc::DataChannelObserver* incoming = receiver.get();
+
+  for (auto _ : state) {
+    incoming->OnMessage(message);
+  }
+  state.SetItemsProcessed(observer.messages);
+}
+BENCHMARK(BM_ControlParseChannelCreated);
+
+} // namespace hotline
@@ -0,0 +1,58 @@
+#ifndef HOTLINE_TUNNEL_BENCH_FAKE_DATA_CHANNEL_H_
+#define HOTLINE_TUNNEL_BENCH_FAKE_DATA_CHANNEL_H_
+#pragma once
+
+#include <string>
+
+#include "webrtc/base/refcount.h"
+#include "talk/app/webrtc/datachannelinterface.h"
+
+
+namespace hotline {
+
+//////////////////////////////////////////////////////////////////////
+// FakeDataChannel
+// An always open data channel that keeps the last message sent on it,
+// so HotlineDataChannel can be driven without a PeerConnection.
+// Create it as rtc::RefCountedObject<FakeDataChannel>.
+//
+class FakeDataChannel : public webrtc::DataChannelInterface {
+public:
+  explicit FakeDataChannel(const std::string& label)
+    : label_(label), observer_(NULL), sent_count_(0),
+      last_sent_(rtc::Buffer(), false) {}
+
+  virtual void RegisterObserver(webrtc::DataChannelObserver* observer) {
+    observer_ = observer;
+  }
+  virtual void UnregisterObserver() { observer_ = NULL; }
+  virtual std::string label() const { return label_; }
+  virtual bool reliable() const { return true; }
+  virtual int id() const { return 0; }
+  virtual DataState state() const { return kOpen; }
+  virtual uint64 buffered_amount() const { return 0; }
+  virtual void Close() {}
+  virtual bool Send(const webrtc::DataBuffer& buffer) {
+    last_sent_ = buffer;
+    sent_count_++;
+    return true;
+  }
+
+  const webrtc::DataBuffer& last_sent() const { return last_sent_; }
+  size_t sent_count() const { return sent_count_; }
+
+protected:
+  virtual ~FakeDataChannel() {}
+
+private:
+  std::string label_;
+  webrtc::DataChannelObserver* observer_;
+  size_t sent_count_;
+  webrtc::DataBuffer last_sent_;
+};
+
+//////////////////////////////////////////////////////////////////////
+
+} // namespace hotline
+
+#endif  // HOTLINE_TUNNEL_BENCH_FAKE_DATA_CHANNEL_H_
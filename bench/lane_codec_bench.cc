@@ -0,0 +1,189 @@
+#include "htn_config.h"
+
+#include <string.h>
+#include <map>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "bench_endpoint.h"
+#include "compression.h"
+#include "dedup.h"
+#include "fec.h"
+
+
+namespace hotline {
+
+namespace {
+
+// Text-like data that deflate does well on.
+std::vector<char> TextPayload(size_t size) {
+  static const char kText[] =
+      "GET /index.html HTTP/1.1\r\nHost: example.com\r\n"
+      "User-Agent: hotline-tunnel\r\nAccept: */*\r\n\r\n";
+  std::vector<char> data(size);
+  for (size_t i = 0; i < size; i++)
+    data[i] = kText[i % (sizeof(kText) - 1)];
+  return data;
+}
+
+std::vector<char> RandomPayload(size_t size) {
+  std::vector<char> data(size);
+  uint64 state = 0x9E3779B97F4A7C15ULL;
+  FillBenchPayload(&data[0], size, &state);
+  return data;
+}
+
+// Drops loss_percent of frames at random, xorshift from a fixed seed so
+// that runs compare.
+bool DropFrame(uint64* state, int loss_percent) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return static_cast<int>(*state % 100) < loss_percent;
+}
+
+} // namespace
+
+
+// A UDP lane through FEC both ways, dropping range(1) percent of frames
+// independently of each other.
+static void BM_FecEncodeDecode(benchmark::State& state) {
+  const int group_size = static_cast<int>(state.range(0));
+  const int loss_percent = static_cast<int>(state.range(1));
+  const size_t size = 1200;
+  std::vector<char> datagram = RandomPayload(size);
+  std::vector<char> data_frame, parity_frame;
+  FecEncoder encoder(group_size);
+  FecDecoder decoder(group_size);
+  uint64 loss_state = 0x9E3779B97F4A7C15ULL;
+  size_t delivered = 0;
+
+  for (auto _ : state) {
+    bool parity = encoder.Encode(&datagram[0], size, &data_frame, &parity_frame);
+    if (!DropFrame(&loss_state, loss_percent)) {
+      decoder.Decode(&data_frame[0], data_frame.size());
+      delivered += decoder.ready().size();
+    }
+    if (parity && !DropFrame(&loss_state, loss_percent)) {
+      decoder.Decode(&parity_frame[0], parity_frame.size());
+      delivered += decoder.ready().size();
+    }
+  }
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * size);
+  state.counters["recovered"] = static_cast<double>(decoder.recovered());
+  state.counters["lost"] = static_cast<double>(decoder.lost());
+  state.counters["delivered"] = state.iterations() ?
+      static_cast<double>(delivered) / static_cast<double>(state.iterations()) : 0;
+}
+BENCHMARK(BM_FecEncodeDecode)
+  ->Args({8, 0})
+  ->Args({8, 1})
+  ->Args({8, 5})
+  ->Args({8, 10})
+  ->Args({16, 1});
+
+
+static void BM_CompressText(benchmark::State& state) {
+  const size_t size = static_cast<size_t>(state.range(0));
+  std::vector<char> data = TextPayload(size);
+  std::vector<char> record;
+  LaneCompressor compressor(6);
+  LaneDecompressor decompressor;
+
+  for (auto _ : state) {
+    compressor.Compress(&data[0], size, &record);
+    const char* out;
+    size_t out_len;
+    decompressor.Decompress(&record[0], record.size(), &out, &out_len);
+    benchmark::DoNotOptimize(out);
+  }
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * size);
+  state.counters["ratio"] = compressor.bytes_in() ?
+      static_cast<double>(compressor.bytes_out()) / compressor.bytes_in() : 0;
+}
+BENCHMARK(BM_CompressText)->Arg(1024)->Arg(16 * 1024);
+
+
+// Incompressible data, which the compressor should pass through.
+static void BM_CompressRandom(benchmark::State& state) {
+  const size_t size = static_cast<size_t>(state.range(0));
+  std::vector<char> data = RandomPayload(size);
+  std::vector<char> record;
+  LaneCompressor compressor(6);
+
+  for (auto _ : state) {
+    compressor.Compress(&data[0], size, &record);
+    benchmark::DoNotOptimize(&record[0]);
+  }
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * size);
+  state.counters["bypassed"] = static_cast<double>(compressor.bypassed());
+}
+BENCHMARK(BM_CompressRandom)->Arg(1024)->Arg(16 * 1024);
+
+
+// What the control channel would carry back after every message.
+static void DeliverDedupAcks(DedupReceiveCache* receive_cache, DedupSendCache* send_cache) {
+  std::map<int, uint64_t> decoded;
+  std::vector<int> closed;
+  receive_cache->TakeAcks(&decoded, &closed);
+  std::map<int, uint64_t>::const_iterator it;
+  for (it = decoded.begin(); it != decoded.end(); ++it) {
+    send_cache->Acknowledge(it->first, it->second);
+  }
+}
+
+
+// The same range(0) bytes sent over and over, so all but the first pass
+// go out as references.
+static void BM_DedupRepeated(benchmark::State& state) {
+  const size_t size = static_cast<size_t>(state.range(0));
+  std::vector<char> data = RandomPayload(size);
+  std::vector<char> records, out;
+  DedupSendCache send_cache(64 * 1024 * 1024);
+  DedupReceiveCache receive_cache(64 * 1024 * 1024);
+  DedupEncoder encoder(&send_cache, 0);
+  DedupDecoder decoder(&receive_cache, 0);
+  uint64 wire_bytes = 0;
+
+  for (auto _ : state) {
+    records.clear();
+    encoder.Encode(&data[0], size, &records);
+    encoder.Flush(&records);
+    decoder.Decode(&records[0], records.size(), &out);
+    DeliverDedupAcks(&receive_cache, &send_cache);
+    wire_bytes += records.size();
+  }
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * size);
+  state.counters["wire_ratio"] = state.iterations() ?
+      static_cast<double>(wire_bytes) / (static_cast<double>(state.iterations()) * size) : 0;
+}
+BENCHMARK(BM_DedupRepeated)->Arg(64 * 1024)->Arg(1024 * 1024);
+
+
+// Fresh data every time: the cost of cutting and hashing chunks.
+static void BM_DedupUnique(benchmark::State& state) {
+  const size_t size = static_cast<size_t>(state.range(0));
+  std::vector<char> data(size);
+  std::vector<char> records, out;
+  DedupSendCache send_cache(64 * 1024 * 1024);
+  DedupReceiveCache receive_cache(64 * 1024 * 1024);
+  DedupEncoder encoder(&send_cache, 0);
+  DedupDecoder decoder(&receive_cache, 0);
+  uint64 random_state = 0x9E3779B97F4A7C15ULL;
+
+  for (auto _ : state) {
+    state.PauseTiming();
+    FillBenchPayload(&data[0], size, &random_state);
+    state.ResumeTiming();
+
+    records.clear();
+    encoder.Encode(&data[0], size, &records);
+    encoder.Flush(&records);
+    decoder.Decode(&records[0], records.size(), &out);
+    DeliverDedupAcks(&receive_cache, &send_cache);
+  }
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * size);
+}
+BENCHMARK(BM_DedupUnique)->Arg(64 * 1024);
+
+} // namespace hotline
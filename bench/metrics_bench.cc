@@ -0,0 +1,47 @@
+#include "htn_config.h"
+
+#include <atomic>
+
+#include "benchmark/benchmark.h"
+#include "metrics.h"
+
+
+namespace hotline {
+
+// What every lane message pays with -metrics: two adds to the lane and
+// two to the sharded totals.
+static void BM_LaneMetricsSent(benchmark::State& state) {
+  static TunnelMetrics metrics;
+  static TunnelMetrics::LaneMetrics* lanes[64];
+  if (state.thread_index() == 0) {
+    for (int i = 0; i < state.threads(); i++) lanes[i] = metrics.OpenLane("bench", "tcp");
+  }
+  // Each thread is a lane of its own, as lanes don't share a socket.
+  for (auto _ : state) {
+    lanes[state.thread_index()]->SentToTunnel(16 * 1024);
+  }
+  if (state.thread_index() == 0) {
+    for (int i = 0; i < state.threads(); i++) metrics.CloseLane(lanes[i]);
+  }
+}
+BENCHMARK(BM_LaneMetricsSent)->Threads(1)->Threads(4)->Threads(16);
+
+
+// The sharded totals against one atomic all threads add to.
+static void BM_ShardedCounterAdd(benchmark::State& state) {
+  static ShardedCounter counter;
+  for (auto _ : state) {
+    counter.Add(1);
+  }
+}
+BENCHMARK(BM_ShardedCounterAdd)->Threads(1)->Threads(4)->Threads(16);
+
+static void BM_SharedAtomicAdd(benchmark::State& state) {
+  static std::atomic<uint64> counter(0);
+  for (auto _ : state) {
+    counter.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+BENCHMARK(BM_SharedAtomicAdd)->Threads(1)->Threads(4)->Threads(16);
+
+} // namespace hotline
@@ -0,0 +1,75 @@
+#include "htn_config.h"
+
+#include <string.h>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "socket.h"
+
+
+namespace hotline {
+
+// One packet in and out of an empty queue, as when the socket keeps up.
+static void BM_PacketQueuePushPop(benchmark::State& state) {
+  SocketConnection::PacketQueue queue;
+  const size_t size = static_cast<size_t>(state.range(0));
+  std::vector<char> payload(size, 'x');
+  rtc::Buffer data(&payload[0], size);
+
+  for (auto _ : state) {
+    queue.Push(new webrtc::DataBuffer(data, true));
+    webrtc::DataBuffer* packet = queue.Front();
+    benchmark::DoNotOptimize(packet);
+    queue.Pop();
+  }
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * size);
+}
+BENCHMARK(BM_PacketQueuePushPop)->Arg(1024)->Arg(16 * 1024)->Arg(64 * 1024);
+
+
+// A backlog of 64 packets drained at once, as after the socket blocked.
+static void BM_PacketQueueBacklog(benchmark::State& state) {
+  SocketConnection::PacketQueue queue;
+  const size_t size = static_cast<size_t>(state.range(0));
+  const int backlog = 64;
+  std::vector<char> payload(size, 'x');
+  rtc::Buffer data(&payload[0], size);
+
+  for (auto _ : state) {
+    for (int i = 0; i < backlog; i++)
+      queue.Push(new webrtc::DataBuffer(data, true));
+    while (!queue.Empty())
+      queue.Pop();
+  }
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * size * backlog);
+}
+BENCHMARK(BM_PacketQueueBacklog)->Arg(1024)->Arg(16 * 1024);
+
+
+// The socket takes a quarter of the front packet per write, so the rest
+// is moved to the front of the buffer each time, the way
+// SocketConnection::SendQueuedDataMessages() does.
+static void BM_PacketQueuePartialFlush(benchmark::State& state) {
+  SocketConnection::PacketQueue queue;
+  const size_t size = static_cast<size_t>(state.range(0));
+  const size_t written = size / 4;
+  std::vector<char> payload(size, 'x');
+  rtc::Buffer data(&payload[0], size);
+
+  for (auto _ : state) {
+    queue.Push(new webrtc::DataBuffer(data, true));
+    while (!queue.Empty()) {
+      webrtc::DataBuffer* buffer = queue.Front();
+      if (buffer->size() <= written) {
+        queue.Pop();
+        continue;
+      }
+      memmove(buffer->data.data(), buffer->data.data() + written, buffer->size() - written);
+      buffer->data.SetSize(buffer->size() - written);
+    }
+  }
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * size);
+}
+BENCHMARK(BM_PacketQueuePartialFlush)->Arg(16 * 1024)->Arg(256 * 1024);
+
+} // namespace hotline
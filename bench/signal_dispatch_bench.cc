@@ -0,0 +1,111 @@
+#include "htn_config.h"
+
+#include <string.h>
+#include <string>
+
+#include "benchmark/benchmark.h"
+#include "webrtc/base/json.h"
+#include "webrtc/base/thread.h"
+#include "signalserver_connection.h"
+
+
+namespace hotline {
+
+namespace {
+
+// Feeds server messages in the way the WebSocket thread does.
+class DispatchConnection : public SignalServerConnection {
+public:
+  explicit DispatchConnection(rtc::Thread* thread)
+    : SignalServerConnection(thread) {}
+
+  void Receive(const WebSocket::Data& data) { onMessage(NULL, data); }
+};
+
+class CountingObserver : public SignalServerConnectionObserver {
+public:
+  CountingObserver() : offers(0) {}
+
+  virtual void OnConnected() {}
+  virtual void OnDisconnected() {}
+  virtual void OnCreatedRoom(std::string& room_id) {}
+  virtual void OnSignedIn(std::string& room_id, uint64 peer_id, uint64 offer_peer_id) {}
+  virtual void OnReconnected(const std::string& room_id, uint64 peer_id) {}
+  virtual void OnPeerConnected(uint64 peer_id) {}
+  virtual void OnPeerDisconnected(uint64 peer_id) {}
+  virtual void OnReceivedOffer(Json::Value& data) { offers++; }
+  virtual void OnServerConnectionFailure(int code, std::string& message) {}
+
+  size_t offers;
+};
+
+// An ICE candidate relayed by the signal server, as Conductor sends them.
+std::string CandidateMessage() {
+  Json::Value candidate;
+  candidate["sdpMid"] = "data";
+  candidate["sdpMLineIndex"] = 0;
+  candidate["candidate"] =
+      "candidate:1467250027 1 udp 2122260223 192.168.0.196 46243 typ host "
+      "generation 0";
+  candidate["room_id"] = "123456";
+  candidate["peer_id"] = "1";
+
+  Json::Value message;
+  message["msgid"] = SignalConnection::MsgReceivedOffer;
+  message["data"] = candidate;
+
+  Json::FastWriter writer;
+  return writer.write(message);
+}
+
+} // namespace
+
+
+// A message from the WebSocket to the observer: queue, post to the signal
+// thread, parse and dispatch there.
+static void BM_SignalDispatch(benchmark::State& state) {
+  rtc::Thread* thread = rtc::Thread::Current();
+  DispatchConnection connection(thread);
+  CountingObserver observer;
+  connection.RegisterObserver(&observer);
+
+  std::string text = CandidateMessage();
+  WebSocket::Data data;
+  data.bytes = &text[0];
+  data.len = text.size();
+
+  for (auto _ : state) {
+    connection.Receive(data);
+    thread->ProcessMessages(0);
+  }
+  state.SetItemsProcessed(observer.offers);
+  connection.UnregisterObserver(&observer);
+}
+BENCHMARK(BM_SignalDispatch);
+
+
+// A burst of candidates queued before the signal thread gets to them, and
+// drained by one post.
+static void BM_SignalDispatchBurst(benchmark::State& state) {
+  rtc::Thread* thread = rtc::Thread::Current();
+  DispatchConnection connection(thread);
+  CountingObserver observer;
+  connection.RegisterObserver(&observer);
+  const int burst = static_cast<int>(state.range(0));
+
+  std::string text = CandidateMessage();
+  WebSocket::Data data;
+  data.bytes = &text[0];
+  data.len = text.size();
+
+  for (auto _ : state) {
+    for (int i = 0; i < burst; i++)
+      connection.Receive(data);
+    thread->ProcessMessages(0);
+  }
+  state.SetItemsProcessed(observer.offers);
+  connection.UnregisterObserver(&observer);
+}
+BENCHMARK(BM_SignalDispatchBurst)->Arg(8)->Arg(32);
+
+} // namespace hotline
@@ -0,0 +1,112 @@
+#include "htn_config.h"
+
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "benchmark/benchmark.h"
+#include "spsc_ring.h"
+
+
+namespace hotline {
+
+namespace {
+
+const int kMessages = 100000;
+
+// The queue WsThreadHelper had before SpscRing: a list behind a mutex.
+class LockedList {
+public:
+  bool Push(int value) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    list_.push_back(value);
+    return true;
+  }
+
+  bool Pop(int* value) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (list_.empty()) return false;
+    *value = list_.front();
+    list_.pop_front();
+    return true;
+  }
+
+private:
+  std::mutex mutex_;
+  std::list<int> list_;
+};
+
+class Ring {
+public:
+  Ring() : ring_(1024) {}
+
+  bool Push(int value) { return ring_.Push(value); }
+
+  bool Pop(int* value) {
+    int* front = ring_.Front();
+    if (!front) return false;
+    *value = *front;
+    ring_.Pop();
+    return true;
+  }
+
+private:
+  SpscRing<int> ring_;
+};
+
+// kMessages from a producer thread to this one.
+template <typename Queue>
+void Transfer(benchmark::State& state) {
+  for (auto _ : state) {
+    Queue queue;
+    std::thread producer([&queue]() {
+      for (int i = 0; i < kMessages; ++i) {
+        while (!queue.Push(i)) std::this_thread::yield();
+      }
+    });
+
+    int received = 0;
+    int value;
+    while (received < kMessages) {
+      if (queue.Pop(&value)) received++;
+      else std::this_thread::yield();
+    }
+    producer.join();
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()) * kMessages);
+}
+
+} // namespace
+
+
+static void BM_LockedListTransfer(benchmark::State& state) {
+  Transfer<LockedList>(state);
+}
+BENCHMARK(BM_LockedListTransfer)->UseRealTime();
+
+static void BM_SpscRingTransfer(benchmark::State& state) {
+  Transfer<Ring>(state);
+}
+BENCHMARK(BM_SpscRingTransfer)->UseRealTime();
+
+
+// A signaling message through a ring slot that keeps its storage, as
+// SignalServerConnection hands server messages to the signal thread.
+static void BM_SpscRingStringSlot(benchmark::State& state) {
+  SpscRing<std::string> ring(256);
+  std::string message(300, 'x');
+
+  for (auto _ : state) {
+    std::string* slot = ring.BeginPush();
+    slot->assign(message.data(), message.size());
+    ring.CommitPush();
+
+    benchmark::DoNotOptimize(ring.Front()->data());
+    ring.Pop();
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_SpscRingStringSlot);
+
+} // namespace hotline
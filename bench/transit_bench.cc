@@ -0,0 +1,45 @@
+#include "htn_config.h"
+
+#include "benchmark/benchmark.h"
+#include "transit.h"
+
+
+namespace hotline {
+
+// What a lane with transit on pays per message on the writing side: the
+// clock read, the offset and the two histogram updates.
+static void BM_TransitRecord(benchmark::State& state) {
+  TransitStats stats;
+  ClockOffsetEstimator clock;
+  clock.AddSample(1000, 5500, 2000);
+  int lane = stats.OpenLane("bench");
+  uint64 stamp = clock.offset() + TransitNow();
+
+  for (auto _ : state) {
+    uint64 now = TransitNow();
+    uint64 sent = clock.ToLocal(stamp);
+    stats.Record(lane, now > sent ? now - sent : 0);
+  }
+}
+BENCHMARK(BM_TransitRecord);
+
+
+// The same with many lanes open, as on a busy peer.
+static void BM_TransitRecordManyLanes(benchmark::State& state) {
+  TransitStats stats;
+  const int lanes = static_cast<int>(state.range(0));
+  int first = 0;
+  for (int i = 0; i < lanes; i++) {
+    int lane = stats.OpenLane("bench");
+    if (i == 0) first = lane;
+  }
+
+  int i = 0;
+  for (auto _ : state) {
+    stats.Record(first + i, 250);
+    i = (i + 1) % lanes;
+  }
+}
+BENCHMARK(BM_TransitRecordManyLanes)->Arg(16)->Arg(256);
+
+} // namespace hotline
@@ -0,0 +1,99 @@
+#include "htn_config.h"
+
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "webrtc/base/asyncsocket.h"
+#include "webrtc/base/physicalsocketserver.h"
+#include "webrtc/base/scoped_ptr.h"
+#include "webrtc/base/socketserver.h"
+#include "webrtc/base/thread.h"
+#include "udp_batch.h"
+
+
+namespace hotline {
+
+namespace {
+
+// Counts what arrives at the far end.
+class DatagramCounter : public sigslot::has_slots<> {
+public:
+  DatagramCounter() : datagrams(0) {}
+
+  void OnDatagram(UdpBatchSocket* socket, const char* data, size_t len,
+                  const rtc::SocketAddress& from) {
+    datagrams++;
+  }
+
+  size_t datagrams;
+};
+
+const size_t kDatagramSize = 1200;
+const int kBurst = UdpBatchSocket::kBatchSize;
+
+} // namespace
+
+
+// A burst of datagrams through one sendto() each, the way a lane sent them
+// before batching.
+static void BM_UdpSendPerDatagram(benchmark::State& state) {
+  rtc::PhysicalSocketServer socket_server;
+  rtc::SocketServerScope socket_server_scope(&socket_server);
+  rtc::Thread* thread = rtc::Thread::Current();
+  rtc::scoped_ptr<UdpBatchSocket> receiver(
+      UdpBatchSocket::Create(&socket_server, rtc::SocketAddress("127.0.0.1", 0)));
+  rtc::scoped_ptr<rtc::AsyncSocket> sender(
+      thread->socketserver()->CreateAsyncSocket(AF_INET, SOCK_DGRAM));
+  if (!receiver || !sender ||
+      sender->Bind(rtc::SocketAddress("127.0.0.1", 0)) != 0 ||
+      sender->Connect(receiver->GetLocalAddress()) != 0) {
+    state.SkipWithError("UDP socket setup failed");
+    return;
+  }
+
+  DatagramCounter counter;
+  receiver->SignalDatagram.connect(&counter, &DatagramCounter::OnDatagram);
+  std::vector<char> datagram(kDatagramSize, 'x');
+
+  for (auto _ : state) {
+    for (int i = 0; i < kBurst; i++)
+      sender->Send(&datagram[0], datagram.size());
+    thread->ProcessMessages(0);
+  }
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * kBurst * kDatagramSize);
+  state.counters["received"] = static_cast<double>(counter.datagrams);
+}
+BENCHMARK(BM_UdpSendPerDatagram);
+
+
+// The same burst through UdpBatchSocket: one sendmmsg() on Linux.
+static void BM_UdpSendBatched(benchmark::State& state) {
+  rtc::PhysicalSocketServer socket_server;
+  rtc::SocketServerScope socket_server_scope(&socket_server);
+  rtc::Thread* thread = rtc::Thread::Current();
+  rtc::scoped_ptr<UdpBatchSocket> receiver(
+      UdpBatchSocket::Create(&socket_server, rtc::SocketAddress("127.0.0.1", 0)));
+  rtc::scoped_ptr<UdpBatchSocket> sender(
+      UdpBatchSocket::Create(&socket_server, rtc::SocketAddress("127.0.0.1", 0)));
+  if (!receiver || !sender || !sender->Connect(receiver->GetLocalAddress())) {
+    state.SkipWithError("UDP socket setup failed");
+    return;
+  }
+
+  DatagramCounter counter;
+  receiver->SignalDatagram.connect(&counter, &DatagramCounter::OnDatagram);
+  std::vector<char> datagram(kDatagramSize, 'x');
+  rtc::SocketAddress to = receiver->GetLocalAddress();
+
+  for (auto _ : state) {
+    for (int i = 0; i < kBurst; i++)
+      sender->SendDatagram(&datagram[0], datagram.size(), to);
+    thread->ProcessMessages(0);
+  }
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * kBurst * kDatagramSize);
+  state.counters["received"] = static_cast<double>(counter.datagrams);
+  state.counters["send_dropped"] = static_cast<double>(sender->send_dropped());
+}
+BENCHMARK(BM_UdpSendBatched);
+
+} // namespace hotline
@@ -0,0 +1,109 @@
+#include "htn_config.h"
+
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "websocket_framing.h"
+
+
+namespace hotline {
+
+namespace {
+
+// Takes fragments the way libwebsocket_write() would when the socket
+// accepts everything: counts them and touches the payload.
+class CountingSink : public WsFragmentSink {
+public:
+  CountingSink() : fragments(0), bytes(0) {}
+
+  virtual int WriteFragment(unsigned char* buf, size_t len, int write_protocol) {
+    benchmark::DoNotOptimize(buf[len - 1]);
+    fragments++;
+    bytes += len;
+    return static_cast<int>(len);
+  }
+
+  size_t fragments;
+  size_t bytes;
+};
+
+} // namespace
+
+
+// One signaling message of range(0) bytes in range(1) byte fragments,
+// from a pooled buffer as WebSocket::send() does.
+static void BM_WsSendFragments(benchmark::State& state) {
+  const size_t len = static_cast<size_t>(state.range(0));
+  const size_t fragment_size = static_cast<size_t>(state.range(1));
+  std::vector<char> message(len, 'x');
+  WsSendBufferPool pool;
+  CountingSink sink;
+
+  for (auto _ : state) {
+    WsSendBuffer* buffer = pool.Get(&message[0], len, false);
+    while (WsWriteFragment(buffer, fragment_size, &sink) == kWsWriteMore) {
+    }
+    pool.Put(buffer);
+  }
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * len);
+  state.counters["fragments"] = benchmark::Counter(static_cast<double>(sink.fragments),
+                                                   benchmark::Counter::kAvgIterations);
+}
+BENCHMARK(BM_WsSendFragments)
+  ->Args({512, 2048})
+  ->Args({4 * 1024, 2048})
+  ->Args({64 * 1024, 2048})
+  ->Args({64 * 1024, 16 * 1024});
+
+
+// A burst of range(0) ICE candidate sized messages queued by one thread
+// and written in one writable callback, the way signaling goes out while
+// ICE gathers.
+static void BM_WsSendBurst(benchmark::State& state) {
+  const int burst = static_cast<int>(state.range(0));
+  const size_t len = 300;
+  std::vector<char> message(len, 'x');
+  std::vector<WsSendBuffer*> queue;
+  WsSendBufferPool pool;
+  CountingSink sink;
+
+  for (auto _ : state) {
+    for (int i = 0; i < burst; ++i)
+      queue.push_back(pool.Get(&message[0], len, false));
+
+    for (size_t i = 0; i < queue.size(); ++i) {
+      WsWriteFragment(queue[i], 2048, &sink);
+      pool.Put(queue[i]);
+    }
+    queue.clear();
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()) * burst);
+}
+BENCHMARK(BM_WsSendBurst)->Arg(1)->Arg(16)->Arg(64);
+
+
+// One message of range(0) bytes arriving in range(1) byte pieces.
+static void BM_WsReceiveReassembly(benchmark::State& state) {
+  const size_t len = static_cast<size_t>(state.range(0));
+  const size_t piece = static_cast<size_t>(state.range(1));
+  std::vector<char> message(len, 'x');
+  WsMessageAssembler assembler;
+
+  for (auto _ : state) {
+    for (size_t offset = 0; offset < len; offset += piece)
+      assembler.Append(&message[offset], std::min(piece, len - offset));
+
+    benchmark::DoNotOptimize(assembler.data());
+    assembler.Reset();
+  }
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * len);
+}
+BENCHMARK(BM_WsReceiveReassembly)
+  ->Args({512, 2048})
+  ->Args({4 * 1024, 2048})
+  ->Args({64 * 1024, 2048})
+  ->Args({256 * 1024, 2048});
+
+} // namespace hotline
@@ -2,6 +2,7 @@
 #
 #  LIBWEBSOCKETS_FOUND
 #  LIBWEBSOCKETS_INCLUDE_DIR
+#  LIBWEBSOCKETS_ZLIB_INCLUDE_DIR
 #  LIBWEBSOCKETS_LIBRARIES
 #
 
@@ -44,6 +45,15 @@ find_path(LIBWEBSOCKETS_INCLUDE_DIR
   	${LIBWEBSOCKETS_ROOT_DIR}/lib
   )
 
+# zlib.h of the zlib linked below: the bundled copy on Windows, the
+# system one elsewhere.
+find_path(LIBWEBSOCKETS_ZLIB_INCLUDE_DIR
+  NAMES
+  	zlib.h
+  PATHS
+  	${LIBWEBSOCKETS_ROOT_DIR}/win32port/zlib
+  )
+
 
 # ============================================================================
 # Find Libwebsockets libries
@@ -0,0 +1,752 @@
+#include "htn_config.h"
+
+#include <string.h>
+#include <algorithm>
+#if defined(WEBRTC_WIN)
+#include <windows.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#include "webrtc/base/common.h"
+#include "webrtc/base/logging.h"
+#include "webrtc/base/socketserver.h"
+#include "webrtc/base/thread.h"
+#include "webrtc/base/timeutils.h"
+#include "bench.h"
+#include "bench_endpoint.h"
+#include "defaults.h"
+
+
+namespace hotline {
+
+static const uint64 kServerPeerId = 1;
+static const uint64 kClientPeerId = 2;
+
+static const size_t kBufferSize = 64 * 1024;
+static const size_t kUdpHeaderSize = BenchEndpointStream::kDatagramHeaderSize;
+static const uint32 kUdpProbeSeq = 0xFFFFFFFF;
+static const int kUdpProbeInterval = 100;  // milliseconds
+static const int kUdpDrainTime = 1000;     // milliseconds
+
+static uint64 NowMicros() {
+  return rtc::TimeNanos() / 1000;
+}
+
+// User and system CPU time of the whole process, all threads.
+static uint64 ProcessCpuMicros() {
+#if defined(WEBRTC_WIN)
+  FILETIME creation, exit, kernel, user;
+  if (!GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user)) return 0;
+  uint64 ticks = ((uint64)kernel.dwHighDateTime << 32 | kernel.dwLowDateTime) +
+                 ((uint64)user.dwHighDateTime << 32 | user.dwLowDateTime);
+  return ticks / 10;  // 100 ns ticks
+#else
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+  return (uint64)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 +
+         usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+#endif
+}
+
+Json::Value LatencyToJson(const Histogram& histogram) {
+  Json::Value json;
+  json["mean"] = histogram.mean();
+  json["p50"] = static_cast<double>(histogram.Percentile(50));
+  json["p99"] = static_cast<double>(histogram.Percentile(99));
+  json["p999"] = static_cast<double>(histogram.Percentile(99.9));
+  json["max"] = static_cast<double>(histogram.max());
+  return json;
+}
+
+static Json::Value OptionsToJson(const TunnelOptions& options) {
+  Json::Value json;
+  json["udp_max_retransmits"] = options.udp_max_retransmits;
+  json["udp_max_packet_lifetime"] = options.udp_max_packet_lifetime;
+  json["udp_batch"] = options.udp_batch;
+  json["udp_fec_group"] = options.udp_fec_group;
+  json["compress_level"] = options.compress_level;
+  json["dedup_cache"] = options.dedup_cache;
+  json["ice_batch"] = options.ice_batch;
+  json["speculative_offer"] = options.speculative_offer;
+  json["bench_payload"] = BenchPayloadName(options.bench_payload);
+  return json;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// BenchRunner
+///////////////////////////////////////////////////////////////////////////////
+
+BenchRunner::BenchRunner(rtc::Thread* thread, const BenchConfig& config,
+                         const TunnelOptions& options)
+  : thread_(thread)
+  , config_(config)
+  , options_(options)
+  , server_signal_(thread, kServerPeerId)
+  , client_signal_(thread, kClientPeerId)
+  , buffer_(kBufferSize)
+  , finished_(false)
+  , start_time_(0)
+  , setup_time_(0)
+  , workload_start_(0)
+  , workload_cpu_start_(0)
+  , send_time_(0)
+  , stall_start_(0)
+  , stall_detected_(0)
+  , warmed_up_(false)
+  , messages_done_(0)
+  , echo_received_(0)
+  , bytes_sent_(0)
+  , bytes_received_(0)
+  , udp_sent_(0)
+  , udp_received_(0)
+  , udp_reordered_(0)
+  , udp_highest_seq_(0)
+  , udp_last_rtt_(0)
+  , udp_jitter_(0)
+  , random_state_(0x2545F4914F6CDD1DULL) {
+  if (!options_.metrics) options_.metrics = &metrics_;
+  LoopbackSignalConnection::Pair(&server_signal_, &client_signal_);
+  config_.message_size = std::max(config_.message_size, 1);
+  if (is_udp()) {
+    config_.message_size = std::min(std::max(config_.message_size, (int)kUdpHeaderSize),
+                                    (int)kBufferSize);
+  }
+}
+
+BenchRunner::~BenchRunner() {
+  thread_->Clear(this);
+  churn_.reset();
+  driver_.reset();
+  replay_.reset();
+  for (size_t i = 0; i < targets_.size(); ++i) {
+    delete targets_[i];
+  }
+}
+
+bool BenchRunner::Start() {
+  start_time_ = NowMicros();
+
+  if (is_replay()) {
+    CaptureHeader header;
+    std::vector<CaptureRecord> records;
+    std::string error;
+    if (!ReadCaptureFile(config_.replay_file, &header, &records, &error)) {
+      Fail(error);
+      return false;
+    }
+    replay_.reset(new CaptureReplay(thread_, header, records));
+    if (!replay_->Listen(&target_address_)) {
+      Fail("Can't open the target socket.");
+      return false;
+    }
+  }
+  else if (!StartTarget()) {
+    Fail("Can't open the target socket.");
+    return false;
+  }
+
+  if (config_.network.enabled()) {
+    network_.reset(new ImpairedNetwork(config_.network));
+    if (!network_->Start()) {
+      Fail("Can't start the impaired network.");
+      return false;
+    }
+    options_.network = network_.get();
+  }
+
+  cricket::ProtocolType protocol = is_udp() ? cricket::PROTO_UDP : cricket::PROTO_TCP;
+
+  UserArguments server_arguments;
+  server_arguments.server_mode = true;
+  server_arguments.protocol = protocol;
+  server_arguments.options = options_;
+  // One peer's lanes make a capture; the client's are the application's.
+  server_arguments.options.capture = NULL;
+
+  UserArguments client_arguments;
+  client_arguments.server_mode = false;
+  client_arguments.local_address = rtc::SocketAddress("127.0.0.1", 0);
+  client_arguments.remote_address = target_address_;
+  client_arguments.protocol = protocol;
+  client_arguments.room_id = LoopbackSignalConnection::kRoomId;
+  client_arguments.options = options_;
+  if (is_driven()) {
+    BenchEndpointStream::ParseName("bench:" + config_.workload,
+                                   &client_arguments.remote_address);
+  }
+
+  if (config_.signal_port > 0) {
+    LocalSignalServerConfig signal_config;
+    signal_config.port = config_.signal_port;
+    signal_config.delay = config_.signal_delay;
+    signal_config.jitter = config_.signal_jitter;
+    signal_config.room_id = LoopbackSignalConnection::kRoomId;
+
+    signal_server_.reset(new LocalSignalServer(signal_config));
+    if (!signal_server_->Start()) {
+      Fail("Can't start the signal server.");
+      return false;
+    }
+
+    server_ws_signal_.reset(new SignalServerConnection(thread_));
+    client_ws_signal_.reset(new SignalServerConnection(thread_));
+    server_ws_signal_->set_fragment_size(config_.ws_fragment_size);
+    client_ws_signal_->set_fragment_size(config_.ws_fragment_size);
+    server_ws_signal_->set_reconnect(config_.signal_reconnect);
+    client_ws_signal_->set_reconnect(config_.signal_reconnect);
+    server_ws_signal_->set_keepalive(config_.signal_ping, config_.signal_ping_timeout);
+    client_ws_signal_->set_keepalive(config_.signal_ping, config_.signal_ping_timeout);
+    server_ws_signal_->SignalConnectionLost.connect(this, &BenchRunner::OnSignalConnectionLost);
+    client_ws_signal_->SignalConnectionLost.connect(this, &BenchRunner::OnSignalConnectionLost);
+    server_.reset(new Conductors(server_ws_signal_.get(), thread_, server_arguments));
+    client_.reset(new Conductors(client_ws_signal_.get(), thread_, client_arguments));
+  }
+  else if (config_.signal_lan_port > 0) {
+    LanSignalConfig lan_config;
+    lan_config.port = config_.signal_lan_port;
+    lan_config.room_id = LoopbackSignalConnection::kRoomId;
+    lan_config.socket_server = options_.socket_server;
+
+    server_lan_signal_.reset(new LanSignalConnection(thread_, lan_config));
+    client_lan_signal_.reset(new LanSignalConnection(thread_, lan_config));
+    server_.reset(new Conductors(server_lan_signal_.get(), thread_, server_arguments));
+    client_.reset(new Conductors(client_lan_signal_.get(), thread_, client_arguments));
+  }
+  else {
+    server_.reset(new Conductors(&server_signal_, thread_, server_arguments));
+    client_.reset(new Conductors(&client_signal_, thread_, client_arguments));
+  }
+  client_->SignalLocalSocketOpened.connect(this, &BenchRunner::OnLocalSocketOpened);
+
+  if (is_driven()) {
+    BenchDriverConfig driver_config;
+    BenchEndpointStream::IsEndpoint(client_arguments.remote_address, &driver_config.kind);
+    driver_config.lanes = config_.lanes;
+    driver_config.seconds = config_.seconds;
+    driver_config.message_size = config_.message_size;
+    driver_config.payload = options_.bench_payload;
+    driver_config.timeout = config_.timeout;
+
+    // The driver has its own timeout, and quits the thread when done.
+    driver_.reset(new BenchDriver(thread_, driver_config));
+    client_->SignalLocalSocketOpened.connect(driver_.get(),
+                                             &BenchDriver::OnLocalSocketOpened);
+    driver_->Start();
+  }
+
+  client_->PrepareOffer();
+  if (signal_server_) {
+    std::string url = "ws://127.0.0.1:" + std::to_string(config_.signal_port) + "/" +
+                      kDefaultServerPath;
+    server_ws_signal_->Connect(url);
+    client_ws_signal_->Connect(url);
+  }
+  else if (server_lan_signal_) {
+    server_lan_signal_->Connect();
+    client_lan_signal_->Connect();
+  }
+  else {
+    server_signal_.Connect();
+    client_signal_.Connect();
+  }
+
+  if (!driver_) {
+    thread_->PostDelayed(config_.timeout * 1000, this, MsgTimeout);
+  }
+  return true;
+}
+
+bool BenchRunner::succeeded() const {
+  if (result_.isMember("error")) return false;
+  return !driver_ || driver_->succeeded();
+}
+
+Json::Value BenchRunner::result() const {
+  if (!driver_ || result_.isMember("error")) return result_;
+
+  Json::Value result = driver_->result();
+  AddCommonResult(&result);
+  return result;
+}
+
+void BenchRunner::OnMessage(rtc::Message* msg) {
+  switch (msg->message_id) {
+  case MsgTimeout:
+    Fail("Timed out.");
+    break;
+  case MsgUdpTick:
+    OnUdpTick();
+    break;
+  case MsgUdpProbe:
+    if (!warmed_up_ && !finished_) {
+      SendUdp(kUdpProbeSeq);
+      thread_->PostDelayed(kUdpProbeInterval, this, MsgUdpProbe);
+    }
+    break;
+  case MsgUdpDrained:
+  case MsgIdleDone:
+    Finish();
+    break;
+  case MsgSignalRestart:
+    if (!signal_server_->Start()) Fail("Can't restart the signal server.");
+    break;
+  case MsgSignalUnstall:
+    signal_server_->Stall(false);
+    break;
+  default:
+    break;
+  }
+}
+
+
+//
+// Target side
+//
+
+bool BenchRunner::StartTarget() {
+  int type = is_udp() ? SOCK_DGRAM : SOCK_STREAM;
+  target_listen_.reset(thread_->socketserver()->CreateAsyncSocket(AF_INET, type));
+  if (!target_listen_) return false;
+
+  if (target_listen_->Bind(rtc::SocketAddress("127.0.0.1", 0)) == SOCKET_ERROR) {
+    return false;
+  }
+
+  if (is_udp()) {
+    target_listen_->SignalReadEvent.connect(this, &BenchRunner::OnTargetUdpRead);
+  }
+  else {
+    if (target_listen_->Listen(128) == SOCKET_ERROR) return false;
+    target_listen_->SignalReadEvent.connect(this, &BenchRunner::OnTargetAccept);
+  }
+
+  target_address_ = target_listen_->GetLocalAddress();
+  return true;
+}
+
+BenchRunner::TargetConnection* BenchRunner::FindTarget(rtc::AsyncSocket* socket) {
+  for (size_t i = 0; i < targets_.size(); ++i) {
+    if (targets_[i]->socket.get() == socket) return targets_[i];
+  }
+  return NULL;
+}
+
+void BenchRunner::OnTargetAccept(rtc::AsyncSocket* socket) {
+  rtc::AsyncSocket* accepted;
+  while ((accepted = socket->Accept(NULL)) != NULL) {
+    TargetConnection* target = new TargetConnection();
+    target->socket.reset(accepted);
+    accepted->SignalReadEvent.connect(this, &BenchRunner::OnTargetRead);
+    accepted->SignalWriteEvent.connect(this, &BenchRunner::OnTargetWrite);
+    accepted->SignalCloseEvent.connect(this, &BenchRunner::OnTargetClose);
+    targets_.push_back(target);
+  }
+}
+
+void BenchRunner::OnTargetRead(rtc::AsyncSocket* socket) {
+  TargetConnection* target = FindTarget(socket);
+  if (!target) return;
+
+  int len;
+  while ((len = socket->Recv(&buffer_[0], buffer_.size())) > 0) {
+    if (config_.workload == "bulk") {
+      bytes_received_ += len;
+      if (bytes_received_ >= bytes_sent_ && bytes_sent_ == (uint64)config_.total_mb << 20) {
+        Finish();
+        return;
+      }
+    }
+    else {
+      target->pending.append(&buffer_[0], len);
+    }
+  }
+
+  if (!target->pending.empty() && !FlushPending(socket, &target->pending)) {
+    Fail("Target socket write failed.");
+  }
+}
+
+void BenchRunner::OnTargetWrite(rtc::AsyncSocket* socket) {
+  TargetConnection* target = FindTarget(socket);
+  if (target && !FlushPending(socket, &target->pending)) {
+    Fail("Target socket write failed.");
+  }
+}
+
+void BenchRunner::OnTargetClose(rtc::AsyncSocket* socket, int error) {
+  std::vector<TargetConnection*>::iterator it;
+  for (it = targets_.begin(); it != targets_.end(); ++it) {
+    if ((*it)->socket.get() == socket) {
+      // We are inside one of the socket's signals.
+      thread_->Dispose((*it)->socket.release());
+      delete *it;
+      targets_.erase(it);
+      return;
+    }
+  }
+}
+
+void BenchRunner::OnTargetUdpRead(rtc::AsyncSocket* socket) {
+  rtc::SocketAddress from;
+  int len;
+  while ((len = socket->RecvFrom(&buffer_[0], buffer_.size(), &from)) >= 0) {
+    socket->SendTo(&buffer_[0], len, from);
+  }
+}
+
+
+//
+// Client side
+//
+
+void BenchRunner::OnLocalSocketOpened(Conductors* conductors,
+                                      const rtc::SocketAddress& address) {
+  if (driver_) {
+    if (!setup_time_) {
+      setup_time_ = NowMicros() - start_time_;
+      StartSignalOutage();
+    }
+    return;
+  }
+  if (client_socket_ || churn_ || workload_start_) return;
+
+  setup_time_ = NowMicros() - start_time_;
+  StartSignalOutage();
+  tunnel_address_ = rtc::SocketAddress("127.0.0.1", address.port());
+
+  if (config_.workload == "idle") {
+    workload_start_ = NowMicros();
+    workload_cpu_start_ = ProcessCpuMicros();
+    thread_->Clear(this, MsgTimeout);
+    thread_->PostDelayed(config_.seconds * 1000, this, MsgIdleDone);
+    return;
+  }
+
+  if (is_replay()) {
+    workload_start_ = NowMicros();
+    replay_->SignalDone.connect(this, &BenchRunner::OnReplayDone);
+    replay_->Start(tunnel_address_);
+    return;
+  }
+
+  if (config_.workload == "churn") {
+    ChurnConfig churn_config;
+    churn_config.connections = config_.count;
+    churn_config.concurrency = config_.concurrency;
+    churn_config.message_size = config_.message_size;
+
+    workload_start_ = NowMicros();
+    churn_.reset(new ChurnLoad(thread_, churn_config, tunnel_address_));
+    churn_->SignalDone.connect(this, &BenchRunner::OnChurnDone);
+    churn_->Start();
+    return;
+  }
+
+  int type = is_udp() ? SOCK_DGRAM : SOCK_STREAM;
+  client_socket_.reset(thread_->socketserver()->CreateAsyncSocket(AF_INET, type));
+  if (!client_socket_) {
+    Fail("Can't create the client socket.");
+    return;
+  }
+
+  if (is_udp()) {
+    if (client_socket_->Bind(rtc::SocketAddress("127.0.0.1", 0)) == SOCKET_ERROR) {
+      Fail("Can't bind the client socket.");
+      return;
+    }
+    client_socket_->SignalReadEvent.connect(this, &BenchRunner::OnClientUdpRead);
+    thread_->Post(this, MsgUdpProbe);
+    return;
+  }
+
+  client_socket_->SignalConnectEvent.connect(this, &BenchRunner::OnClientConnect);
+  client_socket_->SignalReadEvent.connect(this, &BenchRunner::OnClientRead);
+  client_socket_->SignalWriteEvent.connect(this, &BenchRunner::OnClientWrite);
+  client_socket_->SignalCloseEvent.connect(this, &BenchRunner::OnClientClose);
+  if (client_socket_->Connect(tunnel_address_) == SOCKET_ERROR &&
+      !client_socket_->IsBlocking()) {
+    Fail("Can't connect to the tunnel.");
+  }
+}
+
+void BenchRunner::OnClientConnect(rtc::AsyncSocket* socket) {
+  if (config_.workload == "bulk") {
+    workload_start_ = NowMicros();
+    SendBulk();
+  }
+  else {
+    // The first message opens the lane; it is not counted.
+    SendEcho();
+  }
+}
+
+void BenchRunner::SendEcho() {
+  client_pending_.resize(config_.message_size);
+  FillBenchPayload(options_.bench_payload, &client_pending_[0], client_pending_.size(),
+                   &random_state_);
+  send_time_ = NowMicros();
+
+  if (!FlushPending(client_socket_.get(), &client_pending_)) {
+    Fail("Client socket write failed.");
+  }
+}
+
+void BenchRunner::SendBulk() {
+  uint64 total = (uint64)config_.total_mb << 20;
+
+  while (!finished_) {
+    if (!FlushPending(client_socket_.get(), &client_pending_)) {
+      Fail("Client socket write failed.");
+      return;
+    }
+    if (!client_pending_.empty() || bytes_sent_ == total) return;
+
+    size_t len = static_cast<size_t>(std::min<uint64>(kBufferSize, total - bytes_sent_));
+    client_pending_.resize(len);
+    FillBenchPayload(options_.bench_payload, &client_pending_[0], len, &random_state_);
+    bytes_sent_ += len;
+  }
+}
+
+void BenchRunner::OnClientRead(rtc::AsyncSocket* socket) {
+  int len;
+  while ((len = socket->Recv(&buffer_[0], buffer_.size())) > 0) {
+    if (config_.workload != "echo") continue;
+
+    echo_received_ += len;
+    while (echo_received_ >= (size_t)config_.message_size && !finished_) {
+      echo_received_ -= config_.message_size;
+
+      uint64 now = NowMicros();
+      if (!warmed_up_) {
+        warmed_up_ = true;
+        result_["first_rtt_us"] = static_cast<double>(now - send_time_);
+        workload_start_ = now;
+      }
+      else {
+        rtt_.Record(now - send_time_);
+        if (++messages_done_ >= config_.count) {
+          Finish();
+          return;
+        }
+      }
+      SendEcho();
+    }
+  }
+}
+
+void BenchRunner::OnClientWrite(rtc::AsyncSocket* socket) {
+  if (config_.workload == "bulk") {
+    SendBulk();
+  }
+  else if (!FlushPending(socket, &client_pending_)) {
+    Fail("Client socket write failed.");
+  }
+}
+
+void BenchRunner::OnClientClose(rtc::AsyncSocket* socket, int error) {
+  Fail("The tunnel closed the client socket.");
+}
+
+void BenchRunner::SendUdp(uint32 seq) {
+  uint64 now = NowMicros();
+  memcpy(&buffer_[0], &seq, sizeof(seq));
+  memcpy(&buffer_[sizeof(seq)], &now, sizeof(now));
+  client_socket_->SendTo(&buffer_[0], config_.message_size, tunnel_address_);
+}
+
+void BenchRunner::OnUdpTick() {
+  if (finished_) return;
+
+  uint64 elapsed = NowMicros() - workload_start_;
+  uint64 due = std::min<uint64>(config_.count, elapsed * config_.rate / 1000000 + 1);
+  while (udp_sent_ < due) {
+    SendUdp(udp_sent_++);
+  }
+
+  if (udp_sent_ < (uint32)config_.count) {
+    thread_->PostDelayed(1, this, MsgUdpTick);
+  }
+  else {
+    send_time_ = NowMicros();
+    thread_->PostDelayed(kUdpDrainTime, this, MsgUdpDrained);
+  }
+}
+
+void BenchRunner::OnClientUdpRead(rtc::AsyncSocket* socket) {
+  rtc::SocketAddress from;
+  int len;
+  while ((len = socket->RecvFrom(&buffer_[0], buffer_.size(), &from)) >= 0) {
+    if (len < (int)kUdpHeaderSize) continue;
+
+    uint32 seq;
+    uint64 sent;
+    memcpy(&seq, &buffer_[0], sizeof(seq));
+    memcpy(&sent, &buffer_[sizeof(seq)], sizeof(sent));
+    uint64 now = NowMicros();
+
+    if (seq == kUdpProbeSeq) {
+      if (!warmed_up_) {
+        warmed_up_ = true;
+        result_["first_rtt_us"] = static_cast<double>(now - sent);
+        workload_start_ = now;
+        thread_->Post(this, MsgUdpTick);
+      }
+      continue;
+    }
+
+    uint64 rtt = now - sent;
+    rtt_.Record(rtt);
+
+    // RFC 3550 style: a smoothed mean of the change between round trips.
+    if (udp_received_++ > 0) {
+      double change = rtt > udp_last_rtt_ ? (double)(rtt - udp_last_rtt_)
+                                          : (double)(udp_last_rtt_ - rtt);
+      udp_jitter_ += (change - udp_jitter_) / 16;
+    }
+    udp_last_rtt_ = rtt;
+
+    if (seq < udp_highest_seq_) udp_reordered_++;
+    udp_highest_seq_ = std::max(udp_highest_seq_, seq);
+  }
+}
+
+void BenchRunner::OnChurnDone(ChurnLoad* churn) {
+  Finish();
+}
+
+void BenchRunner::OnReplayDone(CaptureReplay* replay) {
+  Finish();
+}
+
+// Both peers lose the signal server while the workload runs. A lane that
+// doesn't survive it closes the client socket and fails the run. A stall
+// keeps the connections open but silent, so only the keepalive notices.
+void BenchRunner::StartSignalOutage() {
+  if (!signal_server_) return;
+
+  if (config_.signal_outage > 0) {
+    signal_server_->Stop();
+    if (config_.signal_outage_forget) signal_server_->ForgetRooms();
+    thread_->PostDelayed(config_.signal_outage, this, MsgSignalRestart);
+  }
+  else if (config_.signal_stall > 0) {
+    signal_server_->Stall(true);
+    stall_start_ = NowMicros();
+    thread_->PostDelayed(config_.signal_stall, this, MsgSignalUnstall);
+  }
+}
+
+void BenchRunner::OnSignalConnectionLost(SignalServerConnection* connection) {
+  if (stall_start_ && !stall_detected_) stall_detected_ = NowMicros();
+}
+
+bool BenchRunner::FlushPending(rtc::AsyncSocket* socket, std::string* pending) {
+  while (!pending->empty()) {
+    int len = socket->Send(pending->data(), pending->size());
+    if (len < 0) return socket->IsBlocking();
+    pending->erase(0, len);
+  }
+  return true;
+}
+
+
+//
+// Results
+//
+
+void BenchRunner::AddCommonResult(Json::Value* result) const {
+  Json::Value& json = *result;
+  json["workload"] = config_.workload;
+  json["options"] = OptionsToJson(options_);
+  json["setup_ms"] = setup_time_ / 1000.0;
+  if (signal_server_) {
+    json["signal_delay_ms"] = config_.signal_delay;
+    json["signal_jitter_ms"] = config_.signal_jitter;
+    json["signal_offers"] = static_cast<double>(signal_server_->relayed_offers());
+    json["signal_outage_ms"] = config_.signal_outage;
+    json["signal_outage_forget"] = config_.signal_outage_forget;
+    json["signal_reconnects"] = server_ws_signal_->reconnects() +
+                                client_ws_signal_->reconnects();
+    int64 rtt = client_ws_signal_->rtt();
+    json["signal_rtt_ms"] = rtt >= 0 ? rtt / 1000.0 : -1;
+    json["signal_stall_ms"] = config_.signal_stall;
+    json["signal_stall_detect_ms"] = stall_detected_ ? (stall_detected_ - stall_start_) / 1000.0 : -1;
+  }
+  if (server_lan_signal_) json["signal_lan_port"] = config_.signal_lan_port;
+  if (network_) json["network"] = network_->config().ToJson();
+  if (options_.transit) options_.transit->Report(&json["transit_us"]);
+
+  // Both peers, both ways: what -compress and -dedup saved.
+  json["app_bytes"] = static_cast<double>(options_.metrics->bytes_from_sockets());
+  json["wire_bytes"] = static_cast<double>(options_.metrics->bytes_to_tunnel());
+}
+
+void BenchRunner::Finish() {
+  if (finished_) return;
+  finished_ = true;
+
+  uint64 end = is_udp() ? send_time_ : NowMicros();
+  double seconds = std::max<uint64>(end - workload_start_, 1) / 1000000.0;
+
+  AddCommonResult(&result_);
+  result_["protocol"] = is_udp() ? "udp" : "tcp";
+  result_["message_size"] = config_.message_size;
+  result_["elapsed_ms"] = seconds * 1000;
+
+  if (config_.workload == "echo") {
+    result_["messages"] = messages_done_;
+    result_["messages_per_sec"] = messages_done_ / seconds;
+    result_["mb_per_sec"] = (double)messages_done_ * config_.message_size / seconds / (1 << 20);
+    result_["rtt_us"] = LatencyToJson(rtt_);
+  }
+  else if (config_.workload == "bulk") {
+    result_["bytes"] = static_cast<double>(bytes_received_);
+    result_["mb_per_sec"] = bytes_received_ / seconds / (1 << 20);
+  }
+  else if (config_.workload == "churn") {
+    churn_->Report(&result_);
+  }
+  else if (is_replay()) {
+    result_["capture"] = config_.replay_file;
+    replay_->Report(&result_);
+  }
+  else if (config_.workload == "idle") {
+    double cpu_ms = (ProcessCpuMicros() - workload_cpu_start_) / 1000.0;
+    result_["cpu_ms"] = cpu_ms;
+    result_["cpu_percent"] = cpu_ms / (seconds * 1000) * 100;
+  }
+  else {
+    result_["sent"] = udp_sent_;
+    result_["received"] = udp_received_;
+    result_["loss"] = udp_sent_ ? 1.0 - (double)udp_received_ / udp_sent_ : 0.0;
+    result_["reordered"] = udp_reordered_;
+    result_["jitter_us"] = udp_jitter_;
+    result_["datagrams_per_sec"] = udp_sent_ / seconds;
+    result_["mb_per_sec"] = (double)udp_sent_ * config_.message_size / seconds / (1 << 20);
+    result_["rtt_us"] = LatencyToJson(rtt_);
+  }
+
+  Stop();
+}
+
+void BenchRunner::Fail(const std::string& error) {
+  if (finished_) return;
+  finished_ = true;
+
+  LOG(LS_ERROR) << "Benchmark failed: " << error;
+  result_["workload"] = config_.workload;
+  result_["error"] = error;
+  Stop();
+}
+
+void BenchRunner::Stop() {
+  thread_->Clear(this);
+  thread_->Quit();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+} // namespace hotline
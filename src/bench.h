@@ -0,0 +1,261 @@
+#ifndef HOTLINE_TUNNEL_BENCH_H_
+#define HOTLINE_TUNNEL_BENCH_H_
+#pragma once
+
+#include "htn_config.h"
+
+#include <string>
+#include <vector>
+
+#include "webrtc/base/asyncsocket.h"
+#include "webrtc/base/json.h"
+#include "webrtc/base/messagehandler.h"
+#include "webrtc/base/scoped_ptr.h"
+#include "webrtc/base/sigslot.h"
+#include "webrtc/base/socketaddress.h"
+#include "bench_driver.h"
+#include "capture_replay.h"
+#include "churn_load.h"
+#include "conductors.h"
+#include "histogram.h"
+#include "impaired_network.h"
+#include "lan_signal.h"
+#include "local_signal_server.h"
+#include "loopback_signal.h"
+#include "signalserver_connection.h"
+
+
+namespace rtc {
+  class Thread;
+}
+
+
+namespace hotline {
+
+struct BenchConfig {
+  BenchConfig()
+    : workload("echo"),
+      message_size(1024),
+      count(10000),
+      total_mb(100),
+      rate(10000),
+      concurrency(64),
+      lanes(1),
+      seconds(10),
+      signal_port(0),
+      signal_lan_port(0),
+      signal_delay(0),
+      signal_jitter(0),
+      ws_fragment_size(2048),
+      signal_reconnect(30000),
+      signal_outage(0),
+      signal_outage_forget(false),
+      signal_stall(0),
+      signal_ping(15000),
+      signal_ping_timeout(10000),
+      timeout(60) {}
+
+  // echo: one message at a time, each echoed back (round trip latency).
+  // bulk: total_mb one way as fast as the tunnel takes it (throughput).
+  // udp:  count datagrams at rate per second, echoed back (loss, jitter).
+  // churn: count short connections, concurrency at a time, each with one
+  //        echoed request (lane setup rate, time to first byte).
+  // sink, source: lanes parallel connections to the server peer's own
+  //        bench endpoint for seconds (throughput per lane, fairness).
+  // replay: the TCP lanes of the capture in replay_file, at their
+  //        captured times and sizes (lane mix of real traffic).
+  // idle: nothing for seconds once the tunnel is up (CPU an idle tunnel
+  //        and its signaling burn).
+  std::string workload;
+  int message_size;   // bytes per message, datagram or request
+  int count;          // messages (echo), datagrams (udp) or connections (churn)
+  int total_mb;       // megabytes (bulk)
+  int rate;           // datagrams per second (udp)
+  int concurrency;    // connections open at once (churn)
+  int lanes;          // parallel lanes (sink, source)
+  int seconds;        // measurement time (sink, source, idle)
+  std::string replay_file;  // a TrafficCapture file (replay)
+  // Signal through a LocalSignalServer on this port, delaying its messages
+  // by signal_delay +/- signal_jitter ms. 0 for a LoopbackSignalConnection.
+  int signal_port;
+  // Signal through LanSignalConnections discovering each other on this
+  // port over loopback, when not 0 and signal_port is.
+  int signal_lan_port;
+  int signal_delay;
+  int signal_jitter;
+  int ws_fragment_size;  // bytes
+  int signal_reconnect;  // ms, longest wait between reconnect tries
+  // With signal_port, the signal server is stopped once the tunnel is up
+  // and started again signal_outage ms later; 0 for no outage.
+  int signal_outage;
+  // The restarted server has lost its rooms: the server peer makes its
+  // room again, the client keeps trying to get back in.
+  bool signal_outage_forget;
+  // With signal_port, the signal server stalls once the tunnel is up, for
+  // signal_stall ms, to time how long the peers' keepalive pings (every
+  // signal_ping ms, signal_ping_timeout ms for the pong) take to notice.
+  int signal_stall;
+  int signal_ping;
+  int signal_ping_timeout;
+  // Run the PeerConnections over an ImpairedNetwork when enabled.
+  ImpairmentConfig network;
+  int timeout;        // seconds
+};
+
+
+// Mean and percentiles of a latency histogram, for a result.
+Json::Value LatencyToJson(const Histogram& histogram);
+
+
+//////////////////////////////////////////////////////////////////////
+// BenchRunner
+// Runs both ends of a tunnel in this process: a server and a client
+// Conductors signaling through a LoopbackSignalConnection pair, or over
+// WebSockets through a LocalSignalServer, with real PeerConnections
+// between them. The workload goes from a local socket
+// into the client end and comes out of the server end into a target
+// socket, so it crosses the whole lane data path twice for echo and udp.
+// sink and source end in the server's bench endpoints instead, driven by
+// a BenchDriver. With config.network the PeerConnections run over an
+// ImpairedNetwork rather than the loopback interface.
+//
+class BenchRunner : public rtc::MessageHandler,
+                    public sigslot::has_slots<> {
+public:
+  BenchRunner(rtc::Thread* thread, const BenchConfig& config,
+              const TunnelOptions& options);
+  virtual ~BenchRunner();
+
+  // Sets up both ends; the thread's message loop then runs the workload
+  // and quits when it is done.
+  bool Start();
+
+  bool succeeded() const;
+  Json::Value result() const;
+
+  //
+  // implements the MessageHandler interface
+  //
+  void OnMessage(rtc::Message* msg);
+
+private:
+  enum ThreadMsgId {
+    MsgTimeout,
+    MsgUdpTick,
+    MsgUdpProbe,
+    MsgUdpDrained,
+    MsgIdleDone,
+    MsgSignalRestart,
+    MsgSignalUnstall
+  };
+
+  // A connection accepted by the target.
+  struct TargetConnection {
+    rtc::scoped_ptr<rtc::AsyncSocket> socket;
+    std::string pending;
+  };
+
+  bool is_udp() const { return config_.workload == "udp"; }
+  bool is_replay() const { return config_.workload == "replay"; }
+  bool is_driven() const {
+    return config_.workload == "sink" || config_.workload == "source";
+  }
+
+  // The far end of the tunnel: echoes (echo, udp, churn) or counts (bulk).
+  bool StartTarget();
+  TargetConnection* FindTarget(rtc::AsyncSocket* socket);
+  void OnTargetAccept(rtc::AsyncSocket* socket);
+  void OnTargetRead(rtc::AsyncSocket* socket);
+  void OnTargetWrite(rtc::AsyncSocket* socket);
+  void OnTargetClose(rtc::AsyncSocket* socket, int error);
+  void OnTargetUdpRead(rtc::AsyncSocket* socket);
+
+  void OnLocalSocketOpened(Conductors* conductors, const rtc::SocketAddress& address);
+
+  // The near end, connected to the client's local socket.
+  void OnClientConnect(rtc::AsyncSocket* socket);
+  void OnClientRead(rtc::AsyncSocket* socket);
+  void OnClientWrite(rtc::AsyncSocket* socket);
+  void OnClientClose(rtc::AsyncSocket* socket, int error);
+  void OnClientUdpRead(rtc::AsyncSocket* socket);
+  void OnChurnDone(ChurnLoad* churn);
+  void OnReplayDone(CaptureReplay* replay);
+  void StartSignalOutage();
+  void OnSignalConnectionLost(SignalServerConnection* connection);
+
+  void SendEcho();
+  void SendBulk();
+  void SendUdp(uint32 seq);
+  void OnUdpTick();
+  bool FlushPending(rtc::AsyncSocket* socket, std::string* pending);
+
+  // Fields every result has: the setup, signaling, network and transit
+  // numbers, whichever side ran the workload.
+  void AddCommonResult(Json::Value* result) const;
+  void Finish();
+  void Fail(const std::string& error);
+  void Stop();
+
+  rtc::Thread* thread_;
+  BenchConfig config_;
+  TunnelOptions options_;
+  // Counts app and wire bytes when the options bring no metrics.
+  TunnelMetrics metrics_;
+  // Outlives the conductors, whose PeerConnections run on it.
+  rtc::scoped_ptr<ImpairedNetwork> network_;
+
+  LoopbackSignalConnection server_signal_;
+  LoopbackSignalConnection client_signal_;
+  rtc::scoped_ptr<LocalSignalServer> signal_server_;
+  rtc::scoped_ptr<SignalServerConnection> server_ws_signal_;
+  rtc::scoped_ptr<SignalServerConnection> client_ws_signal_;
+  rtc::scoped_ptr<LanSignalConnection> server_lan_signal_;
+  rtc::scoped_ptr<LanSignalConnection> client_lan_signal_;
+  rtc::scoped_ptr<Conductors> server_;
+  rtc::scoped_ptr<Conductors> client_;
+
+  rtc::scoped_ptr<rtc::AsyncSocket> target_listen_;
+  std::vector<TargetConnection*> targets_;
+  rtc::scoped_ptr<rtc::AsyncSocket> client_socket_;
+  rtc::scoped_ptr<ChurnLoad> churn_;
+  rtc::scoped_ptr<BenchDriver> driver_;
+  rtc::scoped_ptr<CaptureReplay> replay_;
+  rtc::SocketAddress target_address_;
+  rtc::SocketAddress tunnel_address_;
+  std::string client_pending_;
+  std::vector<char> buffer_;
+  bool finished_;
+
+  uint64 start_time_;
+  uint64 setup_time_;
+  uint64 workload_start_;
+  uint64 workload_cpu_start_;
+  uint64 send_time_;
+  uint64 stall_start_;
+  uint64 stall_detected_;
+  Histogram rtt_;
+
+  // echo and bulk
+  bool warmed_up_;
+  int messages_done_;
+  size_t echo_received_;
+  uint64 bytes_sent_;
+  uint64 bytes_received_;
+
+  // udp
+  uint32 udp_sent_;
+  uint32 udp_received_;
+  uint32 udp_reordered_;
+  uint32 udp_highest_seq_;
+  uint64 udp_last_rtt_;
+  double udp_jitter_;
+
+  uint64 random_state_;
+  Json::Value result_;
+};
+
+//////////////////////////////////////////////////////////////////////
+
+} // namespace hotline
+
+#endif  // HOTLINE_TUNNEL_BENCH_H_
@@ -0,0 +1,482 @@
+#include "htn_config.h"
+
+#include <string.h>
+#include <algorithm>
+
+#include "webrtc/base/common.h"
+#include "webrtc/base/logging.h"
+#include "webrtc/base/socketserver.h"
+#include "webrtc/base/thread.h"
+#include "webrtc/base/timeutils.h"
+#include "bench.h"
+#include "bench_driver.h"
+#include "conductors.h"
+
+
+namespace hotline {
+
+static const size_t kBufferSize = 64 * 1024;
+static const size_t kHeaderSize = BenchEndpointStream::kDatagramHeaderSize;
+static const uint32 kProbeSeq = 0xFFFFFFFF;
+static const int kProbeInterval = 100;  // milliseconds
+static const int kDrainTime = 1000;     // milliseconds
+
+static uint64 NowMicros() {
+  return rtc::TimeNanos() / 1000;
+}
+
+static bool FlushPending(rtc::AsyncSocket* socket, std::string* pending) {
+  while (!pending->empty()) {
+    int len = socket->Send(pending->data(), pending->size());
+    if (len < 0) return socket->IsBlocking();
+    pending->erase(0, len);
+  }
+  return true;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// BenchDriver
+///////////////////////////////////////////////////////////////////////////////
+
+BenchDriver::Lane::Lane()
+  : started(false)
+  , start_time(0)
+  , send_time(0)
+  , echo_received(0)
+  , bytes_sent(0)
+  , bytes_received(0)
+  , sent(0)
+  , received(0)
+  , reordered(0)
+  , first_seq(0)
+  , highest_seq(0)
+  , last_rtt(0)
+  , jitter(0) {
+}
+
+BenchDriver::BenchDriver(rtc::Thread* thread, const BenchDriverConfig& config)
+  : thread_(thread)
+  , config_(config)
+  , buffer_(kBufferSize)
+  , running_(false)
+  , finished_(false)
+  , end_time_(0)
+  , random_state_(0x2545F4914F6CDD1DULL) {
+  config_.lanes = std::max(config_.lanes, 1);
+  config_.message_size = std::min(std::max(config_.message_size, (int)kHeaderSize),
+                                  (int)kBufferSize);
+}
+
+BenchDriver::~BenchDriver() {
+  thread_->Clear(this);
+  for (size_t i = 0; i < lanes_.size(); ++i) delete lanes_[i];
+}
+
+void BenchDriver::Start() {
+  thread_->PostDelayed(config_.timeout * 1000, this, MsgTimeout);
+}
+
+void BenchDriver::OnMessage(rtc::Message* msg) {
+  switch (msg->message_id) {
+  case MsgTimeout:
+    Fail("Timed out waiting for the tunnel.");
+    break;
+  case MsgTick:
+    OnTick();
+    break;
+  case MsgProbe:
+    OnProbe();
+    break;
+  case MsgFinish:
+    running_ = false;
+    end_time_ = NowMicros();
+    // Let echoes still on the way come back.
+    if (is_udp() && config_.kind == BenchEndpointStream::kEcho) {
+      thread_->PostDelayed(kDrainTime, this, MsgReport);
+    }
+    else {
+      Report();
+    }
+    break;
+  case MsgReport:
+    Report();
+    break;
+  default:
+    break;
+  }
+}
+
+void BenchDriver::OnLocalSocketOpened(Conductors* conductors,
+                                      const rtc::SocketAddress& address) {
+  if (running_ || finished_) return;
+
+  thread_->Clear(this, MsgTimeout);
+  tunnel_address_ = address;
+  if (tunnel_address_.IsAnyIP()) {
+    tunnel_address_.SetIP(address.family() == AF_INET6 ? "::1" : "127.0.0.1");
+  }
+
+  int type = is_udp() ? SOCK_DGRAM : SOCK_STREAM;
+  for (int i = 0; i < config_.lanes; ++i) {
+    Lane* lane = new Lane();
+    lanes_.push_back(lane);
+
+    lane->socket.reset(thread_->socketserver()->CreateAsyncSocket(tunnel_address_.family(), type));
+    if (!lane->socket) {
+      Fail("Can't create a lane socket.");
+      return;
+    }
+
+    if (is_udp()) {
+      rtc::SocketAddress any(tunnel_address_.family() == AF_INET6 ? "::1" : "127.0.0.1", 0);
+      if (lane->socket->Bind(any) == SOCKET_ERROR) {
+        Fail("Can't bind a lane socket.");
+        return;
+      }
+      lane->socket->SignalReadEvent.connect(this, &BenchDriver::OnUdpRead);
+
+      // A sink has nothing to wait for; the tunnel opens the lane on the
+      // first datagram.
+      if (config_.kind == BenchEndpointStream::kSink) StartLane(lane);
+      continue;
+    }
+
+    lane->socket->SignalConnectEvent.connect(this, &BenchDriver::OnConnect);
+    lane->socket->SignalReadEvent.connect(this, &BenchDriver::OnRead);
+    lane->socket->SignalWriteEvent.connect(this, &BenchDriver::OnWrite);
+    lane->socket->SignalCloseEvent.connect(this, &BenchDriver::OnClose);
+    if (lane->socket->Connect(tunnel_address_) == SOCKET_ERROR &&
+        !lane->socket->IsBlocking()) {
+      Fail("Can't connect to the tunnel.");
+      return;
+    }
+  }
+
+  running_ = true;
+  thread_->PostDelayed(config_.seconds * 1000, this, MsgFinish);
+  if (is_udp()) {
+    thread_->Post(this, MsgProbe);
+    thread_->Post(this, MsgTick);
+  }
+}
+
+BenchDriver::Lane* BenchDriver::FindLane(rtc::AsyncSocket* socket) {
+  for (size_t i = 0; i < lanes_.size(); ++i) {
+    if (lanes_[i]->socket.get() == socket) return lanes_[i];
+  }
+  return NULL;
+}
+
+void BenchDriver::StartLane(Lane* lane) {
+  lane->started = true;
+  lane->start_time = NowMicros();
+}
+
+
+//
+// TCP lanes
+//
+
+void BenchDriver::OnConnect(rtc::AsyncSocket* socket) {
+  Lane* lane = FindLane(socket);
+  if (!lane || !running_) return;
+
+  if (config_.kind == BenchEndpointStream::kSink) {
+    StartLane(lane);
+    SendBulk(lane);
+  }
+  else if (config_.kind == BenchEndpointStream::kEcho) {
+    // The first message waits for the lane to open; it is not counted.
+    SendEcho(lane);
+  }
+}
+
+void BenchDriver::OnRead(rtc::AsyncSocket* socket) {
+  Lane* lane = FindLane(socket);
+  if (!lane) return;
+
+  int len;
+  while ((len = socket->Recv(&buffer_[0], buffer_.size())) > 0) {
+    if (!running_) continue;
+
+    if (config_.kind == BenchEndpointStream::kSource) {
+      if (!lane->started) StartLane(lane);
+      lane->bytes_received += len;
+      continue;
+    }
+
+    if (config_.kind != BenchEndpointStream::kEcho) continue;
+
+    lane->echo_received += len;
+    while (lane->echo_received >= (size_t)config_.message_size && running_) {
+      lane->echo_received -= config_.message_size;
+
+      if (!lane->started) {
+        StartLane(lane);
+      }
+      else {
+        rtt_.Record(NowMicros() - lane->send_time);
+        lane->bytes_received += config_.message_size;
+      }
+      SendEcho(lane);
+    }
+  }
+}
+
+void BenchDriver::OnWrite(rtc::AsyncSocket* socket) {
+  Lane* lane = FindLane(socket);
+  if (!lane || !running_) return;
+
+  if (config_.kind == BenchEndpointStream::kSink) {
+    SendBulk(lane);
+  }
+  else if (!FlushPending(socket, &lane->pending)) {
+    Fail("Lane write failed.");
+  }
+}
+
+void BenchDriver::OnClose(rtc::AsyncSocket* socket, int error) {
+  if (running_) Fail("The tunnel closed a lane.");
+}
+
+void BenchDriver::SendEcho(Lane* lane) {
+  lane->pending.resize(config_.message_size);
+  FillBenchPayload(config_.payload, &lane->pending[0], lane->pending.size(), &random_state_);
+  lane->send_time = NowMicros();
+
+  if (!FlushPending(lane->socket.get(), &lane->pending)) {
+    Fail("Lane write failed.");
+  }
+}
+
+void BenchDriver::SendBulk(Lane* lane) {
+  while (running_) {
+    if (!FlushPending(lane->socket.get(), &lane->pending)) {
+      Fail("Lane write failed.");
+      return;
+    }
+    if (!lane->pending.empty()) return;
+
+    lane->pending.resize(kBufferSize);
+    FillBenchPayload(config_.payload, &lane->pending[0], kBufferSize, &random_state_);
+    lane->bytes_sent += kBufferSize;
+  }
+}
+
+
+//
+// UDP lanes
+//
+
+void BenchDriver::SendDatagram(Lane* lane, uint32 seq) {
+  uint64 now = NowMicros();
+  memcpy(&buffer_[0], &seq, sizeof(seq));
+  memcpy(&buffer_[sizeof(seq)], &now, sizeof(now));
+  if (seq != kProbeSeq) {
+    FillBenchPayload(config_.payload, &buffer_[kHeaderSize],
+                     config_.message_size - kHeaderSize, &random_state_);
+  }
+  lane->socket->SendTo(&buffer_[0], config_.message_size, tunnel_address_);
+}
+
+void BenchDriver::OnProbe() {
+  if (!running_) return;
+
+  bool waiting = false;
+  for (size_t i = 0; i < lanes_.size(); ++i) {
+    Lane* lane = lanes_[i];
+    if (lane->started) continue;
+    waiting = true;
+
+    if (config_.kind == BenchEndpointStream::kSource) {
+      uint32 rate = config_.rate;
+      lane->socket->SendTo(&rate, sizeof(rate), tunnel_address_);
+    }
+    else {
+      SendDatagram(lane, kProbeSeq);
+    }
+  }
+
+  if (waiting) thread_->PostDelayed(kProbeInterval, this, MsgProbe);
+}
+
+void BenchDriver::OnTick() {
+  if (!running_) return;
+
+  if (config_.kind != BenchEndpointStream::kSource) {
+    uint64 now = NowMicros();
+    for (size_t i = 0; i < lanes_.size(); ++i) {
+      Lane* lane = lanes_[i];
+      if (!lane->started) continue;
+
+      uint64 due = (now - lane->start_time) * config_.rate / 1000000 + 1;
+      while (lane->sent < due) {
+        SendDatagram(lane, lane->sent++);
+        lane->bytes_sent += config_.message_size;
+      }
+    }
+  }
+
+  thread_->PostDelayed(1, this, MsgTick);
+}
+
+void BenchDriver::OnUdpRead(rtc::AsyncSocket* socket) {
+  Lane* lane = FindLane(socket);
+  if (!lane) return;
+
+  rtc::SocketAddress from;
+  int len;
+  while ((len = socket->RecvFrom(&buffer_[0], buffer_.size(), &from)) >= 0) {
+    if (len >= (int)kHeaderSize && !finished_) {
+      OnUdpDatagram(lane, &buffer_[0], len);
+    }
+  }
+}
+
+void BenchDriver::OnUdpDatagram(Lane* lane, const char* data, size_t len) {
+  uint32 seq;
+  uint64 sent;
+  memcpy(&seq, data, sizeof(seq));
+  memcpy(&sent, data + sizeof(seq), sizeof(sent));
+
+  if (seq == kProbeSeq) {
+    if (!lane->started && running_) StartLane(lane);
+    return;
+  }
+
+  if (config_.kind == BenchEndpointStream::kSource) {
+    if (!running_) return;
+    if (!lane->started) {
+      StartLane(lane);
+      lane->first_seq = seq;
+      lane->highest_seq = seq;
+    }
+    if (seq < lane->first_seq) return;
+  }
+  else if (config_.kind == BenchEndpointStream::kEcho) {
+    // Round trip on one clock; the source's send time is the server's.
+    uint64 rtt = NowMicros() - sent;
+    rtt_.Record(rtt);
+
+    // RFC 3550 style: a smoothed mean of the change between round trips.
+    if (lane->received > 0) {
+      double change = rtt > lane->last_rtt ? (double)(rtt - lane->last_rtt)
+                                           : (double)(lane->last_rtt - rtt);
+      lane->jitter += (change - lane->jitter) / 16;
+    }
+    lane->last_rtt = rtt;
+  }
+
+  if (seq < lane->highest_seq) lane->reordered++;
+  lane->highest_seq = std::max(lane->highest_seq, seq);
+  lane->received++;
+  lane->bytes_received += len;
+}
+
+
+//
+// Results
+//
+
+void BenchDriver::Report() {
+  if (finished_) return;
+  finished_ = true;
+
+  bool sink = config_.kind == BenchEndpointStream::kSink;
+  uint64 total_bytes = 0;
+  double total_rate = 0;
+  double sum_squares = 0;
+  uint64 total_sent = 0;
+  uint64 total_received = 0;
+  uint64 total_expected = 0;
+  uint32 total_reordered = 0;
+  double jitter = 0;
+  double seconds = 0;
+  Json::Value lanes(Json::arrayValue);
+
+  for (size_t i = 0; i < lanes_.size(); ++i) {
+    Lane* lane = lanes_[i];
+    Json::Value json;
+    json["started"] = lane->started;
+
+    double lane_seconds = lane->started && end_time_ > lane->start_time ?
+                          (end_time_ - lane->start_time) / 1000000.0 : 0;
+    uint64 bytes = sink ? lane->bytes_sent : lane->bytes_received;
+    double rate = lane_seconds > 0 ? bytes / lane_seconds / (1 << 20) : 0;
+    json["bytes"] = static_cast<double>(bytes);
+    json["mb_per_sec"] = rate;
+    total_bytes += bytes;
+    total_rate += rate;
+    sum_squares += rate * rate;
+    seconds = std::max(seconds, lane_seconds);
+
+    if (is_udp() && !sink) {
+      // A source numbers what it sends; an echo returns what was sent.
+      uint64 expected = config_.kind == BenchEndpointStream::kSource ?
+                        (lane->started ? lane->highest_seq - lane->first_seq + 1 : 0) :
+                        lane->sent;
+      uint64 received = std::min<uint64>(lane->received, expected);
+      json["sent"] = static_cast<double>(expected);
+      json["received"] = lane->received;
+      json["loss"] = expected ? 1.0 - (double)received / expected : 0.0;
+      total_expected += expected;
+      total_received += received;
+      total_reordered += lane->reordered;
+      jitter += lane->jitter / lanes_.size();
+    }
+    else if (is_udp()) {
+      json["sent"] = lane->sent;
+      total_sent += lane->sent;
+    }
+    lanes.append(json);
+  }
+
+  result_["endpoint"] = BenchEndpointStream::KindName(config_.kind);
+  result_["protocol"] = is_udp() ? "udp" : "tcp";
+  result_["lanes"] = config_.lanes;
+  result_["message_size"] = config_.message_size;
+  result_["payload"] = BenchPayloadName(config_.payload);
+  result_["seconds"] = seconds;
+  result_["bytes"] = static_cast<double>(total_bytes);
+  result_["mb_per_sec"] = total_rate;
+  // Jain's index over the lane rates: 1 when all lanes got the same, 1/n
+  // when one lane got everything.
+  result_["fairness"] = sum_squares > 0 ?
+                        total_rate * total_rate / (lanes_.size() * sum_squares) : 0.0;
+
+  if (is_udp() && !sink) {
+    result_["sent"] = static_cast<double>(total_expected);
+    result_["received"] = static_cast<double>(total_received);
+    result_["loss"] = total_expected ? 1.0 - (double)total_received / total_expected : 0.0;
+    result_["reordered"] = total_reordered;
+  }
+  else if (is_udp()) {
+    result_["sent"] = static_cast<double>(total_sent);
+  }
+
+  if (config_.kind == BenchEndpointStream::kEcho) {
+    result_["rtt_us"] = LatencyToJson(rtt_);
+    if (is_udp()) result_["jitter_us"] = jitter;
+  }
+  result_["lane"] = lanes;
+
+  thread_->Clear(this);
+  thread_->Quit();
+}
+
+void BenchDriver::Fail(const std::string& error) {
+  if (finished_) return;
+  finished_ = true;
+  running_ = false;
+
+  LOG(LS_ERROR) << "Benchmark failed: " << error;
+  result_["endpoint"] = BenchEndpointStream::KindName(config_.kind);
+  result_["error"] = error;
+  thread_->Clear(this);
+  thread_->Quit();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+} // namespace hotline
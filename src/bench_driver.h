@@ -0,0 +1,151 @@
+#ifndef HOTLINE_TUNNEL_BENCH_DRIVER_H_
+#define HOTLINE_TUNNEL_BENCH_DRIVER_H_
+#pragma once
+
+#include "htn_config.h"
+
+#include <string>
+#include <vector>
+
+#include "webrtc/base/asyncsocket.h"
+#include "webrtc/base/json.h"
+#include "webrtc/base/messagehandler.h"
+#include "webrtc/base/scoped_ptr.h"
+#include "webrtc/base/sigslot.h"
+#include "webrtc/base/socketaddress.h"
+#include "webrtc/p2p/base/portinterface.h"
+#include "bench_endpoint.h"
+#include "histogram.h"
+
+
+namespace rtc {
+  class Thread;
+}
+
+
+namespace hotline {
+
+class Conductors;
+
+struct BenchDriverConfig {
+  BenchDriverConfig()
+    : kind(BenchEndpointStream::kSink),
+      protocol(cricket::PROTO_TCP),
+      lanes(1),
+      seconds(10),
+      message_size(1024),
+      rate(10000),
+      payload(kPayloadRandom),
+      timeout(60) {}
+
+  BenchEndpointStream::Kind kind;
+  cricket::ProtocolType protocol;
+  int lanes;          // parallel connections to the local socket
+  int seconds;        // measurement time
+  int message_size;   // bytes per echo message or datagram
+  int rate;           // datagrams per second per lane (udp)
+  BenchPayload payload;  // what the lanes send
+  int timeout;        // seconds to wait for the tunnel
+};
+
+
+//////////////////////////////////////////////////////////////////////
+// BenchDriver
+// The client side of a run against a server bench endpoint. Once the
+// tunnel's local socket is open it connects config.lanes sockets to it and
+// for config.seconds drives each lane to suit the endpoint:
+//
+//   sink    writes as fast as the lane takes it (throughput out)
+//   source  reads what the endpoint generates (throughput in; udp: loss)
+//   echo    tcp: one message at a time (round trip latency)
+//           udp: paced datagrams (latency, loss, reordering, jitter)
+//
+// then quits the thread with the result.
+//
+class BenchDriver : public rtc::MessageHandler,
+                    public sigslot::has_slots<> {
+public:
+  BenchDriver(rtc::Thread* thread, const BenchDriverConfig& config);
+  virtual ~BenchDriver();
+
+  // Arms the timeout; the lanes start on OnLocalSocketOpened().
+  void Start();
+  void OnLocalSocketOpened(Conductors* conductors, const rtc::SocketAddress& address);
+
+  bool succeeded() const { return !result_.isMember("error"); }
+  const Json::Value& result() const { return result_; }
+
+  //
+  // implements the MessageHandler interface
+  //
+  void OnMessage(rtc::Message* msg);
+
+private:
+  enum ThreadMsgId {
+    MsgTimeout,
+    MsgTick,
+    MsgProbe,
+    MsgFinish,
+    MsgReport
+  };
+
+  struct Lane {
+    Lane();
+
+    rtc::scoped_ptr<rtc::AsyncSocket> socket;
+    std::string pending;
+    bool started;           // measuring; set once the lane carries data
+    uint64 start_time;
+    uint64 send_time;
+    size_t echo_received;
+    uint64 bytes_sent;
+    uint64 bytes_received;
+
+    // udp
+    uint32 sent;
+    uint32 received;
+    uint32 reordered;
+    uint32 first_seq;
+    uint32 highest_seq;
+    uint64 last_rtt;
+    double jitter;
+  };
+
+  bool is_udp() const { return config_.protocol == cricket::PROTO_UDP; }
+  Lane* FindLane(rtc::AsyncSocket* socket);
+  void StartLane(Lane* lane);
+
+  void OnConnect(rtc::AsyncSocket* socket);
+  void OnRead(rtc::AsyncSocket* socket);
+  void OnWrite(rtc::AsyncSocket* socket);
+  void OnClose(rtc::AsyncSocket* socket, int error);
+  void OnUdpRead(rtc::AsyncSocket* socket);
+  void OnUdpDatagram(Lane* lane, const char* data, size_t len);
+
+  void SendEcho(Lane* lane);
+  void SendBulk(Lane* lane);
+  void SendDatagram(Lane* lane, uint32 seq);
+  void OnTick();
+  void OnProbe();
+
+  void Report();
+  void Fail(const std::string& error);
+
+  rtc::Thread* thread_;
+  BenchDriverConfig config_;
+  rtc::SocketAddress tunnel_address_;
+  std::vector<Lane*> lanes_;
+  std::vector<char> buffer_;
+  bool running_;
+  bool finished_;
+  uint64 end_time_;
+  uint64 random_state_;
+  Histogram rtt_;
+  Json::Value result_;
+};
+
+//////////////////////////////////////////////////////////////////////
+
+} // namespace hotline
+
+#endif  // HOTLINE_TUNNEL_BENCH_DRIVER_H_
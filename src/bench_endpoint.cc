@@ -0,0 +1,346 @@
+#include "htn_config.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+#include "webrtc/base/common.h"
+#include "webrtc/base/logging.h"
+#include "webrtc/base/thread.h"
+#include "webrtc/base/timeutils.h"
+#include "bench_endpoint.h"
+
+
+namespace hotline {
+
+const char BenchEndpointStream::kHostName[] = "bench";
+
+static uint64 NowMicros() {
+  return rtc::TimeNanos() / 1000;
+}
+
+void FillBenchPayload(char* data, size_t len, uint64* state) {
+  for (size_t i = 0; i < len; ++i) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    data[i] = static_cast<char>(*state);
+  }
+}
+
+// Longer than deflate's 32KB window, so only dedup finds the repeats.
+static const size_t kRepeatBlockSize = 256 * 1024;
+
+static std::vector<char> MakeRepeatBlock() {
+  std::vector<char> block(kRepeatBlockSize);
+  uint64 state = 0x9E3779B97F4A7C15ULL;
+  FillBenchPayload(&block[0], block.size(), &state);
+  return block;
+}
+
+bool ParseBenchPayload(const std::string& name, BenchPayload* payload) {
+  if (name == "random") *payload = kPayloadRandom;
+  else if (name == "text") *payload = kPayloadText;
+  else if (name == "repeat") *payload = kPayloadRepeat;
+  else return false;
+  return true;
+}
+
+const char* BenchPayloadName(BenchPayload payload) {
+  switch (payload) {
+  case kPayloadText: return "text";
+  case kPayloadRepeat: return "repeat";
+  default: return "random";
+  }
+}
+
+void FillBenchPayload(BenchPayload payload, char* data, size_t len, uint64* state) {
+  if (payload == kPayloadRepeat) {
+    static const std::vector<char> block = MakeRepeatBlock();
+    for (size_t i = 0; i < len; ++i) {
+      data[i] = block[(*state)++ % kRepeatBlockSize];
+    }
+    return;
+  }
+
+  if (payload != kPayloadText) {
+    FillBenchPayload(data, len, state);
+    return;
+  }
+
+  // Words picked at random: deflate shrinks it a few times over, but the
+  // chunks dedup cuts hardly ever repeat.
+  static const char* const kWords[] = {
+    "the ", "tunnel ", "lane ", "peer ", "data ", "channel ", "sends ",
+    "GET ", "/index.html ", "HTTP/1.1\r\n", "Host: ", "example.com\r\n",
+    "Accept: ", "text/html, ", "of ", "and ", "a ", "to ", "offer ",
+    "answer ", "candidate ", "room ", "signal ", "server ", "\n"
+  };
+  const size_t word_count = sizeof(kWords) / sizeof(kWords[0]);
+  size_t pos = 0;
+  while (pos < len) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    const char* word = kWords[*state % word_count];
+    size_t n = std::min(strlen(word), len - pos);
+    memcpy(data + pos, word, n);
+    pos += n;
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// BenchEndpointStream
+///////////////////////////////////////////////////////////////////////////////
+
+bool BenchEndpointStream::ParseName(const std::string& name,
+                                    rtc::SocketAddress* address) {
+  std::string prefix = std::string(kHostName) + ":";
+  if (name.compare(0, prefix.size(), prefix) != 0) return false;
+
+  std::string service = name.substr(prefix.size());
+  int port;
+  if (service == "echo") port = kEcho;
+  else if (service == "sink") port = kSink;
+  else if (service == "source") port = kSource;
+  else port = atoi(service.c_str());
+
+  if (port != kEcho && port != kSink && port != kSource) return false;
+
+  address->SetIP(kHostName);
+  address->SetPort(port);
+  return true;
+}
+
+bool BenchEndpointStream::IsEndpoint(const rtc::SocketAddress& address, Kind* kind) {
+  if (address.hostname() != kHostName) return false;
+
+  switch (address.port()) {
+  case kEcho:
+  case kSink:
+  case kSource:
+    *kind = static_cast<Kind>(address.port());
+    return true;
+  default:
+    return false;
+  }
+}
+
+const char* BenchEndpointStream::KindName(Kind kind) {
+  switch (kind) {
+  case kEcho: return "echo";
+  case kSink: return "sink";
+  case kSource: return "source";
+  }
+  return "";
+}
+
+
+BenchEndpointStream::BenchEndpointStream(Kind kind, cricket::ProtocolType protocol,
+                                         rtc::Thread* thread,
+                                         rtc::scoped_refptr<HotlineDataChannel> channel,
+                                         BenchPayload payload)
+  : kind_(kind)
+  , protocol_(protocol)
+  , thread_(thread)
+  , channel_(channel)
+  , closed_(false)
+  , readable_pending_(false)
+  , echo_offset_(0)
+  , echo_write_blocked_(false)
+  , payload_(payload)
+  , random_state_(0x9E3779B97F4A7C15ULL)
+  , burst_left_(kSourceBurst)
+  , source_rate_(0)
+  , source_seq_(0)
+  , source_start_(0)
+  , bytes_in_(0)
+  , bytes_out_(0) {
+
+  // A TCP source starts on its own; a UDP one waits to be told the rate.
+  if (kind_ == kSource && protocol_ == cricket::PROTO_TCP) {
+    SignalReadable(0);
+  }
+}
+
+BenchEndpointStream::~BenchEndpointStream() {
+  LOG(LS_INFO) << "Bench " << KindName(kind_) << " closed, "
+               << bytes_in_ << " bytes in, " << bytes_out_ << " bytes out.";
+}
+
+rtc::StreamState BenchEndpointStream::GetState() const {
+  return closed_ ? rtc::SS_CLOSED : rtc::SS_OPEN;
+}
+
+rtc::StreamResult BenchEndpointStream::Read(void* buffer, size_t buffer_len,
+                                            size_t* read, int* error) {
+  if (closed_) return rtc::SR_EOS;
+
+  if (LaneBacklogged()) {
+    SignalReadable(1);
+    return rtc::SR_BLOCK;
+  }
+
+  size_t len = 0;
+  if (kind_ == kSource) {
+    rtc::StreamResult result = ReadSource(static_cast<char*>(buffer), buffer_len, &len);
+    if (result != rtc::SR_SUCCESS) return result;
+  }
+  else if (kind_ == kEcho && protocol_ == cricket::PROTO_UDP) {
+    if (echo_datagrams_.empty()) return rtc::SR_BLOCK;
+
+    std::vector<char>& datagram = echo_datagrams_.front();
+    len = std::min(buffer_len, datagram.size());
+    if (len > 0) memcpy(buffer, &datagram[0], len);
+    echo_datagrams_.pop_front();
+  }
+  else if (kind_ == kEcho) {
+    if (echo_offset_ == echo_bytes_.size()) return rtc::SR_BLOCK;
+
+    len = std::min(buffer_len, echo_bytes_.size() - echo_offset_);
+    memcpy(buffer, echo_bytes_.data() + echo_offset_, len);
+    echo_offset_ += len;
+    if (echo_offset_ == echo_bytes_.size()) {
+      echo_bytes_.clear();
+      echo_offset_ = 0;
+    }
+
+    if (echo_write_blocked_ && echo_bytes_.size() - echo_offset_ < kHighWater) {
+      echo_write_blocked_ = false;
+      thread_->Post(this, MsgWritable);
+    }
+  }
+  else {
+    return rtc::SR_BLOCK;
+  }
+
+  bytes_out_ += len;
+  if (read) *read = len;
+  return rtc::SR_SUCCESS;
+}
+
+rtc::StreamResult BenchEndpointStream::ReadSource(char* buffer, size_t buffer_len,
+                                                  size_t* read) {
+  if (burst_left_ == 0) {
+    SignalReadable(0);
+    return rtc::SR_BLOCK;
+  }
+
+  size_t len = buffer_len;
+  size_t pos = 0;
+
+  if (protocol_ == cricket::PROTO_UDP) {
+    if (source_rate_ == 0) return rtc::SR_BLOCK;
+
+    uint64 now = NowMicros();
+    uint64 due = (now - source_start_) * source_rate_ / 1000000 + 1;
+    if (source_seq_ >= due) {
+      SignalReadable(1);
+      return rtc::SR_BLOCK;
+    }
+
+    len = std::min(buffer_len, (size_t)kSourceDatagramSize);
+    if (len < kDatagramHeaderSize) return rtc::SR_BLOCK;
+
+    memcpy(buffer, &source_seq_, sizeof(source_seq_));
+    memcpy(buffer + sizeof(source_seq_), &now, sizeof(now));
+    pos = kDatagramHeaderSize;
+    source_seq_++;
+  }
+
+  FillBenchPayload(payload_, buffer + pos, len - pos, &random_state_);
+
+  burst_left_ -= std::min(burst_left_, len);
+  *read = len;
+  return rtc::SR_SUCCESS;
+}
+
+rtc::StreamResult BenchEndpointStream::Write(const void* data, size_t data_len,
+                                             size_t* written, int* error) {
+  if (closed_) return rtc::SR_EOS;
+
+  // Like a full socket, the echo takes nothing more until it has sent
+  // some back, then signals SE_WRITE.
+  if (kind_ == kEcho && protocol_ != cricket::PROTO_UDP &&
+      echo_bytes_.size() - echo_offset_ >= kHighWater) {
+    echo_write_blocked_ = true;
+    if (error) *error = EWOULDBLOCK;
+    return rtc::SR_BLOCK;
+  }
+
+  bytes_in_ += data_len;
+
+  if (kind_ == kEcho && protocol_ == cricket::PROTO_UDP) {
+    if (echo_datagrams_.size() >= kMaxQueuedDatagrams) {
+      echo_datagrams_.pop_front();
+    }
+    const char* bytes = static_cast<const char*>(data);
+    echo_datagrams_.push_back(std::vector<char>(bytes, bytes + data_len));
+    SignalReadable(0);
+  }
+  else if (kind_ == kEcho) {
+    // Drop what was read back once it is at least half the buffer, so
+    // the erase stays amortized O(1) per byte.
+    if (echo_offset_ > 0 && echo_offset_ >= echo_bytes_.size() / 2) {
+      echo_bytes_.erase(0, echo_offset_);
+      echo_offset_ = 0;
+    }
+    echo_bytes_.append(static_cast<const char*>(data), data_len);
+    SignalReadable(0);
+  }
+  else if (kind_ == kSource && protocol_ == cricket::PROTO_UDP &&
+           source_rate_ == 0 && data_len >= sizeof(source_rate_)) {
+    memcpy(&source_rate_, data, sizeof(source_rate_));
+    source_start_ = NowMicros();
+    if (source_rate_ > 0) SignalReadable(0);
+  }
+
+  if (written) *written = data_len;
+  return rtc::SR_SUCCESS;
+}
+
+void BenchEndpointStream::Close() {
+  closed_ = true;
+  echo_bytes_.clear();
+  echo_offset_ = 0;
+  echo_datagrams_.clear();
+}
+
+void BenchEndpointStream::OnMessage(rtc::Message* msg) {
+  if (msg->message_id == MsgWritable) {
+    if (!closed_) SignalEvent(this, rtc::SE_WRITE, 0);
+    return;
+  }
+  if (msg->message_id != MsgReadable) {
+    rtc::StreamInterface::OnMessage(msg);
+    return;
+  }
+
+  readable_pending_ = false;
+  burst_left_ = kSourceBurst;
+  if (!closed_) SignalEvent(this, rtc::SE_READ, 0);
+}
+
+bool BenchEndpointStream::LaneBacklogged() const {
+  return channel_ && channel_->buffered_amount() > kHighWater;
+}
+
+// The read event is always posted, so SocketConnection's receive loop is
+// never re-entered and a source yields to the rest of the thread.
+void BenchEndpointStream::SignalReadable(int delay) {
+  if (readable_pending_) return;
+  readable_pending_ = true;
+
+  if (delay > 0) {
+    thread_->PostDelayed(delay, this, MsgReadable);
+  }
+  else {
+    thread_->Post(this, MsgReadable);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+} // namespace hotline
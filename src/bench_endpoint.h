@@ -0,0 +1,148 @@
+#ifndef HOTLINE_TUNNEL_BENCH_ENDPOINT_H_
+#define HOTLINE_TUNNEL_BENCH_ENDPOINT_H_
+#pragma once
+
+#include "htn_config.h"
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "webrtc/base/scoped_ref_ptr.h"
+#include "webrtc/base/socketaddress.h"
+#include "webrtc/base/stream.h"
+#include "webrtc/p2p/base/portinterface.h"
+#include "data_channel.h"
+
+
+namespace rtc {
+  class Thread;
+}
+
+
+namespace hotline {
+
+// Fills data with xorshift noise, which neither compression nor dedup
+// can shrink.
+void FillBenchPayload(char* data, size_t len, uint64* state);
+
+// What benchmark data looks like: noise, text that deflate does well on,
+// or one block of noise over and over, which only dedup can shrink.
+enum BenchPayload {
+  kPayloadRandom,
+  kPayloadText,
+  kPayloadRepeat
+};
+
+// Accepts "random", "text" and "repeat".
+bool ParseBenchPayload(const std::string& name, BenchPayload* payload);
+const char* BenchPayloadName(BenchPayload payload);
+// Fills data with the next len bytes of payload; *state carries on from
+// one call to the next.
+void FillBenchPayload(BenchPayload payload, char* data, size_t len, uint64* state);
+
+
+//////////////////////////////////////////////////////////////////////
+// BenchEndpointStream
+// A virtual destination on the server peer, so a lane can be measured
+// without a real service behind it. The client asks for one with the
+// reserved host name "bench" and the port of the matching inetd service:
+//
+//   bench:7  (echo)    sends back everything it receives
+//   bench:9  (sink)    discards everything it receives
+//   bench:19 (source)  generates data as fast as the lane takes it
+//
+// A UDP source waits for a first datagram whose leading 4 bytes are the
+// datagrams per second it should send; each datagram it sends starts with
+// a sequence number so the receiver can count losses.
+//
+class BenchEndpointStream : public rtc::StreamInterface {
+public:
+  enum Kind {
+    kEcho = 7,
+    kSink = 9,
+    kSource = 19
+  };
+
+  static const char kHostName[];
+
+  // Bytes of sequence number and send time leading every bench datagram.
+  enum { kDatagramHeaderSize = 12 };
+  enum { kSourceDatagramSize = 1200 };
+
+  // Accepts "bench:echo", "bench:sink" and "bench:source" as well as the
+  // numeric form.
+  static bool ParseName(const std::string& name, rtc::SocketAddress* address);
+  static bool IsEndpoint(const rtc::SocketAddress& address, Kind* kind);
+  static const char* KindName(Kind kind);
+
+  // A source generates payload.
+  BenchEndpointStream(Kind kind, cricket::ProtocolType protocol,
+                      rtc::Thread* thread,
+                      rtc::scoped_refptr<HotlineDataChannel> channel,
+                      BenchPayload payload);
+  virtual ~BenchEndpointStream();
+
+  //
+  // StreamInterface implementation.
+  //
+  virtual rtc::StreamState GetState() const;
+  virtual rtc::StreamResult Read(void* buffer, size_t buffer_len,
+                                 size_t* read, int* error);
+  virtual rtc::StreamResult Write(const void* data, size_t data_len,
+                                  size_t* written, int* error);
+  virtual void Close();
+
+  //
+  // implements the MessageHandler interface
+  //
+  virtual void OnMessage(rtc::Message* msg);
+
+private:
+  enum ThreadMsgId {
+    MsgReadable = 1,
+    MsgWritable
+  };
+
+  // Stops reading while the lane has this much unsent, like a socket
+  // whose send buffer is full, and an echo stops taking writes while it
+  // holds this much.
+  enum { kHighWater = 1024 * 1024 };
+  // Bytes a source produces before yielding to the message loop.
+  enum { kSourceBurst = 256 * 1024 };
+  enum { kMaxQueuedDatagrams = 256 };
+
+  bool LaneBacklogged() const;
+  void SignalReadable(int delay);
+  rtc::StreamResult ReadSource(char* buffer, size_t buffer_len, size_t* read);
+
+  Kind kind_;
+  cricket::ProtocolType protocol_;
+  rtc::Thread* thread_;
+  rtc::scoped_refptr<HotlineDataChannel> channel_;
+  bool closed_;
+  bool readable_pending_;
+
+  // echo; bytes before echo_offset_ have been read back already
+  std::string echo_bytes_;
+  size_t echo_offset_;
+  bool echo_write_blocked_;
+  std::deque<std::vector<char> > echo_datagrams_;
+
+  // source
+  BenchPayload payload_;
+  uint64 random_state_;
+  size_t burst_left_;
+  uint32 source_rate_;
+  uint32 source_seq_;
+  uint64 source_start_;
+
+  uint64 bytes_in_;
+  uint64 bytes_out_;
+};
+
+//////////////////////////////////////////////////////////////////////
+
+} // namespace hotline
+
+#endif  // HOTLINE_TUNNEL_BENCH_ENDPOINT_H_
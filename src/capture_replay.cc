@@ -0,0 +1,487 @@
+#include "htn_config.h"
+
+#include <string.h>
+#include <algorithm>
+#include <map>
+#include <set>
+
+#include "webrtc/base/common.h"
+#include "webrtc/base/logging.h"
+#include "webrtc/base/socketserver.h"
+#include "webrtc/base/thread.h"
+#include "webrtc/base/timeutils.h"
+#include "webrtc/p2p/base/portinterface.h"
+#include "bench.h"
+#include "bench_endpoint.h"
+#include "capture_replay.h"
+
+
+namespace hotline {
+
+static const size_t kBufferSize = 64 * 1024;
+static const size_t kLaneNumberSize = 4;
+static const int kCheckInterval = 100;          // milliseconds
+static const uint64 kLaneTimeout = 10000000;    // microseconds after its close
+static const uint64 kNever = ~0ULL;
+
+static uint64 NowMicros() {
+  return rtc::TimeNanos() / 1000;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// CaptureReplay
+///////////////////////////////////////////////////////////////////////////////
+
+CaptureReplay::Lane::Lane()
+  : index(0)
+  , open_time(0)
+  , close_time(0)
+  , up_bytes(0)
+  , down_bytes(0)
+  , next_up(0)
+  , next_down(0)
+  , connect_start(0)
+  , connected(false)
+  , client_received(0)
+  , target(NULL)
+  , ended(false) {
+}
+
+CaptureReplay::CaptureReplay(rtc::Thread* thread, const CaptureHeader& header,
+                             const std::vector<CaptureRecord>& records)
+  : thread_(thread)
+  , buffer_(kBufferSize)
+  , next_open_(0)
+  , done_(false)
+  , start_time_(0)
+  , end_time_(0)
+  , captured_time_(0)
+  , random_state_(0x2545F4914F6CDD1DULL)
+  , skipped_udp_(0)
+  , completed_(0)
+  , failed_(0)
+  , failures_(Json::objectValue)
+  , bytes_up_(0)
+  , bytes_down_(0) {
+  Load(header, records);
+}
+
+CaptureReplay::~CaptureReplay() {
+  thread_->Clear(this);
+  for (size_t i = 0; i < lanes_.size(); ++i) {
+    delete lanes_[i];
+  }
+  for (size_t i = 0; i < targets_.size(); ++i) {
+    delete targets_[i];
+  }
+}
+
+// Turns the records into lanes. Up is the direction from the client peer's
+// local socket to the server peer's, whichever peer was captured.
+void CaptureReplay::Load(const CaptureHeader& header,
+                         const std::vector<CaptureRecord>& records) {
+  if (records.empty()) return;
+
+  bool server_mode = (header.flags & CaptureHeader::kServerMode) != 0;
+  uint8 up_event = server_mode ? kCaptureFromTunnel : kCaptureToTunnel;
+
+  uint64 base = records[0].time;
+  for (size_t i = 1; i < records.size(); ++i) {
+    base = std::min(base, records[i].time);
+  }
+
+  std::map<uint32, Lane*> lanes;
+  std::set<uint32> udp_lanes;
+  for (size_t i = 0; i < records.size(); ++i) {
+    const CaptureRecord& record = records[i];
+    uint64 time = record.time - base;
+    captured_time_ = std::max(captured_time_, time);
+
+    if (udp_lanes.count(record.lane)) continue;
+    if (record.event == kCaptureLaneOpen && record.protocol == cricket::PROTO_UDP) {
+      udp_lanes.insert(record.lane);
+      skipped_udp_++;
+      continue;
+    }
+
+    // A lane whose opening fell out of the ring opens at its first record.
+    Lane*& lane = lanes[record.lane];
+    if (!lane) {
+      lane = new Lane();
+      lane->open_time = time;
+      lane->close_time = time;
+      lanes_.push_back(lane);
+    }
+
+    Step step = { time, record.size };
+    switch (record.event) {
+    case kCaptureToTunnel:
+    case kCaptureFromTunnel:
+      if (record.size == 0) break;
+      if (record.event == up_event) {
+        lane->up.push_back(step);
+        lane->up_bytes += record.size;
+      }
+      else {
+        lane->down.push_back(step);
+        lane->down_bytes += record.size;
+      }
+      lane->close_time = std::max(lane->close_time, time);
+      break;
+    case kCaptureLaneClose:
+      lane->close_time = std::max(lane->close_time, time);
+      break;
+    default:
+      break;
+    }
+  }
+
+  std::stable_sort(lanes_.begin(), lanes_.end(), OpensEarlier);
+  for (size_t i = 0; i < lanes_.size(); ++i) {
+    lanes_[i]->index = static_cast<uint32>(i);
+  }
+}
+
+bool CaptureReplay::OpensEarlier(const Lane* a, const Lane* b) {
+  return a->open_time < b->open_time;
+}
+
+bool CaptureReplay::Listen(rtc::SocketAddress* address) {
+  listen_.reset(thread_->socketserver()->CreateAsyncSocket(AF_INET, SOCK_STREAM));
+  if (!listen_) return false;
+
+  if (listen_->Bind(rtc::SocketAddress("127.0.0.1", 0)) == SOCKET_ERROR ||
+      listen_->Listen(128) == SOCKET_ERROR) {
+    return false;
+  }
+  listen_->SignalReadEvent.connect(this, &CaptureReplay::OnTargetAccept);
+  *address = listen_->GetLocalAddress();
+  return true;
+}
+
+void CaptureReplay::Start(const rtc::SocketAddress& tunnel_address) {
+  tunnel_address_ = tunnel_address;
+  start_time_ = NowMicros();
+  LOG(LS_INFO) << "Replaying " << lanes_.size() << " lanes over "
+               << captured_time_ / 1000 << " ms.";
+  Tick();
+}
+
+uint64 CaptureReplay::Now() const {
+  return NowMicros() - start_time_;
+}
+
+void CaptureReplay::OnMessage(rtc::Message* msg) {
+  switch (msg->message_id) {
+  case MsgTick:
+    Tick();
+    break;
+  default:
+    break;
+  }
+}
+
+void CaptureReplay::Tick() {
+  if (done_) return;
+
+  uint64 now = Now();
+  uint64 next_time = kNever;
+
+  while (next_open_ < lanes_.size() && lanes_[next_open_]->open_time <= now) {
+    OpenLane(lanes_[next_open_++]);
+  }
+  if (next_open_ < lanes_.size()) next_time = lanes_[next_open_]->open_time;
+
+  for (size_t i = 0; i < next_open_; ++i) {
+    if (!lanes_[i]->ended) Advance(lanes_[i], now, &next_time);
+  }
+
+  if (next_open_ == lanes_.size() && completed_ + failed_ == (int)lanes_.size()) {
+    done_ = true;
+    end_time_ = NowMicros();
+    thread_->Clear(this);
+    SignalDone(this);
+    return;
+  }
+
+  // Wake for the next due step, and at least every kCheckInterval for
+  // the timeouts.
+  int delay = kCheckInterval;
+  if (next_time != kNever) {
+    delay = next_time > now ? (int)std::min<uint64>((next_time - now + 999) / 1000, delay) : 0;
+  }
+  thread_->Clear(this, MsgTick);
+  thread_->PostDelayed(delay, this, MsgTick);
+}
+
+void CaptureReplay::OpenLane(Lane* lane) {
+  lateness_.Record(Now() - lane->open_time);
+  lane->connect_start = NowMicros();
+
+  rtc::AsyncSocket* socket =
+      thread_->socketserver()->CreateAsyncSocket(tunnel_address_.family(), SOCK_STREAM);
+  lane->client.reset(socket);
+  if (!socket) {
+    EndLane(lane, "socket");
+    return;
+  }
+
+  socket->SignalConnectEvent.connect(this, &CaptureReplay::OnClientConnect);
+  socket->SignalReadEvent.connect(this, &CaptureReplay::OnClientRead);
+  socket->SignalWriteEvent.connect(this, &CaptureReplay::OnClientWrite);
+  socket->SignalCloseEvent.connect(this, &CaptureReplay::OnClientClose);
+  if (socket->Connect(tunnel_address_) == SOCKET_ERROR && !socket->IsBlocking()) {
+    EndLane(lane, "connect");
+  }
+}
+
+// Sends what is due on both ends of the lane and ends it once everything
+// has arrived and its close time has come. Lowers *next_time to when the
+// lane next has something to do.
+void CaptureReplay::Advance(Lane* lane, uint64 now, uint64* next_time) {
+  if (lane->connected) {
+    SendSteps(lane->up, &lane->next_up, now, &lane->client_pending);
+    if (!Flush(lane->client.get(), &lane->client_pending)) {
+      EndLane(lane, "write");
+      return;
+    }
+    if (lane->next_up < lane->up.size()) {
+      *next_time = std::min(*next_time, lane->up[lane->next_up].time);
+    }
+  }
+
+  if (lane->target) {
+    SendSteps(lane->down, &lane->next_down, now, &lane->target->pending);
+    if (!Flush(lane->target->socket.get(), &lane->target->pending)) {
+      EndLane(lane, "write");
+      return;
+    }
+    if (lane->next_down < lane->down.size()) {
+      *next_time = std::min(*next_time, lane->down[lane->next_down].time);
+    }
+  }
+
+  bool delivered = lane->target &&
+                   lane->next_up == lane->up.size() &&
+                   lane->next_down == lane->down.size() &&
+                   lane->client_pending.empty() && lane->target->pending.empty() &&
+                   lane->target->received >= lane->up_bytes &&
+                   lane->client_received >= lane->down_bytes;
+  if (delivered) {
+    if (now >= lane->close_time) {
+      EndLane(lane, NULL);
+      return;
+    }
+    *next_time = std::min(*next_time, lane->close_time);
+  }
+  else if (now > lane->close_time + kLaneTimeout) {
+    EndLane(lane, "timeout");
+  }
+}
+
+void CaptureReplay::SendSteps(const std::vector<Step>& steps, size_t* next, uint64 now,
+                              std::string* pending) {
+  while (*next < steps.size() && steps[*next].time <= now) {
+    const Step& step = steps[(*next)++];
+    size_t offset = pending->size();
+    pending->resize(offset + step.size);
+    FillBenchPayload(&(*pending)[offset], step.size, &random_state_);
+    lateness_.Record(now - step.time);
+  }
+}
+
+void CaptureReplay::EndLane(Lane* lane, const char* failure) {
+  if (lane->ended) return;
+  lane->ended = true;
+
+  if (lane->client) {
+    lane->client->Close();
+    // Released, not deleted: we may be inside one of its signals.
+    thread_->Dispose(lane->client.release());
+  }
+  if (lane->target) {
+    RemoveTarget(lane->target);
+  }
+
+  if (failure) {
+    failed_++;
+    failures_[failure] = failures_[failure].asInt() + 1;
+  }
+  else {
+    completed_++;
+  }
+
+  thread_->Post(this, MsgTick);
+}
+
+void CaptureReplay::RemoveTarget(Target* target) {
+  if (target->lane) target->lane->target = NULL;
+
+  std::vector<Target*>::iterator it = std::find(targets_.begin(), targets_.end(), target);
+  if (it != targets_.end()) targets_.erase(it);
+
+  target->socket->Close();
+  thread_->Dispose(target->socket.release());
+  delete target;
+}
+
+CaptureReplay::Lane* CaptureReplay::FindClient(rtc::AsyncSocket* socket) {
+  for (size_t i = 0; i < next_open_; ++i) {
+    if (lanes_[i]->client.get() == socket) return lanes_[i];
+  }
+  return NULL;
+}
+
+CaptureReplay::Target* CaptureReplay::FindTarget(rtc::AsyncSocket* socket) {
+  for (size_t i = 0; i < targets_.size(); ++i) {
+    if (targets_[i]->socket.get() == socket) return targets_[i];
+  }
+  return NULL;
+}
+
+bool CaptureReplay::Flush(rtc::AsyncSocket* socket, std::string* pending) {
+  while (!pending->empty()) {
+    int len = socket->Send(pending->data(), pending->size());
+    if (len < 0) return socket->IsBlocking();
+    pending->erase(0, len);
+  }
+  return true;
+}
+
+
+//
+// Client ends
+//
+
+void CaptureReplay::OnClientConnect(rtc::AsyncSocket* socket) {
+  Lane* lane = FindClient(socket);
+  if (!lane) return;
+
+  connect_.Record(NowMicros() - lane->connect_start);
+  lane->connected = true;
+  lane->client_pending.assign(reinterpret_cast<const char*>(&lane->index), kLaneNumberSize);
+
+  uint64 next_time = kNever;
+  Advance(lane, Now(), &next_time);
+}
+
+void CaptureReplay::OnClientRead(rtc::AsyncSocket* socket) {
+  Lane* lane = FindClient(socket);
+  if (!lane) return;
+
+  int len;
+  while ((len = socket->Recv(&buffer_[0], buffer_.size())) > 0) {
+    lane->client_received += len;
+    bytes_down_ += len;
+  }
+
+  uint64 next_time = kNever;
+  Advance(lane, Now(), &next_time);
+}
+
+void CaptureReplay::OnClientWrite(rtc::AsyncSocket* socket) {
+  Lane* lane = FindClient(socket);
+  if (lane && !Flush(socket, &lane->client_pending)) {
+    EndLane(lane, "write");
+  }
+}
+
+void CaptureReplay::OnClientClose(rtc::AsyncSocket* socket, int error) {
+  Lane* lane = FindClient(socket);
+  if (lane) EndLane(lane, "closed");
+}
+
+
+//
+// Target ends
+//
+
+void CaptureReplay::OnTargetAccept(rtc::AsyncSocket* socket) {
+  rtc::AsyncSocket* accepted;
+  while ((accepted = socket->Accept(NULL)) != NULL) {
+    Target* target = new Target();
+    target->socket.reset(accepted);
+    accepted->SignalReadEvent.connect(this, &CaptureReplay::OnTargetRead);
+    accepted->SignalWriteEvent.connect(this, &CaptureReplay::OnTargetWrite);
+    accepted->SignalCloseEvent.connect(this, &CaptureReplay::OnTargetClose);
+    targets_.push_back(target);
+  }
+}
+
+void CaptureReplay::OnTargetRead(rtc::AsyncSocket* socket) {
+  Target* target = FindTarget(socket);
+  if (!target) return;
+
+  int len;
+  while ((len = socket->Recv(&buffer_[0], buffer_.size())) > 0) {
+    size_t offset = 0;
+    if (!target->lane) {
+      offset = std::min(kLaneNumberSize - target->header.size(), (size_t)len);
+      target->header.append(&buffer_[0], offset);
+      if (target->header.size() < kLaneNumberSize) continue;
+
+      uint32 index;
+      memcpy(&index, target->header.data(), sizeof(index));
+      if (index >= lanes_.size() || lanes_[index]->target || lanes_[index]->ended) {
+        LOG(LS_WARNING) << "Replay target got an unknown lane number " << index << ".";
+        RemoveTarget(target);
+        return;
+      }
+      target->lane = lanes_[index];
+      target->lane->target = target;
+    }
+    target->received += len - offset;
+    bytes_up_ += len - offset;
+  }
+
+  if (target->lane) {
+    uint64 next_time = kNever;
+    Advance(target->lane, Now(), &next_time);
+  }
+}
+
+void CaptureReplay::OnTargetWrite(rtc::AsyncSocket* socket) {
+  Target* target = FindTarget(socket);
+  if (target && target->lane && !Flush(socket, &target->pending)) {
+    EndLane(target->lane, "write");
+  }
+}
+
+void CaptureReplay::OnTargetClose(rtc::AsyncSocket* socket, int error) {
+  Target* target = FindTarget(socket);
+  if (!target) return;
+
+  if (target->lane) {
+    EndLane(target->lane, "closed");
+  }
+  else {
+    RemoveTarget(target);
+  }
+}
+
+
+//
+// Results
+//
+
+void CaptureReplay::Report(Json::Value* json) const {
+  uint64 end = done_ ? end_time_ : NowMicros();
+
+  (*json)["lanes"] = static_cast<int>(lanes_.size());
+  (*json)["skipped_udp_lanes"] = skipped_udp_;
+  (*json)["completed"] = completed_;
+  (*json)["failed"] = failed_;
+  (*json)["failures"] = failures_;
+  (*json)["bytes_up"] = static_cast<double>(bytes_up_);
+  (*json)["bytes_down"] = static_cast<double>(bytes_down_);
+  (*json)["captured_ms"] = captured_time_ / 1000.0;
+  (*json)["replayed_ms"] = (start_time_ ? end - start_time_ : 0) / 1000.0;
+  (*json)["connect_us"] = LatencyToJson(connect_);
+  // How far behind the captured schedule opens and sends ran.
+  (*json)["lateness_us"] = LatencyToJson(lateness_);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+} // namespace hotline
@@ -0,0 +1,159 @@
+#ifndef HOTLINE_TUNNEL_CAPTURE_REPLAY_H_
+#define HOTLINE_TUNNEL_CAPTURE_REPLAY_H_
+#pragma once
+
+#include "htn_config.h"
+
+#include <string>
+#include <vector>
+
+#include "webrtc/base/asyncsocket.h"
+#include "webrtc/base/json.h"
+#include "webrtc/base/messagehandler.h"
+#include "webrtc/base/scoped_ptr.h"
+#include "webrtc/base/sigslot.h"
+#include "webrtc/base/socketaddress.h"
+#include "histogram.h"
+#include "traffic_capture.h"
+
+
+namespace rtc {
+  class Thread;
+}
+
+
+namespace hotline {
+
+//////////////////////////////////////////////////////////////////////
+// CaptureReplay
+// Plays the TCP lanes of a TrafficCapture back through a tunnel with
+// synthetic payloads: each captured lane becomes a connection to the
+// tunnel's local socket that opens, sends, receives and closes at the
+// captured times with the captured sizes. Both ends run here: Listen()
+// opens the target the tunnel's far end connects to, which sends the
+// other direction of each lane back on schedule.
+//
+// Each connection starts with a 4 byte lane number so the target knows
+// which lane it is serving. UDP lanes are skipped.
+//
+class CaptureReplay : public rtc::MessageHandler,
+                      public sigslot::has_slots<> {
+public:
+  CaptureReplay(rtc::Thread* thread, const CaptureHeader& header,
+                const std::vector<CaptureRecord>& records);
+  virtual ~CaptureReplay();
+
+  // Opens the target on loopback; its address goes in *address.
+  bool Listen(rtc::SocketAddress* address);
+  // Starts the lanes against the tunnel's local socket.
+  void Start(const rtc::SocketAddress& tunnel_address);
+
+  size_t lane_count() const { return lanes_.size(); }
+  void Report(Json::Value* json) const;
+
+  sigslot::signal1<CaptureReplay*> SignalDone;
+
+  //
+  // implements the MessageHandler interface
+  //
+  void OnMessage(rtc::Message* msg);
+
+private:
+  enum ThreadMsgId {
+    MsgTick
+  };
+
+  struct Step {
+    uint64 time;      // microseconds from the start
+    uint32 size;
+  };
+
+  struct Target;
+
+  struct Lane {
+    Lane();
+
+    uint32 index;               // in lanes_, sent as the lane number
+    uint64 open_time;
+    uint64 close_time;
+    std::vector<Step> up;       // client to target
+    std::vector<Step> down;     // target to client
+    uint64 up_bytes;
+    uint64 down_bytes;
+
+    size_t next_up;
+    size_t next_down;
+    rtc::scoped_ptr<rtc::AsyncSocket> client;
+    uint64 connect_start;
+    bool connected;
+    std::string client_pending;
+    uint64 client_received;
+    Target* target;
+    bool ended;
+  };
+
+  // A connection accepted by the target, its lane known once the lane
+  // number has arrived.
+  struct Target {
+    Target() : lane(NULL), received(0) {}
+
+    rtc::scoped_ptr<rtc::AsyncSocket> socket;
+    std::string header;
+    Lane* lane;
+    std::string pending;
+    uint64 received;
+  };
+
+  static bool OpensEarlier(const Lane* a, const Lane* b);
+  void Load(const CaptureHeader& header, const std::vector<CaptureRecord>& records);
+  uint64 Now() const;
+
+  void Tick();
+  void OpenLane(Lane* lane);
+  void Advance(Lane* lane, uint64 now, uint64* next_time);
+  void SendSteps(const std::vector<Step>& steps, size_t* next, uint64 now,
+                 std::string* pending);
+  void EndLane(Lane* lane, const char* failure);
+  void RemoveTarget(Target* target);
+
+  Lane* FindClient(rtc::AsyncSocket* socket);
+  Target* FindTarget(rtc::AsyncSocket* socket);
+
+  void OnClientConnect(rtc::AsyncSocket* socket);
+  void OnClientRead(rtc::AsyncSocket* socket);
+  void OnClientWrite(rtc::AsyncSocket* socket);
+  void OnClientClose(rtc::AsyncSocket* socket, int error);
+  void OnTargetAccept(rtc::AsyncSocket* socket);
+  void OnTargetRead(rtc::AsyncSocket* socket);
+  void OnTargetWrite(rtc::AsyncSocket* socket);
+  void OnTargetClose(rtc::AsyncSocket* socket, int error);
+  bool Flush(rtc::AsyncSocket* socket, std::string* pending);
+
+  rtc::Thread* thread_;
+  rtc::SocketAddress tunnel_address_;
+  rtc::scoped_ptr<rtc::AsyncSocket> listen_;
+  std::vector<Lane*> lanes_;
+  std::vector<Target*> targets_;
+  std::vector<char> buffer_;
+  size_t next_open_;
+  bool done_;
+  uint64 start_time_;
+  uint64 end_time_;
+  uint64 captured_time_;
+  uint64 random_state_;
+
+  int skipped_udp_;
+  int completed_;
+  int failed_;
+  Json::Value failures_;
+  uint64 bytes_up_;
+  uint64 bytes_down_;
+  Histogram connect_;
+  Histogram lateness_;
+};
+
+//////////////////////////////////////////////////////////////////////
+
+} // namespace hotline
+
+#endif  // HOTLINE_TUNNEL_CAPTURE_REPLAY_H_
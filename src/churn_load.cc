@@ -0,0 +1,226 @@
+#include "htn_config.h"
+
+#include <algorithm>
+
+#include "webrtc/base/common.h"
+#include "webrtc/base/logging.h"
+#include "webrtc/base/socketserver.h"
+#include "webrtc/base/thread.h"
+#include "webrtc/base/timeutils.h"
+#include "bench.h"
+#include "bench_endpoint.h"
+#include "churn_load.h"
+
+
+namespace hotline {
+
+static const size_t kBufferSize = 16 * 1024;
+static const int kCheckInterval = 100;  // milliseconds
+
+static uint64 NowMicros() {
+  return rtc::TimeNanos() / 1000;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// ChurnLoad
+///////////////////////////////////////////////////////////////////////////////
+
+ChurnLoad::ChurnLoad(rtc::Thread* thread, const ChurnConfig& config,
+                     const rtc::SocketAddress& address)
+  : thread_(thread)
+  , config_(config)
+  , address_(address)
+  , buffer_(kBufferSize)
+  , done_(false)
+  , start_time_(0)
+  , end_time_(0)
+  , opened_(0)
+  , completed_(0)
+  , failures_(Json::objectValue)
+  , failed_(0)
+  , max_open_(0) {
+  config_.message_size = std::max(config_.message_size, 1);
+  config_.concurrency = std::max(config_.concurrency, 1);
+
+  uint64 random_state = 0x2545F4914F6CDD1DULL;
+  request_.resize(config_.message_size);
+  FillBenchPayload(&request_[0], request_.size(), &random_state);
+}
+
+ChurnLoad::~ChurnLoad() {
+  thread_->Clear(this);
+  for (size_t i = 0; i < connections_.size(); ++i) {
+    delete connections_[i];
+  }
+}
+
+void ChurnLoad::Start() {
+  start_time_ = NowMicros();
+  OpenConnections();
+  thread_->PostDelayed(kCheckInterval, this, MsgCheckTimeouts);
+}
+
+void ChurnLoad::OnMessage(rtc::Message* msg) {
+  switch (msg->message_id) {
+  case MsgOpen:
+    OpenConnections();
+    break;
+  case MsgCheckTimeouts:
+    CheckTimeouts();
+    break;
+  default:
+    break;
+  }
+}
+
+void ChurnLoad::OpenConnections() {
+  // Sockets are closed from their own callbacks; delete them here.
+  for (size_t i = 0; i < connections_.size();) {
+    if (!connections_[i]->socket) {
+      delete connections_[i];
+      connections_.erase(connections_.begin() + i);
+    }
+    else {
+      ++i;
+    }
+  }
+
+  while (!done_ && opened_ < config_.connections &&
+         connections_.size() < (size_t)config_.concurrency) {
+    Connection* connection = new Connection();
+    connection->socket.reset(
+        thread_->socketserver()->CreateAsyncSocket(AF_INET, SOCK_STREAM));
+    connection->start_time = NowMicros();
+    connections_.push_back(connection);
+    opened_++;
+
+    rtc::AsyncSocket* socket = connection->socket.get();
+    if (!socket) {
+      EndConnection(connection, "socket");
+      continue;
+    }
+    socket->SignalConnectEvent.connect(this, &ChurnLoad::OnConnect);
+    socket->SignalReadEvent.connect(this, &ChurnLoad::OnRead);
+    socket->SignalWriteEvent.connect(this, &ChurnLoad::OnWrite);
+    socket->SignalCloseEvent.connect(this, &ChurnLoad::OnClose);
+    if (socket->Connect(address_) == SOCKET_ERROR && !socket->IsBlocking()) {
+      EndConnection(connection, "connect");
+    }
+  }
+
+  max_open_ = std::max(max_open_, connections_.size());
+
+  if (!done_ && opened_ == config_.connections && completed_ + failed_ == opened_) {
+    done_ = true;
+    end_time_ = NowMicros();
+    thread_->Clear(this);
+    SignalDone(this);
+  }
+}
+
+ChurnLoad::Connection* ChurnLoad::FindConnection(rtc::AsyncSocket* socket) {
+  for (size_t i = 0; i < connections_.size(); ++i) {
+    if (connections_[i]->socket.get() == socket) return connections_[i];
+  }
+  return NULL;
+}
+
+void ChurnLoad::EndConnection(Connection* connection, const char* failure) {
+  if (connection->socket) {
+    connection->socket->Close();
+    // Released, not deleted: we may be inside one of its signals.
+    thread_->Dispose(connection->socket.release());
+  }
+
+  if (failure) {
+    failed_++;
+    failures_[failure] = failures_[failure].asInt() + 1;
+  }
+  else {
+    completed_++;
+    exchange_.Record(NowMicros() - connection->start_time);
+  }
+
+  thread_->Post(this, MsgOpen);
+}
+
+void ChurnLoad::OnConnect(rtc::AsyncSocket* socket) {
+  Connection* connection = FindConnection(socket);
+  if (!connection) return;
+
+  connection->pending = request_;
+  OnWrite(socket);
+}
+
+void ChurnLoad::OnRead(rtc::AsyncSocket* socket) {
+  Connection* connection = FindConnection(socket);
+  if (!connection) return;
+
+  int len;
+  while ((len = socket->Recv(&buffer_[0], buffer_.size())) > 0) {
+    if (!connection->first_byte) {
+      connection->first_byte = true;
+      ttfb_.Record(NowMicros() - connection->start_time);
+    }
+    connection->received += len;
+    if (connection->received >= request_.size()) {
+      EndConnection(connection, NULL);
+      return;
+    }
+  }
+}
+
+void ChurnLoad::OnWrite(rtc::AsyncSocket* socket) {
+  Connection* connection = FindConnection(socket);
+  if (!connection) return;
+
+  while (!connection->pending.empty()) {
+    int len = socket->Send(connection->pending.data(), connection->pending.size());
+    if (len < 0) {
+      if (!socket->IsBlocking()) EndConnection(connection, "write");
+      return;
+    }
+    connection->pending.erase(0, len);
+  }
+}
+
+void ChurnLoad::OnClose(rtc::AsyncSocket* socket, int error) {
+  Connection* connection = FindConnection(socket);
+  if (!connection) return;
+
+  EndConnection(connection, connection->first_byte ? "truncated" : "closed");
+}
+
+void ChurnLoad::CheckTimeouts() {
+  uint64 deadline = NowMicros() - (uint64)config_.connection_timeout * 1000000;
+  for (size_t i = 0; i < connections_.size(); ++i) {
+    Connection* connection = connections_[i];
+    if (connection->socket && connection->start_time < deadline) {
+      EndConnection(connection, "timeout");
+    }
+  }
+
+  if (!done_) {
+    thread_->PostDelayed(kCheckInterval, this, MsgCheckTimeouts);
+  }
+}
+
+void ChurnLoad::Report(Json::Value* json) const {
+  uint64 end = done_ ? end_time_ : NowMicros();
+  double seconds = std::max<uint64>(end - start_time_, 1) / 1000000.0;
+
+  (*json)["connections"] = opened_;
+  (*json)["concurrency"] = config_.concurrency;
+  (*json)["max_open"] = static_cast<int>(max_open_);
+  (*json)["completed"] = completed_;
+  (*json)["failed"] = failed_;
+  (*json)["failures"] = failures_;
+  (*json)["lanes_per_sec"] = completed_ / seconds;
+  (*json)["ttfb_us"] = LatencyToJson(ttfb_);
+  (*json)["exchange_us"] = LatencyToJson(exchange_);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+} // namespace hotline
@@ -0,0 +1,119 @@
+#ifndef HOTLINE_TUNNEL_CHURN_LOAD_H_
+#define HOTLINE_TUNNEL_CHURN_LOAD_H_
+#pragma once
+
+#include "htn_config.h"
+
+#include <string>
+#include <vector>
+
+#include "webrtc/base/asyncsocket.h"
+#include "webrtc/base/json.h"
+#include "webrtc/base/messagehandler.h"
+#include "webrtc/base/scoped_ptr.h"
+#include "webrtc/base/sigslot.h"
+#include "webrtc/base/socketaddress.h"
+#include "histogram.h"
+
+
+namespace rtc {
+  class Thread;
+}
+
+
+namespace hotline {
+
+struct ChurnConfig {
+  ChurnConfig()
+    : connections(10000),
+      concurrency(64),
+      message_size(64),
+      connection_timeout(10) {}
+
+  int connections;         // connections to open in total
+  int concurrency;         // connections open at once
+  int message_size;        // request bytes, echoed back as the response
+  int connection_timeout;  // seconds before a connection counts as failed
+};
+
+
+//////////////////////////////////////////////////////////////////////
+// ChurnLoad
+// Opens config.connections short-lived TCP connections to a tunnel's
+// local socket, config.concurrency at a time. Each one sends a request,
+// waits for the whole echo and closes, so every connection costs the
+// tunnel a lane open, a control channel round trip and a lane close.
+// Measures lanes per second, time to the first response byte and the
+// whole exchange, and counts the connections that failed.
+//
+class ChurnLoad : public rtc::MessageHandler,
+                  public sigslot::has_slots<> {
+public:
+  ChurnLoad(rtc::Thread* thread, const ChurnConfig& config,
+            const rtc::SocketAddress& address);
+  virtual ~ChurnLoad();
+
+  void Start();
+  bool done() const { return done_; }
+
+  // Adds the results to *json.
+  void Report(Json::Value* json) const;
+
+  sigslot::signal1<ChurnLoad*> SignalDone;
+
+  //
+  // implements the MessageHandler interface
+  //
+  void OnMessage(rtc::Message* msg);
+
+private:
+  enum ThreadMsgId {
+    MsgOpen,
+    MsgCheckTimeouts
+  };
+
+  struct Connection {
+    Connection() : start_time(0), received(0), first_byte(false) {}
+
+    rtc::scoped_ptr<rtc::AsyncSocket> socket;
+    std::string pending;
+    uint64 start_time;
+    size_t received;
+    bool first_byte;
+  };
+
+  void OpenConnections();
+  Connection* FindConnection(rtc::AsyncSocket* socket);
+  // Closes the connection; it counts as done or as failed with reason.
+  void EndConnection(Connection* connection, const char* failure);
+
+  void OnConnect(rtc::AsyncSocket* socket);
+  void OnRead(rtc::AsyncSocket* socket);
+  void OnWrite(rtc::AsyncSocket* socket);
+  void OnClose(rtc::AsyncSocket* socket, int error);
+  void CheckTimeouts();
+
+  rtc::Thread* thread_;
+  ChurnConfig config_;
+  rtc::SocketAddress address_;
+  std::vector<Connection*> connections_;
+  std::vector<char> buffer_;
+  std::string request_;
+  bool done_;
+
+  uint64 start_time_;
+  uint64 end_time_;
+  int opened_;
+  int completed_;
+  Json::Value failures_;
+  int failed_;
+  size_t max_open_;
+  Histogram ttfb_;
+  Histogram exchange_;
+};
+
+//////////////////////////////////////////////////////////////////////
+
+} // namespace hotline
+
+#endif  // HOTLINE_TUNNEL_CHURN_LOAD_H_
@@ -0,0 +1,192 @@
+#include "htn_config.h"
+
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+
+#include "compression.h"
+
+
+namespace hotline {
+
+// Raw deflate: the tag byte already frames the data, no zlib header needed.
+static const int kWindowBits = -15;
+static const int kMemLevel = 8;
+
+static const char kSyncFlushTail[] = { 0x00, 0x00, (char)0xff, (char)0xff };
+
+// Below this, deflate is cheaper than estimating whether to run it.
+static const size_t kMinEstimateSize = 512;
+static const size_t kMaxEstimateSample = 1024;
+// Bits per byte above which a sample is treated as random.
+static const double kMaxEntropy = 7.5;
+
+static const int kMaxBackoff = 64;
+
+
+///////////////////////////////////////////////////////////////////////////////
+// LaneCompressor
+///////////////////////////////////////////////////////////////////////////////
+
+LaneCompressor::LaneCompressor(int level)
+  : initialized_(false)
+  , skip_(0)
+  , backoff_(1)
+  , bytes_in_(0)
+  , bytes_out_(0)
+  , bypassed_(0) {
+  memset(&stream_, 0, sizeof(stream_));
+  level = std::min(std::max(level, (int)kMinLevel), (int)kMaxLevel);
+  initialized_ = deflateInit2(&stream_, level, Z_DEFLATED, kWindowBits,
+                              kMemLevel, Z_DEFAULT_STRATEGY) == Z_OK;
+}
+
+LaneCompressor::~LaneCompressor() {
+  if (initialized_) deflateEnd(&stream_);
+}
+
+bool LaneCompressor::LooksIncompressible(const char* data, size_t len) {
+  const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+
+  // TLS record header: content type 20-23, protocol version 3.x.
+  if (len >= 5 && bytes[0] >= 20 && bytes[0] <= 23 &&
+      bytes[1] == 3 && bytes[2] <= 4) {
+    return true;
+  }
+
+  if (len < kMinEstimateSize) return false;
+
+  // Sample evenly across the message so a compressible header in front of
+  // a compressed body doesn't decide for the whole message.
+  size_t sample = std::min(len, kMaxEstimateSample);
+  size_t stride = len / sample;
+  int counts[256] = { 0 };
+  for (size_t i = 0; i < sample; ++i) counts[bytes[i * stride]]++;
+
+  double entropy = 0;
+  for (int i = 0; i < 256; ++i) {
+    if (counts[i] == 0) continue;
+    double p = (double)counts[i] / sample;
+    entropy -= p * log2(p);
+  }
+  return entropy > kMaxEntropy;
+}
+
+void LaneCompressor::MakeRaw(const char* data, size_t len, std::vector<char>* record) {
+  record->resize(len + 1);
+  (*record)[0] = kRecordRaw;
+  if (len > 0) memcpy(&(*record)[1], data, len);
+}
+
+bool LaneCompressor::Compress(const char* data, size_t len, std::vector<char>* record) {
+  if (!initialized_) return false;
+
+  bytes_in_ += len;
+
+  // Raw data never enters the deflate stream, so skipping it keeps both
+  // ends' dictionaries in step.
+  if (skip_ > 0 || len == 0 || LooksIncompressible(data, len)) {
+    if (skip_ > 0) skip_--;
+    bypassed_ += len;
+    MakeRaw(data, len, record);
+    bytes_out_ += record->size();
+    return true;
+  }
+
+  record->resize(1 + len + len / 1000 + 64);
+  (*record)[0] = kRecordCompressed;
+
+  stream_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+  stream_.avail_in = static_cast<uInt>(len);
+
+  size_t out = 1;
+  do {
+    if (out == record->size()) record->resize(record->size() * 2);
+    stream_.next_out = reinterpret_cast<Bytef*>(&(*record)[out]);
+    stream_.avail_out = static_cast<uInt>(record->size() - out);
+
+    int result = deflate(&stream_, Z_SYNC_FLUSH);
+    if (result != Z_OK && result != Z_BUF_ERROR) return false;
+
+    out = record->size() - stream_.avail_out;
+  } while (stream_.avail_out == 0);
+
+  if (out < 1 + sizeof(kSyncFlushTail) ||
+      memcmp(&(*record)[out - sizeof(kSyncFlushTail)], kSyncFlushTail,
+             sizeof(kSyncFlushTail)) != 0) {
+    return false;
+  }
+  out -= sizeof(kSyncFlushTail);
+  record->resize(out);
+
+  // The data is in the dictionary now and has to go out compressed. If
+  // it didn't shrink, leave the next messages alone for a while.
+  if (out > len) {
+    skip_ = backoff_;
+    backoff_ = std::min(backoff_ * 2, kMaxBackoff);
+  }
+  else {
+    backoff_ = 1;
+  }
+
+  bytes_out_ += out;
+  return true;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// LaneDecompressor
+///////////////////////////////////////////////////////////////////////////////
+
+LaneDecompressor::LaneDecompressor()
+  : initialized_(false) {
+  memset(&stream_, 0, sizeof(stream_));
+  initialized_ = inflateInit2(&stream_, kWindowBits) == Z_OK;
+}
+
+LaneDecompressor::~LaneDecompressor() {
+  if (initialized_) inflateEnd(&stream_);
+}
+
+bool LaneDecompressor::Decompress(const char* record, size_t len,
+                                  const char** data, size_t* data_len) {
+  if (!initialized_ || len < 1) return false;
+
+  if (record[0] == LaneCompressor::kRecordRaw) {
+    *data = record + 1;
+    *data_len = len - 1;
+    return true;
+  }
+
+  if (record[0] != LaneCompressor::kRecordCompressed) return false;
+
+  input_.assign(record + 1, record + len);
+  input_.insert(input_.end(), kSyncFlushTail, kSyncFlushTail + sizeof(kSyncFlushTail));
+
+  stream_.next_in = reinterpret_cast<Bytef*>(&input_[0]);
+  stream_.avail_in = static_cast<uInt>(input_.size());
+
+  if (output_.size() < len * 4) output_.resize(len * 4);
+
+  size_t out = 0;
+  do {
+    if (out == output_.size()) output_.resize(output_.size() * 2);
+    stream_.next_out = reinterpret_cast<Bytef*>(&output_[out]);
+    stream_.avail_out = static_cast<uInt>(output_.size() - out);
+
+    int result = inflate(&stream_, Z_SYNC_FLUSH);
+    if (result != Z_OK && result != Z_BUF_ERROR) return false;
+
+    out = output_.size() - stream_.avail_out;
+  } while (stream_.avail_out == 0);
+
+  if (stream_.avail_in != 0) return false;
+
+  *data = out > 0 ? &output_[0] : "";
+  *data_len = out;
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+} // namespace hotline
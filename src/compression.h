@@ -0,0 +1,87 @@
+#ifndef HOTLINE_TUNNEL_COMPRESSION_H_
+#define HOTLINE_TUNNEL_COMPRESSION_H_
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "zlib.h"
+
+
+namespace hotline {
+
+//////////////////////////////////////////////////////////////////////
+// Streaming compression for TCP lanes.
+//
+// Each direction of a lane has one deflate stream. Every data channel
+// message starts with a tag byte:
+//   kRecordRaw         the payload follows as is
+//   kRecordCompressed  deflate output ending in a sync flush, with the
+//                      trailing 00 00 ff ff removed
+// A sync flush makes every message decodable on arrival while the
+// dictionary carries over to the next message, which is what makes small
+// protocol messages compress well. This relies on the lane being reliable
+// and ordered.
+//
+// Data that does not compress (TLS records, media, already compressed
+// files) is sent raw. A byte entropy estimate catches most of it before
+// deflate runs; a message that deflate could not shrink puts the
+// compressor in bypass for a growing number of messages.
+//
+
+class LaneCompressor {
+public:
+  enum { kRecordRaw = 0, kRecordCompressed = 1 };
+  enum { kMinLevel = 1, kMaxLevel = 9 };
+
+  explicit LaneCompressor(int level);
+  ~LaneCompressor();
+
+  // Replaces *record with the tagged record for data. Returns false if
+  // the deflate stream failed; the lane can't continue after that.
+  bool Compress(const char* data, size_t len, std::vector<char>* record);
+
+  uint64_t bytes_in() const { return bytes_in_; }
+  uint64_t bytes_out() const { return bytes_out_; }
+  uint64_t bypassed() const { return bypassed_; }
+
+  // True if data looks incompressible: a TLS record or high entropy.
+  static bool LooksIncompressible(const char* data, size_t len);
+
+private:
+  void MakeRaw(const char* data, size_t len, std::vector<char>* record);
+
+  z_stream stream_;
+  bool initialized_;
+  int skip_;
+  int backoff_;
+  uint64_t bytes_in_;
+  uint64_t bytes_out_;
+  uint64_t bypassed_;
+};
+
+
+class LaneDecompressor {
+public:
+  LaneDecompressor();
+  ~LaneDecompressor();
+
+  // Decodes one record. The payload is valid until the next call.
+  // Returns false for a malformed record or a broken stream.
+  bool Decompress(const char* record, size_t len,
+                  const char** data, size_t* data_len);
+
+private:
+  z_stream stream_;
+  bool initialized_;
+  std::vector<char> output_;
+  std::vector<char> input_;
+};
+
+//////////////////////////////////////////////////////////////////////
+
+} // namespace hotline
+
+#endif  // HOTLINE_TUNNEL_COMPRESSION_H_
@@ -1,6 +1,7 @@
 #include "htn_config.h"
 #include "conductor.h"
 
+#include <algorithm>
 #include <utility>
 #include <vector>
 #include <iostream>
@@ -12,7 +13,13 @@
 #include "webrtc/base/json.h"
 #include "webrtc/base/logging.h"
 #include "defaults.h"
+#include "bench_endpoint.h"
 #include "data_channel.h"
+#include "fec.h"
+#include "compression.h"
+#include "dedup.h"
+#include "impaired_network.h"
+#include "traffic_capture.h"
 
 namespace hotline {
 
@@ -25,6 +32,18 @@ const char kCandidateSdpName[] = "candidate";
 const char kSessionDescriptionTypeName[] = "type";
 const char kSessionDescriptionSdpName[] = "sdp";
 
+// Largest dedup cache a peer may ask for, per direction.
+const int kMaxDedupCacheMB = 1024;
+// Delay for batching dedup acknowledgements, in milliseconds.
+const int kDedupAckDelay = 50;
+// Clock probes: a quick round to fill the estimator's window, then a slow
+// one to follow drift. Milliseconds.
+const int kClockProbeFastInterval = 200;
+const int kClockProbeInterval = 10000;
+// How often lane gauges and GetStats() are sampled for metrics, in
+// milliseconds.
+const int kMetricsInterval = 5000;
+
 #define DTLS_ON  true
 #define DTLS_OFF false
 
@@ -48,12 +67,75 @@ class HotlineSetSessionDescriptionObserver
 };
 
 
+// Picks the round trip time and bytes of the active candidate pair and
+// the bandwidth estimate out of a GetStats() report for TunnelMetrics.
+// Values are read as strings since their types vary between WebRTC
+// versions.
+class HotlineStatsObserver : public webrtc::StatsObserver {
+ public:
+  static HotlineStatsObserver* Create(TunnelMetrics* metrics, uint64 peer_id) {
+    return new rtc::RefCountedObject<HotlineStatsObserver>(metrics, peer_id);
+  }
+
+  virtual void OnComplete(const webrtc::StatsReports& reports) {
+    TunnelMetrics::PeerStats stats;
+    for (size_t i = 0; i < reports.size(); ++i) {
+      const webrtc::StatsReport* report = reports[i];
+      if (report->type() == webrtc::StatsReport::kStatsReportTypeCandidatePair) {
+        const webrtc::StatsReport::Value* active =
+            report->FindValue(webrtc::StatsReport::kStatsValueNameActiveConnection);
+        if (!active || active->ToString() != "true") continue;
+        stats.rtt_ms = Find(report, webrtc::StatsReport::kStatsValueNameRtt, -1);
+        stats.bytes_sent = Find(report, webrtc::StatsReport::kStatsValueNameBytesSent, 0);
+        stats.bytes_received = Find(report, webrtc::StatsReport::kStatsValueNameBytesReceived, 0);
+      }
+      else if (report->type() == webrtc::StatsReport::kStatsReportTypeBwe) {
+        stats.available_send_bandwidth =
+            Find(report, webrtc::StatsReport::kStatsValueNameAvailableSendBandwidth, -1);
+        stats.available_receive_bandwidth =
+            Find(report, webrtc::StatsReport::kStatsValueNameAvailableReceiveBandwidth, -1);
+      }
+    }
+    metrics_->SetPeerStats(peer_id_, stats);
+  }
+
+ protected:
+  HotlineStatsObserver(TunnelMetrics* metrics, uint64 peer_id)
+    : metrics_(metrics), peer_id_(peer_id) {}
+  ~HotlineStatsObserver() {}
+
+ private:
+  static int64 Find(const webrtc::StatsReport* report,
+                    webrtc::StatsReport::StatsValueName name, int64 missing) {
+    const webrtc::StatsReport::Value* value = report->FindValue(name);
+    return value ? strtoll(value->ToString().c_str(), NULL, 10) : missing;
+  }
+
+  TunnelMetrics* metrics_;
+  uint64 peer_id_;
+};
+
+
 Conductor::Conductor()
   : local_peer_id_(0),
     remote_peer_id_(0),
     loopback_(false),
     signal_client_(NULL),
-    local_datachannel_serial_(1) {
+    local_datachannel_serial_(1),
+    dedup_ack_pending_(false),
+    clock_probing_(false),
+    clock_probes_(0),
+    metrics_sampling_(false),
+    metrics_peer_id_(0),
+    ice_connected_(false),
+    tunnel_down_(false),
+    pending_candidates_(Json::arrayValue),
+    candidates_flush_posted_(false),
+    candidates_complete_(false),
+    remote_ice_batch_(false),
+    speculative_(false),
+    taken_candidates_(0),
+    taken_complete_(false) {
 
   socket_client_.RegisterObserver(this);
   socket_listen_server_.RegisterObserver(this);
@@ -70,8 +152,9 @@ void Conductor::Init(bool server_mode,
                     std::string room_id,
                     uint64 local_peer_id,
                     uint64 remote_peer_id,
-                    SignalServerConnection* signal_client,
-                    rtc::Thread* signal_thread
+                    SignalConnection* signal_client,
+                    rtc::Thread* signal_thread,
+                    const TunnelOptions& options
                 ) {
   server_mode_ = server_mode;
   local_address_ = local_address;
@@ -82,6 +165,13 @@ void Conductor::Init(bool server_mode,
   remote_peer_id_ = remote_peer_id;
   signal_client_ = signal_client;
   signal_thread_ = signal_thread;
+  options_ = options;
+
+  socket_listen_server_.set_udp_idle_timeout(options_.udp_idle_timeout * 1000);
+  rtc::PhysicalSocketServer* batch_socket_server =
+      options_.udp_batch ? options_.socket_server : NULL;
+  socket_listen_server_.set_udp_batch(batch_socket_server);
+  socket_client_.set_udp_batch(batch_socket_server);
 }
 
 bool Conductor::connection_active() const {
@@ -89,6 +179,21 @@ bool Conductor::connection_active() const {
 }
 
 void Conductor::Close() {
+  if (clock_probing_) {
+    signal_thread_->Clear(this, MsgClockProbe);
+    clock_probing_ = false;
+  }
+  if (metrics_sampling_) {
+    signal_thread_->Clear(this, MsgSampleMetrics);
+    // A GetStats() still in flight finds the peer gone and drops its stats.
+    if (metrics_peer_id_) options_.metrics->RemovePeer(metrics_peer_id_);
+    metrics_peer_id_ = 0;
+    metrics_sampling_ = false;
+  }
+  if (signal_thread_) {
+    signal_thread_->Clear(this, MsgFlushCandidates);
+    signal_thread_->Clear(this, MsgSpeculativeOfferReady);
+  }
   DeletePeerConnection();
 }
 
@@ -97,7 +202,16 @@ bool Conductor::InitializePeerConnection() {
   ASSERT(peer_connection_factory_.get() == NULL);
   ASSERT(peer_connection_.get() == NULL);
 
-  peer_connection_factory_  = webrtc::CreatePeerConnectionFactory();
+  TraceBegin("peer_connection_init");
+
+  if (options_.network) {
+    peer_connection_factory_ = webrtc::CreatePeerConnectionFactory(
+        options_.network->worker_thread(), options_.network->signaling_thread(),
+        NULL, NULL, NULL);
+  }
+  else {
+    peer_connection_factory_  = webrtc::CreatePeerConnectionFactory();
+  }
 
   if (!peer_connection_factory_.get()) {
     LOG(LS_ERROR) << "Failed to initialize PeerConnectionFactory";
@@ -111,6 +225,10 @@ bool Conductor::InitializePeerConnection() {
   }
   
   AddControlDataChannel();
+  if (peer_connection_.get() && options_.metrics) {
+    StartMetricsSampling();
+  }
+  TraceEnd("peer_connection_init");
 
   return peer_connection_.get() != NULL;
 }
@@ -150,7 +268,8 @@ bool Conductor::CreatePeerConnection(bool dtls) {
   peer_connection_ =
       peer_connection_factory_->CreatePeerConnection(servers,
                                                      &constraints,
-                                                     NULL,
+                                                     options_.network ?
+                                                       options_.network->allocator_factory() : NULL,
                                                      NULL,
                                                      this);
   return peer_connection_.get() != NULL;
@@ -166,6 +285,9 @@ void Conductor::DeletePeerConnection() {
   local_peer_id_ = 0;
   remote_peer_id_ = 0;
   loopback_ = false;
+
+  std::lock_guard<std::mutex> lock(candidates_mutex_);
+  remote_ice_batch_ = false;
 }
 
 
@@ -219,7 +341,6 @@ void Conductor::OnIceCandidate(const webrtc::IceCandidateInterface* candidate) {
     return;
   }
 
-  Json::FastWriter writer;
   Json::Value jmessage;
 
   jmessage[kCandidateSdpMidName] = candidate->sdp_mid();
@@ -230,10 +351,108 @@ void Conductor::OnIceCandidate(const webrtc::IceCandidateInterface* candidate) {
     return;
   }
   jmessage[kCandidateSdpName] = sdp;
+
+  TraceInstant("local_candidate");
+
+  {
+    // The first candidate of a batch opens the window; the rest of the
+    // window's candidates ride along in the same message. Until the peer
+    // of a speculative offer is known they all wait.
+    std::lock_guard<std::mutex> lock(candidates_mutex_);
+    if (speculative_ || BatchingCandidates()) {
+      pending_candidates_.append(jmessage);
+      if (!speculative_ && !candidates_flush_posted_) {
+        candidates_flush_posted_ = true;
+        signal_thread_->PostDelayed(options_.ice_batch, this, MsgFlushCandidates);
+      }
+      return;
+    }
+  }
+
   jmessage["room_id"] = room_id_;
   jmessage["peer_id"] = std::to_string(remote_peer_id_);
+  signal_client_->Send(SignalConnection::MsgSendOffer, jmessage);
+}
+
+void Conductor::OnIceGatheringChange(
+    webrtc::PeerConnectionInterface::IceGatheringState new_state) {
+  if (new_state != webrtc::PeerConnectionInterface::kIceGatheringComplete ||
+      loopback_) {
+    return;
+  }
+
+  // No more candidates: send what is waiting now, marked as the last.
+  std::lock_guard<std::mutex> lock(candidates_mutex_);
+  if (speculative_) {
+    candidates_complete_ = true;
+    return;
+  }
+  if (!BatchingCandidates()) return;
+  candidates_complete_ = true;
+  signal_thread_->Post(this, MsgFlushCandidates);
+}
 
-  signal_client_->Send(SignalServerConnection::MsgSendOffer, jmessage);
+bool Conductor::BatchingCandidates() const {
+  return options_.ice_batch > 0 && remote_ice_batch_;
+}
+
+void Conductor::FlushCandidates() {
+  Json::Value jmessage;
+  bool batching;
+  {
+    std::lock_guard<std::mutex> lock(candidates_mutex_);
+    candidates_flush_posted_ = false;
+    if (pending_candidates_.size() == 0 && !candidates_complete_) return;
+
+    jmessage["candidates"] = pending_candidates_;
+    if (candidates_complete_) jmessage["end_of_candidates"] = true;
+    pending_candidates_ = Json::Value(Json::arrayValue);
+    candidates_complete_ = false;
+    batching = BatchingCandidates();
+  }
+
+  if (!batching) {
+    // Held back for a speculative offer; a peer not known to batch takes
+    // them one by one.
+    Json::Value& candidates = jmessage["candidates"];
+    for (unsigned i = 0; i < candidates.size(); ++i) {
+      Json::Value candidate = candidates[(int)i];
+      candidate["room_id"] = room_id_;
+      candidate["peer_id"] = std::to_string(remote_peer_id_);
+      signal_client_->Send(SignalConnection::MsgSendOffer, candidate);
+    }
+    return;
+  }
+
+  jmessage["room_id"] = room_id_;
+  jmessage["peer_id"] = std::to_string(remote_peer_id_);
+
+  TraceInstant("candidate_batch");
+  signal_client_->Send(SignalConnection::MsgSendOffer, jmessage);
+}
+
+
+// ICE checks start once candidates meet; DTLS and the SCTP association
+// follow on the connected pair and end with the control channel open.
+void Conductor::OnIceConnectionChange(
+    webrtc::PeerConnectionInterface::IceConnectionState new_state) {
+  if (new_state == webrtc::PeerConnectionInterface::kIceConnectionChecking) {
+    TraceBegin("ice_connect");
+  }
+  else if (new_state == webrtc::PeerConnectionInterface::kIceConnectionConnected) {
+    TraceEnd("ice_connect");
+    TraceBegin("dtls_sctp");
+  }
+
+  ice_connected_ =
+      new_state == webrtc::PeerConnectionInterface::kIceConnectionConnected ||
+      new_state == webrtc::PeerConnectionInterface::kIceConnectionCompleted;
+
+  if (new_state == webrtc::PeerConnectionInterface::kIceConnectionFailed ||
+      new_state == webrtc::PeerConnectionInterface::kIceConnectionClosed) {
+    tunnel_down_ = true;
+    SignalTunnelDown(this);
+  }
 }
 
 
@@ -244,9 +463,18 @@ void Conductor::OnIceCandidate(const webrtc::IceCandidateInterface* candidate) {
 
 void Conductor::OnControlDataChannelOpen(rtc::scoped_refptr<HotlineDataChannel> channel, bool is_local){
   LOG(INFO) << "Main data channel opened.";
+  if (is_local) TraceEnd("dtls_sctp");
   if (client_mode()) {
     if (is_local) {
-      local_control_datachannel_->CreateChannel(remote_address_.ToString(), protocol_);
+      LaneSettings proposal;
+      if (protocol_ == cricket::PROTO_UDP) proposal.fec_group = options_.udp_fec_group;
+      if (protocol_ == cricket::PROTO_TCP) {
+        proposal.compress_level = options_.compress_level;
+        proposal.dedup_cache = options_.dedup_cache;
+      }
+      proposal.transit = options_.transit ? 1 : 0;
+      TraceBegin("create_channel");
+      local_control_datachannel_->CreateChannel(remote_address_.ToString(), protocol_, proposal);
     }
     else{
     }
@@ -256,6 +484,8 @@ void Conductor::OnControlDataChannelOpen(rtc::scoped_refptr<HotlineDataChannel>
 
 void Conductor::OnControlDataChannelClosed(rtc::scoped_refptr<HotlineDataChannel> channel, bool is_local){
   LOG(INFO) << "Main data channel cloed.";
+  tunnel_down_ = true;
+  SignalTunnelDown(this);
   if (server_mode()) {
     if (is_local){
       socket_client_.Disconnect();
@@ -272,7 +502,9 @@ void Conductor::OnControlDataChannelClosed(rtc::scoped_refptr<HotlineDataChannel
 
 void Conductor::OnSocketDataChannelOpen(rtc::scoped_refptr<HotlineDataChannel> channel) {
   if (server_mode()){
-    CreateConnectionLane(channel);
+    if (!CreateConnectionLane(channel) && options_.metrics) {
+      options_.metrics->LaneSetupFailed();
+    }
   }
 }
 
@@ -280,9 +512,48 @@ void Conductor::OnSocketDataChannelClosed(rtc::scoped_refptr<HotlineDataChannel>
   SocketConnection* socket = channel->DetachSocket();
 }
 
-void Conductor::OnCreateChannel(rtc::SocketAddress& remote_address, cricket::ProtocolType protocol){
+void Conductor::OnCreateChannel(rtc::SocketAddress& remote_address, cricket::ProtocolType protocol,
+                                LaneSettings& settings){
   ASSERT(server_mode_);
-  channel_.Set(remote_address, protocol);
+  TraceInstant("create_channel");
+
+  if (protocol != cricket::PROTO_UDP) {
+    settings.fec_group = 0;
+  }
+  else if (settings.fec_group != 0) {
+    settings.fec_group = std::min(std::max(settings.fec_group, (int)FecEncoder::kMinGroupSize),
+                                  (int)FecEncoder::kMaxGroupSize);
+  }
+
+  // Streaming compression needs a reliable, ordered lane. It costs this
+  // peer CPU, so it gets at most the level it asked for itself.
+  if (protocol != cricket::PROTO_TCP || options_.compress_level <= 0) {
+    settings.compress_level = 0;
+  }
+  else if (settings.compress_level != 0) {
+    settings.compress_level = std::min(std::max(settings.compress_level, (int)LaneCompressor::kMinLevel),
+                                       std::min(options_.compress_level, (int)LaneCompressor::kMaxLevel));
+  }
+
+  // The dedup cache costs this peer memory, so it gets at most what it
+  // asked for itself, nothing if it didn't.
+  if (protocol != cricket::PROTO_TCP || options_.dedup_cache <= 0) {
+    settings.dedup_cache = 0;
+  }
+  else if (settings.dedup_cache != 0) {
+    settings.dedup_cache = std::min(std::max(settings.dedup_cache, 1),
+                                    std::min(options_.dedup_cache, kMaxDedupCacheMB));
+    CreateDedupCaches(settings.dedup_cache);
+  }
+
+  // Stamps cost 8 bytes a message; always accepted, so the client gets
+  // its histograms whether or not we keep our own.
+  settings.transit = settings.transit ? 1 : 0;
+  if (settings.transit && options_.transit) {
+    StartClockProbes();
+  }
+
+  channel_.Set(remote_address, protocol, settings);
 }
 
 
@@ -298,8 +569,17 @@ void Conductor::OnStopChannel(std::string& channel_name) {
 
 
 
-void Conductor::OnChannelCreated() {
+void Conductor::OnChannelCreated(LaneSettings& settings) {
   ASSERT(!server_mode_);
+  TraceEnd("create_channel");
+
+  lane_settings_ = settings;
+  if (settings.dedup_cache > 0) {
+    CreateDedupCaches(settings.dedup_cache);
+  }
+  if (settings.transit && options_.transit) {
+    StartClockProbes();
+  }
 
   if (!socket_listen_server_.Listen(local_address_, protocol_)){
     std::cerr << "Failed to open local socket " << local_address_.ToString() << std::endl;
@@ -308,6 +588,12 @@ void Conductor::OnChannelCreated() {
   }
 
   std::cout << "Connected. Local socket(" << local_address_.ToString() << ") opened." << std::endl;
+  TraceInstant("local_socket_opened");
+
+  rtc::SocketAddress address;
+  if (socket_listen_server_.GetAddress(&address)) {
+    SignalLocalSocketOpened(this, address);
+  }
 }
 
 void Conductor::OnServerSideReady(std::string& channel_name) {
@@ -315,6 +601,7 @@ void Conductor::OnServerSideReady(std::string& channel_name) {
 
   rtc::scoped_refptr<HotlineDataChannel> channel = datachannels_[channel_name];
   if (channel) {
+    TraceLane('e', channel_name);
     channel->SetSocketReady();
     channel->SocketReadEvent();
   }
@@ -326,7 +613,9 @@ void Conductor::OnServerSideReady(std::string& channel_name) {
 
 void Conductor::OnSocketOpen(SocketConnection* socket){
   if (client_mode()){
-    CreateConnectionLane(socket);
+    if (!CreateConnectionLane(socket) && options_.metrics) {
+      options_.metrics->LaneSetupFailed();
+    }
   }
 }
   
@@ -352,12 +641,85 @@ void Conductor::ConnectToPeer() {
   }
 
   if (InitializePeerConnection()) {
+    TraceBegin("create_offer");
     peer_connection_->CreateOffer(this, NULL);
   } else {
     LOG(LS_ERROR) << "Failed to initialize PeerConnection";
   }
 }
 
+bool Conductor::PrepareOffer() {
+  ASSERT(client_mode());
+
+  if (peer_connection_.get()) {
+    LOG(LS_ERROR) << "We only support connecting to one peer at a time";
+    return false;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(candidates_mutex_);
+    speculative_ = true;
+  }
+
+  if (!InitializePeerConnection()) {
+    LOG(LS_ERROR) << "Failed to initialize PeerConnection";
+    std::lock_guard<std::mutex> lock(candidates_mutex_);
+    speculative_ = false;
+    return false;
+  }
+
+  TraceBegin("create_offer");
+  peer_connection_->CreateOffer(this, NULL);
+  return true;
+}
+
+bool Conductor::TakeSpeculativeOffer(Json::Value* bundle) {
+  std::lock_guard<std::mutex> lock(candidates_mutex_);
+  if (speculative_offer_.isNull()) return false;
+
+  // The candidates stay pending until AdoptRemotePeer() knows whether
+  // the signal server passed them on.
+  *bundle = speculative_offer_;
+  (*bundle)["candidates"] = pending_candidates_;
+  if (candidates_complete_) (*bundle)["end_of_candidates"] = true;
+  taken_candidates_ = pending_candidates_.size();
+  taken_complete_ = candidates_complete_;
+  return true;
+}
+
+void Conductor::AdoptRemotePeer(uint64 local_peer_id, uint64 remote_peer_id,
+                                bool offer_delivered) {
+  local_peer_id_ = local_peer_id;
+  remote_peer_id_ = remote_peer_id;
+
+  Json::Value offer;
+  {
+    std::lock_guard<std::mutex> lock(candidates_mutex_);
+    speculative_ = false;
+
+    if (offer_delivered) {
+      Json::Value rest(Json::arrayValue);
+      for (unsigned i = taken_candidates_; i < pending_candidates_.size(); ++i) {
+        rest.append(pending_candidates_[(int)i]);
+      }
+      pending_candidates_ = rest;
+      if (taken_complete_) candidates_complete_ = false;
+    }
+    else {
+      // Null if not created yet; OnSuccess() sends it then.
+      offer = speculative_offer_;
+    }
+    speculative_offer_ = Json::Value();
+  }
+
+  if (!offer.isNull()) {
+    offer["room_id"] = room_id_;
+    offer["peer_id"] = std::to_string(remote_peer_id_);
+    signal_client_->Send(SignalConnection::MsgSendOffer, offer);
+  }
+  FlushCandidates();
+}
+
 
 bool Conductor::AddControlDataChannel() {
 
@@ -385,7 +747,8 @@ bool Conductor::AddControlDataChannel() {
 }
 
 
-bool Conductor::AddPacketDataChannel(std::string* channel_name) {
+bool Conductor::AddPacketDataChannel(std::string* channel_name,
+                                     cricket::ProtocolType protocol) {
 
   typedef std::pair<std::string,
     rtc::scoped_refptr<HotlineDataChannel> > DataChannelObserverPair;
@@ -393,9 +756,22 @@ bool Conductor::AddPacketDataChannel(std::string* channel_name) {
   int current_serial = local_datachannel_serial_++;
 
   webrtc::DataChannelInit config;
-  config.reliable = true;
-  config.ordered = true;
   config.id =current_serial;
+  if (protocol == cricket::PROTO_UDP) {
+    // Datagrams are independent, so don't let a lost one hold back the
+    // rest. Retransmission is bounded by count or by lifetime.
+    config.reliable = false;
+    config.ordered = false;
+    config.maxRetransmits = options_.udp_max_retransmits;
+    config.maxRetransmitTime = options_.udp_max_packet_lifetime;
+    if (config.maxRetransmitTime >= 0) {
+      config.maxRetransmits = -1;
+    }
+  }
+  else {
+    config.reliable = true;
+    config.ordered = true;
+  }
 
   *channel_name = std::to_string(current_serial);
 
@@ -428,13 +804,15 @@ bool Conductor::AddPacketDataChannel(std::string* channel_name) {
 // create client socket + data channel + server socket connection
 bool Conductor::CreateConnectionLane(SocketConnection* connection) {
   std::string channel_name;
-  if (!AddPacketDataChannel(&channel_name)) return false;
+  if (!AddPacketDataChannel(&channel_name, connection->protocol())) return false;
 
   rtc::scoped_refptr<HotlineDataChannel> channel = datachannels_[channel_name];
   if (channel==NULL) return false;
 
+  TraceLane('b', channel_name);
   channel->AttachSocket(connection);
   connection->AttachChannel(channel);
+  ApplyLaneSettings(connection, lane_settings_);
 
   return true;
 }
@@ -442,20 +820,170 @@ bool Conductor::CreateConnectionLane(SocketConnection* connection) {
 bool Conductor::CreateConnectionLane(rtc::scoped_refptr<HotlineDataChannel> channel) {
   if (channel==NULL) return false;
 
-  SocketConnection* connection = socket_client_.Connect(channel_.remote_address(), channel_.protocol());
+  TraceLane('b', channel->label());
+
+  SocketConnection* connection = NULL;
+  BenchEndpointStream::Kind bench_kind;
+  if (BenchEndpointStream::IsEndpoint(channel_.remote_address(), &bench_kind)) {
+    connection = socket_client_.Open(new BenchEndpointStream(bench_kind, channel_.protocol(),
+                                                             signal_thread_, channel,
+                                                             options_.bench_payload),
+                                      channel_.protocol());
+  }
+  else {
+    connection = socket_client_.Connect(channel_.remote_address(), channel_.protocol());
+  }
   if (connection==NULL) {
+    TraceLane('e', channel->label());
     channel->Stop();
     return false;
   }
 
   channel->AttachSocket(connection);
   connection->AttachChannel(channel);
+  ApplyLaneSettings(connection, channel_.settings());
   connection->SetReady();
   local_control_datachannel_->ServerSideReady(channel->label());
+  TraceLane('e', channel->label());
 
   return true;
 }
 
+void Conductor::ApplyLaneSettings(SocketConnection* connection, const LaneSettings& settings) {
+  if (connection->protocol() == cricket::PROTO_UDP && settings.fec_group > 0) {
+    connection->EnableFec(settings.fec_group);
+  }
+  if (connection->protocol() == cricket::PROTO_TCP && settings.compress_level > 0) {
+    connection->EnableCompression(settings.compress_level);
+  }
+  if (connection->protocol() == cricket::PROTO_TCP && settings.dedup_cache > 0 &&
+      dedup_send_cache_) {
+    connection->EnableDedup(dedup_send_cache_.get(), dedup_receive_cache_.get(),
+                            atoi(connection->GetAttachedChannel()->label().c_str()));
+  }
+  if (options_.capture) {
+    connection->EnableCapture(options_.capture);
+  }
+  std::string name = std::to_string(remote_peer_id_) + "/" +
+                     connection->GetAttachedChannel()->label();
+  if (settings.transit) {
+    connection->EnableTransit(options_.transit, &clock_, name);
+  }
+  if (options_.metrics) {
+    connection->EnableMetrics(options_.metrics, name);
+  }
+}
+
+void Conductor::CreateDedupCaches(int size_mb) {
+  if (dedup_send_cache_) return;
+
+  size_t ring_size = static_cast<size_t>(size_mb) * 1024 * 1024;
+  dedup_send_cache_.reset(new DedupSendCache(ring_size));
+  dedup_receive_cache_.reset(new DedupReceiveCache(ring_size));
+  dedup_receive_cache_->SignalAcksPending.connect(
+      this, &Conductor::OnDedupAcksPending);
+  dedup_receive_cache_->SignalResendNeeded.connect(
+      this, &Conductor::OnDedupResendNeeded);
+}
+
+// Acknowledgements are batched; a late one only delays cross-lane hits.
+// Called on the thread lane data arrives on, as well as the signal thread.
+void Conductor::OnDedupAcksPending(DedupReceiveCache* cache) {
+  if (dedup_ack_pending_.exchange(true)) return;
+  signal_thread_->PostDelayed(kDedupAckDelay, this, MsgDedupAck);
+}
+
+// The lane holds back its data until the chunk comes, so this isn't batched.
+void Conductor::OnDedupResendNeeded(DedupReceiveCache* cache, int lane, uint64_t record) {
+  LOG(LS_WARNING) << "Dedup reference on lane " << lane << " failed, asking for the chunk.";
+  if (local_control_datachannel_) local_control_datachannel_->DedupResend(lane, record);
+}
+
+void Conductor::TraceBegin(const char* name) {
+  if (options_.trace) options_.trace->Begin("peer", name, remote_peer_id_);
+}
+
+void Conductor::TraceEnd(const char* name) {
+  if (options_.trace) options_.trace->End("peer", name, remote_peer_id_);
+}
+
+void Conductor::TraceInstant(const char* name) {
+  if (options_.trace) options_.trace->Instant("peer", name, remote_peer_id_);
+}
+
+// From the client's new socket to the server's ServerSideReady on one
+// side, from the data channel opening to the connected socket on the
+// other. Lanes are told apart by peer and channel label.
+void Conductor::TraceLane(char phase, const std::string& label) {
+  if (!options_.trace) return;
+  uint64 id = (remote_peer_id_ << 24) + strtoul(label.c_str(), NULL, 10);
+  if (phase == 'b') options_.trace->Begin("lane", "lane_open", id);
+  else options_.trace->End("lane", "lane_open", id);
+}
+
+void Conductor::StartMetricsSampling() {
+  if (metrics_sampling_) return;
+  metrics_sampling_ = true;
+  signal_thread_->PostDelayed(kMetricsInterval, this, MsgSampleMetrics);
+}
+
+// The gauges are cheap to sample but need the lane's thread, and a
+// buffered amount is a call through the data channel proxy, so they are
+// polled here rather than kept up to date on the data path.
+void Conductor::SampleMetrics() {
+  typedef std::map<std::string, rtc::scoped_refptr<HotlineDataChannel> > ChannelMap;
+  for (ChannelMap::iterator it = datachannels_.begin(); it != datachannels_.end(); ++it) {
+    SocketConnection* socket = it->second ? it->second->GetAttachedSocket() : NULL;
+    if (socket) socket->SampleMetrics();
+  }
+
+  // A speculative offer starts sampling before the peer is known.
+  if (remote_peer_id_ != metrics_peer_id_) {
+    if (metrics_peer_id_) options_.metrics->RemovePeer(metrics_peer_id_);
+    metrics_peer_id_ = remote_peer_id_;
+    if (metrics_peer_id_) options_.metrics->AddPeer(metrics_peer_id_);
+  }
+
+  if (peer_connection_.get() && metrics_peer_id_) {
+    peer_connection_->GetStats(HotlineStatsObserver::Create(options_.metrics, metrics_peer_id_),
+                               NULL,
+                               webrtc::PeerConnectionInterface::kStatsOutputLevelStandard);
+  }
+}
+
+void Conductor::StartClockProbes() {
+  if (clock_probing_) return;
+  clock_probing_ = true;
+  signal_thread_->Post(this, MsgClockProbe);
+}
+
+// Answered at once, so the reply carries our time of arrival.
+void Conductor::OnClockProbe(uint64 sent) {
+  if (local_control_datachannel_) {
+    local_control_datachannel_->ClockReply(sent, TransitNow());
+  }
+}
+
+void Conductor::OnClockReply(uint64 sent, uint64 remote) {
+  clock_.AddSample(sent, remote, TransitNow());
+}
+
+// The caches are used where the lanes encode, so these move there.
+void Conductor::OnDedupAck(const std::map<int, uint64_t>& decoded,
+                           const std::vector<int>& closed) {
+  DedupMessageData* msgdata = new DedupMessageData();
+  msgdata->decoded = decoded;
+  msgdata->closed = closed;
+  signal_thread_->Post(this, MsgDedupPeerAck, msgdata);
+}
+
+void Conductor::OnDedupResend(int lane, uint64 record) {
+  DedupMessageData* msgdata = new DedupMessageData();
+  msgdata->lane = lane;
+  msgdata->record = record;
+  signal_thread_->Post(this, MsgDedupResend, msgdata);
+}
+
 // delete client socket + data channel + server socket connection
 void Conductor::DeleteConnectionLane(SocketConnection* connection, rtc::scoped_refptr<HotlineDataChannel> channel) {
   // Get variables
@@ -473,6 +1001,13 @@ void Conductor::DeleteConnectionLane(SocketConnection* connection, rtc::scoped_r
 
   std::string channel_name = channel->label();
 
+  // Whatever the lane still has in flight no longer holds back the others.
+  if (dedup_send_cache_) {
+    int lane = atoi(channel_name.c_str());
+    dedup_send_cache_->CloseLane(lane);
+    dedup_receive_cache_->CloseLane(lane);
+  }
+
   // Delete socket
   if (connection) {
     connection->Close();
@@ -494,6 +1029,8 @@ void Conductor::DeleteConnectionLane(SocketConnection* connection, rtc::scoped_r
 
 
 void Conductor::OnSuccess(webrtc::SessionDescriptionInterface* desc) {
+  TraceEnd(desc->type() == webrtc::SessionDescriptionInterface::kOffer ?
+           "create_offer" : "create_answer");
   peer_connection_->SetLocalDescription(
       HotlineSetSessionDescriptionObserver::Create(), desc);
 
@@ -513,14 +1050,33 @@ void Conductor::OnSuccess(webrtc::SessionDescriptionInterface* desc) {
   Json::Value jmessage;
   jmessage[kSessionDescriptionTypeName] = desc->type();
   jmessage[kSessionDescriptionSdpName] = sdp;
+  // We take candidates in batches, whatever we send ourselves.
+  jmessage["ice_batch"] = true;
+
+  {
+    // Kept for TakeSpeculativeOffer() until the remote peer is known.
+    std::lock_guard<std::mutex> lock(candidates_mutex_);
+    if (speculative_) {
+      speculative_offer_ = jmessage;
+      signal_thread_->Post(this, MsgSpeculativeOfferReady);
+      return;
+    }
+  }
+
   jmessage["room_id"] = room_id_;
   jmessage["peer_id"] = std::to_string(remote_peer_id_);
 
-  signal_client_->Send(SignalServerConnection::MsgSendOffer, jmessage);
+  signal_client_->Send(SignalConnection::MsgSendOffer, jmessage);
 }
 
 void Conductor::OnFailure(const std::string& error) {
     LOG(LERROR) << error;
+
+    // Whoever waits for the speculative offer goes on without it.
+    std::lock_guard<std::mutex> lock(candidates_mutex_);
+    if (speculative_) {
+      signal_thread_->Post(this, MsgSpeculativeOfferReady);
+    }
 }
 
 void Conductor::OnMessage(rtc::Message* msg) {
@@ -532,6 +1088,56 @@ void Conductor::OnMessage(rtc::Message* msg) {
         delete msgData;
       }
     }
+    else if (msg->message_id == ThreadMsgId::MsgDedupAck) {
+      dedup_ack_pending_ = false;
+      if (local_control_datachannel_ && dedup_receive_cache_) {
+        std::map<int, uint64_t> decoded;
+        std::vector<int> closed;
+        dedup_receive_cache_->TakeAcks(&decoded, &closed);
+        if (!decoded.empty() || !closed.empty()) {
+          local_control_datachannel_->DedupAck(decoded, closed);
+        }
+      }
+    }
+    else if (msg->message_id == ThreadMsgId::MsgDedupPeerAck) {
+      rtc::scoped_ptr<DedupMessageData> msgdata(static_cast<DedupMessageData*>(msg->pdata));
+      if (dedup_send_cache_) {
+        std::map<int, uint64_t>::const_iterator it;
+        for (it = msgdata->decoded.begin(); it != msgdata->decoded.end(); ++it) {
+          dedup_send_cache_->Acknowledge(it->first, it->second);
+        }
+        for (size_t i = 0; i < msgdata->closed.size(); ++i) {
+          dedup_send_cache_->LaneClosedByReceiver(msgdata->closed[i]);
+        }
+      }
+    }
+    else if (msg->message_id == ThreadMsgId::MsgDedupResend) {
+      rtc::scoped_ptr<DedupMessageData> msgdata(static_cast<DedupMessageData*>(msg->pdata));
+      std::map<std::string, rtc::scoped_refptr<HotlineDataChannel> >::iterator it =
+          datachannels_.find(std::to_string(msgdata->lane));
+      SocketConnection* socket = it != datachannels_.end() && it->second ?
+                                 it->second->GetAttachedSocket() : NULL;
+      if (socket) socket->ResendDedupChunk(msgdata->record);
+    }
+    else if (msg->message_id == ThreadMsgId::MsgClockProbe) {
+      if (local_control_datachannel_) {
+        local_control_datachannel_->ClockProbe(TransitNow());
+      }
+      clock_probes_++;
+      signal_thread_->PostDelayed(clock_probes_ < ClockOffsetEstimator::kWindow ?
+                                  kClockProbeFastInterval : kClockProbeInterval,
+                                  this, MsgClockProbe);
+    }
+    else if (msg->message_id == ThreadMsgId::MsgSampleMetrics) {
+      SampleMetrics();
+      signal_thread_->PostDelayed(kMetricsInterval, this, MsgSampleMetrics);
+    }
+    else if (msg->message_id == ThreadMsgId::MsgFlushCandidates) {
+      FlushCandidates();
+    }
+    else if (msg->message_id == ThreadMsgId::MsgSpeculativeOfferReady) {
+      SignalSpeculativeOfferReady(this);
+    }
   }
   catch (...) {
     LOG(LS_WARNING) << "Conductor::OnMessage() Exception.";
@@ -567,6 +1173,12 @@ void Conductor::OnReceivedOffer(Json::Value& data) {
     return;
   }
 
+  if (!data.isMember(kSessionDescriptionTypeName) &&
+      (data.isMember("candidates") || data.isMember("end_of_candidates"))) {
+    AddRemoteCandidates(data);
+    return;
+  }
+
   rtc::GetStringFromJsonObject(data, kSessionDescriptionTypeName, &type);
   if (!type.empty()) {
     if (type == "offer-loopback") {
@@ -592,38 +1204,73 @@ void Conductor::OnReceivedOffer(Json::Value& data) {
       return;
     }
 
+    TraceInstant(session_description->type() == webrtc::SessionDescriptionInterface::kOffer ?
+                 "remote_offer" : "remote_answer");
+    bool remote_ice_batch = false;
+    rtc::GetBoolFromJsonObject(data, "ice_batch", &remote_ice_batch);
+    {
+      std::lock_guard<std::mutex> lock(candidates_mutex_);
+      remote_ice_batch_ = remote_ice_batch;
+    }
     peer_connection_->SetRemoteDescription(
         HotlineSetSessionDescriptionObserver::Create(), session_description);
 
     if (session_description->type() ==
         webrtc::SessionDescriptionInterface::kOffer) {
+      TraceBegin("create_answer");
       peer_connection_->CreateAnswer(this, NULL);
     }
+
+    // An offer sent along with a sign in brings its candidates.
+    if (data.isMember("candidates")) AddRemoteCandidates(data);
     return;
   } else {
-    std::string sdp_mid;
-    int sdp_mlineindex = 0;
-    std::string sdp;
-    if (!rtc::GetStringFromJsonObject(data, kCandidateSdpMidName, &sdp_mid) ||
-        !rtc::GetIntFromJsonObject(data, kCandidateSdpMlineIndexName,
-                              &sdp_mlineindex) ||
-        !rtc::GetStringFromJsonObject(data, kCandidateSdpName, &sdp)) {
-      LOG(WARNING) << "Can't parse received message.";
-      return;
-    }
-    rtc::scoped_ptr<webrtc::IceCandidateInterface> candidate(
-        webrtc::CreateIceCandidate(sdp_mid, sdp_mlineindex, sdp));
-    if (!candidate.get()) {
-      LOG(WARNING) << "Can't parse received candidate message.";
-      return;
-    }
-    if (!peer_connection_->AddIceCandidate(candidate.get())) {
-      LOG(WARNING) << "Failed to apply the received candidate";
-      return;
-    }
+    if (AddRemoteCandidate(data)) TraceInstant("remote_candidate");
     return;
   }
 }
 
+bool Conductor::AddRemoteCandidate(const Json::Value& data) {
+  std::string sdp_mid;
+  int sdp_mlineindex = 0;
+  std::string sdp;
+  if (!rtc::GetStringFromJsonObject(data, kCandidateSdpMidName, &sdp_mid) ||
+      !rtc::GetIntFromJsonObject(data, kCandidateSdpMlineIndexName,
+                            &sdp_mlineindex) ||
+      !rtc::GetStringFromJsonObject(data, kCandidateSdpName, &sdp)) {
+    LOG(WARNING) << "Can't parse received message.";
+    return false;
+  }
+  rtc::scoped_ptr<webrtc::IceCandidateInterface> candidate(
+      webrtc::CreateIceCandidate(sdp_mid, sdp_mlineindex, sdp));
+  if (!candidate.get()) {
+    LOG(WARNING) << "Can't parse received candidate message.";
+    return false;
+  }
+  if (!peer_connection_->AddIceCandidate(candidate.get())) {
+    LOG(WARNING) << "Failed to apply the received candidate";
+    return false;
+  }
+  return true;
+}
+
+void Conductor::AddRemoteCandidates(const Json::Value& data) {
+  const Json::Value& candidates = data["candidates"];
+  if (candidates.isArray()) {
+    for (unsigned i = 0; i < candidates.size(); ++i) {
+      AddRemoteCandidate(candidates[(int)i]);
+    }
+    TraceInstant("remote_candidate_batch");
+  }
+
+  // This WebRTC has no way to tell the PeerConnection, which keeps
+  // checking what it has; noted for the trace.
+  bool end = false;
+  if (rtc::GetBoolFromJsonObject(data, "end_of_candidates", &end) && end) {
+    LOG(INFO) << "Peer " << remote_peer_id_ << " has no more candidates.";
+    TraceInstant("remote_end_of_candidates");
+  }
+}
+
 
 } // namespace hotline
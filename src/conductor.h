@@ -4,30 +4,107 @@
 
 #include "htn_config.h"
 
+#include <atomic>
 #include <map>
+#include <mutex>
 #include <string>
 
 #include "webrtc/base/scoped_ptr.h"
 #include "webrtc/base/socketaddress.h"
 #include "webrtc/p2p/base/portinterface.h"
 #include "talk/app/webrtc/peerconnectioninterface.h"
+#include "bench_endpoint.h"
 #include "data_channel.h"
-#include "signalserver_connection.h"
+#include "dedup.h"
+#include "metrics.h"
+#include "setup_trace.h"
+#include "signal_connection.h"
 #include "socket_server.h"
 #include "socket_client.h"
+#include "transit.h"
 
 
 namespace hotline {
 
+class ImpairedNetwork;
+class TrafficCapture;
+
+// Tunnel settings shared by every lane of a conductor.
+struct TunnelOptions {
+  TunnelOptions()
+    : udp_max_retransmits(0),
+      udp_max_packet_lifetime(-1),
+      udp_idle_timeout(60),
+      udp_batch(true),
+      udp_fec_group(0),
+      compress_level(0),
+      dedup_cache(0),
+      ice_batch(20),
+      speculative_offer(true),
+      bench_payload(kPayloadRandom),
+      socket_server(NULL),
+      network(NULL),
+      capture(NULL),
+      transit(NULL),
+      metrics(NULL),
+      trace(NULL) {}
+
+  // Reliability of UDP lanes. The lifetime wins when both are >= 0; both
+  // -1 makes the lane reliable (but still unordered).
+  int udp_max_retransmits;
+  int udp_max_packet_lifetime;   // milliseconds
+  // Seconds without traffic before a UDP session and its lane are closed.
+  int udp_idle_timeout;
+  // Batched datagram I/O (recvmmsg/sendmmsg) for UDP sockets.
+  bool udp_batch;
+  // Datagrams per FEC parity group on UDP lanes, 0 for no FEC.
+  int udp_fec_group;
+  // zlib level for TCP lanes, 0 for no compression.
+  int compress_level;
+  // Chunk dedup cache for TCP lanes in MB per direction, 0 for none.
+  int dedup_cache;
+  // Milliseconds to collect local ICE candidates into one signaling
+  // message, 0 to send each on its own. Only once the remote offer or
+  // answer says the peer takes batches; older peers get them one by one.
+  int ice_batch;
+  // Client mode: create the offer while connecting to the signal server
+  // and send it along with the sign in.
+  bool speculative_offer;
+  // What this peer's bench:source endpoint and benchmarks send.
+  BenchPayload bench_payload;
+  // The signal thread's socket server, for the sockets udp_batch wraps by
+  // hand; NULL leaves UDP on ordinary sockets.
+  rtc::PhysicalSocketServer* socket_server;
+  // Network to run the PeerConnection on, NULL for the real one.
+  ImpairedNetwork* network;
+  // Where to record lane events, NULL for no capture.
+  TrafficCapture* capture;
+  // Where to record the transit time of lane data, NULL for no stamps.
+  TransitStats* transit;
+  // Where to count lanes, their traffic and peer stats, NULL for none.
+  TunnelMetrics* metrics;
+  // Where to record setup phases, NULL for no tracing.
+  SetupTrace* trace;
+};
+
+
 class Conductor
   : public webrtc::PeerConnectionObserver,
     public webrtc::CreateSessionDescriptionObserver,
     public HotlineDataChannelObserver,
     public SocketObserver,
-    public rtc::MessageHandler {
+    public rtc::MessageHandler,
+    public sigslot::has_slots<> {
  public:
   enum ThreadMsgId{
-    MsgStopLane
+    MsgStopLane,
+    MsgDedupAck,
+    MsgDedupPeerAck,
+    MsgDedupResend,
+    MsgClockProbe,
+    MsgSampleMetrics,
+    MsgFlushCandidates,
+    MsgSpeculativeOfferReady
   };
 
   Conductor::Conductor();
@@ -40,12 +117,38 @@ class Conductor
                         std::string room_id,
                         uint64 local_peer_id,
                         uint64 remote_peer_id,
-                        SignalServerConnection* signal_client,
-                        rtc::Thread* signal_thread
+                        SignalConnection* signal_client,
+                        rtc::Thread* signal_thread,
+                        const TunnelOptions& options
                         );
 
   bool connection_active() const;
+  // ICE has a working pair to the peer, signal server or not.
+  bool ice_connected() const { return ice_connected_.load(); }
+  // ICE connected and nothing has taken the tunnel down since.
+  bool tunnel_up() const { return ice_connected_.load() && !tunnel_down_.load(); }
+  uint64 remote_peer_id() const { return remote_peer_id_; }
   void ConnectToPeer();
+
+  // Client mode: creates the offer before the remote peer is known. It is
+  // kept, and so are the local candidates, until TakeSpeculativeOffer() and
+  // AdoptRemotePeer(). SignalSpeculativeOfferReady fires once it exists.
+  bool PrepareOffer();
+  // {"type", "sdp", "candidates"[, "end_of_candidates"]}, false if the offer
+  // couldn't be created.
+  bool TakeSpeculativeOffer(Json::Value* bundle);
+  // The peer the speculative offer is for. If the signal server didn't pass
+  // on the taken bundle, the offer and candidates are sent to it now.
+  void AdoptRemotePeer(uint64 local_peer_id, uint64 remote_peer_id,
+                       bool offer_delivered);
+  sigslot::signal1<Conductor*> SignalSpeculativeOfferReady;
+
+  // Client mode: the local socket is listening on the given address.
+  sigslot::signal2<Conductor*, const rtc::SocketAddress&> SignalLocalSocketOpened;
+  // ICE failed or the control channel closed: the tunnel to the peer is
+  // gone. May come on the PeerConnection's signaling thread.
+  sigslot::signal1<Conductor*> SignalTunnelDown;
+
   virtual void OnReceivedOffer(Json::Value& data);
   virtual void Close();
   
@@ -54,16 +157,20 @@ class Conductor
    public:
      ChannelDescription() {}
      
-     void Set(rtc::SocketAddress remote_address, cricket::ProtocolType protocol) {
+     void Set(rtc::SocketAddress remote_address, cricket::ProtocolType protocol,
+              const LaneSettings& settings) {
        remote_address_ = remote_address;
        protocol_ = protocol;
+       settings_ = settings;
      }
                  
      rtc::SocketAddress& remote_address() { return remote_address_;}
      cricket::ProtocolType protocol() { return protocol_; }
+     const LaneSettings& settings() { return settings_; }
    private:
      rtc::SocketAddress remote_address_;
      cricket::ProtocolType protocol_;
+     LaneSettings settings_;
   };
 
   struct LaneMessageData : public rtc::MessageData {
@@ -81,17 +188,45 @@ class Conductor
     HotlineDataChannel* data_channel_;
   };
 
+  // The peer's dedup acknowledgements, or the lane and record of a
+  // reference it wants resent, for the thread the lanes encode on.
+  struct DedupMessageData : public rtc::MessageData {
+    DedupMessageData() : lane(0), record(0) {}
+
+    std::map<int, uint64_t> decoded;
+    std::vector<int> closed;
+    int lane;
+    uint64 record;
+  };
+
   
   bool InitializePeerConnection();
   bool ReinitializePeerConnectionForLoopback();
   bool CreatePeerConnection(bool dtls);
   void DeletePeerConnection();
   bool AddControlDataChannel();
-  bool AddPacketDataChannel(std::string* channel_name);
+  bool AddPacketDataChannel(std::string* channel_name,
+                            cricket::ProtocolType protocol);
 
   // create client socket + data channel + server socket connection
   bool CreateConnectionLane(SocketConnection* connection);
   bool CreateConnectionLane(rtc::scoped_refptr<HotlineDataChannel> channel);
+  void ApplyLaneSettings(SocketConnection* connection, const LaneSettings& settings);
+  void CreateDedupCaches(int size_mb);
+  void OnDedupAcksPending(DedupReceiveCache* cache);
+  void OnDedupResendNeeded(DedupReceiveCache* cache, int lane, uint64_t record);
+  void StartClockProbes();
+  void StartMetricsSampling();
+  void TraceBegin(const char* name);
+  void TraceEnd(const char* name);
+  void TraceInstant(const char* name);
+  void TraceLane(char phase, const std::string& label);
+  void SampleMetrics();
+  void FlushCandidates();
+  // options_.ice_batch applies to this peer. Call with candidates_mutex_.
+  bool BatchingCandidates() const;
+  bool AddRemoteCandidate(const Json::Value& data);
+  void AddRemoteCandidates(const Json::Value& data);
   // delete client socket + data channel + server socket connection
   void DeleteConnectionLane(SocketConnection* connection, rtc::scoped_refptr<HotlineDataChannel> channel);
 
@@ -108,6 +243,10 @@ class Conductor
   virtual void OnDataChannel(webrtc::DataChannelInterface* channel);
   virtual void OnRenegotiationNeeded() {}
   virtual void OnIceChange() {}
+  virtual void OnIceConnectionChange(
+      webrtc::PeerConnectionInterface::IceConnectionState new_state);
+  virtual void OnIceGatheringChange(
+      webrtc::PeerConnectionInterface::IceGatheringState new_state);
   virtual void OnIceCandidate(const webrtc::IceCandidateInterface* candidate);
 
   //
@@ -117,10 +256,16 @@ class Conductor
   virtual void OnControlDataChannelClosed(rtc::scoped_refptr<HotlineDataChannel> channel, bool is_local);
   virtual void OnSocketDataChannelOpen(rtc::scoped_refptr<HotlineDataChannel> channel);
   virtual void OnSocketDataChannelClosed(rtc::scoped_refptr<HotlineDataChannel> channel);
-  virtual void OnCreateChannel(rtc::SocketAddress& remote_address, cricket::ProtocolType protocol);
+  virtual void OnCreateChannel(rtc::SocketAddress& remote_address, cricket::ProtocolType protocol,
+                               LaneSettings& settings);
   virtual void OnStopChannel(std::string& channel_name);
-  virtual void OnChannelCreated();
+  virtual void OnChannelCreated(LaneSettings& settings);
   virtual void OnServerSideReady(std::string& channel_name);
+  virtual void OnDedupAck(const std::map<int, uint64_t>& decoded,
+                          const std::vector<int>& closed);
+  virtual void OnDedupResend(int lane, uint64 record);
+  virtual void OnClockProbe(uint64 sent);
+  virtual void OnClockReply(uint64 sent, uint64 remote);
 
   //
   // SocketObserver implementation.
@@ -151,7 +296,7 @@ class Conductor
   rtc::scoped_refptr<webrtc::PeerConnectionInterface> peer_connection_;
   rtc::scoped_refptr<webrtc::PeerConnectionFactoryInterface>
       peer_connection_factory_;
-  SignalServerConnection* signal_client_;
+  SignalConnection* signal_client_;
   std::deque<std::string*> pending_messages_;
 
   rtc::scoped_refptr<HotlineControlDataChannel> local_control_datachannel_;
@@ -168,6 +313,43 @@ class Conductor
   rtc::SocketAddress remote_address_;
   std::string room_id_;
   cricket::ProtocolType protocol_;
+  TunnelOptions options_;
+  LaneSettings lane_settings_;
+
+  // Shared by all TCP lanes; one per direction.
+  rtc::scoped_ptr<DedupSendCache> dedup_send_cache_;
+  rtc::scoped_ptr<DedupReceiveCache> dedup_receive_cache_;
+  std::atomic<bool> dedup_ack_pending_;
+
+  // The remote peer's clock, for transit stamps.
+  ClockOffsetEstimator clock_;
+  bool clock_probing_;
+  int clock_probes_;
+
+  bool metrics_sampling_;
+  // The peer TunnelMetrics holds GetStats() results for, 0 for none yet.
+  uint64 metrics_peer_id_;
+
+  // Set by OnIceConnectionChange(), on the PeerConnection's signaling thread.
+  std::atomic<bool> ice_connected_;
+  // Set with SignalTunnelDown.
+  std::atomic<bool> tunnel_down_;
+
+  // Local candidates waiting for MsgFlushCandidates. OnIceCandidate() and
+  // OnIceGatheringChange() come on the PeerConnection's signaling thread.
+  std::mutex candidates_mutex_;
+  Json::Value pending_candidates_;
+  bool candidates_flush_posted_;
+  bool candidates_complete_;
+  // The remote offer or answer advertised "ice_batch".
+  bool remote_ice_batch_;
+
+  // The offer made before the remote peer was known, and what of it went
+  // to the signal server with the sign in. Guarded by candidates_mutex_.
+  bool speculative_;
+  Json::Value speculative_offer_;
+  unsigned taken_candidates_;
+  bool taken_complete_;
 
   rtc::Thread* signal_thread_;
   ChannelDescription channel_;
@@ -4,6 +4,9 @@
 #include <vector>
 #include <iostream>
 
+#include "webrtc/base/common.h"
+#include "webrtc/base/logging.h"
+#include "webrtc/base/thread.h"
 #include "conductors.h"
 #include "conductor.h"
 
@@ -11,7 +14,8 @@
 
 namespace hotline {
 
-Conductors::Conductors(SignalServerConnection* signal_client,
+
+Conductors::Conductors(SignalConnection* signal_client,
                      rtc::Thread* signal_thread,
                      UserArguments& arguments)
   : id_(0),
@@ -22,12 +26,18 @@ Conductors::Conductors(SignalServerConnection* signal_client,
     remote_address_(arguments.remote_address),
     protocol_(arguments.protocol),
     room_id_(arguments.room_id),
-    password_(arguments.password) {
+    password_(arguments.password),
+    options_(arguments.options),
+    speculative_ready_(false),
+    connected_(false),
+    sign_in_sent_(false),
+    offer_peer_id_(0) {
 
   signal_client_->RegisterObserver(this);
 }
 
 Conductors::~Conductors() {
+  signal_thread_->Clear(this);
 }
 
 
@@ -51,17 +61,59 @@ void Conductors::Close() {
   // TODO: Delete all peers
 }
 
+void Conductors::PrepareOffer() {
+  if (server_mode() || !options_.speculative_offer || speculative_) return;
+
+  speculative_ = new rtc::RefCountedObject<Conductor>();
+  speculative_->Init(server_mode_,
+                     local_address_,
+                     remote_address_,
+                     protocol_,
+                     room_id_,
+                     0,
+                     0,
+                     signal_client_,
+                     signal_thread_,
+                     options_);
+  speculative_->SignalSpeculativeOfferReady.connect(this, &Conductors::OnSpeculativeOfferReady);
+
+  if (!speculative_->PrepareOffer()) speculative_ = NULL;
+}
+
+void Conductors::OnSpeculativeOfferReady(Conductor* conductor) {
+  speculative_ready_ = true;
+  if (connected_ && !sign_in_sent_) SignIn();
+}
+
+void Conductors::SignIn() {
+  Json::Value offer;
+  if (speculative_ && !speculative_->TakeSpeculativeOffer(&offer)) {
+    // Couldn't make the offer; OnPeerConnected() starts over.
+    speculative_ = NULL;
+  }
+
+  sign_in_sent_ = true;
+  if (options_.trace) options_.trace->Begin("signal", "sign_in", 0);
+  signal_client_->SignIn(room_id_, password_, offer);
+}
+
 
 //
 // SignalServerConnectionObserver implementation.
 //
 
 void Conductors::OnConnected() {
+  if (options_.metrics) options_.metrics->SetSignalState(TunnelMetrics::kSignalConnected);
+  if (options_.trace) options_.trace->End("signal", "signal_connect", 0);
+
   if (server_mode()) {
+    if (options_.trace) options_.trace->Begin("signal", "create_room", 0);
     signal_client_->CreateRoom(password_);
   }
   else {
-    signal_client_->SignIn(room_id_, password_);
+    // Waits for the offer to go along, unless it was already made.
+    connected_ = true;
+    if (!speculative_ || speculative_ready_) SignIn();
   }
 }
 
@@ -71,10 +123,14 @@ void Conductors::OnCreatedRoom(std::string& room_id) {
   std::cout << "Your room id is " << room_id.c_str() << "." << std::endl;
 
   room_id_ = room_id;
-  signal_client_->SignIn(room_id_, password_);
+  if (options_.trace) {
+    options_.trace->End("signal", "create_room", 0);
+    options_.trace->Begin("signal", "sign_in", 0);
+  }
+  signal_client_->SignIn(room_id_, password_, Json::Value());
 } 
 
-void Conductors::OnSignedIn(std::string& room_id, uint64 peer_id) {
+void Conductors::OnSignedIn(std::string& room_id, uint64 peer_id, uint64 offer_peer_id) {
 
   if (server_mode()) {
     ASSERT(room_id_==room_id);
@@ -82,13 +138,51 @@ void Conductors::OnSignedIn(std::string& room_id, uint64 peer_id) {
 
   room_id_ = room_id;
   id_ = peer_id;
+  offer_peer_id_ = offer_peer_id;
+
+  if (options_.metrics) options_.metrics->SetSignalState(TunnelMetrics::kSignalSignedIn);
+  if (options_.trace) {
+    options_.trace->End("signal", "sign_in", 0);
+    options_.trace->Begin("signal", "wait_for_peer", 0);
+  }
 
 }
 
+void Conductors::OnReconnected(const std::string& room_id, uint64 peer_id) {
+  if (options_.metrics) options_.metrics->SetSignalState(TunnelMetrics::kSignalSignedIn);
+
+  // The server had lost our room and we made it again; new peers need the
+  // new id.
+  if (room_id != room_id_) {
+    std::cout << "Your room id is now " << room_id.c_str() << "." << std::endl;
+    room_id_ = room_id;
+  }
+
+  // Only new conductors use the new id; the tunnels carry on regardless.
+  if (peer_id != id_) {
+    LOG(LS_WARNING) << "Signed in again as peer " << peer_id << ", was " << id_ << ".";
+    id_ = peer_id;
+  }
+  std::cout << "Reconnected to signal server." << std::endl;
+}
+
 void Conductors::OnPeerConnected(uint64 peer_id) {
 
   typedef std::pair<uint64, rtc::scoped_refptr<Conductor>> PeerPair;
 
+  // Back after losing the signal server, or us having lost it.
+  if (peers_offer_.find(peer_id) != peers_offer_.end()) {
+    departed_.erase(peer_id);
+    LOG(LS_INFO) << "Peer " << std::to_string(peer_id) << " is back.";
+    return;
+  }
+
+  // Waiting spans from sign in, or from the last peer leaving, to a peer.
+  if (options_.trace) {
+    if (peers_offer_.empty()) options_.trace->End("signal", "wait_for_peer", 0);
+    options_.trace->Instant("signal", "peer_connected", peer_id);
+  }
+
   //
   // Answerer
   //
@@ -106,44 +200,98 @@ void Conductors::OnPeerConnected(uint64 peer_id) {
                     id_,
                     peer_id,
                     signal_client_,
-                    signal_thread_);
+                    signal_thread_,
+                    options_);
 
   //
   // Offerer
   //
 
-  rtc::scoped_refptr<Conductor> conductor_offer(
-          new rtc::RefCountedObject<Conductor> ());
+  rtc::scoped_refptr<Conductor> conductor_offer;
+  bool adopted = false;
+
+  if (speculative_) {
+    // The offer made before signing in is for the first peer. The signal
+    // server passed it on with the sign in if it named this peer.
+    conductor_offer = speculative_;
+    speculative_ = NULL;
+    adopted = true;
+  }
+  else {
+    conductor_offer = new rtc::RefCountedObject<Conductor> ();
+    conductor_offer->Init(server_mode_,
+                      local_address_,
+                      remote_address_,
+                      protocol_,
+                      room_id_,
+                      id_,
+                      peer_id,
+                      signal_client_,
+                      signal_thread_,
+                      options_
+                      );
+  }
 
   peers_offer_.insert(PeerPair(peer_id, conductor_offer));
 
-  conductor_offer->Init(server_mode_,
-                    local_address_,
-                    remote_address_,
-                    protocol_,
-                    room_id_,
-                    id_,
-                    peer_id,
-                    signal_client_,
-                    signal_thread_
-                    );
+  conductor_answer->SignalLocalSocketOpened.connect(this, &Conductors::OnLocalSocketOpened);
+  conductor_offer->SignalLocalSocketOpened.connect(this, &Conductors::OnLocalSocketOpened);
+  conductor_answer->SignalTunnelDown.connect(this, &Conductors::OnTunnelDown);
+  conductor_offer->SignalTunnelDown.connect(this, &Conductors::OnTunnelDown);
 
   // ConnectToPeer if offerer
-  conductor_offer->ConnectToPeer();
+  if (adopted) {
+    conductor_offer->AdoptRemotePeer(id_, peer_id, peer_id == offer_peer_id_);
+  }
+  else {
+    conductor_offer->ConnectToPeer();
+  }
 
   if (server_mode()) {
     std::cout << "Peer connected. (peerid: " << std::to_string(peer_id) << ")." << std::endl;
   }
 }
 
+void Conductors::OnLocalSocketOpened(Conductor* conductor,
+                                     const rtc::SocketAddress& address) {
+  SignalLocalSocketOpened(this, address);
+}
+
+bool Conductors::PeerConnected(uint64 peer_id) {
+  PeerMap::iterator offer = peers_offer_.find(peer_id);
+  PeerMap::iterator answer = peers_answer_.find(peer_id);
+  return (offer != peers_offer_.end() && offer->second->tunnel_up()) ||
+         (answer != peers_answer_.end() && answer->second->tunnel_up());
+}
+
 void Conductors::OnPeerDisconnected(uint64 peer_id) {
   LOG(LS_INFO) << "Peer " << std::to_string(peer_id) << " disconnected.";
 
+  // Gone from the signal server isn't gone from the tunnel: it goes when
+  // ICE fails or the control channel closes, OnTunnelDown().
+  if (PeerConnected(peer_id)) {
+    departed_.insert(peer_id);
+    return;
+  }
+
+  RemovePeer(peer_id);
+}
+
+void Conductors::OnTunnelDown(Conductor* conductor) {
+  signal_thread_->Post(this, MsgPeerGone,
+                       new rtc::TypedMessageData<uint64>(conductor->remote_peer_id()));
+}
+
+void Conductors::RemovePeer(uint64 peer_id) {
+  departed_.erase(peer_id);
   peers_offer_.erase(peer_id);
   peers_answer_.erase(peer_id);
 
   if (server_mode()) {
     std::cout << "Peer disconnected. (peerid: " << std::to_string(peer_id) << ")." << std::endl;
+    if (options_.trace && peers_offer_.empty()) {
+      options_.trace->Begin("signal", "wait_for_peer", 0);
+    }
   }
 
   if (client_mode()) {
@@ -178,12 +326,15 @@ void Conductors::OnReceivedOffer(Json::Value& data) {
 
 
 void Conductors::OnDisconnected() {
+  if (options_.metrics) options_.metrics->SetSignalState(TunnelMetrics::kSignalDisconnected);
   std::cout << "Connection to signal server closed." << std::endl;
 }
 
 void Conductors::OnServerConnectionFailure(int code, std::string& message) {
   ASSERT(signal_thread_ != NULL);
 
+  if (options_.metrics) options_.metrics->SetSignalState(TunnelMetrics::kSignalDisconnected);
+
   if (message.length() > 0) {
     std::cerr << message << std::endl;//:"Signal server connection error. " << GetSignalServerName() << "." << std::endl;
   }
@@ -198,6 +349,17 @@ void Conductors::OnMessage(rtc::Message* msg) {
       OnClose();
       rtc::ThreadManager::Instance()->CurrentThread()->Stop();
     }
+    else if (msg->message_id == ThreadMsgId::MsgPeerGone) {
+      rtc::TypedMessageData<uint64>* data =
+          static_cast<rtc::TypedMessageData<uint64>*>(msg->pdata);
+      uint64 peer_id = data->data();
+      delete data;
+      // Only peers the signal server has lost; the others it reports.
+      if (departed_.count(peer_id) && !PeerConnected(peer_id)) {
+        LOG(LS_INFO) << "Tunnel to departed peer " << std::to_string(peer_id) << " is down.";
+        RemovePeer(peer_id);
+      }
+    }
   }
   catch (...) {
     LOG(LS_WARNING) << "Conductors::OnMessage() Exception.";
@@ -205,6 +367,7 @@ void Conductors::OnMessage(rtc::Message* msg) {
 }
 
 void Conductors::OnClose() {
+  speculative_ = NULL;
   signal_client_->UnregisterObserver(this);
 }
 
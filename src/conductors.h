@@ -5,6 +5,7 @@
 #include "htn_config.h"
 
 #include <map>
+#include <set>
 #include <string>
 
 #include "webrtc/base/scoped_ptr.h"
@@ -12,7 +13,7 @@
 #include "webrtc/p2p/base/portinterface.h"
 #include "talk/app/webrtc/peerconnectioninterface.h"
 #include "data_channel.h"
-#include "signalserver_connection.h"
+#include "signal_connection.h"
 #include "socket_server.h"
 #include "socket_client.h"
 #include "conductor.h"
@@ -27,19 +28,22 @@ struct UserArguments{
   cricket::ProtocolType protocol;
   std::string room_id;
   std::string password;
+  TunnelOptions options;
 };
 
 
 class Conductors
     : public SignalServerConnectionObserver,
-      public rtc::MessageHandler {
+      public rtc::MessageHandler,
+      public sigslot::has_slots<> {
  public:
 
    enum ThreadMsgId{
-    MsgExit
+    MsgExit,
+    MsgPeerGone
   };
 
-  Conductors(SignalServerConnection* signal_client,
+  Conductors(SignalConnection* signal_client,
             rtc::Thread* signal_thread,
             UserArguments& arguments);
   virtual ~Conductors();
@@ -52,6 +56,13 @@ class Conductors
 
   virtual void Close();
 
+  // Client mode, before connecting to the signal server: starts the offer
+  // so it can go along with the sign in (TunnelOptions::speculative_offer).
+  void PrepareOffer();
+
+  // Client mode: a peer's local socket is listening on the given address.
+  sigslot::signal2<Conductors*, const rtc::SocketAddress&> SignalLocalSocketOpened;
+
  protected:
 
   //
@@ -61,7 +72,8 @@ class Conductors
   virtual void OnConnected();
   virtual void OnDisconnected();
   virtual void OnCreatedRoom(std::string& room_id);
-  virtual void OnSignedIn(std::string& room_id, uint64 peer_id);
+  virtual void OnSignedIn(std::string& room_id, uint64 peer_id, uint64 offer_peer_id);
+  virtual void OnReconnected(const std::string& room_id, uint64 peer_id);
   virtual void OnPeerConnected(uint64 peer_id);
   virtual void OnPeerDisconnected(uint64 peer_id);
   virtual void OnReceivedOffer(Json::Value& data);
@@ -73,7 +85,14 @@ class Conductors
   void OnMessage(rtc::Message* msg);
   void OnClose();
 
-  SignalServerConnection* signal_client_;
+  void OnLocalSocketOpened(Conductor* conductor, const rtc::SocketAddress& address);
+  void OnSpeculativeOfferReady(Conductor* conductor);
+  void OnTunnelDown(Conductor* conductor);
+  bool PeerConnected(uint64 peer_id);
+  void RemovePeer(uint64 peer_id);
+  void SignIn();
+
+  SignalConnection* signal_client_;
 
   bool server_mode_;
   rtc::SocketAddress local_address_;
@@ -81,6 +100,7 @@ class Conductors
   cricket::ProtocolType protocol_;
   std::string room_id_;
   std::string password_;
+  TunnelOptions options_;
 
   uint64 id_;
   std::string server_;
@@ -88,6 +108,16 @@ class Conductors
   typedef std::map<uint64, rtc::scoped_refptr<Conductor>> PeerMap;
   PeerMap peers_offer_;
   PeerMap peers_answer_;
+  // Peers the signal server lost while their tunnel still worked. They
+  // stay until the tunnel itself goes down, however long that is.
+  std::set<uint64> departed_;
+
+  // Client mode: the offerer made before signing in, until a peer shows up.
+  rtc::scoped_refptr<Conductor> speculative_;
+  bool speculative_ready_;
+  bool connected_;
+  bool sign_in_sent_;
+  uint64 offer_peer_id_;
 
   rtc::Thread* signal_thread_;
 };
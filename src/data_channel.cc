@@ -15,6 +15,22 @@
 
 namespace hotline {
 
+void LaneSettings::ToJson(Json::Value* json) const {
+  if (fec_group > 0) (*json)["fec_group"] = fec_group;
+  if (compress_level > 0) (*json)["compress_level"] = compress_level;
+  if (dedup_cache > 0) (*json)["dedup_cache"] = dedup_cache;
+  if (transit > 0) (*json)["transit"] = transit;
+}
+
+void LaneSettings::FromJson(const Json::Value& json) {
+  *this = LaneSettings();
+  rtc::GetIntFromJsonObject(json, "fec_group", &fec_group);
+  rtc::GetIntFromJsonObject(json, "compress_level", &compress_level);
+  rtc::GetIntFromJsonObject(json, "dedup_cache", &dedup_cache);
+  rtc::GetIntFromJsonObject(json, "transit", &transit);
+}
+
+
 HotlineDataChannel::HotlineDataChannel(webrtc::DataChannelInterface* channel, bool is_local)
   : channel_(channel), socket_(NULL), callback_(NULL), is_local_(is_local), is_control_channel_(false), closed_by_remote_(false) {
   channel_->RegisterObserver(this);
@@ -79,13 +95,29 @@ void HotlineDataChannel::SocketReadEvent() {
 }
 
 
-bool HotlineDataChannel::Send(char* buf, size_t len) {
+bool HotlineDataChannel::Send(const char* buf, size_t len) {
 
   if (channel_==NULL || channel_->state()!=webrtc::DataChannelInterface::kOpen) return false;
 
   rtc::Buffer buffer(buf, len);
   bool result = channel_->Send(webrtc::DataBuffer(buffer, true));
-  ASSERT(result);
+
+  // Unreliable channels refuse messages instead of queueing them.
+  ASSERT(result || !channel_->reliable());
+
+  return result;
+}
+
+bool HotlineDataChannel::Send(const char* header, size_t header_len,
+                              const char* buf, size_t len) {
+
+  if (channel_==NULL || channel_->state()!=webrtc::DataChannelInterface::kOpen) return false;
+
+  rtc::Buffer buffer(header, header_len, header_len + len);
+  buffer.AppendData(buf, len);
+  bool result = channel_->Send(webrtc::DataBuffer(buffer, true));
+
+  ASSERT(result || !channel_->reliable());
 
   return result;
 }
@@ -159,6 +191,22 @@ void HotlineControlDataChannel::OnMessage(const webrtc::DataBuffer& buffer) {
     OnServerSideReady(data);
     break;
 
+  case MsgDedupAck:
+    OnDedupAck(data);
+    break;
+
+  case MsgClockProbe:
+    OnClockProbe(data);
+    break;
+
+  case MsgClockReply:
+    OnClockReply(data);
+    break;
+
+  case MsgDedupResend:
+    OnDedupResend(data);
+    break;
+
   default:
     break;
   }
@@ -166,13 +214,15 @@ void HotlineControlDataChannel::OnMessage(const webrtc::DataBuffer& buffer) {
 
 
 
-bool HotlineControlDataChannel::CreateChannel(std::string& remote_address, cricket::ProtocolType protocol) {
+bool HotlineControlDataChannel::CreateChannel(std::string& remote_address, cricket::ProtocolType protocol,
+                                              const LaneSettings& settings) {
   Json::FastWriter writer;
   Json::Value jmessage;
   Json::Value data;
 
   data["remote_address"] = remote_address;
   data["protocol"] = protocol;
+  settings.ToJson(&data);
 
   jmessage["id"] = MsgCreateChannel;
   jmessage["data"] = data;
@@ -193,17 +243,23 @@ void HotlineControlDataChannel::OnCreateChannel(Json::Value& json_data) {
   if (!remote_address.FromString(remote_address_string)) return;
   if (protocol != cricket::PROTO_UDP && protocol != cricket::PROTO_TCP) return;
 
-  callback_->OnCreateChannel(remote_address, protocol);
-  ChannelCreated();
+  // The observer trims the proposal down to what it accepts.
+  LaneSettings settings;
+  settings.FromJson(json_data);
+
+  callback_->OnCreateChannel(remote_address, protocol, settings);
+  ChannelCreated(settings);
 
   return;
 }
 
-bool HotlineControlDataChannel::ChannelCreated() {
+bool HotlineControlDataChannel::ChannelCreated(const LaneSettings& settings) {
   Json::FastWriter writer;
   Json::Value jmessage;
   Json::Value data;
 
+  settings.ToJson(&data);
+
   jmessage["id"] = MsgChannelCreated;
   jmessage["data"] = data;
 
@@ -213,7 +269,9 @@ bool HotlineControlDataChannel::ChannelCreated() {
 
 
 void HotlineControlDataChannel::OnChannelCreated(Json::Value& json_data) {
-  callback_->OnChannelCreated();  
+  LaneSettings settings;
+  settings.FromJson(json_data);
+  callback_->OnChannelCreated(settings);
   return;
 }
 
@@ -240,6 +298,127 @@ void HotlineControlDataChannel::OnServerSideReady(Json::Value& json_data) {
 }
 
 
+bool HotlineControlDataChannel::DedupAck(const std::map<int, uint64_t>& decoded,
+                                         const std::vector<int>& closed) {
+  Json::FastWriter writer;
+  Json::Value jmessage;
+  Json::Value data;
+
+  // Lane labels as keys, counts as strings; a JSON number can't hold
+  // every 64-bit value.
+  Json::Value jdecoded(Json::objectValue);
+  for (std::map<int, uint64_t>::const_iterator it = decoded.begin(); it != decoded.end(); ++it) {
+    jdecoded[std::to_string(it->first)] = std::to_string(it->second);
+  }
+  Json::Value jclosed(Json::arrayValue);
+  for (size_t i = 0; i < closed.size(); ++i) {
+    jclosed.append(closed[i]);
+  }
+  data["decoded"] = jdecoded;
+  data["closed"] = jclosed;
+
+  jmessage["id"] = MsgDedupAck;
+  jmessage["data"] = data;
+
+  webrtc::DataBuffer buffer(writer.write(jmessage));
+  return channel_->Send(buffer);
+}
+
+
+void HotlineControlDataChannel::OnDedupAck(Json::Value& json_data) {
+  Json::Value jdecoded;
+  Json::Value jclosed;
+  if (!rtc::GetValueFromJsonObject(json_data, "decoded", &jdecoded) || !jdecoded.isObject()) return;
+  if (!rtc::GetValueFromJsonObject(json_data, "closed", &jclosed) || !jclosed.isArray()) return;
+
+  std::map<int, uint64_t> decoded;
+  Json::Value::Members lanes = jdecoded.getMemberNames();
+  for (size_t i = 0; i < lanes.size(); ++i) {
+    std::string record;
+    if (!rtc::GetStringFromJsonObject(jdecoded, lanes[i], &record)) continue;
+    decoded[atoi(lanes[i].c_str())] = strtoull(record.c_str(), NULL, 10);
+  }
+  std::vector<int> closed;
+  for (Json::Value::ArrayIndex i = 0; i < jclosed.size(); ++i) {
+    int lane;
+    if (rtc::GetIntFromJsonArray(jclosed, i, &lane)) closed.push_back(lane);
+  }
+  callback_->OnDedupAck(decoded, closed);
+}
+
+
+bool HotlineControlDataChannel::DedupResend(int lane, uint64 record) {
+  Json::FastWriter writer;
+  Json::Value jmessage;
+  Json::Value data;
+
+  data["lane"] = lane;
+  data["record"] = std::to_string(record);
+
+  jmessage["id"] = MsgDedupResend;
+  jmessage["data"] = data;
+
+  webrtc::DataBuffer buffer(writer.write(jmessage));
+  return channel_->Send(buffer);
+}
+
+
+void HotlineControlDataChannel::OnDedupResend(Json::Value& json_data) {
+  int lane;
+  std::string record;
+  if (!rtc::GetIntFromJsonObject(json_data, "lane", &lane)) return;
+  if (!rtc::GetStringFromJsonObject(json_data, "record", &record)) return;
+  callback_->OnDedupResend(lane, strtoull(record.c_str(), NULL, 10));
+}
+
+
+bool HotlineControlDataChannel::ClockProbe(uint64 sent) {
+  Json::FastWriter writer;
+  Json::Value jmessage;
+  Json::Value data;
+
+  data["sent"] = std::to_string(sent);
+
+  jmessage["id"] = MsgClockProbe;
+  jmessage["data"] = data;
+
+  webrtc::DataBuffer buffer(writer.write(jmessage));
+  return channel_->Send(buffer);
+}
+
+
+void HotlineControlDataChannel::OnClockProbe(Json::Value& json_data) {
+  std::string sent;
+  if (!rtc::GetStringFromJsonObject(json_data, "sent", &sent)) return;
+  callback_->OnClockProbe(strtoull(sent.c_str(), NULL, 10));
+}
+
+
+bool HotlineControlDataChannel::ClockReply(uint64 sent, uint64 remote) {
+  Json::FastWriter writer;
+  Json::Value jmessage;
+  Json::Value data;
+
+  data["sent"] = std::to_string(sent);
+  data["remote"] = std::to_string(remote);
+
+  jmessage["id"] = MsgClockReply;
+  jmessage["data"] = data;
+
+  webrtc::DataBuffer buffer(writer.write(jmessage));
+  return channel_->Send(buffer);
+}
+
+
+void HotlineControlDataChannel::OnClockReply(Json::Value& json_data) {
+  std::string sent;
+  std::string remote;
+  if (!rtc::GetStringFromJsonObject(json_data, "sent", &sent)) return;
+  if (!rtc::GetStringFromJsonObject(json_data, "remote", &remote)) return;
+  callback_->OnClockReply(strtoull(sent.c_str(), NULL, 10), strtoull(remote.c_str(), NULL, 10));
+}
+
+
 bool HotlineControlDataChannel::DeleteRemoteChannel(std::string& channel_name) {
   Json::FastWriter writer;
   Json::Value jmessage;
@@ -2,6 +2,9 @@
 #define HOTLINE_TUNNEL_DATA_CHANNEL_H_
 #pragma once
 
+#include <map>
+#include <vector>
+
 #include "webrtc/base/scoped_ptr.h"
 #include "webrtc/base/scoped_ref_ptr.h"
 #include "webrtc/base/socketaddress.h"
@@ -17,6 +20,29 @@ class SocketConnection;
 class HotlineDataChannel;
 
 
+//////////////////////////////////////////////////////////////////////
+// LaneSettings
+// Optional lane data path features. The client proposes them in
+// CreateChannel and the server answers with what it accepted in
+// ChannelCreated; a feature missing from the answer stays off.
+//
+struct LaneSettings {
+  LaneSettings() : fec_group(0), compress_level(0), dedup_cache(0), transit(0) {}
+
+  void ToJson(Json::Value* json) const;
+  void FromJson(const Json::Value& json);
+
+  // UDP lanes: datagrams per XOR parity group, 0 for no FEC.
+  int fec_group;
+  // TCP lanes: zlib level 1-9, 0 for no compression.
+  int compress_level;
+  // TCP lanes: dedup cache size in MB, 0 for no deduplication.
+  int dedup_cache;
+  // 1 to stamp every message with its read time, for transit histograms.
+  int transit;
+};
+
+
 //////////////////////////////////////////////////////////////////////
   
 struct HotlineDataChannelObserver{
@@ -25,10 +51,17 @@ struct HotlineDataChannelObserver{
   virtual void OnSocketDataChannelOpen(rtc::scoped_refptr<HotlineDataChannel> channel) = 0;
   virtual void OnSocketDataChannelClosed(rtc::scoped_refptr<HotlineDataChannel> channel) = 0;
 
-  virtual void OnCreateChannel(rtc::SocketAddress& remote_address, cricket::ProtocolType protocol) = 0;
+  virtual void OnCreateChannel(rtc::SocketAddress& remote_address, cricket::ProtocolType protocol,
+                               LaneSettings& settings) = 0;
   virtual void OnStopChannel(std::string& channel_name) = 0;
-  virtual void OnChannelCreated() = 0;
+  virtual void OnChannelCreated(LaneSettings& settings) = 0;
   virtual void OnServerSideReady(std::string& channel_name) = 0;
+  // lane -> records decoded, and the lanes the peer closed.
+  virtual void OnDedupAck(const std::map<int, uint64_t>& decoded,
+                          const std::vector<int>& closed) = 0;
+  virtual void OnDedupResend(int lane, uint64 record) = 0;
+  virtual void OnClockProbe(uint64 sent) = 0;
+  virtual void OnClockReply(uint64 sent, uint64 remote) = 0;
 
 protected:
   virtual ~HotlineDataChannelObserver() {}
@@ -56,7 +89,9 @@ public:
   void SetSocketReady();
   void SocketReadEvent();
 
-  bool Send(char* buf, size_t len);
+  bool Send(const char* buf, size_t len);
+  // Sends header and buf as one message.
+  bool Send(const char* header, size_t header_len, const char* buf, size_t len);
   void Close();
   void Stop();
 
@@ -67,6 +102,8 @@ public:
   void closed_by_remote(bool closed_by_remote) { closed_by_remote_ = closed_by_remote;}
 
   bool IsOpen() const { return state_ == webrtc::DataChannelInterface::kOpen; }
+  // Bytes handed to Send() that SCTP has not taken yet.
+  uint64 buffered_amount() const { return channel_->buffered_amount(); }
 
 
 protected:
@@ -92,7 +129,11 @@ public:
     MsgCreateChannel,
     MsgDeleteChannel,
     MsgChannelCreated,
-    MsgServerSideReady
+    MsgServerSideReady,
+    MsgDedupAck,
+    MsgClockProbe,
+    MsgClockReply,
+    MsgDedupResend
   };
 
   class ControlMessage;
@@ -100,10 +141,15 @@ public:
               : HotlineDataChannel(channel, is_local){is_control_channel_ = true;}
   virtual ~HotlineControlDataChannel() {}
 
-  bool CreateChannel(std::string& remote_address, cricket::ProtocolType protocol);
+  bool CreateChannel(std::string& remote_address, cricket::ProtocolType protocol,
+                     const LaneSettings& settings);
   bool DeleteRemoteChannel(std::string& channel_name);
-  bool ChannelCreated();
+  bool ChannelCreated(const LaneSettings& settings);
   bool ServerSideReady(std::string& channel_name);
+  bool DedupAck(const std::map<int, uint64_t>& decoded, const std::vector<int>& closed);
+  bool DedupResend(int lane, uint64 record);
+  bool ClockProbe(uint64 sent);
+  bool ClockReply(uint64 sent, uint64 remote);
 
 protected:
   virtual void OnStateChange();
@@ -114,6 +160,10 @@ private:
   void OnDeleteRemoteChannel(Json::Value& json_data);
   void OnChannelCreated(Json::Value& json_data);
   void OnServerSideReady(Json::Value& json_data);
+  void OnDedupAck(Json::Value& json_data);
+  void OnDedupResend(Json::Value& json_data);
+  void OnClockProbe(Json::Value& json_data);
+  void OnClockReply(Json::Value& json_data);
 
 };
 
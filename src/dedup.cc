@@ -0,0 +1,458 @@
+#include "htn_config.h"
+
+#include <string.h>
+#include <algorithm>
+
+#include "webrtc/base/common.h"
+#include "webrtc/base/messagedigest.h"
+#include "dedup.h"
+
+
+namespace hotline {
+
+enum {
+  kRecordLiteral = 0,
+  kRecordChunk = 1,
+  kRecordRef = 2,
+  kRecordResend = 3
+};
+
+static const size_t kMinChunkSize = 2 * 1024;
+static const size_t kMaxChunkSize = 64 * 1024;
+// A boundary when the low 13 bits of the rolling hash are zero: ~8KB chunks.
+static const uint32_t kBoundaryMask = (1 << 13) - 1;
+
+static const size_t kRefHashSize = 8;
+static const uint64_t kNoRecord = ~0ULL;
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Helpers
+///////////////////////////////////////////////////////////////////////////////
+
+// Gear table: one fixed pseudo-random value per byte value.
+static const uint32_t* GearTable() {
+  static uint32_t table[256];
+  static bool initialized = false;
+  if (!initialized) {
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+    for (int i = 0; i < 256; ++i) {
+      state ^= state << 13;
+      state ^= state >> 7;
+      state ^= state << 17;
+      table[i] = static_cast<uint32_t>(state >> 16);
+    }
+    initialized = true;
+  }
+  return table;
+}
+
+static std::string ChunkHash(const char* data, size_t len) {
+  char digest[DedupSendCache::kHashSize];
+  rtc::ComputeDigest(rtc::DIGEST_SHA_1, data, len, digest, sizeof(digest));
+  return std::string(digest, sizeof(digest));
+}
+
+static void WriteVarint(uint64_t value, std::vector<char>* out) {
+  while (value >= 0x80) {
+    out->push_back(static_cast<char>((value & 0x7F) | 0x80));
+    value >>= 7;
+  }
+  out->push_back(static_cast<char>(value));
+}
+
+static bool ReadVarint(const char** data, const char* end, uint64_t* value) {
+  *value = 0;
+  for (int shift = 0; shift < 64 && *data < end; shift += 7) {
+    uint8_t byte = static_cast<uint8_t>(*(*data)++);
+    *value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+    if (!(byte & 0x80)) return true;
+  }
+  return false;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// DedupSendCache
+///////////////////////////////////////////////////////////////////////////////
+
+DedupSendCache::DedupSendCache(size_t ring_size)
+  : ring_size_(std::max(ring_size, kMaxChunkSize))
+  , next_seq_(0)
+  , unacknowledged_(0)
+  , hits_(0)
+  , misses_(0)
+  , bytes_saved_(0) {
+}
+
+void DedupSendCache::OpenLane(int lane_id) {
+  lanes_[lane_id] = Lane();
+}
+
+void DedupSendCache::CloseLane(int lane_id) {
+  LaneMap::iterator it = lanes_.find(lane_id);
+  if (it == lanes_.end()) return;
+
+  // Its records stay until the receiver acknowledges them or closes the
+  // lane too; a failed reference may still ask for its chunk.
+  Lane& lane = it->second;
+  ReleaseInFlight(&lane);
+  lane.closed = true;
+  if (lane.closed_by_receiver || lane.records.empty()) lanes_.erase(it);
+}
+
+const DedupSendCache::Chunk* DedupSendCache::Lookup(const std::string& hash, int lane_id) {
+  ChunkMap::iterator it = chunks_.find(hash);
+  if (it == chunks_.end()) return NULL;
+
+  const Chunk& chunk = it->second;
+  if (chunk.lane_id != lane_id && !chunk.acknowledged) return NULL;
+
+  // Other lanes may deliver chunks assigned before the reference, or as
+  // many again as are still unacknowledged after it, ahead of it. None of
+  // them should wrap around onto the chunk by then.
+  if (chunk.seq + ring_size_ < next_seq_ + unacknowledged_) return NULL;
+  return &chunk;
+}
+
+uint64_t DedupSendCache::Insert(const std::string& hash, uint32_t len, int lane_id,
+                                uint64_t record) {
+  Chunk chunk = { next_seq_, len, lane_id, false };
+  next_seq_ += len;
+
+  chunks_[hash] = chunk;
+  order_.push_back(std::make_pair(chunk.seq, hash));
+  Expire();
+
+  // Nothing is acknowledged on a lane the receiver has closed.
+  LaneMap::iterator it = lanes_.find(lane_id);
+  if (it != lanes_.end() && !it->second.closed_by_receiver) {
+    Record entry = { record, chunk.seq, len, hash, std::string() };
+    it->second.records.push_back(entry);
+    if (!it->second.closed) {
+      it->second.in_flight += len;
+      unacknowledged_ += len;
+    }
+  }
+
+  return chunk.seq;
+}
+
+void DedupSendCache::Retain(int lane_id, uint64_t record, const char* data, size_t len) {
+  LaneMap::iterator it = lanes_.find(lane_id);
+  if (it == lanes_.end() || it->second.closed_by_receiver) return;
+
+  Record entry = { record, 0, static_cast<uint32_t>(len), std::string(), std::string(data, len) };
+  it->second.records.push_back(entry);
+}
+
+const std::string* DedupSendCache::Retained(int lane_id, uint64_t record) const {
+  LaneMap::const_iterator it = lanes_.find(lane_id);
+  if (it == lanes_.end()) return NULL;
+
+  const std::deque<Record>& records = it->second.records;
+  for (size_t i = 0; i < records.size(); ++i) {
+    if (records[i].index == record) {
+      return records[i].hash.empty() ? &records[i].data : NULL;
+    }
+  }
+  return NULL;
+}
+
+void DedupSendCache::Acknowledge(int lane_id, uint64_t record) {
+  LaneMap::iterator it = lanes_.find(lane_id);
+  if (it == lanes_.end()) return;
+
+  Lane& lane = it->second;
+  while (!lane.records.empty() && lane.records.front().index < record) {
+    const Record& entry = lane.records.front();
+    if (!entry.hash.empty()) {
+      ChunkMap::iterator chunk = chunks_.find(entry.hash);
+      if (chunk != chunks_.end() && chunk->second.seq == entry.seq) {
+        chunk->second.acknowledged = true;
+      }
+      if (!lane.closed) {
+        lane.in_flight -= entry.len;
+        unacknowledged_ -= entry.len;
+      }
+    }
+    lane.records.pop_front();
+  }
+
+  if (lane.closed && lane.records.empty()) lanes_.erase(it);
+}
+
+void DedupSendCache::LaneClosedByReceiver(int lane_id) {
+  LaneMap::iterator it = lanes_.find(lane_id);
+  if (it == lanes_.end()) return;
+
+  Lane& lane = it->second;
+  ReleaseInFlight(&lane);
+  lane.records.clear();
+  lane.closed_by_receiver = true;
+  if (lane.closed) lanes_.erase(it);
+}
+
+void DedupSendCache::ReleaseInFlight(Lane* lane) {
+  unacknowledged_ -= lane->in_flight;
+  lane->in_flight = 0;
+}
+
+void DedupSendCache::Expire() {
+  // A chunk is valid as long as nothing assigned after it reached past
+  // its own start plus the ring size.
+  while (!order_.empty() && order_.front().first + ring_size_ < next_seq_) {
+    ChunkMap::iterator it = chunks_.find(order_.front().second);
+    if (it != chunks_.end() && it->second.seq == order_.front().first) {
+      chunks_.erase(it);
+    }
+    order_.pop_front();
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// DedupReceiveCache
+///////////////////////////////////////////////////////////////////////////////
+
+DedupReceiveCache::DedupReceiveCache(size_t ring_size)
+  : ring_size_(std::max(ring_size, kMaxChunkSize))
+  , ring_(ring_size_) {
+}
+
+void DedupReceiveCache::Store(uint64_t seq, const char* data, size_t len) {
+  size_t pos = static_cast<size_t>(seq % ring_size_);
+  size_t first = std::min(len, ring_size_ - pos);
+  memcpy(&ring_[pos], data, first);
+  if (first < len) memcpy(&ring_[0], data + first, len - first);
+}
+
+bool DedupReceiveCache::Fetch(uint64_t seq, size_t len, std::vector<char>* out) const {
+  if (len > ring_size_) return false;
+
+  size_t pos = static_cast<size_t>(seq % ring_size_);
+  size_t first = std::min(len, ring_size_ - pos);
+  out->insert(out->end(), ring_.begin() + pos, ring_.begin() + pos + first);
+  out->insert(out->end(), ring_.begin(), ring_.begin() + (len - first));
+  return true;
+}
+
+void DedupReceiveCache::OpenLane(int lane_id) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  lanes_.insert(lane_id);
+}
+
+void DedupReceiveCache::CloseLane(int lane_id) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!lanes_.erase(lane_id)) return;
+    decoded_.erase(lane_id);
+    closed_.push_back(lane_id);
+  }
+  SignalAcksPending(this);
+}
+
+void DedupReceiveCache::Decoded(int lane_id, uint64_t record) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!lanes_.count(lane_id)) return;
+    decoded_[lane_id] = record;
+  }
+  SignalAcksPending(this);
+}
+
+void DedupReceiveCache::RequestResend(int lane_id, uint64_t record) {
+  SignalResendNeeded(this, lane_id, record);
+}
+
+void DedupReceiveCache::TakeAcks(std::map<int, uint64_t>* decoded, std::vector<int>* closed) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  decoded->swap(decoded_);
+  closed->swap(closed_);
+  decoded_.clear();
+  closed_.clear();
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// DedupEncoder
+///////////////////////////////////////////////////////////////////////////////
+
+DedupEncoder::DedupEncoder(DedupSendCache* cache, int lane_id)
+  : cache_(cache)
+  , lane_id_(lane_id)
+  , record_(0)
+  , hash_(0)
+  , chunk_sent_(0) {
+  cache_->OpenLane(lane_id_);
+}
+
+void DedupEncoder::Encode(const char* data, size_t len, std::vector<char>* out) {
+  const uint32_t* gear = GearTable();
+  size_t pos = 0;
+
+  while (pos < len) {
+    size_t start = pos;
+    size_t size = chunk_.size();
+    bool boundary = false;
+
+    while (pos < len) {
+      hash_ = (hash_ << 1) + gear[static_cast<uint8_t>(data[pos++])];
+      if (++size < kMinChunkSize) continue;
+      if ((hash_ & kBoundaryMask) == 0 || size >= kMaxChunkSize) {
+        boundary = true;
+        break;
+      }
+    }
+
+    chunk_.insert(chunk_.end(), data + start, data + pos);
+    if (boundary) EndChunk(out);
+  }
+}
+
+void DedupEncoder::Flush(std::vector<char>* out) {
+  if (chunk_sent_ == chunk_.size()) return;
+
+  out->push_back(kRecordLiteral);
+  WriteVarint(chunk_.size() - chunk_sent_, out);
+  out->insert(out->end(), chunk_.begin() + chunk_sent_, chunk_.end());
+  chunk_sent_ = chunk_.size();
+}
+
+bool DedupEncoder::Resend(uint64_t record, std::vector<char>* out) {
+  const std::string* data = cache_->Retained(lane_id_, record);
+  if (!data) return false;
+
+  out->push_back(kRecordResend);
+  WriteVarint(record, out);
+  WriteVarint(data->size(), out);
+  out->insert(out->end(), data->begin(), data->end());
+  return true;
+}
+
+void DedupEncoder::EndChunk(std::vector<char>* out) {
+  std::string hash = ChunkHash(&chunk_[0], chunk_.size());
+
+  // Part of the chunk may already be out as literals; then the receiver
+  // has it anyway and only a new chunk record makes sense.
+  const DedupSendCache::Chunk* cached =
+      chunk_sent_ == 0 ? cache_->Lookup(hash, lane_id_) : NULL;
+
+  if (cached && cached->len == chunk_.size()) {
+    out->push_back(kRecordRef);
+    WriteVarint(cached->seq, out);
+    WriteVarint(cached->len, out);
+    out->insert(out->end(), hash.begin(), hash.begin() + kRefHashSize);
+    cache_->Retain(lane_id_, record_, &chunk_[0], chunk_.size());
+    cache_->CountHit(chunk_.size());
+  }
+  else {
+    uint64_t seq = cache_->Insert(hash, static_cast<uint32_t>(chunk_.size()), lane_id_,
+                                  record_);
+    out->push_back(kRecordChunk);
+    WriteVarint(seq, out);
+    WriteVarint(chunk_.size() - chunk_sent_, out);
+    out->insert(out->end(), chunk_.begin() + chunk_sent_, chunk_.end());
+    cache_->CountMiss();
+  }
+
+  record_++;
+  chunk_.clear();
+  chunk_sent_ = 0;
+  hash_ = 0;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// DedupDecoder
+///////////////////////////////////////////////////////////////////////////////
+
+DedupDecoder::DedupDecoder(DedupReceiveCache* cache, int lane_id)
+  : cache_(cache)
+  , lane_id_(lane_id)
+  , record_(0)
+  , acknowledged_(0) {
+  cache_->OpenLane(lane_id_);
+}
+
+bool DedupDecoder::Decode(const char* data, size_t len, std::vector<char>* out) {
+  const char* end = data + len;
+  out->clear();
+
+  // Data goes out until a reference fails, and behind it from then on.
+  std::vector<char>* sink = held_.empty() ? out : &held_.back().data;
+
+  while (data < end) {
+    uint8_t type = static_cast<uint8_t>(*data++);
+    uint64_t seq = 0;
+    uint64_t size;
+
+    if (type == kRecordChunk || type == kRecordRef || type == kRecordResend) {
+      if (!ReadVarint(&data, end, &seq)) return false;
+    }
+    if (!ReadVarint(&data, end, &size)) return false;
+
+    if (type == kRecordRef) {
+      if (!chunk_.empty() || (size_t)(end - data) < kRefHashSize) return false;
+
+      size_t start = sink->size();
+      if (!cache_->Fetch(seq, static_cast<size_t>(size), sink)) return false;
+
+      std::string hash = ChunkHash(&(*sink)[start], sink->size() - start);
+      if (memcmp(hash.data(), data, kRefHashSize) != 0) {
+        // Overwritten before the reference came; the sender still has it.
+        sink->resize(start);
+        Held held;
+        held.record = record_;
+        held_.push_back(held);
+        sink = &held_.back().data;
+        cache_->RequestResend(lane_id_, record_);
+      }
+      record_++;
+      data += kRefHashSize;
+      continue;
+    }
+
+    if (type != kRecordLiteral && type != kRecordChunk && type != kRecordResend) return false;
+    if (size > (uint64_t)(end - data)) return false;
+
+    if (type == kRecordResend) {
+      for (size_t i = 0; i < held_.size(); ++i) {
+        if (held_[i].record != seq) continue;
+        held_[i].data.insert(held_[i].data.begin(), data, data + size);
+        held_[i].record = kNoRecord;
+        break;
+      }
+      data += size;
+      continue;
+    }
+
+    sink->insert(sink->end(), data, data + size);
+    chunk_.insert(chunk_.end(), data, data + size);
+    data += size;
+
+    if (type == kRecordChunk) {
+      if (chunk_.size() > kMaxChunkSize) return false;
+      cache_->Store(seq, &chunk_[0], chunk_.size());
+      chunk_.clear();
+      record_++;
+    }
+  }
+
+  while (!held_.empty() && held_.front().record == kNoRecord) {
+    out->insert(out->end(), held_.front().data.begin(), held_.front().data.end());
+    held_.pop_front();
+  }
+
+  // The sender keeps a failed reference until it is acknowledged.
+  uint64_t decoded = held_.empty() ? record_ : held_.front().record;
+  if (decoded != acknowledged_) {
+    acknowledged_ = decoded;
+    cache_->Decoded(lane_id_, decoded);
+  }
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+} // namespace hotline
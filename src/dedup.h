@@ -0,0 +1,238 @@
+#ifndef HOTLINE_TUNNEL_DEDUP_H_
+#define HOTLINE_TUNNEL_DEDUP_H_
+#pragma once
+
+#include "htn_config.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <deque>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "webrtc/base/sigslot.h"
+
+
+namespace hotline {
+
+//////////////////////////////////////////////////////////////////////
+// Chunk deduplication for TCP lanes.
+//
+// The sending side cuts the byte stream of every lane into content-defined
+// chunks (gear rolling hash, 2-64KB, about 8KB on average) and sends each
+// new chunk once. A chunk seen before is sent as a reference instead.
+//
+// Every new chunk is given the next range of a byte sequence shared by all
+// lanes of a conductor. The receiving side keeps the chunks in a ring of
+// ring_size bytes at their sequence position modulo ring_size, so both
+// ends agree on what is still cached without extra messages: a chunk is
+// valid while no chunk assigned after it has wrapped around onto it.
+//
+// Lanes deliver independently of each other, so a chunk is only
+// referenced on the lane that carried it, or on any lane once the
+// receiver has acknowledged it. The receiver acknowledges every lane on
+// its own, by the count of its chunk and reference records decoded, and
+// reports the lanes it closed; a lane that closes with chunks in flight
+// holds back nothing on the others. Lanes are identified by their channel
+// label, which both ends know.
+//
+// Nor is a chunk referenced once the chunks other lanes may deliver ahead
+// of the reference could reach its slot. That is an estimate, so the
+// sender keeps the data of every reference until the lane acknowledges
+// it. A reference that fails its hash check anyway holds back the lane's
+// data behind it until the chunk is sent again in full.
+//
+// Records, all integers LEB128:
+//   kRecordLiteral   len, bytes          part of a chunk still being cut
+//   kRecordChunk     seq, len, bytes     the rest of a new chunk
+//   kRecordRef       seq, len, hash[8]   a cached chunk
+//   kRecordResend    record, len, bytes  the chunk of a failed reference
+//
+
+// Used only on the thread the lanes encode on.
+class DedupSendCache {
+public:
+  enum { kHashSize = 20 };
+
+  struct Chunk {
+    uint64_t seq;
+    uint32_t len;
+    int lane_id;
+    bool acknowledged;
+  };
+
+  explicit DedupSendCache(size_t ring_size);
+
+  size_t ring_size() const { return ring_size_; }
+
+  void OpenLane(int lane_id);
+  // No more data goes out on the lane; what it has in flight no longer
+  // holds back references on the other lanes.
+  void CloseLane(int lane_id);
+
+  // Returns the cached chunk with this hash if lane_id may reference it.
+  const Chunk* Lookup(const std::string& hash, int lane_id);
+  // Assigns a new chunk, the lane's record-th chunk or reference, its
+  // sequence position.
+  uint64_t Insert(const std::string& hash, uint32_t len, int lane_id, uint64_t record);
+  // Keeps the data of the lane's record-th record, a reference, until
+  // the receiver acknowledges it.
+  void Retain(int lane_id, uint64_t record, const char* data, size_t len);
+  // The data of a reference not yet acknowledged, or NULL.
+  const std::string* Retained(int lane_id, uint64_t record) const;
+
+  // The receiver has decoded the lane's records before record.
+  void Acknowledge(int lane_id, uint64_t record);
+  // The receiver closed the lane and acknowledges nothing more on it.
+  void LaneClosedByReceiver(int lane_id);
+
+  void CountHit(size_t len) { hits_++; bytes_saved_ += len; }
+  void CountMiss() { misses_++; }
+  uint64_t hits() const { return hits_; }
+  uint64_t misses() const { return misses_; }
+  uint64_t bytes_saved() const { return bytes_saved_; }
+
+private:
+  typedef std::map<std::string, Chunk> ChunkMap;
+
+  // A chunk or reference the receiver hasn't acknowledged yet.
+  struct Record {
+    uint64_t index;
+    uint64_t seq;
+    uint32_t len;
+    std::string hash;   // of a chunk
+    std::string data;   // of a reference
+  };
+
+  struct Lane {
+    Lane() : in_flight(0), closed(false), closed_by_receiver(false) {}
+
+    std::deque<Record> records;
+    // Bytes of its unacknowledged chunks while the lane is open.
+    uint64_t in_flight;
+    bool closed;
+    bool closed_by_receiver;
+  };
+  typedef std::map<int, Lane> LaneMap;
+
+  void Expire();
+  void ReleaseInFlight(Lane* lane);
+
+  size_t ring_size_;
+  uint64_t next_seq_;
+  // Bytes of unacknowledged chunks on open lanes.
+  uint64_t unacknowledged_;
+  ChunkMap chunks_;
+  LaneMap lanes_;
+  // Hashes in sequence order, to expire what the ring has overwritten.
+  std::deque<std::pair<uint64_t, std::string> > order_;
+
+  uint64_t hits_;
+  uint64_t misses_;
+  uint64_t bytes_saved_;
+};
+
+
+// The ring and the decoders are used from the thread that delivers lane
+// data; the acknowledgements are taken on another, hence the mutex.
+class DedupReceiveCache {
+public:
+  explicit DedupReceiveCache(size_t ring_size);
+
+  size_t ring_size() const { return ring_size_; }
+
+  void Store(uint64_t seq, const char* data, size_t len);
+  // Copies a cached chunk to the end of *out.
+  bool Fetch(uint64_t seq, size_t len, std::vector<char>* out) const;
+
+  void OpenLane(int lane_id);
+  void CloseLane(int lane_id);
+  // The lane's records before record have been decoded.
+  void Decoded(int lane_id, uint64_t record);
+  // The lane's record-th record, a reference, failed its hash check.
+  void RequestResend(int lane_id, uint64_t record);
+
+  // Moves the acknowledgements since the last call to *decoded, lane ->
+  // records decoded, and *closed.
+  void TakeAcks(std::map<int, uint64_t>* decoded, std::vector<int>* closed);
+
+  // Signalled when there are acknowledgements to take.
+  sigslot::signal1<DedupReceiveCache*> SignalAcksPending;
+  // Signalled with the lane and record of a failed reference.
+  sigslot::signal3<DedupReceiveCache*, int, uint64_t> SignalResendNeeded;
+
+private:
+  void AcksChanged();
+
+  size_t ring_size_;
+  std::vector<char> ring_;
+
+  std::mutex mutex_;
+  std::set<int> lanes_;
+  std::map<int, uint64_t> decoded_;
+  std::vector<int> closed_;
+};
+
+
+class DedupEncoder {
+public:
+  DedupEncoder(DedupSendCache* cache, int lane_id);
+
+  // Appends the records for data to *out. The tail of data that does not
+  // complete a chunk is held back until more data or Flush().
+  void Encode(const char* data, size_t len, std::vector<char>* out);
+  // Appends the held back data to *out.
+  void Flush(std::vector<char>* out);
+  // Appends the chunk of the failed reference record to *out. False if
+  // the reference is no longer kept.
+  bool Resend(uint64_t record, std::vector<char>* out);
+
+private:
+  void EndChunk(std::vector<char>* out);
+
+  DedupSendCache* cache_;
+  int lane_id_;
+  // Chunk and reference records sent.
+  uint64_t record_;
+  uint32_t hash_;
+  // The chunk being cut and how much of it already went out as literals.
+  std::vector<char> chunk_;
+  size_t chunk_sent_;
+};
+
+
+class DedupDecoder {
+public:
+  DedupDecoder(DedupReceiveCache* cache, int lane_id);
+
+  // Replaces *out with the data of a message of records that is ready to
+  // deliver; what follows a failed reference waits for its chunk. Returns
+  // false on malformed records.
+  bool Decode(const char* data, size_t len, std::vector<char>* out);
+
+private:
+  // The data behind a failed reference, until its chunk comes.
+  struct Held {
+    uint64_t record;   // kNoRecord once the chunk is in front of data
+    std::vector<char> data;
+  };
+
+  DedupReceiveCache* cache_;
+  int lane_id_;
+  // Chunk and reference records decoded, and as acknowledged.
+  uint64_t record_;
+  uint64_t acknowledged_;
+  // Literals of the chunk being received.
+  std::vector<char> chunk_;
+  std::deque<Held> held_;
+};
+
+//////////////////////////////////////////////////////////////////////
+
+} // namespace hotline
+
+#endif  // HOTLINE_TUNNEL_DEDUP_H_
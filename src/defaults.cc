@@ -35,3 +35,12 @@ std::string GetPeerConnectionString() {
 std::string GetSignalServerName() {
   return GetEnvVarOrDefault("HOTLINE_SIGNAL_SERVER", "ws://signal.hyperpair.com");
 }
+
+std::string GetSignalCacheFile() {
+#ifdef WIN32
+  std::string path = GetEnvVarOrDefault("LOCALAPPDATA", ".") + "\\htunnel_signal_cache";
+#else
+  std::string path = GetEnvVarOrDefault("HOME", ".") + "/.htunnel_signal_cache";
+#endif
+  return GetEnvVarOrDefault("HOTLINE_SIGNAL_CACHE", path.c_str());
+}
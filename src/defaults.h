@@ -15,5 +15,6 @@ std::string GetEnvVarOrDefault(const char* env_var_name,
                                const char* default_value);
 std::string GetPeerConnectionString();
 std::string GetSignalServerName();
+std::string GetSignalCacheFile();
 
 #endif  // HOTLINE_TUNNEL_DEFAULTS_H_
@@ -0,0 +1,214 @@
+#include "htn_config.h"
+
+#include <string.h>
+#include <algorithm>
+
+#include "fec.h"
+
+
+namespace hotline {
+
+static const uint8_t kFrameData = 0xF0;
+static const uint8_t kFrameParity = 0xF1;
+
+static void WriteHeader(char* header, uint8_t type, int group_size,
+                        uint32_t group, int index) {
+  header[0] = static_cast<char>(type);
+  header[1] = static_cast<char>(group_size);
+  header[2] = static_cast<char>(group >> 24);
+  header[3] = static_cast<char>(group >> 16);
+  header[4] = static_cast<char>(group >> 8);
+  header[5] = static_cast<char>(group);
+  header[6] = static_cast<char>(index);
+  header[7] = 0;
+}
+
+static void XorInto(char* dst, const char* src, size_t len) {
+  for (size_t i = 0; i < len; ++i) dst[i] ^= src[i];
+}
+
+static int BitCount(uint64_t bits) {
+  int count = 0;
+  for (; bits; bits &= bits - 1) count++;
+  return count;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// FecEncoder
+///////////////////////////////////////////////////////////////////////////////
+
+FecEncoder::FecEncoder(int group_size)
+  : group_size_(std::min(std::max(group_size, (int)kMinGroupSize), (int)kMaxGroupSize))
+  , group_(0)
+  , index_(0)
+  , length_parity_(0)
+  , parity_len_(0) {
+}
+
+bool FecEncoder::Encode(const char* data, size_t len,
+                        std::vector<char>* data_frame,
+                        std::vector<char>* parity_frame) {
+  data_frame->resize(kHeaderSize + len);
+  WriteHeader(&(*data_frame)[0], kFrameData, group_size_, group_, index_);
+  if (len > 0) memcpy(&(*data_frame)[kHeaderSize], data, len);
+
+  if (parity_.size() < len) parity_.resize(len, 0);
+  XorInto(parity_.empty() ? NULL : &parity_[0], data, len);
+  parity_len_ = std::max(parity_len_, len);
+  length_parity_ ^= static_cast<uint16_t>(len);
+
+  if (++index_ < group_size_) return false;
+
+  parity_frame->resize(kParityHeaderSize + parity_len_);
+  WriteHeader(&(*parity_frame)[0], kFrameParity, group_size_, group_, group_size_);
+  (*parity_frame)[8] = static_cast<char>(length_parity_ >> 8);
+  (*parity_frame)[9] = static_cast<char>(length_parity_);
+  if (parity_len_ > 0) {
+    memcpy(&(*parity_frame)[kParityHeaderSize], &parity_[0], parity_len_);
+  }
+
+  group_++;
+  index_ = 0;
+  length_parity_ = 0;
+  std::fill(parity_.begin(), parity_.begin() + parity_len_, 0);
+  parity_len_ = 0;
+  return true;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// FecDecoder
+///////////////////////////////////////////////////////////////////////////////
+
+FecDecoder::FecDecoder(int group_size)
+  : group_size_(std::min(std::max(group_size, (int)FecEncoder::kMinGroupSize),
+                         (int)FecEncoder::kMaxGroupSize))
+  , newest_(0)
+  , has_newest_(false)
+  , recovered_(0)
+  , lost_(0) {
+}
+
+bool FecDecoder::Decode(const char* frame, size_t len) {
+  ready_.clear();
+
+  if (len < FecEncoder::kHeaderSize) return false;
+
+  const uint8_t* header = reinterpret_cast<const uint8_t*>(frame);
+  uint8_t type = header[0];
+  int group_size = header[1];
+  uint32_t group_id = (uint32_t)header[2] << 24 | (uint32_t)header[3] << 16 |
+                      (uint32_t)header[4] << 8 | (uint32_t)header[5];
+  int index = header[6];
+
+  if (group_size != group_size_) return false;
+  if (type == kFrameData && index >= group_size_) return false;
+  if (type == kFrameParity && (index != group_size_ ||
+                               len < FecEncoder::kParityHeaderSize)) return false;
+  if (type != kFrameData && type != kFrameParity) return false;
+
+  if (has_newest_) {
+    // An expired group was already counted lost and forgotten; a straggler
+    // must not bring it back.
+    if ((int32_t)(newest_ - group_id) > (int32_t)kMaxPendingGroups) return true;
+    if ((int32_t)(group_id - newest_) > 0) {
+      newest_ = group_id;
+      Expire(newest_);
+    }
+  }
+  else {
+    newest_ = group_id;
+    has_newest_ = true;
+  }
+
+  Group& group = groups_[group_id];
+  if (group.data.empty() && !group.done) group.data.resize(group_size_);
+
+  if (type == kFrameData) {
+    const char* payload = frame + FecEncoder::kHeaderSize;
+    size_t payload_len = len - FecEncoder::kHeaderSize;
+
+    // Unordered lanes may deliver a datagram after it was rebuilt, and
+    // retransmits may deliver one twice.
+    uint64_t bit = (uint64_t)1 << index;
+    if (index == group.recovered_index || (group.received & bit)) return true;
+
+    Datagram datagram = { payload, payload_len };
+    ready_.push_back(datagram);
+
+    group.received |= bit;
+    if (group.done) return true;
+    group.data[index].assign(payload, payload + payload_len);
+  }
+  else {
+    if (group.has_parity) return true;
+    group.has_parity = true;
+    group.length_parity = (uint16_t)(header[8] << 8 | header[9]);
+    group.parity.assign(frame + FecEncoder::kParityHeaderSize, frame + len);
+  }
+
+  TryRecover(&group);
+  return true;
+}
+
+void FecDecoder::TryRecover(Group* group) {
+  if (group->done) return;
+
+  int received = BitCount(group->received);
+  if (received == group_size_) {
+    // Nothing lost; the copies are no longer needed.
+    group->done = true;
+    group->data.clear();
+    group->parity.clear();
+    return;
+  }
+
+  if (!group->has_parity || received != group_size_ - 1) return;
+
+  int missing = 0;
+  while (group->received & ((uint64_t)1 << missing)) missing++;
+
+  uint16_t length = group->length_parity;
+  recovered_data_ = group->parity;
+  for (int i = 0; i < group_size_; ++i) {
+    if (i == missing) continue;
+    const std::vector<char>& data = group->data[i];
+    length ^= static_cast<uint16_t>(data.size());
+    if (!data.empty()) XorInto(&recovered_data_[0], &data[0],
+                               std::min(data.size(), recovered_data_.size()));
+  }
+
+  group->done = true;
+  group->recovered_index = missing;
+  group->data.clear();
+  group->parity.clear();
+
+  if (length > recovered_data_.size()) {
+    lost_++;  // Inconsistent group, can't trust the result.
+    return;
+  }
+
+  recovered_data_.resize(length);
+  Datagram datagram = { recovered_data_.empty() ? "" : &recovered_data_[0],
+                        recovered_data_.size() };
+  ready_.push_back(datagram);
+  recovered_++;
+}
+
+void FecDecoder::Expire(uint32_t newest) {
+  for (GroupMap::iterator it = groups_.begin(); it != groups_.end();) {
+    if ((int32_t)(newest - it->first) <= (int32_t)kMaxPendingGroups) {
+      ++it;
+      continue;
+    }
+
+    Group& group = it->second;
+    if (!group.done) lost_ += group_size_ - BitCount(group.received);
+    groups_.erase(it++);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+} // namespace hotline
@@ -0,0 +1,112 @@
+#ifndef HOTLINE_TUNNEL_FEC_H_
+#define HOTLINE_TUNNEL_FEC_H_
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <map>
+#include <vector>
+
+
+namespace hotline {
+
+//////////////////////////////////////////////////////////////////////
+// Forward error correction for UDP lanes.
+//
+// Datagrams are framed in groups of N. After the N-th data frame of a group
+// the encoder emits one parity frame, the XOR of the group's datagrams
+// (padded to the longest) and of their lengths. The decoder passes data
+// frames through immediately and rebuilds a single lost datagram per group
+// once the parity frame and the other N-1 frames have arrived, so the
+// overhead is 1/N and recovery costs no extra round trip.
+//
+// Frame layout (big endian):
+//   [0]    kFrameData or kFrameParity
+//   [1]    group size N
+//   [2..5] group sequence number
+//   [6]    index within the group (data: 0..N-1, parity: N)
+//   [7]    reserved, 0
+//   parity frames: [8..9] XOR of the data lengths, then the XOR payload
+//   data frames:   the datagram
+//
+
+class FecEncoder {
+public:
+  enum { kHeaderSize = 8, kParityHeaderSize = 10 };
+  enum { kMinGroupSize = 2, kMaxGroupSize = 32 };
+
+  explicit FecEncoder(int group_size);
+
+  // Frames a datagram into data_frame. Returns true if the group is now
+  // complete and parity_frame holds its parity frame.
+  bool Encode(const char* data, size_t len,
+              std::vector<char>* data_frame,
+              std::vector<char>* parity_frame);
+
+  int group_size() const { return group_size_; }
+
+private:
+  int group_size_;
+  uint32_t group_;
+  int index_;
+  uint16_t length_parity_;
+  std::vector<char> parity_;
+  size_t parity_len_;
+};
+
+
+class FecDecoder {
+public:
+  struct Datagram {
+    const char* data;
+    size_t len;
+  };
+
+  // Groups older than this many groups behind the newest are given up;
+  // frames that arrive for them later are dropped.
+  enum { kMaxPendingGroups = 16 };
+
+  explicit FecDecoder(int group_size);
+
+  // Consumes one frame. The datagrams it yields, the frame's own and/or a
+  // recovered one, are in ready() until the next call. Returns false if
+  // the frame is malformed.
+  bool Decode(const char* frame, size_t len);
+  const std::vector<Datagram>& ready() const { return ready_; }
+
+  uint64_t recovered() const { return recovered_; }
+  uint64_t lost() const { return lost_; }
+
+private:
+  struct Group {
+    Group() : received(0), recovered_index(-1), has_parity(false), done(false),
+              length_parity(0) {}
+    uint64_t received;
+    int recovered_index;
+    bool has_parity;
+    bool done;
+    uint16_t length_parity;
+    std::vector<std::vector<char> > data;
+    std::vector<char> parity;
+  };
+  typedef std::map<uint32_t, Group> GroupMap;
+
+  void TryRecover(Group* group);
+  void Expire(uint32_t newest);
+
+  int group_size_;
+  GroupMap groups_;
+  uint32_t newest_;       // highest group id seen, once has_newest_
+  bool has_newest_;
+  std::vector<Datagram> ready_;
+  std::vector<char> recovered_data_;
+  uint64_t recovered_;
+  uint64_t lost_;
+};
+
+//////////////////////////////////////////////////////////////////////
+
+} // namespace hotline
+
+#endif  // HOTLINE_TUNNEL_FEC_H_
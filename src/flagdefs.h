@@ -16,6 +16,126 @@ DEFINE_bool(server, false, "server mode");
 DEFINE_string(p, "", "password");
 DEFINE_string(r, "", "Room id");
 DEFINE_bool(udp, false, "UDP mode");
+DEFINE_int(udp_max_retransmits, 0,
+           "UDP mode: retransmissions per datagram, -1 for no limit");
+DEFINE_int(udp_max_packet_lifetime, -1,
+           "UDP mode: milliseconds a datagram may be retransmitted, "
+           "-1 for no limit. Overrides udp_max_retransmits when set.");
+DEFINE_int(udp_idle_timeout, 60,
+           "UDP mode: seconds before an idle client session is closed");
+DEFINE_bool(udp_batch, true,
+            "UDP mode: batch datagram I/O with recvmmsg/sendmmsg");
+DEFINE_int(udp_fec_group, 0,
+           "UDP mode: add one XOR parity datagram per n datagrams (2-32) "
+           "to rebuild single losses, 0 for no FEC");
+DEFINE_int(compress, 0,
+           "TCP mode: compress lane data at zlib level n (1-9), 0 for none; "
+           "both peers must set it, the lower level is used");
+DEFINE_int(dedup, 0,
+           "TCP mode: deduplicate repeated data with an n MB chunk cache "
+           "on each peer, 0 for none; both peers must set it, the smaller "
+           "cache is used");
+DEFINE_int(ice_batch, 20,
+           "Milliseconds to collect local ICE candidates into one signaling "
+           "message once the peer's offer or answer says it takes batches, "
+           "0 to always send each alone");
+DEFINE_bool(speculative_offer, true,
+            "Client mode: create the offer while connecting to the signal "
+            "server and send it along with the sign in");
+DEFINE_int(signal_reconnect, 30000,
+           "Longest wait in milliseconds between tries to reconnect to the "
+           "signal server once signed in, 0 to give up on losing it");
+DEFINE_int(signal_ping, 15000,
+           "Milliseconds between keepalive pings to the signal server, "
+           "0 for none");
+DEFINE_int(signal_ping_timeout, 10000,
+           "Milliseconds to wait for a pong before the signal server "
+           "connection is taken for dead");
+DEFINE_bool(signal_cache, true,
+            "Remember the signal server's address between runs and connect "
+            "to it without a DNS lookup (ws:// only; file in "
+            "HOTLINE_SIGNAL_CACHE or ~/.htunnel_signal_cache)");
+DEFINE_bool(lan, false,
+            "Signal without the signal server: find the room's peer on the "
+            "LAN or this host by multicast and talk to it directly");
+DEFINE_int(lan_port, 8090, "-lan: UDP port rooms are looked for on");
+DEFINE_int(ws_fragment, 2048,
+           "Largest WebSocket fragment sent to the signal server, bytes");
+DEFINE_string(bench, "",
+              "Run both peers in this process and benchmark the tunnel: "
+              "echo (round trip latency), bulk (throughput), udp "
+              "(loss and jitter), churn (lane setup rate), sink and "
+              "source (throughput and fairness of -bench_lanes lanes), "
+              "replay (the lanes of a -capture file) or idle (CPU use of "
+              "an open, idle tunnel for -bench_time seconds)");
+DEFINE_int(bench_size, 1024, "Benchmark: bytes per message or datagram");
+DEFINE_string(bench_payload, "random",
+              "Benchmark data, and what bench:source sends: random "
+              "(incompressible), text (compresses well) or repeat (a "
+              "256KB block over and over, for -dedup)");
+DEFINE_int(bench_count, 10000,
+           "Benchmark: messages (echo), datagrams (udp) or connections (churn)");
+DEFINE_int(bench_mb, 100, "Benchmark: megabytes to send (bulk)");
+DEFINE_int(bench_rate, 10000, "Benchmark: datagrams per second (udp)");
+DEFINE_int(bench_concurrency, 64, "Benchmark: connections open at once (churn)");
+DEFINE_int(bench_timeout, 60, "Benchmark: seconds before giving up");
+DEFINE_int(bench_lanes, 1,
+           "Benchmark against bench:sink, bench:source or bench:echo on the "
+           "remote peer: parallel lanes, 0 to only open the tunnel");
+DEFINE_int(bench_time, 10, "Benchmark against a remote bench endpoint: seconds");
+DEFINE_int(bench_signal, 0,
+           "Benchmark: signal through a stand-in signal server on this local "
+           "port instead of in-process, 0 for in-process");
+DEFINE_int(bench_signal_lan, 0,
+           "Benchmark: signal with -lan discovery on this local port "
+           "instead of in-process");
+DEFINE_int(bench_signal_outage, 0,
+           "Benchmark with -bench_signal: stop the signal server once the "
+           "tunnel is up and start it again after this many milliseconds");
+DEFINE_bool(bench_signal_forget, false,
+            "Benchmark with -bench_signal_outage: the restarted signal "
+            "server has lost its rooms");
+DEFINE_int(bench_signal_stall, 0,
+           "Benchmark with -bench_signal: stall the signal server once the "
+           "tunnel is up, for this many milliseconds");
+DEFINE_int(signal_server, 0,
+           "Run a stand-in signal server on this port instead of a peer, "
+           "for testing without a network");
+DEFINE_int(signal_delay, 0,
+           "Stand-in signal server: milliseconds to hold back every message");
+DEFINE_int(signal_jitter, 0,
+           "Stand-in signal server: random +/- milliseconds added to the delay");
+DEFINE_int(net_delay, 0,
+           "Benchmark: run the PeerConnections over a virtual network with "
+           "this one-way delay in milliseconds");
+DEFINE_int(net_jitter, 0,
+           "Benchmark: virtual network delay standard deviation, milliseconds");
+DEFINE_float(net_loss, 0, "Benchmark: virtual network packet loss, percent");
+DEFINE_int(net_rate, 0,
+           "Benchmark: virtual network rate per peer in kbit/s, 0 for no limit");
+DEFINE_string(bench_replay, "", "Benchmark: capture file to replay (replay)");
+DEFINE_string(capture, "",
+              "Record lane opens, closes, reads and writes (sizes and times, "
+              "no data) to this file, for -bench replay");
+DEFINE_int(capture_records, 1048576,
+           "Capture: records kept, 24 bytes each; older ones are overwritten");
+DEFINE_bool(transit, false,
+            "Stamp lane data with its read time and keep histograms of its "
+            "transit through the tunnel, from one peer's read to the other's "
+            "write (with -bench, in the result)");
+DEFINE_int(transit_report, 0,
+           "Transit: print the histograms as JSON every n seconds, 0 for never");
+DEFINE_string(metrics, "",
+              "Serve lane, tunnel and peer counters in the Prometheus text "
+              "format over HTTP on this port or address (e.g. 9100 or "
+              "127.0.0.1:9100)");
+DEFINE_string(trace, "",
+              "Trace the phases of connection and lane setup and write them "
+              "to this file at exit, as Chrome trace JSON (also served at "
+              "/trace with -metrics)");
+DEFINE_int(trace_events, 16384, "Trace: events kept; older ones are overwritten");
+DEFINE_string(bench_out, "", "Benchmark: write the JSON result to this file "
+              "instead of stdout");
 
 
 #endif  // HOTLINE_TUNNEL_FLAGDEFS_H_
@@ -0,0 +1,106 @@
+#ifndef HOTLINE_TUNNEL_HISTOGRAM_H_
+#define HOTLINE_TUNNEL_HISTOGRAM_H_
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <vector>
+
+
+namespace hotline {
+
+//////////////////////////////////////////////////////////////////////
+// Histogram
+// A log-linear histogram of non-negative integer samples, in the style of
+// HdrHistogram: every power of two is split into kSubBuckets / 2 linear
+// buckets, so any value is kept within 1/64 of its size while recording
+// stays a few instructions and the memory a fixed ~30KB.
+//
+class Histogram {
+public:
+  enum { kSubBucketBits = 7 };
+  enum { kSubBuckets = 1 << kSubBucketBits };
+  enum { kBucketCount = kSubBuckets + (64 - kSubBucketBits) * (kSubBuckets / 2) };
+
+  Histogram() : counts_(kBucketCount, 0) { Reset(); }
+
+  void Record(uint64_t value) {
+    counts_[Index(value)]++;
+    count_++;
+    sum_ += value;
+    min_ = std::min(min_, value);
+    max_ = std::max(max_, value);
+  }
+
+  void Merge(const Histogram& other) {
+    for (size_t i = 0; i < counts_.size(); ++i) counts_[i] += other.counts_[i];
+    count_ += other.count_;
+    sum_ += other.sum_;
+    min_ = std::min(min_, other.min_);
+    max_ = std::max(max_, other.max_);
+  }
+
+  void Reset() {
+    std::fill(counts_.begin(), counts_.end(), 0);
+    count_ = 0;
+    sum_ = 0;
+    min_ = UINT64_MAX;
+    max_ = 0;
+  }
+
+  uint64_t count() const { return count_; }
+  uint64_t min() const { return count_ ? min_ : 0; }
+  uint64_t max() const { return max_; }
+  double mean() const { return count_ ? (double)sum_ / count_ : 0; }
+
+  // The value below which percentile percent (0-100) of the samples fall.
+  uint64_t Percentile(double percentile) const {
+    if (count_ == 0) return 0;
+    if (percentile >= 100) return max_;
+
+    uint64_t rank = static_cast<uint64_t>(percentile / 100 * count_ + 0.5);
+    rank = std::min(std::max(rank, (uint64_t)1), count_);
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < counts_.size(); ++i) {
+      seen += counts_[i];
+      if (seen >= rank) return std::min(std::max(Value(i), min_), max_);
+    }
+    return max_;
+  }
+
+private:
+  static size_t Index(uint64_t value) {
+    if (value < kSubBuckets) return static_cast<size_t>(value);
+
+    int msb = 63;
+    while (!(value >> msb)) msb--;
+    int exponent = msb - kSubBucketBits + 1;
+    uint64_t mantissa = value >> exponent;   // [kSubBuckets / 2, kSubBuckets)
+    return kSubBuckets + (exponent - 1) * (kSubBuckets / 2) +
+           static_cast<size_t>(mantissa - kSubBuckets / 2);
+  }
+
+  // The middle of the bucket's range.
+  static uint64_t Value(size_t index) {
+    if (index < kSubBuckets) return index;
+
+    int exponent = static_cast<int>((index - kSubBuckets) / (kSubBuckets / 2)) + 1;
+    uint64_t mantissa = (index - kSubBuckets) % (kSubBuckets / 2) + kSubBuckets / 2;
+    return (mantissa << exponent) + ((uint64_t)1 << (exponent - 1));
+  }
+
+  std::vector<uint64_t> counts_;
+  uint64_t count_;
+  uint64_t sum_;
+  uint64_t min_;
+  uint64_t max_;
+};
+
+//////////////////////////////////////////////////////////////////////
+
+} // namespace hotline
+
+#endif  // HOTLINE_TUNNEL_HISTOGRAM_H_
@@ -0,0 +1,112 @@
+#include "htn_config.h"
+
+#include <vector>
+
+#include "webrtc/base/common.h"
+#include "webrtc/base/fakenetwork.h"
+#include "webrtc/base/logging.h"
+#include "webrtc/base/physicalsocketserver.h"
+#include "webrtc/base/refcount.h"
+#include "webrtc/base/thread.h"
+#include "webrtc/base/virtualsocketserver.h"
+#include "webrtc/p2p/base/basicpacketsocketfactory.h"
+#include "webrtc/p2p/client/basicportallocator.h"
+#include "impaired_network.h"
+
+
+namespace hotline {
+
+Json::Value ImpairmentConfig::ToJson() const {
+  Json::Value json;
+  json["delay_ms"] = delay;
+  json["jitter_ms"] = jitter;
+  json["loss_percent"] = loss;
+  json["rate_kbps"] = rate;
+  return json;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// ImpairedNetwork::AllocatorFactory
+///////////////////////////////////////////////////////////////////////////////
+
+// Port allocators for hosts on the virtual network, 10.0.0.1 and up. Only
+// host candidates: there is no STUN or TURN server to reach.
+class ImpairedNetwork::AllocatorFactory
+  : public webrtc::PortAllocatorFactoryInterface {
+public:
+  explicit AllocatorFactory(rtc::SocketFactory* socket_factory)
+    : socket_factory_(socket_factory), next_host_(1) {}
+
+  virtual cricket::PortAllocator* CreatePortAllocator(
+      const std::vector<StunConfiguration>& stun,
+      const std::vector<TurnConfiguration>& turn) {
+    rtc::FakeNetworkManager* network = new rtc::FakeNetworkManager();
+    network->AddInterface(rtc::SocketAddress("10.0.0." + std::to_string(next_host_++), 0));
+    networks_.push_back(network);
+
+    cricket::BasicPortAllocator* allocator =
+        new cricket::BasicPortAllocator(network, &socket_factory_);
+    allocator->set_flags(cricket::PORTALLOCATOR_DISABLE_TCP |
+                         cricket::PORTALLOCATOR_DISABLE_RELAY);
+    return allocator;
+  }
+
+protected:
+  virtual ~AllocatorFactory() {
+    for (size_t i = 0; i < networks_.size(); ++i) {
+      delete networks_[i];
+    }
+  }
+
+private:
+  rtc::BasicPacketSocketFactory socket_factory_;
+  std::vector<rtc::FakeNetworkManager*> networks_;
+  int next_host_;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+// ImpairedNetwork
+///////////////////////////////////////////////////////////////////////////////
+
+ImpairedNetwork::ImpairedNetwork(const ImpairmentConfig& config)
+  : config_(config)
+  , physical_(new rtc::PhysicalSocketServer())
+  , virtual_(new rtc::VirtualSocketServer(physical_.get())) {
+  virtual_->set_delay_mean(config_.delay);
+  virtual_->set_delay_stddev(config_.jitter);
+  virtual_->UpdateDelayDistribution();
+  virtual_->set_drop_probability(config_.loss / 100.0);
+  virtual_->set_bandwidth(config_.rate * 1000 / 8);
+
+  worker_thread_.reset(new rtc::Thread(virtual_.get()));
+  signaling_thread_.reset(new rtc::Thread());
+  allocator_factory_ = new rtc::RefCountedObject<AllocatorFactory>(virtual_.get());
+}
+
+ImpairedNetwork::~ImpairedNetwork() {
+  allocator_factory_ = NULL;
+  signaling_thread_->Stop();
+  worker_thread_->Stop();
+}
+
+bool ImpairedNetwork::Start() {
+  if (!worker_thread_->Start() || !signaling_thread_->Start()) {
+    LOG(LS_ERROR) << "Can't start the impaired network threads.";
+    return false;
+  }
+
+  LOG(LS_INFO) << "Impaired network: delay " << config_.delay << " ms, jitter "
+               << config_.jitter << " ms, loss " << config_.loss << "%, rate "
+               << config_.rate << " kbps.";
+  return true;
+}
+
+webrtc::PortAllocatorFactoryInterface* ImpairedNetwork::allocator_factory() {
+  return allocator_factory_.get();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+} // namespace hotline
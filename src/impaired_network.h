@@ -0,0 +1,73 @@
+#ifndef HOTLINE_TUNNEL_IMPAIRED_NETWORK_H_
+#define HOTLINE_TUNNEL_IMPAIRED_NETWORK_H_
+#pragma once
+
+#include "htn_config.h"
+
+#include "webrtc/base/json.h"
+#include "webrtc/base/scoped_ptr.h"
+#include "webrtc/base/scoped_ref_ptr.h"
+#include "talk/app/webrtc/peerconnectioninterface.h"
+
+
+namespace rtc {
+  class PhysicalSocketServer;
+  class Thread;
+  class VirtualSocketServer;
+}
+
+
+namespace hotline {
+
+struct ImpairmentConfig {
+  ImpairmentConfig() : delay(0), jitter(0), loss(0), rate(0) {}
+
+  bool enabled() const { return delay > 0 || jitter > 0 || loss > 0 || rate > 0; }
+  Json::Value ToJson() const;
+
+  int delay;      // one-way milliseconds
+  int jitter;     // standard deviation of the delay, milliseconds
+  double loss;    // percent of packets dropped
+  int rate;       // kbit/s each sender may put on the network, 0 for no limit
+};
+
+
+//////////////////////////////////////////////////////////////////////
+// ImpairedNetwork
+// A virtual network for PeerConnections in this process: a
+// VirtualSocketServer delays, drops and rate limits every packet as
+// configured, and each PeerConnection created with allocator_factory()
+// gets a host of its own on it. Peers on the same ImpairedNetwork reach
+// each other only through it, never through a real interface.
+//
+// Give the PeerConnectionFactory worker_thread() and signaling_thread(),
+// and keep the network until the factories are gone.
+//
+class ImpairedNetwork {
+public:
+  explicit ImpairedNetwork(const ImpairmentConfig& config);
+  ~ImpairedNetwork();
+
+  bool Start();
+
+  const ImpairmentConfig& config() const { return config_; }
+  rtc::Thread* worker_thread() { return worker_thread_.get(); }
+  rtc::Thread* signaling_thread() { return signaling_thread_.get(); }
+  webrtc::PortAllocatorFactoryInterface* allocator_factory();
+
+private:
+  class AllocatorFactory;
+
+  ImpairmentConfig config_;
+  rtc::scoped_ptr<rtc::PhysicalSocketServer> physical_;
+  rtc::scoped_ptr<rtc::VirtualSocketServer> virtual_;
+  rtc::scoped_ptr<rtc::Thread> worker_thread_;
+  rtc::scoped_ptr<rtc::Thread> signaling_thread_;
+  rtc::scoped_refptr<AllocatorFactory> allocator_factory_;
+};
+
+//////////////////////////////////////////////////////////////////////
+
+} // namespace hotline
+
+#endif  // HOTLINE_TUNNEL_IMPAIRED_NETWORK_H_
@@ -0,0 +1,699 @@
+#include "htn_config.h"
+
+#include <string.h>
+#include <algorithm>
+
+#if defined(WEBRTC_POSIX)
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include "webrtc/base/common.h"
+#include "webrtc/base/helpers.h"
+#include "webrtc/base/logging.h"
+#include "webrtc/base/messagedigest.h"
+#include "webrtc/base/messagequeue.h"
+#include "webrtc/base/physicalsocketserver.h"
+#include "webrtc/base/thread.h"
+#include "webrtc/base/timeutils.h"
+#include "lan_signal.h"
+
+#if defined(WEBRTC_WIN)
+#include <ws2tcpip.h>
+#include "webrtc/base/win32socketserver.h"
+#endif
+
+
+namespace hotline {
+
+static const int kQueryInterval = 200;   // milliseconds
+static const size_t kMaxMessageSize = 1024 * 1024;
+static const size_t kNonceSize = 32;
+
+typedef rtc::TypedMessageData<Json::Value> JsonMessageData;
+
+
+// Compares digests in time independent of where they differ.
+static bool SameDigest(const std::string& a, const std::string& b) {
+  if (a.size() != b.size() || a.empty()) return false;
+  unsigned char diff = 0;
+  for (size_t i = 0; i < a.size(); ++i) diff |= a[i] ^ b[i];
+  return diff == 0;
+}
+
+static std::string MessageMac(const std::string& key, uint64 count, int msgid,
+                              const Json::Value& data) {
+  return rtc::ComputeHmac(rtc::DIGEST_SHA_256, key,
+                          std::to_string(count) + ":" + std::to_string(msgid) + ":" +
+                          Json::FastWriter().write(data));
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// LanSignalConnection
+///////////////////////////////////////////////////////////////////////////////
+
+LanSignalConnection::LanSignalConnection(rtc::Thread* signal_thread,
+                                         const LanSignalConfig& config)
+  : signal_thread_(signal_thread)
+  , config_(config)
+  , callback_(NULL)
+  , peer_id_(0)
+  , random_state_((rtc::TimeNanos() ^ reinterpret_cast<uintptr_t>(this)) | 1)
+  , owner_(false)
+  , proof_failed_(false) {
+  // Peers meet without anyone handing out ids.
+  while (!peer_id_) peer_id_ = Random();
+}
+
+LanSignalConnection::~LanSignalConnection() {
+  Close();
+  signal_thread_->Clear(this);
+}
+
+void LanSignalConnection::Connect() {
+  signal_thread_->Post(this, MsgConnected);
+}
+
+void LanSignalConnection::CreateRoom(const std::string& password) {
+  created_room_id_ = config_.room_id;
+  if (created_room_id_.empty()) created_room_id_ = std::to_string(10000 + Random() % 90000);
+  password_ = password;
+  signal_thread_->Post(this, MsgCreatedRoom);
+}
+
+void LanSignalConnection::SignIn(std::string& room_id, std::string& password,
+                                 const Json::Value& offer) {
+  Close();
+  room_id_ = room_id;
+  password_ = password;
+  offer_ = offer;
+  owner_ = !created_room_id_.empty() && room_id == created_room_id_;
+  proof_failed_ = false;
+
+  if (owner_) {
+    if (!OpenRoom()) {
+      Fail(kDiscoveryFailed, "Can't open room " + room_id + " on the LAN.");
+      return;
+    }
+    signal_thread_->Post(this, MsgSignedIn);
+  }
+  else {
+    if (!StartQuerying()) {
+      Fail(kDiscoveryFailed, "Can't look for room " + room_id + " on the LAN.");
+      return;
+    }
+    signal_thread_->PostDelayed(config_.timeout, this, MsgTimeout);
+  }
+}
+
+void LanSignalConnection::SignOut(std::string& room_id) {
+  Close();
+}
+
+void LanSignalConnection::RegisterObserver(SignalServerConnectionObserver* callback) {
+  ASSERT(callback_ == NULL);
+  callback_ = callback;
+}
+
+void LanSignalConnection::UnregisterObserver(SignalServerConnectionObserver* callback) {
+  ASSERT(callback_ != NULL);
+  callback_ = NULL;
+}
+
+bool LanSignalConnection::Send(const MsgID msgid, Json::Value& data) {
+  if (msgid != MsgSendOffer) return false;
+
+  std::string to;
+  rtc::GetStringFromJsonObject(data, "peer_id", &to);
+  Peer* peer = FindPeer(strtoull(to.c_str(), NULL, 10));
+  if (!peer) return false;
+
+  // As the signal server would, replaces the addressee with the sender.
+  Json::Value relayed = data;
+  relayed["peer_id"] = std::to_string(peer_id_);
+  Write(peer, MsgReceivedOffer, relayed);
+  return true;
+}
+
+
+//
+// Sockets
+//
+
+bool LanSignalConnection::OpenRoom() {
+  rtc::SocketServer* socket_server = signal_thread_->socketserver();
+  rtc::SocketAddress any("0.0.0.0", 0);
+
+  listen_.reset(socket_server->CreateAsyncSocket(AF_INET, SOCK_STREAM));
+  if (!listen_ || listen_->Bind(any) == SOCKET_ERROR || listen_->Listen(16) == SOCKET_ERROR) {
+    LOG(LS_ERROR) << "Can't listen for LAN peers.";
+    listen_.reset();
+    return false;
+  }
+  listen_->SignalReadEvent.connect(this, &LanSignalConnection::OnAccept);
+
+  // Made by hand to join the group, then handed to a socket implementation
+  // that services it like its own.
+#if defined(WEBRTC_WIN)
+  SOCKET fd = ::socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd == INVALID_SOCKET) {
+    LOG_ERR(LS_ERROR) << "LAN discovery socket creation failed";
+    return false;
+  }
+  BOOL reuse = TRUE;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&reuse),
+             sizeof(reuse));
+  rtc::Win32Socket* win32_socket = new rtc::Win32Socket();
+  if (!win32_socket->Attach(fd)) {
+    delete win32_socket;
+    closesocket(fd);
+    return false;
+  }
+  discovery_.reset(win32_socket);
+#elif defined(WEBRTC_POSIX)
+  int fd = -1;
+  if (config_.socket_server && config_.socket_server == socket_server) {
+    fd = ::socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+      LOG_ERR(LS_ERROR) << "LAN discovery socket creation failed";
+      return false;
+    }
+    int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    discovery_.reset(config_.socket_server->WrapSocket(fd));
+    if (!discovery_) {
+      ::close(fd);
+      return false;
+    }
+  }
+  else {
+    discovery_.reset(socket_server->CreateAsyncSocket(AF_INET, SOCK_DGRAM));
+    if (!discovery_) return false;
+  }
+#else
+#error Platform not supported.
+#endif
+
+  if (discovery_->Bind(rtc::SocketAddress("0.0.0.0", config_.port)) == SOCKET_ERROR) {
+    LOG(LS_ERROR) << "Can't bind LAN discovery port " << config_.port << ".";
+    discovery_.reset();
+    return false;
+  }
+
+  // Peers on this host find the room through 127.0.0.1 regardless.
+#if defined(WEBRTC_POSIX)
+  if (fd < 0) {
+    LOG(LS_WARNING) << "No socket server to join multicast group " << config_.group
+                    << " with; the room can only be found from this host.";
+  }
+  else
+#endif
+  {
+    ip_mreq membership;
+    memset(&membership, 0, sizeof(membership));
+    membership.imr_multiaddr.s_addr = inet_addr(config_.group.c_str());
+    membership.imr_interface.s_addr = htonl(INADDR_ANY);
+    if (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+                   reinterpret_cast<const char*>(&membership), sizeof(membership)) < 0) {
+      LOG_ERR(LS_WARNING) << "Can't join multicast group " << config_.group;
+    }
+  }
+
+  discovery_->SignalReadEvent.connect(this, &LanSignalConnection::OnDiscoveryRead);
+  LOG(LS_INFO) << "Room " << room_id_ << " is open to the LAN on port "
+               << listen_->GetLocalAddress().port() << ".";
+  return true;
+}
+
+bool LanSignalConnection::StartQuerying() {
+  discovery_.reset(signal_thread_->socketserver()->CreateAsyncSocket(AF_INET, SOCK_DGRAM));
+  if (!discovery_ || discovery_->Bind(rtc::SocketAddress("0.0.0.0", 0)) == SOCKET_ERROR) {
+    discovery_.reset();
+    return false;
+  }
+  discovery_->SignalReadEvent.connect(this, &LanSignalConnection::OnDiscoveryRead);
+  signal_thread_->Post(this, MsgQuery);
+  return true;
+}
+
+void LanSignalConnection::Close() {
+  signal_thread_->Clear(this, MsgQuery);
+  signal_thread_->Clear(this, MsgTimeout);
+
+  // Possibly from inside a socket's callback, hence Dispose().
+  for (size_t i = 0; i < peers_.size(); ++i) {
+    peers_[i]->socket->Close();
+    signal_thread_->Dispose(peers_[i]->socket.release());
+    delete peers_[i];
+  }
+  peers_.clear();
+  discovery_.reset();
+  listen_.reset();
+}
+
+LanSignalConnection::Peer* LanSignalConnection::Find(rtc::AsyncSocket* socket) {
+  for (size_t i = 0; i < peers_.size(); ++i) {
+    if (peers_[i]->socket.get() == socket) return peers_[i];
+  }
+  return NULL;
+}
+
+LanSignalConnection::Peer* LanSignalConnection::FindPeer(uint64 peer_id) {
+  for (size_t i = 0; i < peers_.size(); ++i) {
+    if (peers_[i]->signed_in && peers_[i]->peer_id == peer_id) return peers_[i];
+  }
+  return NULL;
+}
+
+void LanSignalConnection::Write(Peer* peer, int msgid, const Json::Value& data) {
+  Json::FastWriter writer;
+  Json::Value jmessage;
+  jmessage["msgid"] = msgid;
+  jmessage["data"] = data;
+  if (!peer->key.empty()) {
+    jmessage["mac"] = MessageMac(peer->key, peer->messages_sent++, msgid, data);
+  }
+
+  // FastWriter ends the message with the newline that delimits it.
+  peer->sending.append(writer.write(jmessage));
+  Flush(peer);
+}
+
+void LanSignalConnection::Flush(Peer* peer) {
+  while (!peer->sending.empty()) {
+    int len = peer->socket->Send(peer->sending.data(), peer->sending.size());
+    // The rest waits for OnWrite(), or for OnClose() to drop it.
+    if (len < 0) return;
+    peer->sending.erase(0, len);
+  }
+}
+
+void LanSignalConnection::Remove(Peer* peer) {
+  std::vector<Peer*>::iterator it = std::find(peers_.begin(), peers_.end(), peer);
+  if (it != peers_.end()) peers_.erase(it);
+
+  peer->socket->Close();
+  signal_thread_->Dispose(peer->socket.release());
+  if (peer->signed_in && callback_) callback_->OnPeerDisconnected(peer->peer_id);
+  delete peer;
+}
+
+void LanSignalConnection::Fail(Error code, const std::string& message) {
+  Json::Value data;
+  data["code"] = code;
+  data["message"] = message;
+  signal_thread_->Post(this, MsgFailed, new JsonMessageData(data));
+}
+
+uint64 LanSignalConnection::Random() {
+  random_state_ ^= random_state_ << 13;
+  random_state_ ^= random_state_ >> 7;
+  random_state_ ^= random_state_ << 17;
+  return random_state_;
+}
+
+std::string LanSignalConnection::Proof(const std::string& role,
+                                       const std::string& challenge,
+                                       const std::string& nonce) const {
+  return rtc::ComputeHmac(rtc::DIGEST_SHA_256, password_,
+                          role + ":" + room_id_ + ":" + challenge + ":" + nonce);
+}
+
+std::string LanSignalConnection::SessionKey(const std::string& joiner_nonce,
+                                            const std::string& owner_nonce) const {
+  return rtc::ComputeHmac(rtc::DIGEST_SHA_256, password_,
+                          "key:" + room_id_ + ":" + joiner_nonce + ":" + owner_nonce);
+}
+
+
+//
+// Discovery
+//
+// The peer signing in sends {"lan_query": room id}; the owner of the room
+// answers from the port it listens on, {"lan_room": room id, "port": n}.
+//
+
+void LanSignalConnection::OnDiscoveryRead(rtc::AsyncSocket* socket) {
+  char buffer[2048];
+  rtc::SocketAddress from;
+  int len;
+  while (discovery_ && (len = socket->RecvFrom(buffer, sizeof(buffer), &from)) > 0) {
+    Json::Reader reader;
+    Json::Value datagram;
+    if (!reader.parse(buffer, buffer + len, datagram)) continue;
+
+    std::string room_id;
+    if (owner_) {
+      if (!rtc::GetStringFromJsonObject(datagram, "lan_query", &room_id) ||
+          room_id != room_id_) {
+        continue;
+      }
+
+      Json::Value answer;
+      answer["lan_room"] = room_id_;
+      answer["port"] = listen_->GetLocalAddress().port();
+      std::string text = Json::FastWriter().write(answer);
+      socket->SendTo(text.data(), text.size(), from);
+    }
+    else {
+      int port;
+      if (!rtc::GetStringFromJsonObject(datagram, "lan_room", &room_id) ||
+          room_id != room_id_ || !rtc::GetIntFromJsonObject(datagram, "port", &port) ||
+          !peers_.empty()) {
+        continue;
+      }
+
+      // The first to answer; the query may have reached it twice.
+      Peer* peer = new Peer();
+      peer->socket.reset(signal_thread_->socketserver()->CreateAsyncSocket(AF_INET, SOCK_STREAM));
+      if (!peer->socket) {
+        delete peer;
+        continue;
+      }
+      peer->socket->SignalConnectEvent.connect(this, &LanSignalConnection::OnConnect);
+      peer->socket->SignalReadEvent.connect(this, &LanSignalConnection::OnRead);
+      peer->socket->SignalWriteEvent.connect(this, &LanSignalConnection::OnWrite);
+      peer->socket->SignalCloseEvent.connect(this, &LanSignalConnection::OnClose);
+      peers_.push_back(peer);
+
+      rtc::SocketAddress address(from.ipaddr(), port);
+      LOG(LS_INFO) << "Room " << room_id_ << " found at " << address.ToString() << ".";
+      signal_thread_->Clear(this, MsgQuery);
+      if (peer->socket->Connect(address) == SOCKET_ERROR && !peer->socket->IsBlocking()) {
+        Remove(peer);
+        signal_thread_->Post(this, MsgQuery);
+      }
+    }
+  }
+}
+
+
+//
+// TCP
+//
+
+void LanSignalConnection::OnAccept(rtc::AsyncSocket* socket) {
+  rtc::AsyncSocket* accepted;
+  while ((accepted = socket->Accept(NULL)) != NULL) {
+    Peer* peer = new Peer();
+    peer->socket.reset(accepted);
+    accepted->SignalReadEvent.connect(this, &LanSignalConnection::OnRead);
+    accepted->SignalWriteEvent.connect(this, &LanSignalConnection::OnWrite);
+    accepted->SignalCloseEvent.connect(this, &LanSignalConnection::OnClose);
+    peers_.push_back(peer);
+  }
+}
+
+void LanSignalConnection::OnConnect(rtc::AsyncSocket* socket) {
+  Peer* peer = Find(socket);
+  if (!peer) return;
+
+  // Nothing about us until the owner proves it knows the password.
+  peer->nonce = rtc::CreateRandomString(kNonceSize);
+  Json::Value data;
+  data["room_id"] = room_id_;
+  data["nonce"] = peer->nonce;
+  Write(peer, MsgLanHello, data);
+}
+
+void LanSignalConnection::OnRead(rtc::AsyncSocket* socket) {
+  Peer* peer = Find(socket);
+  if (!peer) return;
+
+  char buffer[4096];
+  int len;
+  while ((len = socket->Recv(buffer, sizeof(buffer))) > 0) {
+    peer->received.append(buffer, len);
+
+    size_t end;
+    while ((end = peer->received.find('\n')) != std::string::npos) {
+      std::string text = peer->received.substr(0, end);
+      peer->received.erase(0, end + 1);
+      OnPeerMessage(peer, text);
+      // The message may have cost the peer its place.
+      if (Find(socket) != peer) return;
+    }
+
+    if (peer->received.size() > kMaxMessageSize) {
+      LOG(LS_WARNING) << "LAN peer sent a message too large.";
+      Remove(peer);
+      return;
+    }
+  }
+}
+
+void LanSignalConnection::OnWrite(rtc::AsyncSocket* socket) {
+  Peer* peer = Find(socket);
+  if (peer) Flush(peer);
+}
+
+void LanSignalConnection::OnClose(rtc::AsyncSocket* socket, int error) {
+  Peer* peer = Find(socket);
+  if (!peer) return;
+
+  // Lost before signing in: the room may answer again.
+  bool looking = !owner_ && !peer->signed_in && discovery_;
+  Remove(peer);
+  if (looking) signal_thread_->Post(this, MsgQuery);
+}
+
+
+//
+// Protocol
+//
+
+void LanSignalConnection::OnPeerMessage(Peer* peer, const std::string& text) {
+  Json::Reader reader;
+  Json::Value jmessage;
+  if (!reader.parse(text, jmessage)) {
+    LOG(LS_WARNING) << "Received unknown message from a LAN peer. " << text;
+    return;
+  }
+
+  int msgid;
+  Json::Value data;
+  if (!rtc::GetIntFromJsonObject(jmessage, "msgid", &msgid)) return;
+  if (!rtc::GetValueFromJsonObject(jmessage, "data", &data)) data = Json::Value();
+
+  if (!peer->key.empty()) {
+    std::string mac;
+    rtc::GetStringFromJsonObject(jmessage, "mac", &mac);
+    if (!SameDigest(mac, MessageMac(peer->key, peer->messages_received++, msgid, data))) {
+      LOG(LS_WARNING) << "Dropped a LAN peer whose message failed authentication.";
+      Remove(peer);
+      return;
+    }
+  }
+
+  switch (msgid) {
+  case MsgLanHello:
+    if (owner_) OnHello(peer, data);
+    break;
+  case MsgLanProof:
+    if (!owner_) OnHelloReply(peer, data);
+    break;
+  case MsgSignIn:
+    // Only over a connection that finished the handshake.
+    if (peer->key.empty()) break;
+    if (owner_) {
+      OnSignInRequest(peer, data);
+    }
+    else {
+      OnSignInReply(peer, data);
+    }
+    break;
+  case MsgReceivedOffer:
+    if (peer->signed_in && callback_) {
+      // Whatever it says, it's from this peer.
+      data["peer_id"] = std::to_string(peer->peer_id);
+      callback_->OnReceivedOffer(data);
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+void LanSignalConnection::OnHello(Peer* peer, Json::Value& data) {
+  if (!peer->nonce.empty()) return;
+
+  std::string room_id;
+  std::string nonce;
+  rtc::GetStringFromJsonObject(data, "room_id", &room_id);
+  rtc::GetStringFromJsonObject(data, "nonce", &nonce);
+  if (room_id != room_id_ || nonce.empty() || nonce.size() > 4 * kNonceSize) {
+    Remove(peer);
+    return;
+  }
+
+  // Answers the challenge and sets our own; the joiner's sign in, under
+  // the session key, answers ours.
+  peer->remote_nonce = nonce;
+  peer->nonce = rtc::CreateRandomString(kNonceSize);
+
+  Json::Value reply;
+  reply["nonce"] = peer->nonce;
+  reply["proof"] = Proof("owner", peer->remote_nonce, peer->nonce);
+  Write(peer, MsgLanProof, reply);
+  peer->key = SessionKey(peer->remote_nonce, peer->nonce);
+}
+
+void LanSignalConnection::OnHelloReply(Peer* peer, Json::Value& data) {
+  if (peer->nonce.empty() || !peer->key.empty()) return;
+
+  std::string nonce;
+  std::string proof;
+  rtc::GetStringFromJsonObject(data, "nonce", &nonce);
+  rtc::GetStringFromJsonObject(data, "proof", &proof);
+  if (nonce.empty() || nonce.size() > 4 * kNonceSize ||
+      !SameDigest(proof, Proof("owner", peer->nonce, nonce))) {
+    // Someone else answering for the room, or the wrong password; the
+    // real owner may still answer.
+    LOG(LS_WARNING) << "A LAN peer answered for room " << room_id_
+                    << " without its password.";
+    proof_failed_ = true;
+    Remove(peer);
+    if (discovery_) signal_thread_->Post(this, MsgQuery);
+    return;
+  }
+
+  peer->remote_nonce = nonce;
+  peer->key = SessionKey(peer->nonce, peer->remote_nonce);
+
+  Json::Value sign_in;
+  sign_in["room_id"] = room_id_;
+  sign_in["proof"] = Proof("joiner", peer->remote_nonce, peer->nonce);
+  sign_in["peer_id"] = std::to_string(peer_id_);
+  if (!offer_.isNull()) sign_in["offer"] = offer_;
+  Write(peer, MsgSignIn, sign_in);
+}
+
+void LanSignalConnection::OnSignInRequest(Peer* peer, Json::Value& data) {
+  if (peer->signed_in) return;
+
+  std::string room_id;
+  std::string proof;
+  std::string peer_id;
+  rtc::GetStringFromJsonObject(data, "room_id", &room_id);
+  rtc::GetStringFromJsonObject(data, "proof", &proof);
+  rtc::GetStringFromJsonObject(data, "peer_id", &peer_id);
+  uint64 id = strtoull(peer_id.c_str(), NULL, 10);
+
+  Json::Value offer;
+  rtc::GetValueFromJsonObject(data, "offer", &offer);
+
+  Json::Value reply;
+  if (room_id != room_id_ || !SameDigest(proof, Proof("joiner", peer->nonce, peer->remote_nonce)) ||
+      !id || id == peer_id_ || FindPeer(id)) {
+    reply["successful"] = false;
+    Write(peer, MsgSignIn, reply);
+    Remove(peer);
+    return;
+  }
+
+  peer->peer_id = id;
+  peer->signed_in = true;
+
+  reply["successful"] = true;
+  reply["room_id"] = room_id_;
+  reply["peer_id"] = std::to_string(peer_id_);
+  if (!offer.isNull()) reply["offer_peer_id"] = std::to_string(peer_id_);
+  Write(peer, MsgSignIn, reply);
+
+  if (!callback_) return;
+  callback_->OnPeerConnected(id);
+  if (!offer.isNull()) {
+    offer["room_id"] = room_id_;
+    offer["peer_id"] = peer_id;
+    callback_->OnReceivedOffer(offer);
+  }
+}
+
+void LanSignalConnection::OnSignInReply(Peer* peer, Json::Value& data) {
+  if (peer->signed_in) return;
+
+  bool successful = false;
+  rtc::GetBoolFromJsonObject(data, "successful", &successful);
+  if (!successful) {
+    Remove(peer);
+    discovery_.reset();
+    signal_thread_->Clear(this, MsgTimeout);
+    Fail(kSignInRefused, "Sign in to room " + room_id_ + " on the LAN refused.");
+    return;
+  }
+
+  std::string peer_id;
+  std::string offer_peer_id;
+  rtc::GetStringFromJsonObject(data, "peer_id", &peer_id);
+  rtc::GetStringFromJsonObject(data, "offer_peer_id", &offer_peer_id);
+  peer->peer_id = strtoull(peer_id.c_str(), NULL, 10);
+  peer->signed_in = true;
+
+  // Found; nothing more to look for.
+  signal_thread_->Clear(this, MsgTimeout);
+  discovery_.reset();
+
+  if (!callback_) return;
+  callback_->OnSignedIn(room_id_, peer_id_, strtoull(offer_peer_id.c_str(), NULL, 10));
+  callback_->OnPeerConnected(peer->peer_id);
+}
+
+
+//
+// MessageHandler
+//
+
+void LanSignalConnection::OnMessage(rtc::Message* msg) {
+  rtc::scoped_ptr<JsonMessageData> msgdata(static_cast<JsonMessageData*>(msg->pdata));
+
+  switch (msg->message_id) {
+  case MsgQuery:
+    if (discovery_ && !owner_ && peers_.empty()) {
+      Json::Value query;
+      query["lan_query"] = room_id_;
+      std::string text = Json::FastWriter().write(query);
+      discovery_->SendTo(text.data(), text.size(),
+                         rtc::SocketAddress(config_.group, config_.port));
+      discovery_->SendTo(text.data(), text.size(),
+                         rtc::SocketAddress("127.0.0.1", config_.port));
+      signal_thread_->PostDelayed(kQueryInterval, this, MsgQuery);
+    }
+    break;
+  case MsgTimeout:
+    Close();
+    if (proof_failed_) {
+      Fail(kSignInRefused, "Room " + room_id_ + " on the LAN doesn't take this password.");
+    }
+    else {
+      Fail(kRoomNotFound, "Room " + room_id_ + " not found on the LAN.");
+    }
+    break;
+  case MsgConnected:
+    if (callback_) callback_->OnConnected();
+    break;
+  case MsgCreatedRoom:
+    if (callback_) callback_->OnCreatedRoom(created_room_id_);
+    break;
+  case MsgSignedIn:
+    if (callback_) callback_->OnSignedIn(room_id_, peer_id_, 0);
+    break;
+  case MsgFailed:
+    if (callback_) {
+      int code = 0;
+      std::string message;
+      rtc::GetIntFromJsonObject(msgdata->data(), "code", &code);
+      rtc::GetStringFromJsonObject(msgdata->data(), "message", &message);
+      callback_->OnServerConnectionFailure(code, message);
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+} // namespace hotline
@@ -0,0 +1,196 @@
+#ifndef HOTLINE_TUNNEL_LAN_SIGNAL_H_
+#define HOTLINE_TUNNEL_LAN_SIGNAL_H_
+#pragma once
+
+#include "htn_config.h"
+
+#include <string>
+#include <vector>
+
+#include "webrtc/base/asyncsocket.h"
+#include "webrtc/base/json.h"
+#include "webrtc/base/messagehandler.h"
+#include "webrtc/base/scoped_ptr.h"
+#include "webrtc/base/sigslot.h"
+#include "webrtc/base/socketaddress.h"
+#include "signal_connection.h"
+
+
+namespace rtc {
+  class PhysicalSocketServer;
+  class Thread;
+}
+
+
+namespace hotline {
+
+struct LanSignalConfig {
+  LanSignalConfig()
+    : port(8090),
+      group("239.255.72.84"),
+      timeout(10000),
+      socket_server(NULL) {}
+
+  // UDP port and multicast group rooms are looked for on.
+  int port;
+  std::string group;
+  // Milliseconds a peer looks for the room before giving up.
+  int timeout;
+  // If set, CreateRoom returns it rather than a random room id.
+  std::string room_id;
+  // POSIX: the signal thread's socket server, which the owner's discovery
+  // socket is wrapped into so it can join the group. Without it the room is
+  // only found from the same host.
+  rtc::PhysicalSocketServer* socket_server;
+};
+
+
+//////////////////////////////////////////////////////////////////////
+// LanSignalConnection
+// Signaling without the signal server, for peers on one network or one
+// host. The peer that creates a room owns it: it listens on TCP and
+// answers queries for the room id on config.port, joined to the multicast
+// group. A peer signing in to the room asks the group, and 127.0.0.1 so
+// that one host needs no multicast route, connects to whoever answers and
+// signs in over TCP. From then on both ends relay offers, answers and
+// candidates over that connection, one JSON message per line in the
+// signal server's {"msgid", "data"} form.
+//
+// Anyone on the network can answer for a room, so the password never goes
+// over the wire. Each end sends a nonce and proves the password with an
+// HMAC over both; the joiner's offer only goes to an owner that proved it,
+// and every message after that carries an HMAC keyed by the password and
+// the nonces. Messages are authenticated, not encrypted.
+//
+// Everything runs on the signal thread, through its socket server; the
+// observer sees the same calls as with the signal server. Only the room
+// owner binds config.port, so one host can hold one room per port.
+//
+class LanSignalConnection : public SignalConnection,
+                            public rtc::MessageHandler,
+                            public sigslot::has_slots<> {
+public:
+  // Codes of OnServerConnectionFailure().
+  enum Error {
+    kDiscoveryFailed = 1,   // sockets couldn't be opened
+    kRoomNotFound,          // nobody answered for the room in time
+    kSignInRefused          // the password or room was refused
+  };
+
+  LanSignalConnection(rtc::Thread* signal_thread, const LanSignalConfig& config);
+  virtual ~LanSignalConnection();
+
+  // Reports OnConnected() to the observer; there is nothing to connect to.
+  void Connect();
+
+  //
+  // SignalConnection implementation.
+  //
+  virtual void CreateRoom(const std::string& password);
+  virtual void SignIn(std::string& room_id, std::string& password,
+                      const Json::Value& offer);
+  virtual void SignOut(std::string& room_id);
+
+  virtual void RegisterObserver(SignalServerConnectionObserver* callback);
+  virtual void UnregisterObserver(SignalServerConnectionObserver* callback);
+
+  virtual bool Send(const MsgID msgid, Json::Value& data);
+
+  //
+  // implements the MessageHandler interface
+  //
+  void OnMessage(rtc::Message* msg);
+
+private:
+  // Handshake on a new connection, ahead of MsgSignIn; numbered apart from
+  // SignalConnection::MsgID.
+  enum LanMsgID {
+    MsgLanHello = 100,      // joiner to owner: room id and nonce
+    MsgLanProof = 101       // owner to joiner: nonce and proof
+  };
+
+  enum ThreadMsgId {
+    MsgConnected,
+    MsgCreatedRoom,
+    MsgSignedIn,
+    MsgFailed,
+    MsgQuery,
+    MsgTimeout
+  };
+
+  // The other end of a TCP connection: a peer that signed in to our room,
+  // or the owner of the room we signed in to.
+  struct Peer {
+    Peer() : peer_id(0), signed_in(false), messages_sent(0), messages_received(0) {}
+
+    rtc::scoped_ptr<rtc::AsyncSocket> socket;
+    uint64 peer_id;
+    bool signed_in;
+    std::string received;
+    std::string sending;
+
+    std::string nonce;          // ours, for this connection
+    std::string remote_nonce;
+    // Authenticates messages in both directions once set; counts keep them
+    // from being replayed or reordered.
+    std::string key;
+    uint64 messages_sent;
+    uint64 messages_received;
+  };
+
+  bool OpenRoom();
+  bool StartQuerying();
+  void Close();
+
+  Peer* Find(rtc::AsyncSocket* socket);
+  Peer* FindPeer(uint64 peer_id);
+  void Write(Peer* peer, int msgid, const Json::Value& data);
+  void Flush(Peer* peer);
+  void Remove(Peer* peer);
+
+  void OnPeerMessage(Peer* peer, const std::string& text);
+  void OnHello(Peer* peer, Json::Value& data);
+  void OnHelloReply(Peer* peer, Json::Value& data);
+  void OnSignInRequest(Peer* peer, Json::Value& data);
+  void OnSignInReply(Peer* peer, Json::Value& data);
+  void Fail(Error code, const std::string& message);
+  uint64 Random();
+
+  // HMAC of the password over who is proving it and both nonces.
+  std::string Proof(const std::string& role, const std::string& challenge,
+                    const std::string& nonce) const;
+  std::string SessionKey(const std::string& joiner_nonce,
+                         const std::string& owner_nonce) const;
+
+  // Discovery datagrams, on either end.
+  void OnDiscoveryRead(rtc::AsyncSocket* socket);
+  // TCP
+  void OnAccept(rtc::AsyncSocket* socket);
+  void OnConnect(rtc::AsyncSocket* socket);
+  void OnRead(rtc::AsyncSocket* socket);
+  void OnWrite(rtc::AsyncSocket* socket);
+  void OnClose(rtc::AsyncSocket* socket, int error);
+
+  rtc::Thread* signal_thread_;
+  LanSignalConfig config_;
+  SignalServerConnectionObserver* callback_;
+  uint64 peer_id_;
+  uint64 random_state_;
+
+  std::string created_room_id_;
+  std::string room_id_;
+  std::string password_;
+  bool owner_;                 // of room_id_, once signed in
+  bool proof_failed_;          // someone answered without our password
+  Json::Value offer_;          // to go along with our sign in
+
+  rtc::scoped_ptr<rtc::AsyncSocket> discovery_;
+  rtc::scoped_ptr<rtc::AsyncSocket> listen_;
+  std::vector<Peer*> peers_;
+};
+
+//////////////////////////////////////////////////////////////////////
+
+} // namespace hotline
+
+#endif  // HOTLINE_TUNNEL_LAN_SIGNAL_H_
@@ -0,0 +1,431 @@
+#include "htn_config.h"
+
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+
+#include "webrtc/base/common.h"
+#include "webrtc/base/logging.h"
+#include "webrtc/base/timeutils.h"
+#ifdef ARRAY_SIZE
+#undef ARRAY_SIZE
+#endif
+#include "libwebsockets.h"
+#include "local_signal_server.h"
+
+
+namespace hotline {
+
+static const char kHttpProtocolName[] = "http-only";
+// What WebSocket asks for when given no protocols.
+static const char kSignalProtocolName[] = "default-protocol";
+
+static const int kServiceInterval = 10;  // milliseconds
+
+static uint64 NowMicros() {
+  return rtc::TimeNanos() / 1000;
+}
+
+
+// Routes libwebsockets callbacks to the server in the context's user data.
+class LocalSignalServerCallbackWrapper {
+public:
+  static int OnHttpCallback(struct libwebsocket_context* ctx, struct libwebsocket* wsi,
+                            enum libwebsocket_callback_reasons reason,
+                            void* user, void* in, size_t len) {
+    // Plain HTTP requests are refused.
+    return reason == LWS_CALLBACK_HTTP ? -1 : 0;
+  }
+
+  static int OnSignalCallback(struct libwebsocket_context* ctx, struct libwebsocket* wsi,
+                              enum libwebsocket_callback_reasons reason,
+                              void* user, void* in, size_t len) {
+    LocalSignalServer* server = (LocalSignalServer*)libwebsocket_context_user(ctx);
+    if (server) {
+      return server->OnSignalCallback(wsi, reason, user, in, len);
+    }
+    return 0;
+  }
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+// LocalSignalServer
+///////////////////////////////////////////////////////////////////////////////
+
+LocalSignalServer::LocalSignalServer(const LocalSignalServerConfig& config)
+  : config_(config)
+  , context_(NULL)
+  , protocols_(NULL)
+  , thread_(NULL)
+  , quit_(false)
+  , stalled_(false)
+  , next_room_id_(100001)
+  , next_peer_id_(1)
+  , random_state_(0x2545F4914F6CDD1DULL)
+  , relayed_offers_(0) {
+  config_.delay = std::max(config_.delay, 0);
+  config_.jitter = std::max(config_.jitter, 0);
+
+  if (!config_.room_id.empty()) {
+    rooms_[config_.room_id];
+  }
+}
+
+LocalSignalServer::~LocalSignalServer() {
+  Stop();
+  delete[] protocols_;
+}
+
+bool LocalSignalServer::Start() {
+  ASSERT(context_ == NULL);
+
+  // Again after a Stop().
+  delete[] protocols_;
+  protocols_ = new libwebsocket_protocols[3];
+  memset(protocols_, 0, sizeof(libwebsocket_protocols) * 3);
+  protocols_[0].name = kHttpProtocolName;
+  protocols_[0].callback = LocalSignalServerCallbackWrapper::OnHttpCallback;
+  protocols_[1].name = kSignalProtocolName;
+  protocols_[1].callback = LocalSignalServerCallbackWrapper::OnSignalCallback;
+  protocols_[1].per_session_data_size = sizeof(Session*);
+
+  struct lws_context_creation_info info;
+  memset(&info, 0, sizeof info);
+  info.port = config_.port;
+  info.protocols = protocols_;
+#ifndef LWS_NO_EXTENSIONS
+  info.extensions = libwebsocket_get_internal_extensions();
+#endif
+  info.gid = -1;
+  info.uid = -1;
+  info.user = (void*)this;
+
+  context_ = libwebsocket_create_context(&info);
+  if (context_ == NULL) {
+    LOG(LS_ERROR) << "Signal server can't listen on port " << config_.port << ".";
+    return false;
+  }
+
+  LOG(LS_INFO) << "Signal server listening on port " << config_.port
+               << ", delay " << config_.delay << " ms, jitter " << config_.jitter << " ms.";
+
+  quit_ = false;
+  thread_ = new std::thread(&LocalSignalServer::ServiceLoop, this);
+  return true;
+}
+
+void LocalSignalServer::Stop() {
+  if (thread_) {
+    quit_ = true;
+    thread_->join();
+    delete thread_;
+    thread_ = NULL;
+  }
+
+  // Closes the sessions, so OnClosed() runs for each of them here.
+  if (context_) {
+    libwebsocket_context_destroy(context_);
+    context_ = NULL;
+  }
+}
+
+void LocalSignalServer::ForgetRooms() {
+  ASSERT(thread_ == NULL);
+  rooms_.clear();
+  config_.room_id.clear();
+}
+
+void LocalSignalServer::ServiceLoop() {
+  int timeout = kServiceInterval;
+  while (!quit_) {
+    if (stalled_) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(kServiceInterval));
+      continue;
+    }
+
+    libwebsocket_service(context_, timeout);
+
+    uint64 now = NowMicros();
+    uint64 next_due = now + kServiceInterval * 1000;
+    for (size_t i = 0; i < sessions_.size(); ++i) {
+      Session* session = sessions_[i];
+      if (session->outgoing.empty()) continue;
+
+      uint64 due = session->outgoing.front().first;
+      if (due <= now) {
+        libwebsocket_callback_on_writable(context_, session->wsi);
+      }
+      next_due = std::min(next_due, due);
+    }
+
+    // Wake up in time for the next held back message.
+    timeout = static_cast<int>(std::max<uint64>(next_due > now ? (next_due - now) / 1000 : 0, 1));
+  }
+}
+
+
+//
+// libwebsockets callbacks, on the service thread.
+//
+
+int LocalSignalServer::OnSignalCallback(struct libwebsocket* wsi, int reason,
+                                        void* user, void* in, size_t len) {
+  Session** session = (Session**)user;
+
+  switch (reason) {
+  case LWS_CALLBACK_ESTABLISHED:
+    *session = new Session();
+    (*session)->wsi = wsi;
+    sessions_.push_back(*session);
+    break;
+
+  case LWS_CALLBACK_RECEIVE:
+    if (*session && in && len > 0) {
+      (*session)->receiving.Append((const char*)in, len);
+
+      // Clients fragment long messages, so wait for the final fragment.
+      if (libwebsockets_remaining_packet_payload(wsi) == 0 &&
+          libwebsocket_is_final_fragment(wsi)) {
+        OnMessage(*session, (*session)->receiving.data(),
+                  (*session)->receiving.size());
+        (*session)->receiving.Reset();
+      }
+    }
+    break;
+
+  case LWS_CALLBACK_SERVER_WRITEABLE:
+    if (*session) OnWriteable(*session);
+    break;
+
+  case LWS_CALLBACK_CLOSED:
+    if (*session) {
+      OnClosed(*session);
+      *session = NULL;
+    }
+    break;
+
+  default:
+    break;
+  }
+
+  return 0;
+}
+
+void LocalSignalServer::OnWriteable(Session* session) {
+  if (session->outgoing.empty() || session->outgoing.front().first > NowMicros()) {
+    return;
+  }
+
+  // One write per callback.
+  const std::string& message = session->outgoing.front().second;
+  std::vector<unsigned char> buffer(LWS_SEND_BUFFER_PRE_PADDING + message.size() +
+                                    LWS_SEND_BUFFER_POST_PADDING);
+  memcpy(&buffer[LWS_SEND_BUFFER_PRE_PADDING], message.data(), message.size());
+  libwebsocket_write(session->wsi, &buffer[LWS_SEND_BUFFER_PRE_PADDING], message.size(),
+                     LWS_WRITE_TEXT);
+  session->outgoing.pop_front();
+
+  if (!session->outgoing.empty() && session->outgoing.front().first <= NowMicros()) {
+    libwebsocket_callback_on_writable(context_, session->wsi);
+  }
+}
+
+void LocalSignalServer::OnClosed(Session* session) {
+  OnSignOut(session);
+  sessions_.erase(std::remove(sessions_.begin(), sessions_.end(), session), sessions_.end());
+  delete session;
+}
+
+
+//
+// Protocol
+//
+
+void LocalSignalServer::OnMessage(Session* session, const char* text, size_t len) {
+  Json::Reader reader;
+  Json::Value jmessage;
+  if (!reader.parse(text, text + len, jmessage)) {
+    LOG(LS_WARNING) << "Signal server received unknown message. "
+                    << std::string(text, len);
+    return;
+  }
+
+  int msgid;
+  Json::Value data;
+  if (!rtc::GetIntFromJsonObject(jmessage, "msgid", &msgid)) return;
+  if (!rtc::GetValueFromJsonObject(jmessage, "data", &data)) data = Json::Value();
+
+  switch (msgid) {
+  case SignalConnection::MsgCreateRoom:
+    OnCreateRoom(session, data);
+    break;
+  case SignalConnection::MsgSignIn:
+    OnSignIn(session, data);
+    break;
+  case SignalConnection::MsgSignOut:
+    OnSignOut(session);
+    break;
+  case SignalConnection::MsgSendOffer:
+    OnSendOffer(session, data);
+    break;
+  default:
+    break;
+  }
+}
+
+void LocalSignalServer::OnCreateRoom(Session* session, Json::Value& data) {
+  std::string room_id = config_.room_id;
+  if (room_id.empty()) {
+    room_id = std::to_string(next_room_id_++);
+    rtc::GetStringFromJsonObject(data, "password", &rooms_[room_id].password);
+  }
+
+  Json::Value reply;
+  reply["successful"] = true;
+  reply["room_id"] = room_id;
+  Send(session, SignalConnection::MsgCreateRoom, reply);
+}
+
+void LocalSignalServer::OnSignIn(Session* session, Json::Value& data) {
+  std::string room_id;
+  std::string password;
+  rtc::GetStringFromJsonObject(data, "room_id", &room_id);
+  rtc::GetStringFromJsonObject(data, "password", &password);
+
+  Json::Value reply;
+  reply["room_id"] = room_id;
+
+  std::map<std::string, Room>::iterator room = rooms_.find(room_id);
+  if (room == rooms_.end() || session->peer_id != 0) {
+    reply["successful"] = false;
+    reply["message"] = session->peer_id ? "Already signed in." : "No such room.";
+    Send(session, SignalConnection::MsgSignIn, reply);
+    return;
+  }
+  if (room_id != config_.room_id && password != room->second.password) {
+    reply["successful"] = false;
+    reply["message"] = "Wrong password.";
+    Send(session, SignalConnection::MsgSignIn, reply);
+    return;
+  }
+
+  // A peer signing in again after losing the connection keeps its id,
+  // unless someone has it.
+  std::string resume_id;
+  uint64 peer_id = 0;
+  if (rtc::GetStringFromJsonObject(data, "peer_id", &resume_id)) {
+    peer_id = strtoull(resume_id.c_str(), NULL, 10);
+    for (size_t i = 0; i < sessions_.size() && peer_id; ++i) {
+      if (sessions_[i]->peer_id == peer_id) peer_id = 0;
+    }
+    if (peer_id >= next_peer_id_) peer_id = 0;
+  }
+
+  session->peer_id = peer_id ? peer_id : next_peer_id_++;
+  session->room_id = room_id;
+
+  // An offer made before joining goes to the peer that has been in the
+  // room longest, the one that created it, right after it hears of the
+  // joiner; the joiner is told who got it.
+  std::vector<Session*>& peers = room->second.peers;
+  Json::Value offer;
+  rtc::GetValueFromJsonObject(data, "offer", &offer);
+  bool forward_offer = offer.isObject() && !peers.empty();
+
+  reply["successful"] = true;
+  reply["peer_id"] = std::to_string(session->peer_id);
+  reply["message"] = "";
+  if (forward_offer) reply["offer_peer_id"] = std::to_string(peers[0]->peer_id);
+  Send(session, SignalConnection::MsgSignIn, reply);
+
+  // Everyone in a room is told about everyone else.
+  for (size_t i = 0; i < peers.size(); ++i) {
+    Json::Value peer;
+    peer["peer_id"] = std::to_string(peers[i]->peer_id);
+    Send(session, SignalConnection::MsgPeerConnected, peer);
+
+    peer["peer_id"] = std::to_string(session->peer_id);
+    Send(peers[i], SignalConnection::MsgPeerConnected, peer);
+  }
+
+  if (forward_offer) {
+    offer["room_id"] = room_id;
+    offer["peer_id"] = std::to_string(session->peer_id);
+    Send(peers[0], SignalConnection::MsgReceivedOffer, offer);
+    relayed_offers_++;
+  }
+  peers.push_back(session);
+}
+
+void LocalSignalServer::OnSignOut(Session* session) {
+  if (session->peer_id == 0) return;
+
+  std::map<std::string, Room>::iterator room = rooms_.find(session->room_id);
+  if (room != rooms_.end()) {
+    std::vector<Session*>& peers = room->second.peers;
+    peers.erase(std::remove(peers.begin(), peers.end(), session), peers.end());
+
+    Json::Value peer;
+    peer["peer_id"] = std::to_string(session->peer_id);
+    for (size_t i = 0; i < peers.size(); ++i) {
+      Send(peers[i], SignalConnection::MsgPeerDisconnected, peer);
+    }
+
+    if (peers.empty() && room->first != config_.room_id) {
+      rooms_.erase(room);
+    }
+  }
+
+  session->peer_id = 0;
+  session->room_id.clear();
+}
+
+void LocalSignalServer::OnSendOffer(Session* session, Json::Value& data) {
+  std::string peer_id;
+  if (session->peer_id == 0 || !rtc::GetStringFromJsonObject(data, "peer_id", &peer_id)) {
+    return;
+  }
+
+  std::map<std::string, Room>::iterator room = rooms_.find(session->room_id);
+  if (room == rooms_.end()) return;
+
+  uint64 to = strtoull(peer_id.c_str(), NULL, 10);
+  std::vector<Session*>& peers = room->second.peers;
+  for (size_t i = 0; i < peers.size(); ++i) {
+    if (peers[i]->peer_id != to) continue;
+
+    // The addressee is replaced with the sender.
+    Json::Value relayed = data;
+    relayed["peer_id"] = std::to_string(session->peer_id);
+    Send(peers[i], SignalConnection::MsgReceivedOffer, relayed);
+    relayed_offers_++;
+    return;
+  }
+}
+
+void LocalSignalServer::Send(Session* session, SignalConnection::MsgID msgid,
+                             const Json::Value& data) {
+  Json::FastWriter writer;
+  Json::Value jmessage;
+  jmessage["msgid"] = msgid;
+  jmessage["data"] = data;
+
+  int64 delay = config_.delay;
+  if (config_.jitter > 0) {
+    random_state_ ^= random_state_ << 13;
+    random_state_ ^= random_state_ >> 7;
+    random_state_ ^= random_state_ << 17;
+    delay += static_cast<int64>(random_state_ % (2 * config_.jitter + 1)) - config_.jitter;
+  }
+
+  // Held back messages still leave in order, like over one connection.
+  uint64 due = NowMicros() + static_cast<uint64>(std::max<int64>(delay, 0)) * 1000;
+  due = std::max(due, session->last_due);
+  session->last_due = due;
+  session->outgoing.push_back(std::make_pair(due, writer.write(jmessage)));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+} // namespace hotline
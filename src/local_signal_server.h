@@ -0,0 +1,130 @@
+#ifndef HOTLINE_TUNNEL_LOCAL_SIGNAL_SERVER_H_
+#define HOTLINE_TUNNEL_LOCAL_SIGNAL_SERVER_H_
+#pragma once
+
+#include "htn_config.h"
+
+#include <atomic>
+#include <deque>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "webrtc/base/basictypes.h"
+#include "webrtc/base/json.h"
+#include "signal_connection.h"
+#include "websocket_framing.h"
+
+
+struct libwebsocket_context;
+struct libwebsocket;
+struct libwebsocket_protocols;
+
+
+namespace hotline {
+
+struct LocalSignalServerConfig {
+  LocalSignalServerConfig()
+    : port(8089),
+      delay(0),
+      jitter(0) {}
+
+  int port;
+  // Every message the server sends is held back delay +/- jitter
+  // milliseconds, in order, as if the server were that far away.
+  int delay;
+  int jitter;
+  // If set, the only room: it exists from the start, with no password,
+  // and CreateRoom returns it. Lets both peers start at once.
+  std::string room_id;
+};
+
+
+//////////////////////////////////////////////////////////////////////
+// LocalSignalServer
+// A stand-in for the signal server, speaking the SignalConnection
+// protocol over libwebsockets on its own thread: rooms with a password,
+// sign in, peer connected/disconnected notices and relaying of offers,
+// answers and candidates between the peers of a room, including an offer
+// sent along with a sign in, and signing in again as the same peer. It
+// keeps no state on disk and trusts its clients; it is for testing
+// without a network.
+//
+class LocalSignalServer {
+public:
+  explicit LocalSignalServer(const LocalSignalServerConfig& config);
+  ~LocalSignalServer();
+
+  // Listens on config.port and starts serving. Returns false if the port
+  // can't be opened.
+  bool Start();
+  // Drops every client. config.room_id and the peer ids given out stay
+  // for the next Start(), so clients can sign in again as they were.
+  void Stop();
+  // Forgets every room, config.room_id included, as a server restarted
+  // from scratch would. Only while stopped.
+  void ForgetRooms();
+  // While stalled the server neither reads, writes nor answers pings,
+  // but keeps its connections open, like a host that has gone silent.
+  void Stall(bool stalled) { stalled_ = stalled; }
+
+  const LocalSignalServerConfig& config() const { return config_; }
+  // Offers, answers and candidate messages relayed so far.
+  uint64 relayed_offers() const { return relayed_offers_.load(); }
+
+private:
+  struct Session {
+    Session() : wsi(NULL), peer_id(0), last_due(0) {}
+
+    struct libwebsocket* wsi;
+    uint64 peer_id;
+    std::string room_id;
+    WsMessageAssembler receiving;
+    // Outgoing messages and when they may leave.
+    std::deque<std::pair<uint64, std::string> > outgoing;
+    uint64 last_due;
+  };
+
+  struct Room {
+    std::string password;
+    std::vector<Session*> peers;
+  };
+
+  friend class LocalSignalServerCallbackWrapper;
+  int OnSignalCallback(struct libwebsocket* wsi, int reason,
+                       void* user, void* in, size_t len);
+
+  void ServiceLoop();
+
+  void OnMessage(Session* session, const char* text, size_t len);
+  void OnCreateRoom(Session* session, Json::Value& data);
+  void OnSignIn(Session* session, Json::Value& data);
+  void OnSignOut(Session* session);
+  void OnSendOffer(Session* session, Json::Value& data);
+  void OnWriteable(Session* session);
+  void OnClosed(Session* session);
+
+  // Queues a message for the session after the configured delay.
+  void Send(Session* session, SignalConnection::MsgID msgid, const Json::Value& data);
+
+  LocalSignalServerConfig config_;
+  struct libwebsocket_context* context_;
+  struct libwebsocket_protocols* protocols_;
+  std::thread* thread_;
+  volatile bool quit_;
+  std::atomic<bool> stalled_;
+
+  std::map<std::string, Room> rooms_;
+  std::vector<Session*> sessions_;
+  uint64 next_room_id_;
+  uint64 next_peer_id_;
+  uint64 random_state_;
+  std::atomic<uint64> relayed_offers_;
+};
+
+//////////////////////////////////////////////////////////////////////
+
+} // namespace hotline
+
+#endif  // HOTLINE_TUNNEL_LOCAL_SIGNAL_SERVER_H_
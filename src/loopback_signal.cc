@@ -0,0 +1,156 @@
+#include "htn_config.h"
+
+#include "webrtc/base/common.h"
+#include "webrtc/base/logging.h"
+#include "webrtc/base/messagequeue.h"
+#include "webrtc/base/scoped_ptr.h"
+#include "webrtc/base/thread.h"
+#include "loopback_signal.h"
+
+
+namespace hotline {
+
+const char LoopbackSignalConnection::kRoomId[] = "loopback";
+
+typedef rtc::TypedMessageData<Json::Value> JsonMessageData;
+
+
+LoopbackSignalConnection::LoopbackSignalConnection(rtc::Thread* signal_thread,
+                                                   uint64 peer_id)
+  : signal_thread_(signal_thread)
+  , peer_id_(peer_id)
+  , other_(NULL)
+  , callback_(NULL)
+  , signed_in_(false) {
+}
+
+LoopbackSignalConnection::~LoopbackSignalConnection() {
+  if (other_) other_->other_ = NULL;
+}
+
+void LoopbackSignalConnection::Pair(LoopbackSignalConnection* first,
+                                    LoopbackSignalConnection* second) {
+  ASSERT(first->peer_id_ != second->peer_id_);
+  first->other_ = second;
+  second->other_ = first;
+}
+
+void LoopbackSignalConnection::Connect() {
+  Post(this, MsgConnected, Json::Value());
+}
+
+void LoopbackSignalConnection::CreateRoom(const std::string& password) {
+  Json::Value data;
+  data["successful"] = true;
+  data["room_id"] = kRoomId;
+  Post(this, MsgCreatedRoom, data);
+}
+
+void LoopbackSignalConnection::SignIn(std::string& room_id, std::string& password,
+                                      const Json::Value& offer) {
+  room_id_ = room_id;
+  signed_in_ = true;
+  bool joined = other_ && other_->signed_in_;
+
+  Json::Value data;
+  data["room_id"] = room_id;
+  data["peer_id"] = std::to_string(peer_id_);
+  if (joined && !offer.isNull()) data["offer_peer_id"] = std::to_string(other_->peer_id_);
+  Post(this, MsgSignedIn, data);
+
+  // A pair shares one room.
+  if (joined) {
+    Json::Value peer;
+    peer["peer_id"] = std::to_string(other_->peer_id_);
+    Post(this, MsgPeerConnected, peer);
+
+    peer["peer_id"] = std::to_string(peer_id_);
+    Post(other_, MsgPeerConnected, peer);
+
+    if (!offer.isNull()) {
+      Json::Value relayed = offer;
+      relayed["room_id"] = room_id;
+      relayed["peer_id"] = std::to_string(peer_id_);
+      Post(other_, MsgReceivedOffer, relayed);
+    }
+  }
+}
+
+void LoopbackSignalConnection::SignOut(std::string& room_id) {
+  if (!signed_in_) return;
+  signed_in_ = false;
+
+  if (other_ && other_->signed_in_) {
+    Json::Value peer;
+    peer["peer_id"] = std::to_string(peer_id_);
+    Post(other_, MsgPeerDisconnected, peer);
+  }
+}
+
+void LoopbackSignalConnection::RegisterObserver(SignalServerConnectionObserver* callback) {
+  ASSERT(callback_ == NULL);
+  callback_ = callback;
+}
+
+void LoopbackSignalConnection::UnregisterObserver(SignalServerConnectionObserver* callback) {
+  ASSERT(callback_ != NULL);
+  callback_ = NULL;
+}
+
+bool LoopbackSignalConnection::Send(const MsgID msgid, Json::Value& data) {
+  if (msgid != MsgSendOffer || !other_ || !signed_in_) return false;
+
+  // The server replaces the addressee with the sender.
+  Json::Value relayed = data;
+  relayed["peer_id"] = std::to_string(peer_id_);
+  Post(other_, MsgReceivedOffer, relayed);
+  return true;
+}
+
+void LoopbackSignalConnection::Post(LoopbackSignalConnection* to, ThreadMsgId id,
+                                    const Json::Value& data) {
+  signal_thread_->Post(to, id, new JsonMessageData(data));
+}
+
+void LoopbackSignalConnection::OnMessage(rtc::Message* msg) {
+  rtc::scoped_ptr<JsonMessageData> msgdata(static_cast<JsonMessageData*>(msg->pdata));
+  if (!callback_) return;
+
+  Json::Value& data = msgdata->data();
+  std::string room_id;
+  std::string peer_id;
+  rtc::GetStringFromJsonObject(data, "room_id", &room_id);
+  rtc::GetStringFromJsonObject(data, "peer_id", &peer_id);
+
+  switch (msg->message_id) {
+  case MsgConnected:
+    callback_->OnConnected();
+    break;
+  case MsgCreatedRoom:
+    callback_->OnCreatedRoom(room_id);
+    break;
+  case MsgSignedIn:
+    {
+      std::string offer_peer_id;
+      rtc::GetStringFromJsonObject(data, "offer_peer_id", &offer_peer_id);
+      callback_->OnSignedIn(room_id, strtoull(peer_id.c_str(), NULL, 10),
+                            strtoull(offer_peer_id.c_str(), NULL, 10));
+    }
+    break;
+  case MsgPeerConnected:
+    callback_->OnPeerConnected(strtoull(peer_id.c_str(), NULL, 10));
+    break;
+  case MsgPeerDisconnected:
+    callback_->OnPeerDisconnected(strtoull(peer_id.c_str(), NULL, 10));
+    break;
+  case MsgReceivedOffer:
+    callback_->OnReceivedOffer(data);
+    break;
+  default:
+    break;
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+} // namespace hotline
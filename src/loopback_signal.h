@@ -0,0 +1,87 @@
+#ifndef HOTLINE_TUNNEL_LOOPBACK_SIGNAL_H_
+#define HOTLINE_TUNNEL_LOOPBACK_SIGNAL_H_
+#pragma once
+
+#include "htn_config.h"
+
+#include <string>
+
+#include "webrtc/base/json.h"
+#include "webrtc/base/messagehandler.h"
+#include "signal_connection.h"
+
+
+namespace rtc {
+  class Thread;
+}
+
+
+namespace hotline {
+
+//////////////////////////////////////////////////////////////////////
+// LoopbackSignalConnection
+// One end of an in-process signaling channel. Two paired ends behave like
+// two clients of the signal server sharing a room: once both have signed
+// in each is told about the other, and offers, answers and candidates sent
+// on one end are received on the other. Everything is delivered through
+// the thread's message queue, never from inside the call.
+//
+class LoopbackSignalConnection : public SignalConnection,
+                                 public rtc::MessageHandler {
+public:
+  LoopbackSignalConnection(rtc::Thread* signal_thread, uint64 peer_id);
+  virtual ~LoopbackSignalConnection();
+
+  // The room CreateRoom() reports.
+  static const char kRoomId[];
+
+  static void Pair(LoopbackSignalConnection* first, LoopbackSignalConnection* second);
+
+  // Reports OnConnected() to the observer.
+  void Connect();
+
+  uint64 peer_id() const { return peer_id_; }
+
+  //
+  // SignalConnection implementation.
+  //
+  virtual void CreateRoom(const std::string& password);
+  virtual void SignIn(std::string& room_id, std::string& password,
+                      const Json::Value& offer);
+  virtual void SignOut(std::string& room_id);
+
+  virtual void RegisterObserver(SignalServerConnectionObserver* callback);
+  virtual void UnregisterObserver(SignalServerConnectionObserver* callback);
+
+  virtual bool Send(const MsgID msgid, Json::Value& data);
+
+  //
+  // implements the MessageHandler interface
+  //
+  void OnMessage(rtc::Message* msg);
+
+private:
+  enum ThreadMsgId {
+    MsgConnected,
+    MsgCreatedRoom,
+    MsgSignedIn,
+    MsgPeerConnected,
+    MsgPeerDisconnected,
+    MsgReceivedOffer
+  };
+
+  void Post(LoopbackSignalConnection* to, ThreadMsgId id, const Json::Value& data);
+
+  rtc::Thread* signal_thread_;
+  uint64 peer_id_;
+  LoopbackSignalConnection* other_;
+  SignalServerConnectionObserver* callback_;
+  std::string room_id_;
+  bool signed_in_;
+};
+
+//////////////////////////////////////////////////////////////////////
+
+} // namespace hotline
+
+#endif  // HOTLINE_TUNNEL_LOOPBACK_SIGNAL_H_
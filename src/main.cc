@@ -1,17 +1,31 @@
 #include "htn_config.h"
 
+#include <string.h>
+#include <algorithm>
+#include <fstream>
 #include <iostream>
 #include <string>
 
+#include "webrtc/base/physicalsocketserver.h"
 #include "webrtc/base/ssladapter.h"
+#include "webrtc/base/thread.h"
 #include "webrtc/base/win32socketinit.h"
 #include "webrtc/base/win32socketserver.h"
 #include "webrtc/base/logging.h"
 #include "webrtc/system_wrappers/interface/trace.h"
 
+#include "bench.h"
+#include "bench_driver.h"
 #include "conductors.h"
 #include "flagdefs.h"
+#include "lan_signal.h"
+#include "local_signal_server.h"
+#include "metrics.h"
+#include "setup_trace.h"
+#include "signal_address_cache.h"
 #include "signalserver_connection.h"
+#include "traffic_capture.h"
+#include "transit.h"
 
 
 #if WIN32
@@ -21,6 +35,9 @@ bool ReinitializeWinSock();
 void Usage();
 void Error(const std::string& msg);
 void FatalError(const std::string& msg);
+int RunBenchmark(const hotline::TunnelOptions& options);
+int RunSignalServer();
+void WriteBenchResult(const Json::Value& result);
 
 
 int main(int argc, char** argv) {
@@ -58,6 +75,13 @@ int main(int argc, char** argv) {
     Error("WinSock initialization failed.");
     return 1;
   }
+#else
+  //
+  // Run the main thread on a socket server of our own, which batched UDP
+  // sockets are wrapped into.
+  //
+  rtc::PhysicalSocketServer socket_server;
+  rtc::SocketServerScope socket_server_scope(&socket_server);
 #endif // WIN32
 
   rtc::WindowsCommandLineArguments win_args;
@@ -78,6 +102,76 @@ int main(int argc, char** argv) {
   arguments.protocol = FLAG_udp ? cricket::PROTO_UDP : cricket::PROTO_TCP;
   arguments.room_id = FLAG_r;
   arguments.password = FLAG_p;
+  arguments.options.udp_max_retransmits = FLAG_udp_max_retransmits;
+  arguments.options.udp_max_packet_lifetime = FLAG_udp_max_packet_lifetime;
+  arguments.options.udp_idle_timeout = FLAG_udp_idle_timeout;
+  arguments.options.udp_batch = FLAG_udp_batch;
+  arguments.options.udp_fec_group = FLAG_udp_fec_group;
+  arguments.options.compress_level = FLAG_compress;
+  arguments.options.dedup_cache = FLAG_dedup;
+  arguments.options.ice_batch = FLAG_ice_batch;
+  arguments.options.speculative_offer = FLAG_speculative_offer;
+  if (!hotline::ParseBenchPayload(FLAG_bench_payload, &arguments.options.bench_payload)) {
+    Error("-bench_payload must be random, text or repeat.");
+    return 1;
+  }
+#ifndef WIN32
+  arguments.options.socket_server = &socket_server;
+#endif
+
+  hotline::TrafficCapture capture;
+  if (strlen(FLAG_capture) > 0) {
+    if (!capture.Open(FLAG_capture, FLAG_capture_records > 0 ? FLAG_capture_records : 1,
+                      arguments.server_mode)) {
+      Error(std::string("Can't create the capture file ") + FLAG_capture + ".");
+      return 1;
+    }
+    arguments.options.capture = &capture;
+  }
+
+  hotline::TransitStats transit;
+  if (FLAG_transit) {
+    arguments.options.transit = &transit;
+  }
+
+  if (FLAG_signal_server > 0) {
+    return RunSignalServer();
+  }
+
+  rtc::scoped_ptr<hotline::SetupTrace> trace;
+  if (strlen(FLAG_trace) > 0) {
+    trace.reset(new hotline::SetupTrace(FLAG_trace_events > 0 ? FLAG_trace_events : 1));
+    trace->Begin("signal", "signal_connect", 0);
+    arguments.options.trace = trace.get();
+  }
+
+  hotline::TunnelMetrics metrics;
+  hotline::MetricsServer metrics_server(rtc::ThreadManager::Instance()->CurrentThread(),
+                                        &metrics);
+  if (strlen(FLAG_metrics) > 0) {
+    std::string metrics_address = FLAG_metrics;
+    if (metrics_address.find(":") == std::string::npos) {
+      metrics_address = "127.0.0.1:" + metrics_address;
+    }
+    rtc::SocketAddress address;
+    if (!address.FromString(metrics_address) || !metrics_server.Listen(address)) {
+      Error("Can't serve metrics on " + metrics_address + ".");
+      return 1;
+    }
+    if (FLAG_transit) metrics.set_transit(&transit);
+    metrics_server.set_trace(trace.get());
+    arguments.options.metrics = &metrics;
+  }
+
+  if (strlen(FLAG_bench) > 0) {
+    rtc::InitializeSSL();
+    int result = RunBenchmark(arguments.options);
+    rtc::CleanupSSL();
+    if (trace && !trace->WriteChromeJson(FLAG_trace)) {
+      Error(std::string("Can't write the trace to ") + FLAG_trace + ".");
+    }
+    return result;
+  }
 
   if (arguments.server_mode) {
     if (argc != 1) {
@@ -100,10 +194,13 @@ int main(int argc, char** argv) {
       return 1;
     }
 
-    if (remote_port.find(":") == std::string::npos) remote_port = "127.0.0.1:" + remote_port;
-    if (!arguments.remote_address.FromString(remote_port)) {
-      LOG(LS_ERROR) << argv[1] + std::string(" is not a valid port or address");
-      return 1;
+    // bench:sink and friends are served by the remote peer itself.
+    if (!hotline::BenchEndpointStream::ParseName(remote_port, &arguments.remote_address)) {
+      if (remote_port.find(":") == std::string::npos) remote_port = "127.0.0.1:" + remote_port;
+      if (!arguments.remote_address.FromString(remote_port)) {
+        LOG(LS_ERROR) << argv[1] + std::string(" is not a valid port or address");
+        return 1;
+      }
     }
   }
 
@@ -112,9 +209,31 @@ int main(int argc, char** argv) {
   //
 
   rtc::InitializeSSL();
+  rtc::scoped_ptr<hotline::SignalAddressCache> address_cache;
+  if (FLAG_signal_cache) {
+    address_cache.reset(new hotline::SignalAddressCache(GetSignalCacheFile()));
+  }
   hotline::SignalServerConnection signal_client(rtc::ThreadManager::Instance()->CurrentThread());
+  signal_client.set_fragment_size(std::max(FLAG_ws_fragment, 1));
+  signal_client.set_reconnect(std::max(FLAG_signal_reconnect, 0));
+  signal_client.set_address_cache(address_cache.get());
+  signal_client.set_keepalive(std::max(FLAG_signal_ping, 0), FLAG_signal_ping_timeout);
+  signal_client.set_metrics(arguments.options.metrics);
+  signal_client.set_trace(trace.get());
+  rtc::scoped_ptr<hotline::LanSignalConnection> lan_signal;
+  if (FLAG_lan) {
+    hotline::LanSignalConfig lan_config;
+    lan_config.port = FLAG_lan_port;
+#ifndef WIN32
+    lan_config.socket_server = &socket_server;
+#endif
+    lan_signal.reset(new hotline::LanSignalConnection(
+        rtc::ThreadManager::Instance()->CurrentThread(), lan_config));
+  }
   rtc::scoped_ptr<hotline::Conductors> conductors(
-                              new hotline::Conductors( &signal_client,
+                              new hotline::Conductors(
+                              lan_signal ? static_cast<hotline::SignalConnection*>(lan_signal.get())
+                                         : &signal_client,
                               rtc::ThreadManager::Instance()->CurrentThread(),
                               arguments)
                               );
@@ -123,20 +242,72 @@ int main(int argc, char** argv) {
   // Connect to signal server
   //
 
-  std::string server_url = GetSignalServerName();
-  if ((server_url.find("ws://") != 0 && server_url.find("wss://") != 0)) {
-    return 1;
+  if (lan_signal) {
+    lan_signal->Connect();
   }
+  else {
+    std::string server_url = GetSignalServerName();
+    if ((server_url.find("ws://") != 0 && server_url.find("wss://") != 0)) {
+      return 1;
+    }
 
-  if (server_url.back() != '/') server_url.push_back('/');
-  server_url.append(kDefaultServerPath);
+    if (server_url.back() != '/') server_url.push_back('/');
+    server_url.append(kDefaultServerPath);
 
-  signal_client.Connect(server_url);
+    // The connect, TLS included, runs on the WebSocket thread while this
+    // one creates the PeerConnectionFactory and the offer; what the socket
+    // has to say waits for the message loop.
+    signal_client.Connect(server_url);
+  }
+
+  //
+  // Drive a remote bench endpoint
+  //
+
+  rtc::scoped_ptr<hotline::BenchDriver> bench_driver;
+  hotline::BenchEndpointStream::Kind bench_kind;
+  if (hotline::BenchEndpointStream::IsEndpoint(arguments.remote_address, &bench_kind) &&
+      FLAG_bench_lanes > 0) {
+    hotline::BenchDriverConfig config;
+    config.kind = bench_kind;
+    config.protocol = arguments.protocol;
+    config.lanes = FLAG_bench_lanes;
+    config.seconds = FLAG_bench_time;
+    config.message_size = FLAG_bench_size;
+    config.rate = FLAG_bench_rate;
+    config.payload = arguments.options.bench_payload;
+    config.timeout = FLAG_bench_timeout;
+
+    bench_driver.reset(new hotline::BenchDriver(rtc::ThreadManager::Instance()->CurrentThread(),
+                                                config));
+    conductors->SignalLocalSocketOpened.connect(bench_driver.get(),
+                                                &hotline::BenchDriver::OnLocalSocketOpened);
+    bench_driver->Start();
+  }
+
+  rtc::scoped_ptr<hotline::TransitReporter> transit_reporter;
+  if (FLAG_transit && FLAG_transit_report > 0) {
+    transit_reporter.reset(new hotline::TransitReporter(
+        rtc::ThreadManager::Instance()->CurrentThread(), &transit, FLAG_transit_report));
+    transit_reporter->Start();
+  }
+
+  conductors->PrepareOffer();
 
   rtc::ThreadManager::Instance()->CurrentThread()->Run();
 
+  if (trace && !trace->WriteChromeJson(FLAG_trace)) {
+    Error(std::string("Can't write the trace to ") + FLAG_trace + ".");
+  }
+
+  int result = 0;
+  if (bench_driver) {
+    WriteBenchResult(bench_driver->result());
+    result = bench_driver->succeeded() ? 0 : 1;
+  }
+
   rtc::CleanupSSL();
-  return 0;
+  return result;
 }
 
 
@@ -165,6 +336,91 @@ bool ReinitializeWinSock() {
 }
 #endif // WIN32
 
+// Runs both peers on this thread and prints the result as JSON.
+int RunBenchmark(const hotline::TunnelOptions& options) {
+  hotline::BenchConfig config;
+  config.workload = FLAG_bench;
+  config.message_size = FLAG_bench_size;
+  config.count = FLAG_bench_count;
+  config.total_mb = FLAG_bench_mb;
+  config.rate = FLAG_bench_rate;
+  config.concurrency = FLAG_bench_concurrency;
+  config.lanes = FLAG_bench_lanes;
+  config.seconds = FLAG_bench_time;
+  config.signal_port = FLAG_bench_signal;
+  config.signal_lan_port = FLAG_bench_signal_lan;
+  config.signal_delay = FLAG_signal_delay;
+  config.signal_jitter = FLAG_signal_jitter;
+  config.ws_fragment_size = std::max(FLAG_ws_fragment, 1);
+  config.signal_reconnect = std::max(FLAG_signal_reconnect, 0);
+  config.signal_outage = std::max(FLAG_bench_signal_outage, 0);
+  config.signal_outage_forget = FLAG_bench_signal_forget;
+  config.signal_stall = std::max(FLAG_bench_signal_stall, 0);
+  config.signal_ping = std::max(FLAG_signal_ping, 0);
+  config.signal_ping_timeout = FLAG_signal_ping_timeout;
+  config.replay_file = FLAG_bench_replay;
+  config.network.delay = FLAG_net_delay;
+  config.network.jitter = FLAG_net_jitter;
+  config.network.loss = FLAG_net_loss;
+  config.network.rate = FLAG_net_rate;
+  config.timeout = FLAG_bench_timeout;
+
+  if (config.workload != "echo" && config.workload != "bulk" &&
+      config.workload != "udp" && config.workload != "churn" &&
+      config.workload != "sink" && config.workload != "source" &&
+      config.workload != "replay" && config.workload != "idle") {
+    Error("-bench must be echo, bulk, udp, churn, sink, source, replay or idle.");
+    return 1;
+  }
+  if (config.workload == "replay" && config.replay_file.empty()) {
+    Error("-bench replay needs -bench_replay file.");
+    return 1;
+  }
+
+  rtc::Thread* thread = rtc::ThreadManager::Instance()->CurrentThread();
+  hotline::BenchRunner runner(thread, config, options);
+  if (runner.Start()) {
+    thread->Run();
+  }
+
+  WriteBenchResult(runner.result());
+  return runner.succeeded() ? 0 : 1;
+}
+
+// Serves signaling for peers on this machine until killed.
+int RunSignalServer() {
+  hotline::LocalSignalServerConfig config;
+  config.port = FLAG_signal_server;
+  config.delay = FLAG_signal_delay;
+  config.jitter = FLAG_signal_jitter;
+
+  hotline::LocalSignalServer server(config);
+  if (!server.Start()) {
+    Error("Can't start the signal server on port " + std::to_string(config.port) + ".");
+    return 1;
+  }
+
+  std::cout << "Signal server listening on port " << config.port
+            << ". Point peers at it with HOTLINE_SIGNAL_SERVER=ws://127.0.0.1:"
+            << config.port << std::endl;
+
+  rtc::ThreadManager::Instance()->CurrentThread()->Run();
+  return 0;
+}
+
+// Writes a benchmark result to -bench_out, or stdout.
+void WriteBenchResult(const Json::Value& result) {
+  Json::StyledWriter writer;
+  std::string output = writer.write(result);
+  if (strlen(FLAG_bench_out) > 0) {
+    std::ofstream file(FLAG_bench_out);
+    file << output;
+  }
+  else {
+    std::cout << output;
+  }
+}
+
 // Prints out a usage message then exits.
 void Usage() {
   std::cerr << "Hotline tunnel: Mini peer to peer VPN." << std::endl;
@@ -172,6 +428,10 @@ void Usage() {
   std::cerr << "Usage" << std::endl;
   std::cerr << " Remote peer: htunnel -server [-p password]" << std::endl;
   std::cerr << " Local  peer: htunnel localport remotehost:port -r roomid [-p password -udp]" << std::endl;
+  std::cerr << " Benchmark  : htunnel -bench echo|bulk|udp|churn|sink|source|replay [-bench_size n ... -net_delay ms ...]" << std::endl;
+  std::cerr << "              htunnel localport bench:sink|source|echo -r roomid [-bench_lanes n -bench_time s]" << std::endl;
+  std::cerr << " Test signal: htunnel -signal_server port [-signal_delay ms -signal_jitter ms]" << std::endl;
+  std::cerr << " No server  : add -lan to both peers' command lines" << std::endl;
   std::cerr << std::endl;
   std::cerr << "Example" << std::endl;
   std::cerr << " Remote: htunnel -server -p roompassword" << std::endl;
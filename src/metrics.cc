@@ -0,0 +1,461 @@
+#include "htn_config.h"
+
+#include <algorithm>
+#include <sstream>
+
+#include "webrtc/base/common.h"
+#include "webrtc/base/json.h"
+#include "webrtc/base/logging.h"
+#include "webrtc/base/socketserver.h"
+#include "webrtc/base/thread.h"
+#include "metrics.h"
+#include "setup_trace.h"
+#include "transit.h"
+
+#if defined(_MSC_VER)
+#define HTN_THREAD_LOCAL __declspec(thread)
+#else
+#define HTN_THREAD_LOCAL __thread
+#endif
+
+
+namespace hotline {
+
+static const char* kStopReasonNames[kStopReasonCount] = {
+  "socket_closed",
+  "read_error",
+  "write_error",
+  "channel_send",
+  "queue_full",
+  "corrupt_data",
+  "idle"
+};
+
+static const char* kSignalStateNames[] = {
+  "disconnected",
+  "connected",
+  "signed_in"
+};
+
+// Requests are a line and a few headers; anything longer isn't one.
+static const size_t kMaxRequestSize = 8 * 1024;
+
+
+///////////////////////////////////////////////////////////////////////////////
+// ShardedCounter
+///////////////////////////////////////////////////////////////////////////////
+
+static std::atomic<unsigned int> next_shard(0);
+
+ShardedCounter::ShardedCounter() {
+  for (int i = 0; i < kShards; ++i) shards_[i].value = 0;
+}
+
+uint64 ShardedCounter::value() const {
+  uint64 sum = 0;
+  for (int i = 0; i < kShards; ++i) sum += shards_[i].value.load(std::memory_order_relaxed);
+  return sum;
+}
+
+// Threads take shards in turn the first time they count anything.
+size_t ShardedCounter::Shard() {
+  static HTN_THREAD_LOCAL int shard = -1;
+  if (shard < 0) shard = static_cast<int>(next_shard++ % kShards);
+  return shard;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// TunnelMetrics::LaneMetrics
+///////////////////////////////////////////////////////////////////////////////
+
+TunnelMetrics::LaneMetrics::LaneMetrics(TunnelMetrics* owner, const std::string& name,
+                                        const char* protocol)
+  : owner(owner)
+  , name(name)
+  , protocol(protocol)
+  , bytes_to_tunnel(0)
+  , messages_to_tunnel(0)
+  , bytes_from_tunnel(0)
+  , messages_from_tunnel(0)
+  , queued_bytes(0)
+  , buffered_amount(0) {
+}
+
+void TunnelMetrics::LaneMetrics::ReadFromSocket(size_t len) {
+  owner->bytes_from_sockets_.Add(len);
+}
+
+void TunnelMetrics::LaneMetrics::SentToTunnel(size_t len) {
+  bytes_to_tunnel.fetch_add(len, std::memory_order_relaxed);
+  messages_to_tunnel.fetch_add(1, std::memory_order_relaxed);
+  owner->bytes_to_tunnel_.Add(len);
+  owner->messages_to_tunnel_.Add(1);
+}
+
+void TunnelMetrics::LaneMetrics::ReceivedFromTunnel(size_t len) {
+  bytes_from_tunnel.fetch_add(len, std::memory_order_relaxed);
+  messages_from_tunnel.fetch_add(1, std::memory_order_relaxed);
+  owner->bytes_from_tunnel_.Add(len);
+  owner->messages_from_tunnel_.Add(1);
+}
+
+void TunnelMetrics::LaneMetrics::SetQueued(uint64 queued, uint64 buffered) {
+  queued_bytes.store(queued, std::memory_order_relaxed);
+  buffered_amount.store(buffered, std::memory_order_relaxed);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// TunnelMetrics
+///////////////////////////////////////////////////////////////////////////////
+
+TunnelMetrics::TunnelMetrics()
+  : signal_state_(kSignalDisconnected)
+  , signal_rtt_us_(-1)
+  , transit_(NULL) {
+}
+
+TunnelMetrics::~TunnelMetrics() {
+  for (std::list<LaneMetrics*>::iterator it = lanes_.begin(); it != lanes_.end(); ++it) {
+    delete *it;
+  }
+}
+
+TunnelMetrics::LaneMetrics* TunnelMetrics::OpenLane(const std::string& name,
+                                                    const char* protocol) {
+  LaneMetrics* lane = new LaneMetrics(this, name, protocol);
+  lanes_opened_.Add(1);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  lanes_.push_back(lane);
+  return lane;
+}
+
+void TunnelMetrics::CloseLane(LaneMetrics* lane) {
+  lanes_closed_.Add(1);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    lanes_.remove(lane);
+  }
+  delete lane;
+}
+
+void TunnelMetrics::LaneSetupFailed() {
+  lane_setup_failures_.Add(1);
+}
+
+void TunnelMetrics::LaneStopped(LaneStopReason reason) {
+  if (reason >= 0 && reason < kStopReasonCount) lane_stops_[reason].Add(1);
+}
+
+void TunnelMetrics::SetSignalState(SignalState state) {
+  signal_state_ = state;
+}
+
+void TunnelMetrics::AddPeer(uint64 peer_id) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  live_peers_.insert(peer_id);
+}
+
+void TunnelMetrics::SetPeerStats(uint64 peer_id, const PeerStats& stats) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (live_peers_.find(peer_id) == live_peers_.end()) return;
+  peers_[peer_id] = stats;
+}
+
+void TunnelMetrics::RemovePeer(uint64 peer_id) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  live_peers_.erase(peer_id);
+  peers_.erase(peer_id);
+}
+
+
+// Label values may hold anything but \, " and newlines unescaped.
+static std::string LabelValue(const std::string& value) {
+  std::string escaped;
+  for (size_t i = 0; i < value.size(); ++i) {
+    if (value[i] == '\\') escaped += "\\\\";
+    else if (value[i] == '"') escaped += "\\\"";
+    else if (value[i] == '\n') escaped += "\\n";
+    else escaped += value[i];
+  }
+  return escaped;
+}
+
+static void Family(std::ostringstream& out, const char* name, const char* type,
+                   const char* help) {
+  out << "# HELP " << name << " " << help << "\n";
+  out << "# TYPE " << name << " " << type << "\n";
+}
+
+static void TransitSummary(std::ostringstream& out, const std::string& labels,
+                           const Json::Value& latency) {
+  static const char* kQuantiles[][2] = {
+    { "0.5", "p50" }, { "0.99", "p99" }, { "0.999", "p999" }
+  };
+  const char* separator = labels.empty() ? "" : ",";
+  for (size_t i = 0; i < sizeof(kQuantiles) / sizeof(kQuantiles[0]); ++i) {
+    out << "htunnel_transit_seconds{" << labels << separator << "quantile=\""
+        << kQuantiles[i][0] << "\"} " << latency[kQuantiles[i][1]].asDouble() / 1e6 << "\n";
+  }
+
+  std::string braces = labels.empty() ? "" : "{" + labels + "}";
+  double count = latency["count"].asDouble();
+  out << "htunnel_transit_seconds_sum" << braces << " "
+      << latency["mean"].asDouble() * count / 1e6 << "\n";
+  out << "htunnel_transit_seconds_count" << braces << " " << count << "\n";
+}
+
+std::string TunnelMetrics::Render() const {
+  std::ostringstream out;
+  out.precision(12);
+
+  Family(out, "htunnel_signal_state", "gauge",
+         "1 for the state of the signal server connection.");
+  int state = signal_state_;
+  for (int i = kSignalDisconnected; i <= kSignalSignedIn; ++i) {
+    out << "htunnel_signal_state{state=\"" << kSignalStateNames[i] << "\"} "
+        << (i == state ? 1 : 0) << "\n";
+  }
+  int64 signal_rtt = signal_rtt_us_;
+  if (signal_rtt >= 0) {
+    Family(out, "htunnel_signal_rtt_seconds", "gauge",
+           "Round trip time of the last keepalive ping to the signal server.");
+    out << "htunnel_signal_rtt_seconds " << signal_rtt / 1000000.0 << "\n";
+  }
+
+  Family(out, "htunnel_lanes_opened_total", "counter", "Lanes opened.");
+  out << "htunnel_lanes_opened_total " << lanes_opened_.value() << "\n";
+  Family(out, "htunnel_lanes_closed_total", "counter", "Lanes closed.");
+  out << "htunnel_lanes_closed_total " << lanes_closed_.value() << "\n";
+  Family(out, "htunnel_lane_setup_failures_total", "counter",
+         "Lanes that couldn't be set up.");
+  out << "htunnel_lane_setup_failures_total " << lane_setup_failures_.value() << "\n";
+  Family(out, "htunnel_lane_stops_total", "counter", "Lanes stopped, by reason.");
+  for (int i = 0; i < kStopReasonCount; ++i) {
+    out << "htunnel_lane_stops_total{reason=\"" << kStopReasonNames[i] << "\"} "
+        << lane_stops_[i].value() << "\n";
+  }
+
+  Family(out, "htunnel_bytes_total", "counter",
+         "Bytes of lane messages sent to and received from the tunnel.");
+  out << "htunnel_bytes_total{direction=\"to_tunnel\"} " << bytes_to_tunnel_.value() << "\n";
+  out << "htunnel_bytes_total{direction=\"from_tunnel\"} " << bytes_from_tunnel_.value() << "\n";
+  Family(out, "htunnel_socket_read_bytes_total", "counter",
+         "Bytes lanes read from their local sockets, before compression and dedup.");
+  out << "htunnel_socket_read_bytes_total " << bytes_from_sockets_.value() << "\n";
+  Family(out, "htunnel_messages_total", "counter",
+         "Lane messages sent to and received from the tunnel.");
+  out << "htunnel_messages_total{direction=\"to_tunnel\"} " << messages_to_tunnel_.value() << "\n";
+  out << "htunnel_messages_total{direction=\"from_tunnel\"} " << messages_from_tunnel_.value() << "\n";
+
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  Family(out, "htunnel_lanes_open", "gauge", "Lanes open now.");
+  out << "htunnel_lanes_open " << lanes_.size() << "\n";
+
+  Family(out, "htunnel_lane_bytes_total", "counter", "Bytes of messages of an open lane.");
+  for (std::list<LaneMetrics*>::const_iterator it = lanes_.begin(); it != lanes_.end(); ++it) {
+    std::string labels = "lane=\"" + LabelValue((*it)->name) + "\",protocol=\"" +
+                         (*it)->protocol + "\"";
+    out << "htunnel_lane_bytes_total{" << labels << ",direction=\"to_tunnel\"} "
+        << (*it)->bytes_to_tunnel.load(std::memory_order_relaxed) << "\n";
+    out << "htunnel_lane_bytes_total{" << labels << ",direction=\"from_tunnel\"} "
+        << (*it)->bytes_from_tunnel.load(std::memory_order_relaxed) << "\n";
+  }
+  Family(out, "htunnel_lane_messages_total", "counter", "Messages of an open lane.");
+  for (std::list<LaneMetrics*>::const_iterator it = lanes_.begin(); it != lanes_.end(); ++it) {
+    std::string labels = "lane=\"" + LabelValue((*it)->name) + "\",protocol=\"" +
+                         (*it)->protocol + "\"";
+    out << "htunnel_lane_messages_total{" << labels << ",direction=\"to_tunnel\"} "
+        << (*it)->messages_to_tunnel.load(std::memory_order_relaxed) << "\n";
+    out << "htunnel_lane_messages_total{" << labels << ",direction=\"from_tunnel\"} "
+        << (*it)->messages_from_tunnel.load(std::memory_order_relaxed) << "\n";
+  }
+  Family(out, "htunnel_lane_queued_bytes", "gauge",
+         "Bytes from the tunnel the local socket hasn't taken yet.");
+  for (std::list<LaneMetrics*>::const_iterator it = lanes_.begin(); it != lanes_.end(); ++it) {
+    out << "htunnel_lane_queued_bytes{lane=\"" << LabelValue((*it)->name) << "\"} "
+        << (*it)->queued_bytes.load(std::memory_order_relaxed) << "\n";
+  }
+  Family(out, "htunnel_lane_buffered_bytes", "gauge",
+         "Bytes sent to the data channel that SCTP hasn't taken yet.");
+  for (std::list<LaneMetrics*>::const_iterator it = lanes_.begin(); it != lanes_.end(); ++it) {
+    out << "htunnel_lane_buffered_bytes{lane=\"" << LabelValue((*it)->name) << "\"} "
+        << (*it)->buffered_amount.load(std::memory_order_relaxed) << "\n";
+  }
+
+  Family(out, "htunnel_peer_rtt_seconds", "gauge",
+         "Round trip time of the active ICE candidate pair.");
+  for (std::map<uint64, PeerStats>::const_iterator it = peers_.begin(); it != peers_.end(); ++it) {
+    if (it->second.rtt_ms < 0) continue;
+    out << "htunnel_peer_rtt_seconds{peer=\"" << it->first << "\"} "
+        << it->second.rtt_ms / 1000.0 << "\n";
+  }
+  Family(out, "htunnel_peer_available_bandwidth_bits", "gauge",
+         "Bandwidth estimate of the connection to a peer, bits per second.");
+  for (std::map<uint64, PeerStats>::const_iterator it = peers_.begin(); it != peers_.end(); ++it) {
+    if (it->second.available_send_bandwidth >= 0) {
+      out << "htunnel_peer_available_bandwidth_bits{peer=\"" << it->first
+          << "\",direction=\"send\"} " << it->second.available_send_bandwidth << "\n";
+    }
+    if (it->second.available_receive_bandwidth >= 0) {
+      out << "htunnel_peer_available_bandwidth_bits{peer=\"" << it->first
+          << "\",direction=\"receive\"} " << it->second.available_receive_bandwidth << "\n";
+    }
+  }
+  Family(out, "htunnel_peer_bytes_total", "counter",
+         "Bytes on the active ICE candidate pair, as of the last GetStats().");
+  for (std::map<uint64, PeerStats>::const_iterator it = peers_.begin(); it != peers_.end(); ++it) {
+    out << "htunnel_peer_bytes_total{peer=\"" << it->first << "\",direction=\"sent\"} "
+        << it->second.bytes_sent << "\n";
+    out << "htunnel_peer_bytes_total{peer=\"" << it->first << "\",direction=\"received\"} "
+        << it->second.bytes_received << "\n";
+  }
+
+  if (transit_) {
+    Json::Value report;
+    transit_->Report(&report);
+
+    Family(out, "htunnel_transit_seconds", "summary",
+           "Time lane data spends between one peer's read and the other's write.");
+    TransitSummary(out, "", report["total"]);
+    const Json::Value& lanes = report["lanes"];
+    std::vector<std::string> names = lanes.getMemberNames();
+    for (size_t i = 0; i < names.size(); ++i) {
+      TransitSummary(out, "lane=\"" + LabelValue(names[i]) + "\"", lanes[names[i]]);
+    }
+  }
+
+  return out.str();
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// MetricsServer
+///////////////////////////////////////////////////////////////////////////////
+
+MetricsServer::MetricsServer(rtc::Thread* thread, const TunnelMetrics* metrics)
+  : thread_(thread)
+  , metrics_(metrics)
+  , trace_(NULL) {
+}
+
+MetricsServer::~MetricsServer() {
+  for (size_t i = 0; i < clients_.size(); ++i) {
+    delete clients_[i];
+  }
+}
+
+bool MetricsServer::Listen(const rtc::SocketAddress& address) {
+  listen_.reset(thread_->socketserver()->CreateAsyncSocket(address.family(), SOCK_STREAM));
+  if (!listen_) return false;
+
+  if (listen_->Bind(address) == SOCKET_ERROR || listen_->Listen(16) == SOCKET_ERROR) {
+    LOG(LS_ERROR) << "Can't listen for metrics on " << address.ToString() << ".";
+    listen_.reset();
+    return false;
+  }
+  listen_->SignalReadEvent.connect(this, &MetricsServer::OnAccept);
+  LOG(LS_INFO) << "Serving metrics on " << listen_->GetLocalAddress().ToString() << ".";
+  return true;
+}
+
+MetricsServer::Client* MetricsServer::Find(rtc::AsyncSocket* socket) {
+  for (size_t i = 0; i < clients_.size(); ++i) {
+    if (clients_[i]->socket.get() == socket) return clients_[i];
+  }
+  return NULL;
+}
+
+void MetricsServer::Respond(Client* client) {
+  std::string status = "200 OK";
+  std::string type = "text/plain; version=0.0.4";
+  std::string body;
+  if (client->request.compare(0, 4, "GET ") != 0) {
+    status = "405 Method Not Allowed";
+  }
+  else if (trace_ && client->request.compare(4, 7, "/trace ") == 0) {
+    type = "application/json";
+    body = trace_->ToChromeJson();
+  }
+  else {
+    body = metrics_->Render();
+  }
+
+  std::ostringstream response;
+  response << "HTTP/1.0 " << status << "\r\n"
+           << "Content-Type: " << type << "\r\n"
+           << "Content-Length: " << body.size() << "\r\n"
+           << "Connection: close\r\n\r\n"
+           << body;
+  client->response = response.str();
+  Flush(client);
+}
+
+void MetricsServer::Flush(Client* client) {
+  while (!client->response.empty()) {
+    int len = client->socket->Send(client->response.data(), client->response.size());
+    if (len < 0) {
+      if (!client->socket->IsBlocking()) Remove(client);
+      return;
+    }
+    client->response.erase(0, len);
+  }
+  Remove(client);
+}
+
+void MetricsServer::Remove(Client* client) {
+  std::vector<Client*>::iterator it = std::find(clients_.begin(), clients_.end(), client);
+  if (it != clients_.end()) clients_.erase(it);
+
+  client->socket->Close();
+  thread_->Dispose(client->socket.release());
+  delete client;
+}
+
+void MetricsServer::OnAccept(rtc::AsyncSocket* socket) {
+  rtc::AsyncSocket* accepted;
+  while ((accepted = socket->Accept(NULL)) != NULL) {
+    Client* client = new Client();
+    client->socket.reset(accepted);
+    accepted->SignalReadEvent.connect(this, &MetricsServer::OnRead);
+    accepted->SignalWriteEvent.connect(this, &MetricsServer::OnWrite);
+    accepted->SignalCloseEvent.connect(this, &MetricsServer::OnClose);
+    clients_.push_back(client);
+  }
+}
+
+void MetricsServer::OnRead(rtc::AsyncSocket* socket) {
+  Client* client = Find(socket);
+  if (!client || !client->response.empty()) return;
+
+  char buffer[1024];
+  int len;
+  while ((len = socket->Recv(buffer, sizeof(buffer))) > 0) {
+    client->request.append(buffer, len);
+    if (client->request.find("\r\n\r\n") != std::string::npos) {
+      Respond(client);
+      return;
+    }
+    if (client->request.size() > kMaxRequestSize) {
+      Remove(client);
+      return;
+    }
+  }
+}
+
+void MetricsServer::OnWrite(rtc::AsyncSocket* socket) {
+  Client* client = Find(socket);
+  if (client && !client->response.empty()) Flush(client);
+}
+
+void MetricsServer::OnClose(rtc::AsyncSocket* socket, int error) {
+  Client* client = Find(socket);
+  if (client) Remove(client);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+} // namespace hotline
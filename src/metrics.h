@@ -0,0 +1,219 @@
+#ifndef HOTLINE_TUNNEL_METRICS_H_
+#define HOTLINE_TUNNEL_METRICS_H_
+#pragma once
+
+#include "htn_config.h"
+
+#include <atomic>
+#include <list>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "webrtc/base/asyncsocket.h"
+#include "webrtc/base/basictypes.h"
+#include "webrtc/base/scoped_ptr.h"
+#include "webrtc/base/sigslot.h"
+#include "webrtc/base/socketaddress.h"
+
+
+namespace rtc {
+  class Thread;
+}
+
+
+namespace hotline {
+
+class SetupTrace;
+class TransitStats;
+
+// Why SocketConnection::Stop() gave up on a lane.
+enum LaneStopReason {
+  kStopSocketClosed,     // the local socket was closed
+  kStopReadError,        // reading the local socket failed
+  kStopWriteError,       // writing the local socket failed
+  kStopChannelSend,      // the data channel refused data
+  kStopQueueFull,        // the local socket fell too far behind
+  kStopCorruptData,      // the peer's data didn't decode
+  kStopIdle,             // a UDP session timed out
+  kStopReasonCount
+};
+
+
+//////////////////////////////////////////////////////////////////////
+// ShardedCounter
+// A counter any thread can add to without a lock or a shared cache
+// line: each thread adds to one of kShards padded slots, and value()
+// sums them.
+//
+class ShardedCounter {
+public:
+  enum { kShards = 16 };
+
+  ShardedCounter();
+
+  void Add(uint64 n) {
+    shards_[Shard()].value.fetch_add(n, std::memory_order_relaxed);
+  }
+  uint64 value() const;
+
+private:
+  struct Slot {
+    std::atomic<uint64> value;
+    char padding[64 - sizeof(std::atomic<uint64>)];
+  };
+
+  static size_t Shard();
+
+  Slot shards_[kShards];
+};
+
+
+//////////////////////////////////////////////////////////////////////
+// TunnelMetrics
+// Counters of the tunnel, its lanes and peers, rendered in the
+// Prometheus text format. The data path only touches atomics: a lane
+// adds to its own LaneMetrics and to the sharded totals. Opening and
+// closing lanes, peer stats and Render() take a lock.
+//
+class TunnelMetrics {
+public:
+  enum SignalState {
+    kSignalDisconnected,
+    kSignalConnected,
+    kSignalSignedIn
+  };
+
+  // One lane's numbers. Written by the lane, read by Render().
+  struct LaneMetrics {
+    LaneMetrics(TunnelMetrics* owner, const std::string& name, const char* protocol);
+
+    // Data read from the local socket, before compression and dedup.
+    void ReadFromSocket(size_t len);
+    // A message sent to or received from the data channel.
+    void SentToTunnel(size_t len);
+    void ReceivedFromTunnel(size_t len);
+    // Gauges, sampled by the conductor.
+    void SetQueued(uint64 queued_bytes, uint64 buffered_amount);
+
+    TunnelMetrics* owner;
+    std::string name;
+    const char* protocol;
+    std::atomic<uint64> bytes_to_tunnel;
+    std::atomic<uint64> messages_to_tunnel;
+    std::atomic<uint64> bytes_from_tunnel;
+    std::atomic<uint64> messages_from_tunnel;
+    // Received data the local socket hasn't taken (PacketQueue::byte_count()).
+    std::atomic<uint64> queued_bytes;
+    // Sent data SCTP hasn't taken (the data channel's buffered amount).
+    std::atomic<uint64> buffered_amount;
+  };
+
+  // What WebRTC's GetStats() says about the connection to a peer.
+  struct PeerStats {
+    PeerStats() : rtt_ms(-1), available_send_bandwidth(-1),
+                  available_receive_bandwidth(-1), bytes_sent(0), bytes_received(0) {}
+
+    int64 rtt_ms;                        // -1 if unknown
+    int64 available_send_bandwidth;      // bits per second, -1 if unknown
+    int64 available_receive_bandwidth;
+    int64 bytes_sent;
+    int64 bytes_received;
+  };
+
+  TunnelMetrics();
+  ~TunnelMetrics();
+
+  // protocol is "tcp" or "udp". The lane stays reported until CloseLane().
+  LaneMetrics* OpenLane(const std::string& name, const char* protocol);
+  void CloseLane(LaneMetrics* lane);
+  void LaneSetupFailed();
+  void LaneStopped(LaneStopReason reason);
+
+  void SetSignalState(SignalState state);
+  // Round trip of the last keepalive ping to the signal server, -1 if
+  // unknown. From any thread.
+  void SetSignalRtt(int64 rtt_us) { signal_rtt_us_ = rtt_us; }
+  // Stats are only kept for a peer between AddPeer() and RemovePeer(), so
+  // a GetStats() answer that comes in after the peer is gone is ignored.
+  void AddPeer(uint64 peer_id);
+  void SetPeerStats(uint64 peer_id, const PeerStats& stats);
+  void RemovePeer(uint64 peer_id);
+
+  // Also renders the total of transit, which must outlive this.
+  void set_transit(const TransitStats* transit) { transit_ = transit; }
+
+  // Everything, in the Prometheus text exposition format 0.0.4.
+  std::string Render() const;
+
+  uint64 bytes_from_sockets() const { return bytes_from_sockets_.value(); }
+  uint64 bytes_to_tunnel() const { return bytes_to_tunnel_.value(); }
+
+private:
+  mutable std::mutex mutex_;
+  std::list<LaneMetrics*> lanes_;
+  std::set<uint64> live_peers_;
+  std::map<uint64, PeerStats> peers_;
+  std::atomic<int> signal_state_;
+  std::atomic<int64> signal_rtt_us_;
+  const TransitStats* transit_;
+
+  ShardedCounter lanes_opened_;
+  ShardedCounter lanes_closed_;
+  ShardedCounter lane_setup_failures_;
+  ShardedCounter lane_stops_[kStopReasonCount];
+  ShardedCounter bytes_from_sockets_;
+  ShardedCounter bytes_to_tunnel_;
+  ShardedCounter messages_to_tunnel_;
+  ShardedCounter bytes_from_tunnel_;
+  ShardedCounter messages_from_tunnel_;
+};
+
+
+//////////////////////////////////////////////////////////////////////
+// MetricsServer
+// Serves TunnelMetrics::Render() over HTTP on the given thread: any GET
+// gets the whole page and the connection is closed. With a trace,
+// GET /trace gets it as Chrome trace JSON instead.
+//
+class MetricsServer : public sigslot::has_slots<> {
+public:
+  MetricsServer(rtc::Thread* thread, const TunnelMetrics* metrics);
+  ~MetricsServer();
+
+  // Listens on address, e.g. 127.0.0.1:9100.
+  bool Listen(const rtc::SocketAddress& address);
+  // Must outlive this.
+  void set_trace(const SetupTrace* trace) { trace_ = trace; }
+
+private:
+  struct Client {
+    rtc::scoped_ptr<rtc::AsyncSocket> socket;
+    std::string request;
+    std::string response;
+  };
+
+  Client* Find(rtc::AsyncSocket* socket);
+  void Respond(Client* client);
+  void Flush(Client* client);
+  void Remove(Client* client);
+
+  void OnAccept(rtc::AsyncSocket* socket);
+  void OnRead(rtc::AsyncSocket* socket);
+  void OnWrite(rtc::AsyncSocket* socket);
+  void OnClose(rtc::AsyncSocket* socket, int error);
+
+  rtc::Thread* thread_;
+  const TunnelMetrics* metrics_;
+  const SetupTrace* trace_;
+  rtc::scoped_ptr<rtc::AsyncSocket> listen_;
+  std::vector<Client*> clients_;
+};
+
+//////////////////////////////////////////////////////////////////////
+
+} // namespace hotline
+
+#endif  // HOTLINE_TUNNEL_METRICS_H_
@@ -0,0 +1,107 @@
+#include "htn_config.h"
+
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <thread>
+
+#include "webrtc/base/timeutils.h"
+#include "setup_trace.h"
+
+
+namespace hotline {
+
+static uint64 NowMicros() {
+  return rtc::TimeNanos() / 1000;
+}
+
+// Chrome only needs threads told apart.
+static uint32 CurrentThread() {
+  return static_cast<uint32>(std::hash<std::thread::id>()(std::this_thread::get_id()));
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// SetupTrace
+///////////////////////////////////////////////////////////////////////////////
+
+SetupTrace::SetupTrace(size_t capacity)
+  : events_(new Event[std::max(capacity, (size_t)1)])
+  , capacity_(std::max(capacity, (size_t)1))
+  , next_event_(0)
+  , start_time_(NowMicros()) {
+  for (size_t i = 0; i < capacity_; ++i) events_[i].sequence = 0;
+}
+
+void SetupTrace::Begin(const char* category, const char* name, uint64 id) {
+  Record('b', category, name, id);
+}
+
+void SetupTrace::End(const char* category, const char* name, uint64 id) {
+  Record('e', category, name, id);
+}
+
+void SetupTrace::Instant(const char* category, const char* name, uint64 id) {
+  Record('n', category, name, id);
+}
+
+void SetupTrace::Record(char phase, const char* category, const char* name, uint64 id) {
+  uint64 index = next_event_++;
+  Event* event = &events_[index % capacity_];
+
+  // The fence keeps the field stores below from becoming visible before
+  // the slot is marked as being written.
+  event->sequence.store(0, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  event->category.store(category, std::memory_order_relaxed);
+  event->name.store(name, std::memory_order_relaxed);
+  event->id.store(id, std::memory_order_relaxed);
+  event->time.store(NowMicros() - start_time_, std::memory_order_relaxed);
+  event->thread.store(CurrentThread(), std::memory_order_relaxed);
+  event->phase.store(phase, std::memory_order_relaxed);
+  event->sequence.store(index + 1, std::memory_order_release);
+}
+
+// Events still being written, or overwritten while read, are skipped.
+std::string SetupTrace::ToChromeJson() const {
+  std::ostringstream out;
+  out << "{\"traceEvents\":[";
+
+  uint64 end = next_event_;
+  uint64 begin = end > capacity_ ? end - capacity_ : 0;
+  bool first = true;
+  for (uint64 index = begin; index < end; ++index) {
+    const Event* slot = &events_[index % capacity_];
+    if (slot->sequence.load(std::memory_order_acquire) != index + 1) continue;
+    const char* category = slot->category.load(std::memory_order_relaxed);
+    const char* name = slot->name.load(std::memory_order_relaxed);
+    uint64 id = slot->id.load(std::memory_order_relaxed);
+    uint64 time = slot->time.load(std::memory_order_relaxed);
+    uint32 thread = slot->thread.load(std::memory_order_relaxed);
+    char phase = slot->phase.load(std::memory_order_relaxed);
+    // Orders the field loads above before the second look at the sequence;
+    // if a writer got in between, it shows here.
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot->sequence.load(std::memory_order_relaxed) != index + 1) continue;
+
+    out << (first ? "" : ",") << "\n{\"name\":\"" << name << "\",\"cat\":\"" << category
+        << "\",\"ph\":\"" << phase << "\",\"id\":\"0x" << std::hex << id << std::dec
+        << "\",\"ts\":" << time << ",\"pid\":1,\"tid\":" << thread << "}";
+    first = false;
+  }
+
+  out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+  return out.str();
+}
+
+bool SetupTrace::WriteChromeJson(const std::string& path) const {
+  std::ofstream file(path.c_str(), std::ios::binary);
+  if (!file) return false;
+  file << ToChromeJson();
+  return file.good();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+} // namespace hotline
@@ -0,0 +1,69 @@
+#ifndef HOTLINE_TUNNEL_SETUP_TRACE_H_
+#define HOTLINE_TUNNEL_SETUP_TRACE_H_
+#pragma once
+
+#include "htn_config.h"
+
+#include <atomic>
+#include <string>
+
+#include "webrtc/base/basictypes.h"
+#include "webrtc/base/scoped_ptr.h"
+
+
+namespace hotline {
+
+//////////////////////////////////////////////////////////////////////
+// SetupTrace
+// Spans and instants of connection and lane setup, kept in a ring of
+// fixed size events and exported as Chrome trace JSON (chrome://tracing,
+// Perfetto). Spans are async events matched by name and id, so one may
+// begin on one thread and end on another; the id tells apart spans of
+// the same name, e.g. per peer or per lane.
+//
+// Recording is a clock read, an atomic increment and a store into the
+// ring; safe from any thread. Names and categories must be string
+// literals: only the pointers are kept. When the ring is full the oldest
+// events are overwritten.
+//
+class SetupTrace {
+public:
+  explicit SetupTrace(size_t capacity);
+
+  void Begin(const char* category, const char* name, uint64 id);
+  void End(const char* category, const char* name, uint64 id);
+  void Instant(const char* category, const char* name, uint64 id);
+
+  // {"traceEvents": [...]}, timestamps in microseconds since the trace
+  // was created.
+  std::string ToChromeJson() const;
+  bool WriteChromeJson(const std::string& path) const;
+
+private:
+  // A seqlock slot: the fields are relaxed atomics, ordered by fences
+  // around the sequence, so a reader racing a writer sees a torn event it
+  // then discards rather than undefined behaviour.
+  struct Event {
+    // 0 while being written, else the event's index + 1.
+    std::atomic<uint64> sequence;
+    std::atomic<const char*> category;
+    std::atomic<const char*> name;
+    std::atomic<uint64> id;
+    std::atomic<uint64> time;
+    std::atomic<uint32> thread;
+    std::atomic<char> phase;
+  };
+
+  void Record(char phase, const char* category, const char* name, uint64 id);
+
+  rtc::scoped_ptr<Event[]> events_;
+  size_t capacity_;
+  std::atomic<uint64> next_event_;
+  uint64 start_time_;
+};
+
+//////////////////////////////////////////////////////////////////////
+
+} // namespace hotline
+
+#endif  // HOTLINE_TUNNEL_SETUP_TRACE_H_
@@ -0,0 +1,91 @@
+#include "htn_config.h"
+
+#include <time.h>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+#include "webrtc/base/logging.h"
+#include "signal_address_cache.h"
+
+
+namespace hotline {
+
+///////////////////////////////////////////////////////////////////////////////
+// SignalAddressCache
+///////////////////////////////////////////////////////////////////////////////
+
+SignalAddressCache::SignalAddressCache(const std::string& path)
+  : path_(path)
+  , hosts_(Json::objectValue) {
+  std::ifstream file(path_.c_str(), std::ios::binary);
+  if (!file) return;
+
+  std::stringstream text;
+  text << file.rdbuf();
+  std::string content = text.str();
+
+  Json::Reader reader;
+  Json::Value json;
+  if (!reader.parse(content.data(), content.data() + content.size(), json) ||
+      !json.isObject()) {
+    LOG(LS_WARNING) << path_ << " is not a signal address cache, ignored.";
+    return;
+  }
+  hosts_ = json;
+}
+
+bool SignalAddressCache::Lookup(const std::string& host, std::string* address) const {
+  Json::Value entry;
+  double stored = 0;
+  if (!rtc::GetValueFromJsonObject(hosts_, host, &entry) ||
+      !rtc::GetStringFromJsonObject(entry, "address", address) ||
+      !rtc::GetDoubleFromJsonObject(entry, "time", &stored)) {
+    return false;
+  }
+
+  double now = static_cast<double>(time(NULL));
+  if (now < stored || now - stored > kMaxAge) return false;
+  return !address->empty();
+}
+
+void SignalAddressCache::Store(const std::string& host, const std::string& address) {
+  std::string known;
+  if (Lookup(host, &known) && known == address) return;
+
+  Json::Value entry;
+  entry["address"] = address;
+  entry["time"] = static_cast<double>(time(NULL));
+  hosts_[host] = entry;
+  Save();
+}
+
+void SignalAddressCache::Forget(const std::string& host) {
+  Json::Value entry;
+  if (!rtc::GetValueFromJsonObject(hosts_, host, &entry)) return;
+
+  Json::Value hosts(Json::objectValue);
+  std::vector<std::string> names = hosts_.getMemberNames();
+  for (size_t i = 0; i < names.size(); ++i) {
+    if (names[i] != host) hosts[names[i]] = hosts_[names[i]];
+  }
+  hosts_ = hosts;
+  Save();
+}
+
+bool SignalAddressCache::Save() const {
+  if (path_.empty()) return false;
+
+  std::ofstream file(path_.c_str(), std::ios::binary);
+  if (!file) {
+    LOG(LS_WARNING) << "Can't write the signal address cache " << path_ << ".";
+    return false;
+  }
+  Json::FastWriter writer;
+  file << writer.write(hosts_);
+  return file.good();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+} // namespace hotline
@@ -0,0 +1,46 @@
+#ifndef HOTLINE_TUNNEL_SIGNAL_ADDRESS_CACHE_H_
+#define HOTLINE_TUNNEL_SIGNAL_ADDRESS_CACHE_H_
+#pragma once
+
+#include "htn_config.h"
+
+#include <string>
+
+#include "webrtc/base/basictypes.h"
+#include "webrtc/base/json.h"
+
+
+namespace hotline {
+
+//////////////////////////////////////////////////////////////////////
+// SignalAddressCache
+// The addresses signal server host names led to, kept in a small JSON
+// file between runs so a start can connect without waiting for DNS.
+// An entry is trusted for kMaxAge seconds, and dropped as soon as
+// connecting to it fails. Not thread safe; the signal thread owns it.
+//
+class SignalAddressCache {
+public:
+  enum { kMaxAge = 24 * 60 * 60 };
+
+  // Reads path, if it exists.
+  explicit SignalAddressCache(const std::string& path);
+
+  // The numeric address host was last reached at, if fresh enough.
+  bool Lookup(const std::string& host, std::string* address) const;
+  // Remember and save at once; the next start may be moments away.
+  void Store(const std::string& host, const std::string& address);
+  void Forget(const std::string& host);
+
+private:
+  bool Save() const;
+
+  std::string path_;
+  Json::Value hosts_;   // host: {"address", "time"}
+};
+
+//////////////////////////////////////////////////////////////////////
+
+} // namespace hotline
+
+#endif  // HOTLINE_TUNNEL_SIGNAL_ADDRESS_CACHE_H_
@@ -0,0 +1,78 @@
+#ifndef HOTLINE_TUNNEL_SIGNAL_CONNECTION_H_
+#define HOTLINE_TUNNEL_SIGNAL_CONNECTION_H_
+#pragma once
+
+#include <string>
+
+#include "webrtc/base/basictypes.h"
+#include "webrtc/base/json.h"
+
+
+namespace hotline {
+
+struct SignalServerConnectionObserver {
+
+  virtual void OnConnected() = 0;
+  virtual void OnDisconnected() = 0;
+  virtual void OnCreatedRoom(std::string& room_id) = 0;
+  // offer_peer_id is the peer the offer given to SignIn() was forwarded
+  // to, 0 if none was (or the server doesn't forward offers).
+  virtual void OnSignedIn(std::string& room_id, uint64 peer_id, uint64 offer_peer_id) = 0;
+  // Signed in again after the connection to the server was lost. room_id
+  // is the old one unless the server had lost the room and it was made
+  // again; peer_id is the old one unless the server gave a new one.
+  virtual void OnReconnected(const std::string& room_id, uint64 peer_id) = 0;
+  virtual void OnPeerConnected(uint64 peer_id) = 0;
+  virtual void OnPeerDisconnected(uint64 peer_id) = 0;
+  virtual void OnReceivedOffer(Json::Value& data) = 0;
+  virtual void OnServerConnectionFailure(int code, std::string& message) = 0;
+
+protected:
+  virtual ~SignalServerConnectionObserver() {}
+
+};
+
+
+//////////////////////////////////////////////////////////////////////
+// SignalConnection
+// What Conductors and Conductor need from a signaling channel: rooms,
+// sign in and relaying offers, answers and candidates to the other peer.
+// SignalServerConnection implements it over the signal server; tests and
+// benchmarks can replace it with an in-process one.
+//
+class SignalConnection {
+public:
+
+  // MsgID must be the same as MsgId of signal_server.py
+  enum MsgID {
+    MsgCreateRoom        = 1,
+    MsgSignIn            = 2,
+    MsgSignOut           = 3,
+    MsgPeerConnected     = 4,
+    MsgPeerDisconnected  = 5,
+    MsgSendOffer         = 6,
+    MsgReceivedOffer     = 7
+  };
+
+  virtual void CreateRoom(const std::string& password) = 0;
+  // offer, unless null, is an offer made before knowing any peer
+  // ({"type", "sdp", "candidates"}); the server forwards it to the peer
+  // already in the room, as if that peer had been sent it.
+  virtual void SignIn(std::string& room_id, std::string& password,
+                      const Json::Value& offer) = 0;
+  virtual void SignOut(std::string& room_id) = 0;
+
+  virtual void RegisterObserver(SignalServerConnectionObserver* callback) = 0;
+  virtual void UnregisterObserver(SignalServerConnectionObserver* callback) = 0;
+
+  virtual bool Send(const MsgID msgid, Json::Value& data) = 0;
+
+protected:
+  virtual ~SignalConnection() {}
+};
+
+//////////////////////////////////////////////////////////////////////
+
+} // namespace hotline
+
+#endif  // HOTLINE_TUNNEL_SIGNAL_CONNECTION_H_
@@ -1,5 +1,7 @@
 #include "htn_config.h"
 
+#include <algorithm>
+
 #include "webrtc/base/common.h"
 #include "webrtc/base/logging.h"
 #include "webrtc/base/json.h"
@@ -11,27 +13,86 @@
 
 namespace hotline {
 
+// Messages from the server that may wait for the signal thread at once.
+static const size_t kReceiveQueueSize = 256;
+// First delay before connecting again, milliseconds; it doubles per try.
+static const int kReconnectBaseDelay = 250;
+// Messages kept for the server while reconnecting; the oldest go first.
+static const size_t kMaxPendingSends = 256;
+
 
 SignalServerConnection::SignalServerConnection(rtc::Thread* signal_thread)
   : callback_(NULL)
   , signal_thread_(signal_thread)
+  , fragment_size_(0)
+  , address_cache_(NULL)
+  , trace_(NULL)
+  , metrics_(NULL)
+  , ping_interval_(0)
+  , ping_timeout_(0)
+  , rtt_(-1)
+  , cached_address_used_(false)
+  , opened_(false)
+  , room_owner_(false)
+  , recreating_room_(false)
+  , peer_id_(0)
+  , signed_in_(false)
+  , reconnect_max_delay_(0)
+  , reconnect_attempts_(0)
+  , reconnect_posted_(false)
+  , reconnects_(0)
+  , random_state_(reinterpret_cast<uintptr_t>(this) | 1)
+  , resuming_(false)
+  , received_(kReceiveQueueSize)
+  , drain_posted_(false)
 {
 }
 
 SignalServerConnection::~SignalServerConnection() {
+  // Stops the websocket thread before dropping what it may have posted.
+  ws_.reset();
+  signal_thread_->Clear(this);
 }
 
 
 void SignalServerConnection::Connect(const std::string& url) {
   url_ = url;
 
-  ws_ = rtc::scoped_ptr<WebSocket>(new WebSocket());
+  {
+    // The old socket's thread is done once it's deleted, and with it
+    // anything it had to say.
+    std::lock_guard<std::mutex> lock(send_mutex_);
+    ws_ = rtc::scoped_ptr<WebSocket>(new WebSocket());
+  }
+  signal_thread_->Clear(this, MsgSocketOpened);
+  signal_thread_->Clear(this, MsgSocketClosed);
+  signal_thread_->Clear(this, MsgSocketError);
+
   if (ws_==NULL) {
     LOG(LS_ERROR) << "WebSocket creation failed. ";
     return;
   }
 
   InitSocketSignals();
+  if (fragment_size_ > 0) ws_->setFragmentSize(fragment_size_);
+  if (ping_interval_ > 0) ws_->setKeepalive(ping_interval_, ping_timeout_);
+
+  // Skips DNS when the host was reached before. Plain ws:// only: over
+  // TLS the address would go out as the server name.
+  opened_ = false;
+  cached_address_used_ = false;
+  host_.clear();
+  if (address_cache_ && url.find("ws://") == 0) {
+    host_ = url.substr(5, url.find_first_of(":/", 5) - 5);
+    std::string address;
+    if (address_cache_->Lookup(host_, &address)) {
+      ws_->setConnectAddress(address);
+      cached_address_used_ = true;
+    }
+    if (trace_) {
+      trace_->Instant("signal", cached_address_used_ ? "cached_address" : "resolve_address", 0);
+    }
+  }
 
   if (!ws_->init(url)) {
     LOG(LS_ERROR) << "WebSocket init failed. ";
@@ -46,21 +107,40 @@ void SignalServerConnection::CreateRoom(const std::string& password) {
   Json::Value jdata;
   jdata["password"] = password;
 
-  Send(MsgCreateRoom, jdata);
+  room_owner_ = true;
+  password_ = password;
+
+  if (!Send(MsgCreateRoom, jdata)) {
+    LOG(LS_ERROR) << "Failed to send the create room request.";
+    std::string message("Failed to send the create room request.");
+    ServerConnectionFailure(CreateRoomFailed, message);
+  }
 }
 
-void SignalServerConnection::SignIn(std::string& room_id, std::string& password) {
+void SignalServerConnection::SignIn(std::string& room_id, std::string& password,
+                                    const Json::Value& offer) {
   Json::Value jdata;
 
   jdata["room_id"] = room_id;
   jdata["password"] = password;
+  if (!offer.isNull()) jdata["offer"] = offer;
 
-  Send(MsgSignIn, jdata);
+  room_id_ = room_id;
+  password_ = password;
+  if (!Send(MsgSignIn, jdata)) {
+    LOG(LS_ERROR) << "Failed to send the sign in request.";
+    std::string message("Failed to send the sign in request.");
+    ServerConnectionFailure(SigninFailed, message);
+  }
 }
 
 void SignalServerConnection::SignOut(std::string& room_id) {
   Json::Value jdata;
 
+  {
+    std::lock_guard<std::mutex> lock(send_mutex_);
+    signed_in_ = false;
+  }
   jdata["room_id"] = room_id;
 
   Send(MsgSignOut, jdata);
@@ -85,83 +165,258 @@ void SignalServerConnection::InitSocketSignals() {
   ws_->SignalCloseEvent.connect(this, &SignalServerConnection::onClose);
   ws_->SignalErrorEvent.connect(this, &SignalServerConnection::onError);
   ws_->SignalReadEvent.connect(this, &SignalServerConnection::onMessage);
+  ws_->SignalPongEvent.connect(this, &SignalServerConnection::onPong);
 }
 
 
 void SignalServerConnection::OnMessage(rtc::Message* msg) {
 
-  try {
-    if (msg->message_id == ThreadMsgId::MsgServerMessage) {
-      rtc::scoped_ptr<ServerMessageData> server_msg(static_cast<ServerMessageData*>(msg->pdata));
-    
-      switch (server_msg->msgid()) {
-      case MsgCreateRoom:
-        OnCreatedRoom(server_msg->data());
-        break;
-      case MsgSignIn:
-        OnSignedIn(server_msg->data());
-       break;
-      case MsgPeerConnected:
-        OnPeerConnected(server_msg->data());
-        break;
-      case MsgPeerDisconnected:
-        OnPeerDisconnected(server_msg->data());
-        break;
-      case MsgReceivedOffer:
-        OnReceivedOffer(server_msg->data());
-        break;
-      default:
-        break;
-      }
+  switch (msg->message_id) {
+  case ThreadMsgId::MsgSocketOpened:
+    OnSocketOpened();
+    return;
+  case ThreadMsgId::MsgSocketClosed:
+    OnConnectionLost(false);
+    return;
+  case ThreadMsgId::MsgSocketError:
+    OnConnectionLost(true);
+    return;
+  case ThreadMsgId::MsgReconnect:
+    reconnect_posted_ = false;
+    {
+      std::lock_guard<std::mutex> lock(send_mutex_);
+      resuming_ = true;
     }
+    LOG(LS_INFO) << "Connecting to the signal server again, try " << reconnect_attempts_ << ".";
+    Connect(url_);
+    return;
+  case ThreadMsgId::MsgRetryResolved:
+    reconnect_posted_ = false;
+    Connect(url_);
+    return;
+  case ThreadMsgId::MsgServerMessage:
+    break;
+  default:
+    return;
   }
-  catch (...) {
-    LOG(LS_WARNING) << "SignalServerConnection::OnMessage() Exception.";
-  }
-}
 
+  // Anything received from here on needs another post. An exchange, not
+  // a store, so this also sees every message whose sender found the post
+  // pending.
+  drain_posted_.exchange(false);
 
-void SignalServerConnection::onOpen(WebSocket* ws) {
-  if (callback_) {
-    callback_->OnConnected();
+  std::string* text;
+  while ((text = received_.Front()) != NULL) {
+    try {
+      DispatchServerMessage(*text);
+    }
+    catch (...) {
+      LOG(LS_WARNING) << "SignalServerConnection::OnMessage() Exception.";
+    }
+    received_.Pop();
   }
 }
 
-void SignalServerConnection::onMessage(WebSocket* ws, const WebSocket::Data& data) {
+void SignalServerConnection::DispatchServerMessage(const std::string& text) {
   Json::Reader reader;
   Json::Value jmessage;
-  if (!reader.parse(data.bytes, jmessage)) {
-    LOG(WARNING) << "Received unknown message. " << data.bytes;
+  if (!reader.parse(text.data(), text.data() + text.size(), jmessage)) {
+    LOG(WARNING) << "Received unknown message. " << text;
     return;
   }
 
-  ServerMessageData* msgdata = NULL;
   MsgID msgid;
-  Json::Value payload_data;
+  Json::Value data;
 
   if(!rtc::GetIntFromJsonObject(jmessage, "msgid", (int*)&msgid)) return;
-  if(!rtc::GetValueFromJsonObject(jmessage, "data", &payload_data)) return;
+  if(!rtc::GetValueFromJsonObject(jmessage, "data", &data)) return;
+
+  switch (msgid) {
+  case MsgCreateRoom:
+    OnCreatedRoom(data);
+    break;
+  case MsgSignIn:
+    OnSignedIn(data);
+   break;
+  case MsgPeerConnected:
+    OnPeerConnected(data);
+    break;
+  case MsgPeerDisconnected:
+    OnPeerDisconnected(data);
+    break;
+  case MsgReceivedOffer:
+    OnReceivedOffer(data);
+    break;
+  default:
+    break;
+  }
+}
+
 
-  msgdata = new ServerMessageData(msgid, payload_data);
-  signal_thread_->Post(this, ThreadMsgId::MsgServerMessage, msgdata);
+// The socket's own events come on its thread, and go to the signal thread
+// in order with the messages received.
+
+void SignalServerConnection::onOpen(WebSocket* ws) {
+  signal_thread_->Post(this, ThreadMsgId::MsgSocketOpened);
+}
+
+void SignalServerConnection::onMessage(WebSocket* ws, const WebSocket::Data& data) {
+  // On the websocket thread: copy the message into the next free slot,
+  // whose string keeps its storage, and leave parsing to the signal
+  // thread. One post drains everything received until it runs.
+  std::string* slot = received_.BeginPush();
+  if (slot == NULL) {
+    LOG(LS_ERROR) << "Signal thread too far behind, server message dropped.";
+    return;
+  }
+  slot->assign(data.bytes, data.len);
+  received_.CommitPush();
+
+  if (!drain_posted_.exchange(true)) {
+    signal_thread_->Post(this, ThreadMsgId::MsgServerMessage);
+  }
 }
 
 void SignalServerConnection::onClose(WebSocket* ws) {
-  if (callback_) {
+  signal_thread_->Post(this, ThreadMsgId::MsgSocketClosed);
+}
+
+
+void SignalServerConnection::onError(WebSocket* ws, const WebSocket::ErrorCode& error) {
+  signal_thread_->Post(this, ThreadMsgId::MsgSocketError);
+}
+
+void SignalServerConnection::onPong(WebSocket* ws, int64 rtt) {
+  rtt_ = rtt;
+  if (metrics_) metrics_->SetSignalRtt(rtt);
+}
+
+void SignalServerConnection::OnSocketOpened() {
+  bool resuming;
+  {
+    std::lock_guard<std::mutex> lock(send_mutex_);
+    resuming = resuming_;
+  }
+
+  opened_ = true;
+  if (address_cache_ && !host_.empty()) {
+    std::string address = ws_->getPeerAddress();
+    if (!address.empty()) address_cache_->Store(host_, address);
+  }
+
+  if (!resuming) {
+    if (callback_) callback_->OnConnected();
+    return;
+  }
+
+  SendResumeSignIn();
+}
+
+// Back in the room as the same peer, if the server lets us; everything
+// else waits for the answer.
+void SignalServerConnection::SendResumeSignIn() {
+  Json::FastWriter writer;
+  Json::Value jmessage;
+  jmessage["msgid"] = MsgSignIn;
+  jmessage["ver"] = HOTLINE_API_VERSION;
+  jmessage["data"]["room_id"] = room_id_;
+  jmessage["data"]["password"] = password_;
+  jmessage["data"]["peer_id"] = std::to_string(peer_id_);
+
+  std::lock_guard<std::mutex> lock(send_mutex_);
+  SendNow(writer.write(jmessage));
+}
+
+void SignalServerConnection::OnConnectionLost(bool error) {
+  if (reconnect_posted_) return;
+  SignalConnectionLost(this);
+
+  // The server moved, or is down: ask DNS this time.
+  if (cached_address_used_ && !opened_) {
+    LOG(LS_INFO) << "Cached signal server address failed, resolving " << host_ << ".";
+    address_cache_->Forget(host_);
+    reconnect_posted_ = true;
+    signal_thread_->Post(this, ThreadMsgId::MsgRetryResolved);
+    return;
+  }
+
+  // The PeerConnections don't need the server; only new peers and
+  // renegotiation do, so a session is worth getting back.
+  if (signed_in_ && reconnect_max_delay_ > 0) {
+    if (reconnect_attempts_ == 0 && callback_) callback_->OnDisconnected();
+    ScheduleReconnect();
+    return;
+  }
+
+  if (error) {
+    std::string message = std::string("Signal server connection error. ") + url_ + std::string(".");
+    ServerConnectionFailure(ConnectionFailed, message);
+  }
+  else if (callback_) {
     callback_->OnDisconnected();
   }
 }
 
+void SignalServerConnection::ScheduleReconnect() {
+  int delay = kReconnectBaseDelay;
+  for (int i = 0; i < reconnect_attempts_ && delay < reconnect_max_delay_; ++i) {
+    delay *= 2;
+  }
+  delay = std::min(delay, reconnect_max_delay_);
+
+  // Half the delay plus a random half, so peers that lost the server at
+  // the same moment don't all come back at the same moment.
+  random_state_ ^= random_state_ << 13;
+  random_state_ ^= random_state_ >> 7;
+  random_state_ ^= random_state_ << 17;
+  delay = delay / 2 + static_cast<int>(random_state_ % (delay / 2 + 1));
+
+  reconnect_attempts_++;
+  reconnect_posted_ = true;
+  signal_thread_->PostDelayed(delay, this, ThreadMsgId::MsgReconnect);
+}
+
+// The server doesn't know the room any more, e.g. it was restarted. The
+// tunnels don't care, so this is never fatal: the room's creator makes it
+// again, anyone else keeps trying with the backoff in case it comes back.
+void SignalServerConnection::OnResumeRefused(const std::string& message) {
+  LOG(LS_WARNING) << "Signing in again refused: " << message;
 
-void SignalServerConnection::onError(WebSocket* ws, const WebSocket::ErrorCode& error) {
-  std::string message = std::string("Signal server connection error. ") + url_ + std::string(".");
-  ServerConnectionFailure(ConnectionFailed, message);
+  if (room_owner_ && !recreating_room_) {
+    recreating_room_ = true;
+
+    Json::FastWriter writer;
+    Json::Value jmessage;
+    jmessage["msgid"] = MsgCreateRoom;
+    jmessage["ver"] = HOTLINE_API_VERSION;
+    jmessage["data"]["password"] = password_;
+
+    std::lock_guard<std::mutex> lock(send_mutex_);
+    SendNow(writer.write(jmessage));
+    return;
+  }
+
+  // Still resuming_, so sends keep waiting; the new socket replaces this one.
+  recreating_room_ = false;
+  if (!reconnect_posted_) ScheduleReconnect();
 }
 
 void SignalServerConnection::OnCreatedRoom(Json::Value& data) {
   bool successful;
   std::string room_id;
 
+  if (recreating_room_) {
+    if (!rtc::GetBoolFromJsonObject(data, "successful", &successful) || !successful ||
+        !rtc::GetStringFromJsonObject(data, "room_id", &room_id)) {
+      OnResumeRefused("Room creation failed by signal server.");
+      return;
+    }
+    recreating_room_ = false;
+    room_id_ = room_id;
+    SendResumeSignIn();
+    return;
+  }
+
   if(!rtc::GetBoolFromJsonObject(data, "successful", &successful)) {
     LOG(LS_WARNING) << "Invalid message format";
     ServerConnectionFailure(CreateRoomFailed, std::string("Invalid signal server message format."));
@@ -192,6 +447,19 @@ void SignalServerConnection::OnSignedIn(Json::Value& data) {
   std::string message;
   uint64 npeer_id;
 
+  bool resuming;
+  {
+    std::lock_guard<std::mutex> lock(send_mutex_);
+    resuming = resuming_;
+  }
+
+  if (resuming && (!rtc::GetBoolFromJsonObject(data, "successful", &successful) ||
+                   !successful || !rtc::GetStringFromJsonObject(data, "peer_id", &peer_id))) {
+    rtc::GetStringFromJsonObject(data, "message", &message);
+    OnResumeRefused(message);
+    return;
+  }
+
   if(!rtc::GetBoolFromJsonObject(data, "successful", &successful)
       || !rtc::GetStringFromJsonObject(data, "room_id", &room_id)
       || !rtc::GetStringFromJsonObject(data, "message", &message)
@@ -214,8 +482,35 @@ void SignalServerConnection::OnSignedIn(Json::Value& data) {
   }
 
   npeer_id = strtoull(peer_id.c_str(), NULL, 10);
+  peer_id_ = npeer_id;
+
+  bool resumed = false;
+  {
+    std::lock_guard<std::mutex> lock(send_mutex_);
+    signed_in_ = true;
+    if (resuming_) {
+      resuming_ = false;
+      resumed = true;
+      while (!pending_sends_.empty()) {
+        SendNow(pending_sends_.front());
+        pending_sends_.pop_front();
+      }
+    }
+  }
+
+  if (resumed) {
+    reconnect_attempts_ = 0;
+    reconnects_++;
+    if (callback_) callback_->OnReconnected(room_id_, npeer_id);
+    return;
+  }
+
+  // Only from servers that forward an offer given with the sign in.
+  std::string offer_peer_id;
+  rtc::GetStringFromJsonObject(data, "offer_peer_id", &offer_peer_id);
+
   if (callback_) {
-    callback_->OnSignedIn(room_id, npeer_id);
+    callback_->OnSignedIn(room_id, npeer_id, strtoull(offer_peer_id.c_str(), NULL, 10));
   }
 }
 
@@ -264,8 +559,7 @@ void SignalServerConnection::ServerConnectionFailure(int code, std::string& mess
   }
 }
 
-template<typename T>
-bool SignalServerConnection::Send(const MsgID msgid, T& data) {
+bool SignalServerConnection::Send(const MsgID msgid, Json::Value& data) {
 
   int version = HOTLINE_API_VERSION;
 
@@ -276,14 +570,29 @@ bool SignalServerConnection::Send(const MsgID msgid, T& data) {
   jmessage["ver"] = version;
   jmessage["data"] = data;
 
-  if (ws_->getReadyState() != WebSocket::State::OPEN) {
+  std::lock_guard<std::mutex> lock(send_mutex_);
+
+  // Between losing the server and signing in again; from any thread.
+  if (resuming_ || (signed_in_ && reconnect_max_delay_ > 0 &&
+                    (!ws_ || ws_->getReadyState() != WebSocket::State::OPEN))) {
+    if (pending_sends_.size() >= kMaxPendingSends) pending_sends_.pop_front();
+    pending_sends_.push_back(writer.write(jmessage));
+    return true;
+  }
+
+  if (!ws_ || ws_->getReadyState() != WebSocket::State::OPEN) {
     LOG(LS_ERROR) << "WebSocket not opened, Send("
         + std::to_string(msgid) + ", " + std::to_string(version) + ", " + writer.write(data) + ") failed.";
     return false;
   }
 
-  ws_->send(writer.write(jmessage));
-  return true;
+  return SendNow(writer.write(jmessage));
+}
+
+// With send_mutex_ held.
+bool SignalServerConnection::SendNow(const std::string& message) {
+  if (!ws_ || ws_->getReadyState() != WebSocket::State::OPEN) return false;
+  return ws_->send(message);
 }
 
 bool SignalServerConnection::Send(const MsgID msgid) {
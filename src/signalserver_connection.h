@@ -2,6 +2,9 @@
 #define HOTLINE_TUNNEL_SIGNALSERVER_CONNECTION_H_
 #pragma once
 
+#include <atomic>
+#include <deque>
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -10,45 +13,28 @@
 #include "webrtc/base/scoped_ptr.h"
 #include "webrtc/base/thread.h"
 #include "webrtc/base/json.h"
+#include "metrics.h"
+#include "signal_address_cache.h"
+#include "setup_trace.h"
+#include "signal_connection.h"
+#include "spsc_ring.h"
 #include "websocket.h"
 
 
 namespace hotline {
 
-struct SignalServerConnectionObserver {
-
-  virtual void OnConnected() = 0;
-  virtual void OnDisconnected() = 0;
-  virtual void OnCreatedRoom(std::string& room_id) = 0;
-  virtual void OnSignedIn(std::string& room_id, uint64 peer_id) = 0;
-  virtual void OnPeerConnected(uint64 peer_id) = 0;
-  virtual void OnPeerDisconnected(uint64 peer_id) = 0;
-  virtual void OnReceivedOffer(Json::Value& data) = 0;
-  virtual void OnServerConnectionFailure(int code, std::string& message) = 0;
-
-protected:
-  virtual ~SignalServerConnectionObserver() {}
-
-};
-
-
-class SignalServerConnection : public sigslot::has_slots<>,
+class SignalServerConnection : public SignalConnection,
+                             public sigslot::has_slots<>,
                              public rtc::MessageHandler {
 public:
 
-  // MsgID must be the same as MsgId of signal_server.py
-  enum MsgID {
-    MsgCreateRoom        = 1,
-    MsgSignIn            = 2,
-    MsgSignOut           = 3,
-    MsgPeerConnected     = 4,
-    MsgPeerDisconnected  = 5,
-    MsgSendOffer         = 6,
-    MsgReceivedOffer     = 7
-  };
-
   enum ThreadMsgId{
-    MsgServerMessage
+    MsgServerMessage,
+    MsgSocketOpened,
+    MsgSocketClosed,
+    MsgSocketError,
+    MsgReconnect,
+    MsgRetryResolved
   };
 
   enum ServerError {
@@ -58,35 +44,49 @@ public:
     CreateRoomFailed
   };
 
-  struct ServerMessageData : public rtc::MessageData {
-  public:
-    ServerMessageData(MsgID msgid, Json::Value& data) {
-      msgid_ = msgid;
-      data_ = data;
-    }
-
-    MsgID msgid() {return msgid_;}
-    Json::Value& data() {return data_;}
-
-  private:
-    MsgID msgid_;
-    Json::Value data_;
-  };
-
   SignalServerConnection(rtc::Thread* signal_thread);
   virtual ~SignalServerConnection();
 
   void Connect(const std::string& url);
-  void CreateRoom(const std::string& password);
-  void SignIn(std::string& room_id, std::string& password);
-  void SignOut(std::string& room_id);
+  // Largest WebSocket fragment sent, in bytes, for the next Connect().
+  void set_fragment_size(size_t size) { fragment_size_ = size; }
+  // Once signed in, a lost connection is made again after a jittered
+  // backoff doubling up to max_delay ms, signing in to the same room as
+  // the same peer; what is sent meanwhile waits. 0 gives up instead.
+  void set_reconnect(int max_delay) { reconnect_max_delay_ = max_delay; }
+  // Times signed in again after losing the connection.
+  int reconnects() const { return reconnects_; }
+  // For ws:// URLs, connect to the address the host led to last time and
+  // remember where it leads this time. Must outlive this.
+  void set_address_cache(SignalAddressCache* cache) { address_cache_ = cache; }
+  // Where to note how the server's address was found, NULL for nowhere.
+  void set_trace(SetupTrace* trace) { trace_ = trace; }
+  // Pings the server every interval ms and drops the connection when a
+  // pong is timeout ms late, for the next Connect(). 0 for no pings.
+  void set_keepalive(int interval, int timeout) {
+    ping_interval_ = interval;
+    ping_timeout_ = timeout;
+  }
+  // Where to report the ping round trip, NULL for nowhere. Must outlive this.
+  void set_metrics(TunnelMetrics* metrics) { metrics_ = metrics; }
+  // Round trip of the last ping, microseconds; -1 if none came back yet.
+  int64 rtt() const { return rtt_.load(); }
+
+  // The connection dropped or failed, reconnecting or not. Signal thread.
+  sigslot::signal1<SignalServerConnection*> SignalConnectionLost;
 
+  //
+  // SignalConnection implementation.
+  //
+  virtual void CreateRoom(const std::string& password);
+  virtual void SignIn(std::string& room_id, std::string& password,
+                      const Json::Value& offer);
+  virtual void SignOut(std::string& room_id);
 
-  void RegisterObserver(SignalServerConnectionObserver* callback);
-  void UnregisterObserver(SignalServerConnectionObserver* callback);
+  virtual void RegisterObserver(SignalServerConnectionObserver* callback);
+  virtual void UnregisterObserver(SignalServerConnectionObserver* callback);
 
-  template<typename  T>
-  bool Send(const MsgID msgid, T& data);
+  virtual bool Send(const MsgID msgid, Json::Value& data);
   bool Send(const MsgID msgid);
 
   // implements the MessageHandler interface
@@ -97,6 +97,7 @@ protected:
   virtual void onMessage(WebSocket* ws, const WebSocket::Data& data);
   virtual void onClose(WebSocket* ws);
   virtual void onError(WebSocket* ws, const WebSocket::ErrorCode& error);
+  virtual void onPong(WebSocket* ws, int64 rtt);
 
   virtual void OnCreatedRoom(Json::Value& data);
   virtual void OnSignedIn(Json::Value& data);
@@ -107,7 +108,14 @@ protected:
 
 private:
   void InitSocketSignals();
+  void DispatchServerMessage(const std::string& text);
   void ServerConnectionFailure(int code, std::string& message);
+  void OnSocketOpened();
+  void OnConnectionLost(bool error);
+  void ScheduleReconnect();
+  void SendResumeSignIn();
+  void OnResumeRefused(const std::string& message);
+  bool SendNow(const std::string& message);
 
   //
   // Member variables
@@ -117,6 +125,42 @@ private:
   SignalServerConnectionObserver* callback_;
   rtc::Thread *signal_thread_;
   std::string url_;
+  size_t fragment_size_;
+
+  SignalAddressCache* address_cache_;
+  SetupTrace* trace_;
+  TunnelMetrics* metrics_;
+  int ping_interval_;
+  int ping_timeout_;
+  std::atomic<int64> rtt_;
+  std::string host_;           // of url_, for address_cache_
+  bool cached_address_used_;   // by the current socket
+  bool opened_;                // the current socket got as far as open
+
+  // The session to resume after losing the connection. signed_in_ is
+  // also read by Send(), under send_mutex_.
+  std::string room_id_;
+  std::string password_;
+  bool room_owner_;            // we created room_id_ and create it again
+  bool recreating_room_;       // because the server had lost it
+  uint64 peer_id_;
+  bool signed_in_;
+  int reconnect_max_delay_;
+  int reconnect_attempts_;
+  bool reconnect_posted_;
+  int reconnects_;
+  uint64 random_state_;
+
+  // Guards ws_ against Send() from other threads while it's replaced, and
+  // the messages sent while signing in again.
+  std::mutex send_mutex_;
+  bool resuming_;
+  std::deque<std::string> pending_sends_;
+
+  // Server messages from the websocket thread to the signal thread, and
+  // whether a MsgServerMessage is already on its way to drain them.
+  SpscRing<std::string> received_;
+  std::atomic<bool> drain_posted_;
 };
 
 
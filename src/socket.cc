@@ -1,15 +1,18 @@
 #include "htn_config.h"
 
+#include <string.h>
+
 #include "webrtc/base/common.h"
 #include "webrtc/base/thread.h"
 #include "webrtc/base/asyncudpsocket.h"
-#include "webrtc/system_wrappers/interface/sleep.h"
 
 #ifdef WIN32
 #include "webrtc/base/win32socketserver.h"
 #endif
 
 #include "socket.h"
+#include "traffic_capture.h"
+#include "transit.h"
 
 
 namespace hotline {
@@ -73,14 +76,27 @@ void SocketConnection::PacketQueue::Swap(PacketQueue* other) {
 SocketConnection::SocketConnection(SocketBase* socket_base)
   : socket_base_(socket_base)
   , stream_(NULL)
+  , protocol_(cricket::PROTO_TCP)
   , closing_(false)
   , is_ready_(false)
-  , recv_len_(0) {
+  , recv_len_(0)
+  , capture_(NULL)
+  , capture_lane_(0)
+  , transit_(false)
+  , transit_stats_(NULL)
+  , transit_clock_(NULL)
+  , transit_lane_(0)
+  , read_stamp_(0)
+  , receive_stamp_(0)
+  , metrics_(NULL)
+  , stopped_(false) {
 }
 
 
 SocketConnection::~SocketConnection() {
-  
+  if (capture_) capture_->Record(capture_lane_, kCaptureLaneClose, 0);
+  if (transit_stats_) transit_stats_->CloseLane(transit_lane_);
+  if (metrics_) metrics_->owner->CloseLane(metrics_);
 }
 
 bool SocketConnection::AttachChannel(rtc::scoped_refptr<HotlineDataChannel> channel) {
@@ -122,54 +138,175 @@ rtc::StreamInterface* SocketConnection::EndProcess(){
   return stream;
 }
 
+void SocketConnection::EnableFec(int group_size) {
+  ASSERT(protocol_ == cricket::PROTO_UDP);
+  fec_encoder_.reset(new FecEncoder(group_size));
+  fec_decoder_.reset(new FecDecoder(group_size));
+}
+
+void SocketConnection::EnableCompression(int level) {
+  ASSERT(protocol_ == cricket::PROTO_TCP);
+  compressor_.reset(new LaneCompressor(level));
+  decompressor_.reset(new LaneDecompressor());
+}
+
+void SocketConnection::EnableDedup(DedupSendCache* send_cache,
+                                   DedupReceiveCache* receive_cache, int lane_id) {
+  ASSERT(protocol_ == cricket::PROTO_TCP);
+  dedup_encoder_.reset(new DedupEncoder(send_cache, lane_id));
+  dedup_decoder_.reset(new DedupDecoder(receive_cache, lane_id));
+}
+
+void SocketConnection::ResendDedupChunk(uint64 record) {
+  if (!dedup_encoder_ || stopped_ || closing_) return;
+
+  dedup_records_.clear();
+  if (!dedup_encoder_->Resend(record, &dedup_records_)) {
+    LOG(LS_ERROR) << "Dedup chunk to send again is no longer kept.";
+    Stop(kStopCorruptData);
+    return;
+  }
+  if (!SendRecords(&dedup_records_[0], dedup_records_.size())) {
+    Stop(kStopChannelSend);
+  }
+}
+
+void SocketConnection::EnableCapture(TrafficCapture* capture) {
+  if (capture_) return;
+  capture_ = capture;
+  capture_lane_ = capture_->OpenLane(protocol_);
+}
+
+void SocketConnection::EnableTransit(TransitStats* stats, const ClockOffsetEstimator* clock,
+                                     const std::string& name) {
+  if (transit_) return;
+  transit_ = true;
+  transit_clock_ = clock;
+  transit_stats_ = stats;
+  if (transit_stats_) transit_lane_ = transit_stats_->OpenLane(name);
+}
+
+void SocketConnection::EnableMetrics(TunnelMetrics* metrics, const std::string& name) {
+  if (metrics_) return;
+  metrics_ = metrics->OpenLane(name, protocol_ == cricket::PROTO_UDP ? "udp" : "tcp");
+}
+
+void SocketConnection::SampleMetrics() {
+  if (!metrics_) return;
+  metrics_->SetQueued(queued_send_data_.byte_count(),
+                      channel_ ? channel_->buffered_amount() : 0);
+}
+
 bool SocketConnection::Send(const webrtc::DataBuffer& buffer) {
+  const char* data = buffer.data.data();
+  size_t len = buffer.size();
+
+  if (metrics_) metrics_->ReceivedFromTunnel(len);
+
+  if (transit_) {
+    if (len < kTransitStampSize) {
+      LOG(LS_WARNING) << "Dropping a lane message without a transit stamp.";
+      return true;
+    }
+    memcpy(&receive_stamp_, data, kTransitStampSize);
+    data += kTransitStampSize;
+    len -= kTransitStampSize;
+  }
+
+  if (!fec_decoder_) {
+    return ReceiveFromChannel(data, len);
+  }
+
+  if (!fec_decoder_->Decode(data, len)) {
+    LOG(LS_WARNING) << "Dropping malformed FEC frame.";
+    return true;
+  }
+
+  const std::vector<FecDecoder::Datagram>& ready = fec_decoder_->ready();
+  for (size_t i = 0; i < ready.size(); ++i) {
+    if (!ReceiveFromChannel(ready[i].data, ready[i].len)) return false;
+  }
+  return true;
+}
+
+bool SocketConnection::ReceiveFromChannel(const char* data, size_t len) {
+  if (decompressor_) {
+    if (!decompressor_->Decompress(data, len, &data, &len)) {
+      LOG(LS_ERROR) << "Corrupt compressed data on the lane.";
+      Stop(kStopCorruptData);
+      return false;
+    }
+  }
+
+  if (dedup_decoder_) {
+    if (!dedup_decoder_->Decode(data, len, &dedup_data_)) {
+      LOG(LS_ERROR) << "Corrupt dedup record on the lane.";
+      Stop(kStopCorruptData);
+      return false;
+    }
+    if (dedup_data_.empty()) return true;
+    data = &dedup_data_[0];
+    len = dedup_data_.size();
+  }
+
+  if (capture_) capture_->Record(capture_lane_, kCaptureFromTunnel, len);
+  return WriteData(data, len);
+}
+
+bool SocketConnection::WriteData(const char* data, size_t len) {
 
   size_t written;
   size_t pos = 0;
   int error;
 
   if (stream_->GetState() != rtc::SS_OPEN) {
-    if (!QueueSendDataMessage(buffer)) {
-      Stop();
+    if (!QueueSendDataMessage(webrtc::DataBuffer(rtc::Buffer(data, len), true))) {
+      Stop(kStopQueueFull);
       return false;
     }
     return true;
   }
 
-  if (buffer.size() == 0) {
+  if (len == 0) {
     return true;
   }
   
   if (!queued_send_data_.Empty()) {
-    if (!QueueSendDataMessage(buffer)) {
-      Stop();
+    if (!QueueSendDataMessage(webrtc::DataBuffer(rtc::Buffer(data, len), true))) {
+      Stop(kStopQueueFull);
       return false;
     }
     return true;
   }
 
   do{
-    rtc::StreamResult write_result = stream_->Write( buffer.data.data()+pos,
-                                                     buffer.size()-pos,
+    rtc::StreamResult write_result = stream_->Write( data+pos,
+                                                     len-pos,
                                                      &written,
                                                      &error);
     ASSERT(write_result!=rtc::SR_ERROR);
 
     if (write_result == rtc::SR_SUCCESS) {
-      if (buffer.size() < pos + written) {
+      if (len < pos + written) {
         pos = pos + written;
         continue;
       }
 
+      if (transit_) RecordTransit(receive_stamp_);
       break;
     }
     else if (write_result == rtc::SR_BLOCK) {
-      webrtc::SleepMs(1);
-      continue;
+      // Sleeping here would stall the thread the stream drains on; the
+      // rest goes out from the queue on the stream's SE_WRITE.
+      if (!QueueSendDataMessage(webrtc::DataBuffer(rtc::Buffer(data + pos, len - pos), true))) {
+        Stop(kStopQueueFull);
+        return false;
+      }
+      return true;
     }
     else {
       // rtc::SR_EOS, rtc::SR_ERROR
-      Stop();
+      Stop(kStopWriteError);
       return false;
     }
   }
@@ -184,7 +321,10 @@ void SocketConnection::Close() {
 }
 
 
-void SocketConnection::Stop() {
+// Only the first reason a lane is stopped for is counted.
+void SocketConnection::Stop(LaneStopReason reason) {
+  if (metrics_ && !stopped_) metrics_->owner->LaneStopped(reason);
+  stopped_ = true;
   socket_base_->Stop(this);
 }
 
@@ -215,7 +355,7 @@ void SocketConnection::OnStreamEvent(rtc::StreamInterface* stream,
 
   if (events & rtc::SE_CLOSE) {
     LOG(INFO) << __FUNCTION__ << " " << " rtc::SE_CLOSE.";
-    Stop();
+    Stop(kStopSocketClosed);
   }
 }
 
@@ -230,25 +370,36 @@ void SocketConnection::DoReceiveLoop() {
 
   LOG(INFO) << "DoReceiveLoop() passed";
 
+  // TCP reads stay at kBufferSize per data channel message.
+  size_t read_size = protocol_ == cricket::PROTO_UDP ? sizeof(recv_buffer_)
+                                                     : (size_t)kBufferSize;
   do{
     rtc::StreamResult read_result = stream_->Read(recv_buffer_,
-                                                  sizeof(recv_buffer_),
+                                                  read_size,
                                                   &recv_len_,
                                                   &error);
     ASSERT(read_result!=rtc::SR_ERROR);
 
     if (read_result == rtc::SR_SUCCESS) {
-      if (!channel_->Send(recv_buffer_, recv_len_)) {
+      if (transit_) read_stamp_ = TransitNow();
+      if (capture_) capture_->Record(capture_lane_, kCaptureToTunnel, recv_len_);
+      if (metrics_) metrics_->ReadFromSocket(recv_len_);
+      if (!SendToChannel(recv_buffer_, recv_len_)) {
+        // An unreliable lane drops what SCTP can't buffer, like the
+        // network would.
+        if (protocol_ == cricket::PROTO_UDP && channel_->IsOpen()) continue;
         ASSERT(FALSE);
-        Stop();
+        Stop(kStopChannelSend);
         return;
       }
     }
     else if (read_result == rtc::SR_BLOCK) {
+      if (!FlushToChannel()) Stop(kStopChannelSend);
       break;
     }
     else {
-      Stop();
+      FlushToChannel();
+      Stop(read_result == rtc::SR_EOS ? kStopSocketClosed : kStopReadError);
       return;
     }
   }
@@ -257,6 +408,71 @@ void SocketConnection::DoReceiveLoop() {
   return;
 }
 
+bool SocketConnection::SendToChannel(const char* data, size_t len) {
+  if (!dedup_encoder_) {
+    return SendRecords(data, len);
+  }
+
+  dedup_records_.clear();
+  dedup_encoder_->Encode(data, len, &dedup_records_);
+  if (dedup_records_.empty()) return true;
+  return SendRecords(&dedup_records_[0], dedup_records_.size());
+}
+
+// Sends what the dedup stage holds back for the next chunk boundary, so
+// the data doesn't wait for more input.
+bool SocketConnection::FlushToChannel() {
+  if (!dedup_encoder_) return true;
+
+  dedup_records_.clear();
+  dedup_encoder_->Flush(&dedup_records_);
+  if (dedup_records_.empty()) return true;
+  return SendRecords(&dedup_records_[0], dedup_records_.size());
+}
+
+bool SocketConnection::SendRecords(const char* data, size_t len) {
+  if (compressor_) {
+    if (!compressor_->Compress(data, len, &compressed_)) {
+      LOG(LS_ERROR) << "Compression failed.";
+      return false;
+    }
+    data = &compressed_[0];
+    len = compressed_.size();
+  }
+
+  if (!fec_encoder_) {
+    return SendMessage(data, len);
+  }
+
+  bool has_parity = fec_encoder_->Encode(data, len, &fec_data_frame_, &fec_parity_frame_);
+  bool result = SendMessage(&fec_data_frame_[0], fec_data_frame_.size());
+
+  // A lost parity frame only costs the group its protection.
+  if (has_parity) {
+    SendMessage(&fec_parity_frame_[0], fec_parity_frame_.size());
+  }
+  return result;
+}
+
+bool SocketConnection::SendMessage(const char* data, size_t len) {
+  if (metrics_) metrics_->SentToTunnel(transit_ ? kTransitStampSize + len : len);
+  if (!transit_) {
+    return channel_->Send(data, len);
+  }
+  return channel_->Send(reinterpret_cast<const char*>(&read_stamp_), kTransitStampSize,
+                        data, len);
+}
+
+// The peer's stamp is on its clock; until the offset is known there is
+// nothing to record.
+void SocketConnection::RecordTransit(uint64 stamp) {
+  if (!transit_stats_ || !transit_clock_->valid()) return;
+
+  uint64 now = TransitNow();
+  uint64 sent = transit_clock_->ToLocal(stamp);
+  transit_stats_->Record(transit_lane_, now > sent ? now - sent : 0);
+}
+
 void SocketConnection::flush_data() {
   SendQueuedDataMessages();
 }
@@ -267,6 +483,7 @@ bool SocketConnection::QueueSendDataMessage(const webrtc::DataBuffer& buffer) {
     return false;
   }
   queued_send_data_.Push(new webrtc::DataBuffer(buffer));
+  if (transit_) queued_stamps_.push_back(receive_stamp_);
   return true;
 }
 
@@ -294,11 +511,11 @@ void SocketConnection::SendQueuedDataMessages() {
         break;
       }
       else if (write_result == rtc::SR_BLOCK) {
-        webrtc::SleepMs(1);
-        continue;
+        // Picked up again on the next SE_WRITE.
+        return;
       }
       else {
-        Stop();
+        Stop(kStopWriteError);
         return;
       }
     }
@@ -306,6 +523,11 @@ void SocketConnection::SendQueuedDataMessages() {
 
     queued_send_data_.Pop();
     delete buffer;
+
+    if (!queued_stamps_.empty()) {
+      RecordTransit(queued_stamps_.front());
+      queued_stamps_.pop_front();
+    }
   }
 }
 
@@ -343,12 +565,14 @@ void SocketBase::Stop(SocketConnection* connection) {
 }
 
 
-SocketConnection* SocketBase::HandleConnection(rtc::StreamInterface* stream) {
+SocketConnection* SocketBase::HandleConnection(rtc::StreamInterface* stream,
+                                               cricket::ProtocolType protocol) {
 
   SocketConnection* connection = new SocketConnection(this);
   if (connection==NULL) return NULL;
 
   connection->peer_id(peer_id());
+  connection->protocol(protocol);
   connections_.push_back(connection);
 
   // Notify to conductor
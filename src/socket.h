@@ -2,7 +2,10 @@
 #define HOTLINE_TUNNEL_SOCKET_H_
 #pragma once
 
+#include <deque>
 #include <list>
+#include <string>
+#include <vector>
 
 #include "webrtc/base/stream.h"
 #include "webrtc/base/socketaddress.h"
@@ -10,13 +13,21 @@
 #include "webrtc/base/socketstream.h"
 #include "webrtc/p2p/base/portinterface.h"
 #include "webrtc/base/refcount.h"
+#include "webrtc/base/scoped_ptr.h"
 #include "data_channel.h"
+#include "fec.h"
+#include "compression.h"
+#include "dedup.h"
+#include "metrics.h"
 
 
 namespace hotline {
 
 class SocketBase;
 class HotlineDataChannel;
+class TrafficCapture;
+class TransitStats;
+class ClockOffsetEstimator;
 
 
 //////////////////////////////////////////////////////////////////////
@@ -35,27 +46,10 @@ public:
 class SocketConnection : public sigslot::has_slots<> {
  public:
   enum { kBufferSize = 32 * 1024 };
+  // A UDP lane reads whole datagrams, up to the largest IP allows.
+  enum { kMaxDatagramSize = 64 * 1024 };
 
-  SocketConnection(SocketBase* server);
-  virtual ~SocketConnection();
-
-  bool AttachChannel(rtc::scoped_refptr<HotlineDataChannel> channel);
-  rtc::scoped_refptr<HotlineDataChannel>  DetachChannel();
-  rtc::scoped_refptr<HotlineDataChannel> GetAttachedChannel();
-  void SetReady();
-  void ReadEvent();
-
-  void BeginProcess(rtc::StreamInterface* stream);
-  rtc::StreamInterface* EndProcess();
-  bool Send(const webrtc::DataBuffer& buffer);
-  void Close();
-  void Stop();
-
-  uint64 peer_id() { return peer_id_; }
-  void peer_id(uint64 peer_id) { peer_id_ = peer_id;}
-
- protected:
-
+  // Data received from the lane that the socket has not taken yet.
   class PacketQueue {
   public:
     PacketQueue();
@@ -75,10 +69,60 @@ class SocketConnection : public sigslot::has_slots<> {
     size_t byte_count_;
   };
 
+  SocketConnection(SocketBase* server);
+  virtual ~SocketConnection();
+
+  bool AttachChannel(rtc::scoped_refptr<HotlineDataChannel> channel);
+  rtc::scoped_refptr<HotlineDataChannel>  DetachChannel();
+  rtc::scoped_refptr<HotlineDataChannel> GetAttachedChannel();
+  void SetReady();
+  void ReadEvent();
+
+  void BeginProcess(rtc::StreamInterface* stream);
+  rtc::StreamInterface* EndProcess();
+  bool Send(const webrtc::DataBuffer& buffer);
+  void Close();
+  void Stop(LaneStopReason reason);
+
+  // Frames datagrams of a UDP lane in FEC groups of group_size.
+  void EnableFec(int group_size);
+  // Compresses the data of a TCP lane at the given zlib level.
+  void EnableCompression(int level);
+  // Deduplicates the data of a TCP lane against the conductor's caches,
+  // as lane_id there.
+  void EnableDedup(DedupSendCache* send_cache, DedupReceiveCache* receive_cache,
+                   int lane_id);
+  // Sends the chunk of a reference the peer couldn't resolve again.
+  void ResendDedupChunk(uint64 record);
+  // Records the lane's opening, reads, writes and closing to capture.
+  void EnableCapture(TrafficCapture* capture);
+  // Stamps the lane's messages with their read time and expects the
+  // peer's to be stamped. With stats, records the transit of the peer's
+  // data, its stamps converted by clock, as lane name.
+  void EnableTransit(TransitStats* stats, const ClockOffsetEstimator* clock,
+                     const std::string& name);
+  // Counts the lane's messages in metrics as lane name.
+  void EnableMetrics(TunnelMetrics* metrics, const std::string& name);
+  // Updates the lane's queue gauges; from the thread the lane runs on.
+  void SampleMetrics();
+
+  uint64 peer_id() { return peer_id_; }
+  void peer_id(uint64 peer_id) { peer_id_ = peer_id;}
+  cricket::ProtocolType protocol() { return protocol_; }
+  void protocol(cricket::ProtocolType protocol) { protocol_ = protocol; }
+
+ protected:
   void OnStreamEvent(rtc::StreamInterface* stream, int events, int error);
   void HandleStreamClose();
 
   void DoReceiveLoop();
+  bool SendToChannel(const char* data, size_t len);
+  bool FlushToChannel();
+  bool SendRecords(const char* data, size_t len);
+  bool SendMessage(const char* data, size_t len);
+  void RecordTransit(uint64 stamp);
+  bool ReceiveFromChannel(const char* data, size_t len);
+  bool WriteData(const char* data, size_t len);
   void flush_data();
 
   bool QueueSendDataMessage(const webrtc::DataBuffer& buffer);
@@ -88,12 +132,41 @@ class SocketConnection : public sigslot::has_slots<> {
   rtc::scoped_refptr<HotlineDataChannel> channel_;
   rtc::StreamInterface* stream_;
   uint64 peer_id_;
+  cricket::ProtocolType protocol_;
   bool closing_;
   bool is_ready_;
 
   PacketQueue queued_send_data_;
-  char recv_buffer_[kBufferSize];
+  char recv_buffer_[kMaxDatagramSize];
   size_t recv_len_;
+
+  rtc::scoped_ptr<FecEncoder> fec_encoder_;
+  rtc::scoped_ptr<FecDecoder> fec_decoder_;
+  std::vector<char> fec_data_frame_;
+  std::vector<char> fec_parity_frame_;
+
+  rtc::scoped_ptr<LaneCompressor> compressor_;
+  rtc::scoped_ptr<LaneDecompressor> decompressor_;
+  std::vector<char> compressed_;
+
+  rtc::scoped_ptr<DedupEncoder> dedup_encoder_;
+  rtc::scoped_ptr<DedupDecoder> dedup_decoder_;
+  std::vector<char> dedup_records_;
+  std::vector<char> dedup_data_;
+
+  TrafficCapture* capture_;
+  uint32 capture_lane_;
+
+  bool transit_;
+  TransitStats* transit_stats_;
+  const ClockOffsetEstimator* transit_clock_;
+  int transit_lane_;
+  uint64 read_stamp_;      // of the data being sent
+  uint64 receive_stamp_;   // of the message being received
+  std::deque<uint64> queued_stamps_;  // of queued_send_data_
+
+  TunnelMetrics::LaneMetrics* metrics_;
+  bool stopped_;
 };
 
 //////////////////////////////////////////////////////////////////////
@@ -113,7 +186,8 @@ public:
   sigslot::signal3<SocketBase*, SocketConnection*, rtc::StreamInterface*> SignalConnectionClosed;
 
 protected:
-  SocketConnection* HandleConnection(rtc::StreamInterface* stream);
+  SocketConnection* HandleConnection(rtc::StreamInterface* stream,
+                                     cricket::ProtocolType protocol);
   void Remove(SocketConnection* connection);
   void Stop(SocketConnection* connection);
 
@@ -5,6 +5,10 @@
 #include "webrtc/base/asyncudpsocket.h"
 #include "socket_client.h"
 
+#if defined(WEBRTC_POSIX)
+#include "udp_batch.h"
+#endif
+
 #ifdef WIN32
 #include "webrtc/base/win32socketserver.h"
 #endif
@@ -16,7 +20,8 @@ namespace hotline {
 // SocketListenServer
 ///////////////////////////////////////////////////////////////////////////////
 
-SocketClient::SocketClient() {
+SocketClient::SocketClient()
+  : batch_socket_server_(NULL) {
   SignalConnectionClosed.connect(this, &SocketClient::OnConnectionClosed);
 }
 
@@ -26,6 +31,23 @@ SocketClient::~SocketClient() {
 SocketConnection* SocketClient::Connect(const rtc::SocketAddress& address,
                            const cricket::ProtocolType protocol) {
 
+#if defined(WEBRTC_POSIX)
+  if (protocol == cricket::PROTO_UDP && batch_socket_server_) {
+    rtc::SocketAddress any_address(address.ipaddr().family() == AF_INET6 ?
+                                   "::" : "0.0.0.0", 0);
+    UdpBatchSocket* batch_socket = UdpBatchSocket::Create(batch_socket_server_,
+                                                           any_address);
+    if (batch_socket == NULL) return NULL;
+
+    if (!batch_socket->Connect(address)) {
+      delete batch_socket;
+      return NULL;
+    }
+
+    return HandleConnection(new UdpConnectedStream(batch_socket, address), protocol);
+  }
+#endif
+
 #if defined(WEBRTC_WIN)
   rtc::Win32Socket* sock = new rtc::Win32Socket();
 
@@ -57,10 +79,15 @@ SocketConnection* SocketClient::Connect(const rtc::SocketAddress& address,
   rtc::StreamInterface *stream = new rtc::SocketStream(sock);
   if (stream == NULL) return NULL;
 
-  SocketConnection* connection = HandleConnection(stream);
+  SocketConnection* connection = HandleConnection(stream, protocol);
   return connection;
 }
 
+SocketConnection* SocketClient::Open(rtc::StreamInterface* stream,
+                                     const cricket::ProtocolType protocol) {
+  return HandleConnection(stream, protocol);
+}
+
 
 void SocketClient::Disconnect() {
   
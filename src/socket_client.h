@@ -16,6 +16,7 @@
 
 namespace rtc {
   class ByteBuffer;
+  class PhysicalSocketServer;
   class Thread;
 }
 
@@ -34,14 +35,25 @@ public:
 
   SocketConnection* Connect(const rtc::SocketAddress& address,
               const cricket::ProtocolType protocol);
+  // Runs a connection over a stream that is not a socket; takes ownership.
+  SocketConnection* Open(rtc::StreamInterface* stream,
+              const cricket::ProtocolType protocol);
 
   void Disconnect();
 
+  // Gives UDP connections a batched socket (recvmmsg/sendmmsg), wrapped
+  // into socket_server, which must be the connecting thread's. POSIX only;
+  // NULL turns it off.
+  void set_udp_batch(rtc::PhysicalSocketServer* socket_server) {
+    batch_socket_server_ = socket_server;
+  }
+
 private:
   void OnReadEvent(rtc::AsyncSocket* socket);
   void OnConnectionClosed(SocketBase* server, SocketConnection* connection,
     rtc::StreamInterface* stream);
 
+  rtc::PhysicalSocketServer* batch_socket_server_;
 };
 
 //////////////////////////////////////////////////////////////////////
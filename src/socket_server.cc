@@ -1,8 +1,11 @@
 #include "htn_config.h"
 
+#include <algorithm>
+
 #include "webrtc/base//common.h"
 #include "webrtc/base/thread.h"
 #include "webrtc/base/asyncudpsocket.h"
+#include "webrtc/base/timeutils.h"
 #include "socket_server.h"
 
 #ifdef WIN32
@@ -12,12 +15,20 @@
 
 namespace hotline {
 
+static const size_t kMaxDatagramSize = 64 * 1024;
+static const int kMaxDatagramsPerReadEvent = 64;
+static const uint32 kMinUdpExpiryIntervalMs = 1000;
+static const uint32 kDefaultUdpIdleTimeoutMs = 60 * 1000;
+
 
 ///////////////////////////////////////////////////////////////////////////////
 // SocketListenServer
 ///////////////////////////////////////////////////////////////////////////////
 
-SocketListenServer::SocketListenServer() {
+SocketListenServer::SocketListenServer()
+  : udp_idle_timeout_(kDefaultUdpIdleTimeoutMs)
+  , udp_expiry_scheduled_(false)
+  , batch_socket_server_(NULL) {
   SignalConnectionClosed.connect(this, &SocketListenServer::OnConnectionClosed);
 }
 
@@ -30,6 +41,16 @@ bool SocketListenServer::Listen(const rtc::SocketAddress& address,
   // UDP socket
   //
   if (protocol == cricket::PROTO_UDP) {
+#if defined(WEBRTC_POSIX)
+    if (batch_socket_server_) {
+      batch_listener_.reset(UdpBatchSocket::Create(batch_socket_server_, address));
+      if (!batch_listener_) return false;
+
+      batch_listener_->SignalDatagram.connect(this, &SocketListenServer::OnBatchDatagram);
+      return true;
+    }
+#endif
+
 #if defined(WEBRTC_WIN)
     rtc::Win32Socket* sock = new rtc::Win32Socket();
     if (!sock->CreateT(address.family(), SOCK_DGRAM)){
@@ -56,9 +77,10 @@ bool SocketListenServer::Listen(const rtc::SocketAddress& address,
       return false;
     }
 
-    rtc::StreamInterface *stream = new rtc::SocketStream(listener_.get());
-    if (stream == NULL) return false;
-    HandleConnection(stream);
+    // Each client source address becomes its own session and lane,
+    // created when its first datagram arrives.
+    udp_buffer_.resize(kMaxDatagramSize);
+    listener_->SignalReadEvent.connect(this, &SocketListenServer::OnUdpReadEvent);
   }
 
   //
@@ -105,6 +127,13 @@ bool SocketListenServer::Listen(const rtc::SocketAddress& address,
 }
 
 bool SocketListenServer::GetAddress(rtc::SocketAddress* address) const {
+#if defined(WEBRTC_POSIX)
+  if (batch_listener_) {
+    *address = batch_listener_->GetLocalAddress();
+    return !address->IsNil();
+  }
+#endif
+
   if (!listener_) {
     return false;
   }
@@ -116,6 +145,27 @@ void SocketListenServer::StopListening() {
   if (listener_) {
     listener_->Close();
   }
+
+#if defined(WEBRTC_POSIX)
+  if (batch_listener_) {
+    batch_listener_->Close();
+  }
+#endif
+
+  for (UdpSessionMap::iterator it = udp_sessions_.begin();
+       it != udp_sessions_.end();
+       ++it) {
+    it->second.stream->Close();
+  }
+}
+
+int SocketListenServer::SendDatagram(const void* data, size_t len,
+                                     const rtc::SocketAddress& to) {
+#if defined(WEBRTC_POSIX)
+  if (batch_listener_) return batch_listener_->SendDatagram(data, len, to);
+#endif
+  if (!listener_) return -1;
+  return listener_->SendTo(data, len, to);
 }
 
 void SocketListenServer::OnReadEvent(rtc::AsyncSocket* socket) {
@@ -125,13 +175,107 @@ void SocketListenServer::OnReadEvent(rtc::AsyncSocket* socket) {
   if (incoming) {
     rtc::StreamInterface* stream = new rtc::SocketStream(incoming);
     //stream = new LoggingAdapter(stream, LS_VERBOSE, "SocketServer", false);
-    HandleConnection(stream);
+    HandleConnection(stream, cricket::PROTO_TCP);
+  }
+}
+
+void SocketListenServer::OnUdpReadEvent(rtc::AsyncSocket* socket) {
+  ASSERT(socket == listener_.get());
+
+  rtc::SocketAddress from;
+  for (int i = 0; i < kMaxDatagramsPerReadEvent; ++i) {
+    int len = listener_->RecvFrom(&udp_buffer_[0], udp_buffer_.size(), &from);
+    if (len < 0) break;
+    DeliverDatagram(&udp_buffer_[0], len, from);
+  }
+}
+
+#if defined(WEBRTC_POSIX)
+void SocketListenServer::OnBatchDatagram(UdpBatchSocket* socket,
+                                         const char* data, size_t len,
+                                         const rtc::SocketAddress& from) {
+  DeliverDatagram(data, len, from);
+}
+#endif
+
+void SocketListenServer::DeliverDatagram(const char* data, size_t len,
+                                         const rtc::SocketAddress& from) {
+  UdpSessionMap::iterator it = udp_sessions_.find(from);
+  if (it != udp_sessions_.end()) {
+    it->second.stream->Deliver(data, len);
+    return;
+  }
+
+  if (udp_sessions_.size() >= kMaxUdpSessions) {
+    LOG(LS_WARNING) << "Too many UDP sessions, datagram from "
+                    << from.ToString() << " dropped.";
+    return;
+  }
+
+  LOG(INFO) << "New UDP session " << from.ToString();
+
+  UdpSessionStream* stream = new UdpSessionStream(this, from);
+  UdpSession& session = udp_sessions_[from];
+  session.stream = stream;
+  session.connection = NULL;
+  session.connection = HandleConnection(stream, cricket::PROTO_UDP);
+
+  // Queued until the lane is ready, then drained by SocketConnection.
+  stream->Deliver(data, len);
+
+  ScheduleUdpSessionExpiry();
+}
+
+void SocketListenServer::ScheduleUdpSessionExpiry() {
+  if (udp_expiry_scheduled_ || udp_idle_timeout_ == 0) return;
+
+  uint32 interval = std::max(udp_idle_timeout_ / 4, kMinUdpExpiryIntervalMs);
+  rtc::Thread::Current()->PostDelayed(interval, this, MsgExpireUdpSessions);
+  udp_expiry_scheduled_ = true;
+}
+
+void SocketListenServer::ExpireUdpSessions() {
+  uint32 now = rtc::Time();
+
+  std::vector<SocketConnection*> expired;
+  for (UdpSessionMap::iterator it = udp_sessions_.begin();
+       it != udp_sessions_.end();
+       ++it) {
+    UdpSessionStream* stream = it->second.stream;
+    if (rtc::TimeDiff(now, stream->last_activity()) >= (int32)udp_idle_timeout_
+        && it->second.connection) {
+      LOG(INFO) << "UDP session " << it->first.ToString() << " expired.";
+      expired.push_back(it->second.connection);
+    }
+  }
+
+  // Stop() goes through the conductor, which closes the lane and lands
+  // back in OnConnectionClosed() to erase the session.
+  for (size_t i = 0; i < expired.size(); ++i) {
+    expired[i]->Stop(kStopIdle);
+  }
+}
+
+void SocketListenServer::OnMessage(rtc::Message* msg) {
+  if (msg->message_id == MsgExpireUdpSessions) {
+    udp_expiry_scheduled_ = false;
+    ExpireUdpSessions();
+    if (!udp_sessions_.empty()) ScheduleUdpSessionExpiry();
   }
 }
 
 void SocketListenServer::OnConnectionClosed(SocketBase* server,
             SocketConnection* connection,
             rtc::StreamInterface* stream) {
+  for (UdpSessionMap::iterator it = udp_sessions_.begin();
+       it != udp_sessions_.end();
+       ++it) {
+    if (it->second.stream == stream) {
+      udp_sessions_.erase(it);
+      break;
+    }
+  }
+
   rtc::Thread::Current()->Dispose(stream);
 }
 
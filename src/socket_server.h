@@ -3,6 +3,8 @@
 #pragma once
 
 #include <list>
+#include <map>
+#include <vector>
 
 #include "webrtc/base/stream.h"
 #include "webrtc/base/socketaddress.h"
@@ -10,12 +12,19 @@
 #include "webrtc/base/socketstream.h"
 #include "webrtc/p2p/base/portinterface.h"
 #include "webrtc/base/refcount.h"
+#include "webrtc/base/messagehandler.h"
 #include "data_channel.h"
 #include "socket.h"
+#include "udp_session.h"
+
+#if defined(WEBRTC_POSIX)
+#include "udp_batch.h"
+#endif
 
 
 namespace rtc {
   class ByteBuffer;
+  class PhysicalSocketServer;
   class Thread;
 }
 
@@ -27,8 +36,17 @@ class HotlineDataChannel;
 
 //////////////////////////////////////////////////////////////////////
 
-class SocketListenServer : public SocketBase, public sigslot::has_slots<> {
+class SocketListenServer : public SocketBase,
+                           public UdpSessionSender,
+                           public rtc::MessageHandler,
+                           public sigslot::has_slots<> {
 public:
+  enum { kMaxUdpSessions = 1024 };
+
+  enum ThreadMsgId{
+    MsgExpireUdpSessions
+  };
+
   SocketListenServer();
   virtual ~SocketListenServer();
 
@@ -37,12 +55,60 @@ public:
   bool GetAddress(rtc::SocketAddress* address) const;
   void StopListening();
 
+  // UDP sessions without traffic in either direction for this long are
+  // stopped, which deletes their lane. 0 disables expiry.
+  void set_udp_idle_timeout(uint32 timeout_ms) { udp_idle_timeout_ = timeout_ms; }
+  size_t udp_session_count() const { return udp_sessions_.size(); }
+  // Moves UDP datagrams with recvmmsg/sendmmsg instead of one syscall each,
+  // on a socket wrapped into socket_server, which must be the listening
+  // thread's. POSIX only; NULL turns it off. Takes effect on the next
+  // Listen().
+  void set_udp_batch(rtc::PhysicalSocketServer* socket_server) {
+    batch_socket_server_ = socket_server;
+  }
+
+  //
+  // UdpSessionSender implementation.
+  //
+  virtual int SendDatagram(const void* data, size_t len,
+                           const rtc::SocketAddress& to);
+
+  //
+  // implements the MessageHandler interface
+  //
+  void OnMessage(rtc::Message* msg);
+
 private:
+  struct UdpSession {
+    UdpSessionStream* stream;
+    SocketConnection* connection;
+  };
+  typedef std::map<rtc::SocketAddress, UdpSession> UdpSessionMap;
+
   void OnReadEvent(rtc::AsyncSocket* socket);
+  void OnUdpReadEvent(rtc::AsyncSocket* socket);
+#if defined(WEBRTC_POSIX)
+  void OnBatchDatagram(UdpBatchSocket* socket, const char* data, size_t len,
+                       const rtc::SocketAddress& from);
+#endif
   void OnConnectionClosed(SocketBase* server, SocketConnection* connection,
     rtc::StreamInterface* stream);
 
+  void DeliverDatagram(const char* data, size_t len,
+                       const rtc::SocketAddress& from);
+  void ScheduleUdpSessionExpiry();
+  void ExpireUdpSessions();
+
   rtc::scoped_ptr<rtc::AsyncSocket> listener_;
+#if defined(WEBRTC_POSIX)
+  rtc::scoped_ptr<UdpBatchSocket> batch_listener_;
+#endif
+
+  UdpSessionMap udp_sessions_;
+  uint32 udp_idle_timeout_;
+  bool udp_expiry_scheduled_;
+  rtc::PhysicalSocketServer* batch_socket_server_;
+  std::vector<char> udp_buffer_;
 };
 
 //////////////////////////////////////////////////////////////////////
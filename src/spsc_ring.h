@@ -0,0 +1,108 @@
+#ifndef HOTLINE_TUNNEL_SPSC_RING_H_
+#define HOTLINE_TUNNEL_SPSC_RING_H_
+#pragma once
+
+#include <stddef.h>
+
+#include <atomic>
+
+#include "webrtc/base/scoped_ptr.h"
+
+
+namespace hotline {
+
+//////////////////////////////////////////////////////////////////////
+// SpscRing
+// A bounded queue from one producer thread to one consumer thread, over
+// slots allocated up front. Neither side ever takes a lock or waits for
+// the other: a full ring refuses a push, an empty one has no front.
+//
+// Slots are reused in place, so a T that keeps its storage (a string, a
+// vector) stops allocating once the ring has gone round: the producer
+// fills the slot BeginPush() returns and publishes it with CommitPush();
+// the consumer reads Front() and hands the slot back with Pop().
+//
+template <typename T>
+class SpscRing {
+public:
+  // capacity is rounded up to a power of two.
+  explicit SpscRing(size_t capacity)
+    : head_(0), cached_tail_(0), tail_(0), cached_head_(0) {
+    size_t size = 1;
+    while (size < capacity) size <<= 1;
+    slots_.reset(new T[size]);
+    mask_ = size - 1;
+  }
+
+  size_t capacity() const { return mask_ + 1; }
+
+  //
+  // Producer side
+  //
+
+  // The slot to fill next, or NULL if the ring is full.
+  T* BeginPush() {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - cached_head_ > mask_) {
+      cached_head_ = head_.load(std::memory_order_acquire);
+      if (tail - cached_head_ > mask_) return NULL;
+    }
+    return &slots_[tail & mask_];
+  }
+
+  // Makes the slot from BeginPush() visible to the consumer.
+  void CommitPush() {
+    tail_.store(tail_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+
+  bool Push(const T& value) {
+    T* slot = BeginPush();
+    if (!slot) return false;
+    *slot = value;
+    CommitPush();
+    return true;
+  }
+
+  //
+  // Consumer side
+  //
+
+  // The oldest slot, or NULL if the ring is empty.
+  T* Front() {
+    size_t head = head_.load(std::memory_order_relaxed);
+    if (head == cached_tail_) {
+      cached_tail_ = tail_.load(std::memory_order_acquire);
+      if (head == cached_tail_) return NULL;
+    }
+    return &slots_[head & mask_];
+  }
+
+  // Gives the slot from Front() back to the producer.
+  void Pop() {
+    head_.store(head_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+
+  // Either side; only a hint to the other one.
+  bool empty() const {
+    return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+  }
+
+private:
+  // The consumer's and the producer's index each on a cache line of their
+  // own, next to what only that side touches.
+  std::atomic<size_t> head_;
+  size_t cached_tail_;   // consumer's last look at tail_
+  char head_padding_[64 - sizeof(std::atomic<size_t>) - sizeof(size_t)];
+  std::atomic<size_t> tail_;
+  size_t cached_head_;   // producer's last look at head_
+  char tail_padding_[64 - sizeof(std::atomic<size_t>) - sizeof(size_t)];
+
+  rtc::scoped_ptr<T[]> slots_;
+  size_t mask_;
+};
+
+//////////////////////////////////////////////////////////////////////
+
+} // namespace hotline
+
+#endif  // HOTLINE_TUNNEL_SPSC_RING_H_
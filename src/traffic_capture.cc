@@ -0,0 +1,209 @@
+#include "htn_config.h"
+
+#include <string.h>
+#include <algorithm>
+#include <fstream>
+
+#if defined(WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "webrtc/base/common.h"
+#include "webrtc/base/logging.h"
+#include "webrtc/base/timeutils.h"
+#include "traffic_capture.h"
+
+
+namespace hotline {
+
+const char kCaptureMagic[8] = { 'H', 'T', 'N', 'C', 'A', 'P', '1', 0 };
+
+static_assert(sizeof(CaptureRecord) == 24, "capture records are 24 bytes");
+static_assert(sizeof(CaptureHeader) == 64, "the capture header is 64 bytes");
+
+static uint64 NowMicros() {
+  return rtc::TimeNanos() / 1000;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// TrafficCapture
+///////////////////////////////////////////////////////////////////////////////
+
+TrafficCapture::TrafficCapture()
+  : header_(NULL)
+  , records_(NULL)
+  , mapped_size_(0)
+#if defined(WIN32)
+  , file_(INVALID_HANDLE_VALUE)
+  , mapping_(NULL)
+#else
+  , fd_(-1)
+#endif
+  , start_time_(0)
+  , next_record_(0)
+  , next_lane_(1) {
+}
+
+TrafficCapture::~TrafficCapture() {
+  Close();
+}
+
+bool TrafficCapture::Open(const std::string& path, uint64 capacity, bool server_mode) {
+  ASSERT(!is_open());
+  if (capacity == 0) return false;
+
+  mapped_size_ = static_cast<size_t>(sizeof(CaptureHeader) + capacity * sizeof(CaptureRecord));
+  void* base = NULL;
+
+#if defined(WIN32)
+  file_ = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL,
+                      CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (file_ != INVALID_HANDLE_VALUE) {
+    mapping_ = CreateFileMappingA(file_, NULL, PAGE_READWRITE,
+                                  (DWORD)((uint64)mapped_size_ >> 32),
+                                  (DWORD)mapped_size_, NULL);
+  }
+  if (mapping_) {
+    base = MapViewOfFile(mapping_, FILE_MAP_WRITE, 0, 0, mapped_size_);
+  }
+#else
+  fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd_ >= 0 && ftruncate(fd_, mapped_size_) == 0) {
+    base = mmap(NULL, mapped_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (base == MAP_FAILED) base = NULL;
+  }
+#endif
+
+  if (!base) {
+    LOG(LS_ERROR) << "Can't map the capture file " << path << ".";
+    Close();
+    return false;
+  }
+
+  header_ = static_cast<CaptureHeader*>(base);
+  records_ = reinterpret_cast<CaptureRecord*>(header_ + 1);
+  memset(header_, 0, sizeof(*header_));
+  memcpy(header_->magic, kCaptureMagic, sizeof(kCaptureMagic));
+  header_->record_size = sizeof(CaptureRecord);
+  header_->flags = server_mode ? CaptureHeader::kServerMode : 0;
+  header_->capacity = capacity;
+
+  start_time_ = NowMicros();
+  next_record_ = 0;
+  next_lane_ = 1;
+  LOG(LS_INFO) << "Capturing lane events to " << path << ", " << capacity << " records.";
+  return true;
+}
+
+void TrafficCapture::Close() {
+#if defined(WIN32)
+  if (header_) UnmapViewOfFile(header_);
+  if (mapping_) CloseHandle(mapping_);
+  if (file_ != INVALID_HANDLE_VALUE) CloseHandle(file_);
+  mapping_ = NULL;
+  file_ = INVALID_HANDLE_VALUE;
+#else
+  if (header_) munmap(header_, mapped_size_);
+  if (fd_ >= 0) close(fd_);
+  fd_ = -1;
+#endif
+  header_ = NULL;
+  records_ = NULL;
+}
+
+// Raises the header's count to value unless a racing writer has already
+// raised it further, so it never goes back. count sits 8 byte aligned in
+// the mapping.
+static void RaiseCount(uint64* count, uint64 value) {
+#if defined(WIN32)
+  volatile LONG64* target = reinterpret_cast<volatile LONG64*>(count);
+  LONG64 seen = *target;
+  while (static_cast<uint64>(seen) < value) {
+    LONG64 previous = InterlockedCompareExchange64(target, static_cast<LONG64>(value), seen);
+    if (previous == seen) break;
+    seen = previous;
+  }
+#else
+  uint64 seen = __atomic_load_n(count, __ATOMIC_RELAXED);
+  while (seen < value &&
+         !__atomic_compare_exchange_n(count, &seen, value, true,
+                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+  }
+#endif
+}
+
+uint32 TrafficCapture::OpenLane(int protocol) {
+  uint32 lane = next_lane_++;
+  if (!header_) return lane;
+
+  uint64 index = next_record_++;
+  CaptureRecord* record = &records_[index % header_->capacity];
+  record->time = NowMicros() - start_time_;
+  record->lane = lane;
+  record->size = 0;
+  record->event = kCaptureLaneOpen;
+  record->protocol = static_cast<uint8>(protocol);
+  RaiseCount(&header_->count, index + 1);
+  return lane;
+}
+
+void TrafficCapture::Record(uint32 lane, CaptureEvent event, size_t size) {
+  if (!header_) return;
+
+  uint64 index = next_record_++;
+  CaptureRecord* record = &records_[index % header_->capacity];
+  record->time = NowMicros() - start_time_;
+  record->lane = lane;
+  record->size = static_cast<uint32>(size);
+  record->event = static_cast<uint8>(event);
+  record->protocol = 0;
+  // count covers every record claimed so far. A file read while lanes
+  // still run may hold a record a racing writer hasn't finished.
+  RaiseCount(&header_->count, index + 1);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// ReadCaptureFile
+///////////////////////////////////////////////////////////////////////////////
+
+bool ReadCaptureFile(const std::string& path, CaptureHeader* header,
+                     std::vector<CaptureRecord>* records, std::string* error) {
+  std::ifstream file(path.c_str(), std::ios::binary);
+  if (!file) {
+    *error = "Can't open " + path + ".";
+    return false;
+  }
+
+  if (!file.read(reinterpret_cast<char*>(header), sizeof(*header)) ||
+      memcmp(header->magic, kCaptureMagic, sizeof(kCaptureMagic)) != 0 ||
+      header->record_size != sizeof(CaptureRecord) || header->capacity == 0) {
+    *error = path + " is not a capture file.";
+    return false;
+  }
+
+  std::vector<CaptureRecord> ring(static_cast<size_t>(header->capacity));
+  if (!file.read(reinterpret_cast<char*>(&ring[0]), ring.size() * sizeof(CaptureRecord))) {
+    *error = path + " is truncated.";
+    return false;
+  }
+
+  // Oldest first: after a wrap the ring starts at count % capacity.
+  uint64 kept = std::min(header->count, header->capacity);
+  uint64 first = header->count - kept;
+  records->clear();
+  records->reserve(static_cast<size_t>(kept));
+  for (uint64 i = first; i < header->count; ++i) {
+    records->push_back(ring[i % header->capacity]);
+  }
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+} // namespace hotline
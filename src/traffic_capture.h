@@ -0,0 +1,98 @@
+#ifndef HOTLINE_TUNNEL_TRAFFIC_CAPTURE_H_
+#define HOTLINE_TUNNEL_TRAFFIC_CAPTURE_H_
+#pragma once
+
+#include "htn_config.h"
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "webrtc/base/basictypes.h"
+
+
+namespace hotline {
+
+// What happened on a lane. Directions are seen from the capturing peer:
+// kToTunnel is data read from its local socket and sent to the other
+// peer, kFromTunnel data from the other peer written to its local socket.
+enum CaptureEvent {
+  kCaptureLaneOpen = 1,
+  kCaptureLaneClose = 2,
+  kCaptureToTunnel = 3,
+  kCaptureFromTunnel = 4
+};
+
+// One fixed size record of the ring. Only metadata: no payload is kept.
+struct CaptureRecord {
+  uint64 time;        // microseconds since the capture started
+  uint32 lane;        // lane number, in order of opening from 1
+  uint32 size;        // bytes, for kCaptureToTunnel and kCaptureFromTunnel
+  uint8 event;        // CaptureEvent
+  uint8 protocol;     // cricket::ProtocolType, on kCaptureLaneOpen
+  uint8 reserved[6];
+};
+
+// The start of a capture file, followed by capacity records.
+struct CaptureHeader {
+  enum { kServerMode = 1 };
+
+  char magic[8];      // kCaptureMagic
+  uint32 record_size;
+  uint32 flags;       // kServerMode if captured by the server peer
+  uint64 capacity;    // records in the ring
+  uint64 count;       // records written; the ring keeps the last capacity
+  uint8 reserved[32];
+};
+
+extern const char kCaptureMagic[8];
+
+
+//////////////////////////////////////////////////////////////////////
+// TrafficCapture
+// Records lane events into a ring of fixed size records in a memory
+// mapped file. Recording is a clock read, an atomic increment and a
+// 24 byte store into the mapping; the kernel writes the pages back, so
+// capturing costs the lanes no system calls. When the ring is full the
+// oldest records are overwritten. Safe to call from any thread.
+//
+class TrafficCapture {
+public:
+  TrafficCapture();
+  ~TrafficCapture();
+
+  // Creates or truncates path and maps a ring of capacity records.
+  bool Open(const std::string& path, uint64 capacity, bool server_mode);
+  void Close();
+  bool is_open() const { return header_ != NULL; }
+
+  // A new lane number; records its kCaptureLaneOpen.
+  uint32 OpenLane(int protocol);
+  void Record(uint32 lane, CaptureEvent event, size_t size);
+
+private:
+  CaptureHeader* header_;
+  CaptureRecord* records_;
+  size_t mapped_size_;
+#if defined(WIN32)
+  void* file_;
+  void* mapping_;
+#else
+  int fd_;
+#endif
+  uint64 start_time_;
+  std::atomic<uint64> next_record_;
+  std::atomic<uint32> next_lane_;
+};
+
+
+// Reads a capture file back in order, oldest record first. Returns false
+// and sets error if it is not a capture.
+bool ReadCaptureFile(const std::string& path, CaptureHeader* header,
+                     std::vector<CaptureRecord>* records, std::string* error);
+
+//////////////////////////////////////////////////////////////////////
+
+} // namespace hotline
+
+#endif  // HOTLINE_TUNNEL_TRAFFIC_CAPTURE_H_
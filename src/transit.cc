@@ -0,0 +1,131 @@
+#include "htn_config.h"
+
+#include <algorithm>
+#include <iostream>
+
+#include "webrtc/base/thread.h"
+#include "webrtc/base/timeutils.h"
+#include "bench.h"
+#include "transit.h"
+
+
+namespace hotline {
+
+uint64 TransitNow() {
+  return rtc::TimeNanos() / 1000;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// ClockOffsetEstimator
+///////////////////////////////////////////////////////////////////////////////
+
+void ClockOffsetEstimator::AddSample(uint64 sent, uint64 remote, uint64 received) {
+  if (received < sent) return;
+
+  Sample sample;
+  sample.rtt = received - sent;
+  sample.offset = (int64)remote - (int64)(sent + sample.rtt / 2);
+
+  samples_.push_back(sample);
+  if (samples_.size() > kWindow) samples_.pop_front();
+
+  const Sample* best = &samples_[0];
+  for (size_t i = 1; i < samples_.size(); ++i) {
+    if (samples_[i].rtt < best->rtt) best = &samples_[i];
+  }
+  offset_ = best->offset;
+  rtt_ = best->rtt;
+  valid_ = true;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// TransitStats
+///////////////////////////////////////////////////////////////////////////////
+
+TransitStats::TransitStats()
+  : next_lane_(1)
+  , closed_lanes_(0) {
+}
+
+TransitStats::~TransitStats() {
+  for (std::map<int, Lane*>::iterator it = lanes_.begin(); it != lanes_.end(); ++it) {
+    delete it->second;
+  }
+}
+
+int TransitStats::OpenLane(const std::string& name) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  int id = next_lane_++;
+  Lane* lane = new Lane();
+  lane->name = name;
+  lanes_[id] = lane;
+  return id;
+}
+
+void TransitStats::CloseLane(int lane) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::map<int, Lane*>::iterator it = lanes_.find(lane);
+  if (it == lanes_.end()) return;
+
+  delete it->second;
+  lanes_.erase(it);
+  closed_lanes_++;
+}
+
+void TransitStats::Record(int lane, uint64 transit) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::map<int, Lane*>::iterator it = lanes_.find(lane);
+  if (it != lanes_.end()) it->second->transit.Record(transit);
+  total_.Record(transit);
+}
+
+void TransitStats::Report(Json::Value* json) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  Json::Value lanes(Json::objectValue);
+  for (std::map<int, Lane*>::const_iterator it = lanes_.begin(); it != lanes_.end(); ++it) {
+    Json::Value lane = LatencyToJson(it->second->transit);
+    lane["count"] = static_cast<double>(it->second->transit.count());
+    lanes[it->second->name] = lane;
+  }
+
+  (*json)["total"] = LatencyToJson(total_);
+  (*json)["total"]["count"] = static_cast<double>(total_.count());
+  (*json)["lanes"] = lanes;
+  (*json)["closed_lanes"] = closed_lanes_;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// TransitReporter
+///////////////////////////////////////////////////////////////////////////////
+
+TransitReporter::TransitReporter(rtc::Thread* thread, const TransitStats* stats,
+                                 int interval)
+  : thread_(thread)
+  , stats_(stats)
+  , interval_(std::max(interval, 1)) {
+}
+
+TransitReporter::~TransitReporter() {
+  thread_->Clear(this);
+}
+
+void TransitReporter::Start() {
+  thread_->PostDelayed(interval_ * 1000, this);
+}
+
+void TransitReporter::OnMessage(rtc::Message* msg) {
+  Json::Value json;
+  stats_->Report(&json);
+
+  Json::FastWriter writer;
+  std::cout << writer.write(json) << std::flush;
+  thread_->PostDelayed(interval_ * 1000, this);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+} // namespace hotline
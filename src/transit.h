@@ -0,0 +1,137 @@
+#ifndef HOTLINE_TUNNEL_TRANSIT_H_
+#define HOTLINE_TUNNEL_TRANSIT_H_
+#pragma once
+
+#include "htn_config.h"
+
+#include <atomic>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include "webrtc/base/basictypes.h"
+#include "webrtc/base/json.h"
+#include "webrtc/base/messagehandler.h"
+#include "histogram.h"
+
+
+namespace rtc {
+  class Thread;
+}
+
+
+namespace hotline {
+
+// Bytes of the read time stamp in front of every message of a lane with
+// LaneSettings::transit.
+const size_t kTransitStampSize = sizeof(uint64);
+
+// Microseconds on the clock transit stamps are taken from.
+uint64 TransitNow();
+
+
+//////////////////////////////////////////////////////////////////////
+// ClockOffsetEstimator
+// The offset of a peer's clock from ours, from probes over the control
+// channel: we send our time, the peer answers with its own, and the
+// offset is the peer's time minus the midpoint of the round trip. Of the
+// last kWindow probes the one with the shortest round trip wins, since
+// queueing on either way only makes a probe less symmetric.
+//
+// AddSample() is called from one thread; ToLocal() from any.
+//
+class ClockOffsetEstimator {
+public:
+  enum { kWindow = 8 };
+
+  ClockOffsetEstimator() : offset_(0), rtt_(0), valid_(false) {}
+
+  // A probe sent at our time sent, answered at the peer's time remote and
+  // back at our time received.
+  void AddSample(uint64 sent, uint64 remote, uint64 received);
+
+  bool valid() const { return valid_; }
+  // Peer minus local, microseconds.
+  int64 offset() const { return offset_; }
+  uint64 rtt() const { return rtt_; }
+  // A time on the peer's clock, on ours.
+  uint64 ToLocal(uint64 remote) const { return remote - offset_; }
+
+private:
+  struct Sample {
+    int64 offset;
+    uint64 rtt;
+  };
+
+  std::deque<Sample> samples_;
+  std::atomic<int64> offset_;
+  std::atomic<uint64> rtt_;
+  std::atomic<bool> valid_;
+};
+
+
+//////////////////////////////////////////////////////////////////////
+// TransitStats
+// Histograms of how long lane data spends in the tunnel, from the moment
+// one peer reads it from its local socket to the moment the other writes
+// it to its own, per lane and in total. Lanes record from their threads;
+// Report() may be called at any time from any thread.
+//
+class TransitStats {
+public:
+  TransitStats();
+  ~TransitStats();
+
+  // A new lane id for Record(); name is how the lane is reported.
+  int OpenLane(const std::string& name);
+  // Keeps the lane in the total and drops its own histogram.
+  void CloseLane(int lane);
+  void Record(int lane, uint64 transit);
+
+  // {"total": {...}, "lanes": {name: {...}}, "closed_lanes": n}, times in
+  // microseconds.
+  void Report(Json::Value* json) const;
+
+private:
+  struct Lane {
+    std::string name;
+    Histogram transit;
+  };
+
+  mutable std::mutex mutex_;
+  std::map<int, Lane*> lanes_;
+  Histogram total_;
+  int next_lane_;
+  int closed_lanes_;
+};
+
+
+//////////////////////////////////////////////////////////////////////
+// TransitReporter
+// Prints a TransitStats report as one line of JSON to stdout every
+// interval seconds.
+//
+class TransitReporter : public rtc::MessageHandler {
+public:
+  TransitReporter(rtc::Thread* thread, const TransitStats* stats, int interval);
+  virtual ~TransitReporter();
+
+  void Start();
+
+  //
+  // implements the MessageHandler interface
+  //
+  void OnMessage(rtc::Message* msg);
+
+private:
+  rtc::Thread* thread_;
+  const TransitStats* stats_;
+  int interval_;
+};
+
+//////////////////////////////////////////////////////////////////////
+
+} // namespace hotline
+
+#endif  // HOTLINE_TUNNEL_TRANSIT_H_
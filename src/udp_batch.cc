@@ -0,0 +1,298 @@
+#include "htn_config.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+
+#include "webrtc/base/common.h"
+#include "webrtc/base/logging.h"
+#include "webrtc/base/physicalsocketserver.h"
+#include "webrtc/base/thread.h"
+#include "udp_batch.h"
+
+
+namespace hotline {
+
+static const int kSocketBufferSize = 1024 * 1024;
+static const int kMaxBatchesPerReadEvent = 8;
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Receive buffers
+//
+// All UDP sockets are serviced on the signaling thread, one read event at a
+// time, so they share one set of receive slots instead of carrying 2MB each.
+///////////////////////////////////////////////////////////////////////////////
+
+struct ReceiveSlots {
+  ReceiveSlots() : buffers(UdpBatchSocket::kBatchSize * UdpBatchSocket::kMaxDatagramSize) {
+    memset(addresses, 0, sizeof(addresses));
+  }
+
+  char* slot(int i) { return &buffers[i * UdpBatchSocket::kMaxDatagramSize]; }
+
+  std::vector<char> buffers;
+  sockaddr_storage addresses[UdpBatchSocket::kBatchSize];
+};
+
+static ReceiveSlots* SharedReceiveSlots() {
+  static ReceiveSlots* slots = new ReceiveSlots();
+  return slots;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// UdpBatchSocket
+///////////////////////////////////////////////////////////////////////////////
+
+UdpBatchSocket* UdpBatchSocket::Create(rtc::PhysicalSocketServer* socket_server,
+                                       const rtc::SocketAddress& bind_address) {
+  rtc::Thread* thread = rtc::Thread::Current();
+  ASSERT(thread != NULL);
+  if (socket_server == NULL || thread->socketserver() != socket_server) {
+    LOG(LS_ERROR) << "Batched UDP needs the thread's PhysicalSocketServer.";
+    return NULL;
+  }
+
+  int fd = ::socket(bind_address.family(), SOCK_DGRAM, 0);
+  if (fd < 0) {
+    LOG_ERR(LS_ERROR) << "UDP socket creation failed";
+    return NULL;
+  }
+
+  int size = kSocketBufferSize;
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+  setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+
+  // The socket server makes the descriptor non-blocking and reports
+  // readiness like for any AsyncSocket.
+  rtc::AsyncSocket* socket = socket_server->WrapSocket(fd);
+  if (!socket) {
+    ::close(fd);
+    return NULL;
+  }
+
+  if (socket->Bind(bind_address) == SOCKET_ERROR) {
+    LOG(LS_ERROR) << "Local port already in use or no privilege to bind port.";
+    delete socket;
+    return NULL;
+  }
+
+  return new UdpBatchSocket(socket, fd);
+}
+
+UdpBatchSocket::UdpBatchSocket(rtc::AsyncSocket* socket, int fd)
+  : socket_(socket)
+  , fd_(fd)
+  , connected_(false)
+  , flush_posted_(false)
+  , send_queue_(kBatchSize)
+  , send_count_(0)
+  , send_dropped_(0) {
+  socket_->SignalReadEvent.connect(this, &UdpBatchSocket::OnReadEvent);
+}
+
+UdpBatchSocket::~UdpBatchSocket() {
+  Close();
+}
+
+bool UdpBatchSocket::Connect(const rtc::SocketAddress& address) {
+  if (!socket_ || socket_->Connect(address) == SOCKET_ERROR) return false;
+  connected_ = true;
+  return true;
+}
+
+void UdpBatchSocket::Close() {
+  if (!socket_) return;
+
+  Flush();
+  socket_->Close();
+  socket_.reset();
+  fd_ = -1;
+}
+
+rtc::SocketAddress UdpBatchSocket::GetLocalAddress() const {
+  if (!socket_) return rtc::SocketAddress();
+  return socket_->GetLocalAddress();
+}
+
+int UdpBatchSocket::SendDatagram(const void* data, size_t len,
+                                 const rtc::SocketAddress& to) {
+  if (!socket_) return -1;
+
+  PendingDatagram& pending = send_queue_[send_count_++];
+  pending.data.assign(static_cast<const char*>(data),
+                      static_cast<const char*>(data) + len);
+  pending.to = to;
+
+  if (send_count_ == kBatchSize) {
+    Flush();
+  }
+  else if (!flush_posted_) {
+    rtc::Thread::Current()->Post(this, MsgFlush);
+    flush_posted_ = true;
+  }
+
+  return static_cast<int>(len);
+}
+
+void UdpBatchSocket::Flush() {
+  if (send_count_ == 0 || fd_ < 0) {
+    send_count_ = 0;
+    return;
+  }
+
+  sockaddr_storage addresses[kBatchSize];
+  socklen_t address_lens[kBatchSize];
+  for (size_t i = 0; i < send_count_; ++i) {
+    address_lens[i] = connected_ ? 0 : static_cast<socklen_t>(
+        send_queue_[i].to.ToSockAddrStorage(&addresses[i]));
+  }
+
+  // Datagrams the kernel refused (EAGAIN, unreachable, ...) are lost, the
+  // same as a datagram dropped on the wire; the rest of the batch still goes.
+  size_t sent = 0;
+  size_t dropped = 0;
+
+#if defined(__linux__)
+  mmsghdr messages[kBatchSize];
+  iovec iovecs[kBatchSize];
+  memset(messages, 0, sizeof(messages));
+
+  for (size_t i = 0; i < send_count_; ++i) {
+    iovecs[i].iov_base = send_queue_[i].data.empty() ? NULL : &send_queue_[i].data[0];
+    iovecs[i].iov_len = send_queue_[i].data.size();
+    messages[i].msg_hdr.msg_iov = &iovecs[i];
+    messages[i].msg_hdr.msg_iovlen = 1;
+    if (!connected_) {
+      messages[i].msg_hdr.msg_name = &addresses[i];
+      messages[i].msg_hdr.msg_namelen = address_lens[i];
+    }
+  }
+
+  while (sent < send_count_) {
+    int result = sendmmsg(fd_, messages + sent,
+                          static_cast<unsigned int>(send_count_ - sent), 0);
+    if (result < 0) {
+      if (errno == EINTR) continue;
+      // sendmmsg() only fails when the first datagram does; skip it.
+      sent++;
+      dropped++;
+      continue;
+    }
+    sent += result;
+  }
+#else
+  for (; sent < send_count_; ++sent) {
+    const PendingDatagram& pending = send_queue_[sent];
+    ssize_t result;
+    do {
+      result = ::sendto(fd_, pending.data.empty() ? NULL : &pending.data[0],
+                        pending.data.size(), 0,
+                        connected_ ? NULL : reinterpret_cast<sockaddr*>(&addresses[sent]),
+                        address_lens[sent]);
+    } while (result < 0 && errno == EINTR);
+    if (result < 0) dropped++;
+  }
+#endif
+
+  send_dropped_ += dropped;
+  send_count_ = 0;
+}
+
+void UdpBatchSocket::OnMessage(rtc::Message* msg) {
+  if (msg->message_id == MsgFlush) {
+    flush_posted_ = false;
+    Flush();
+  }
+}
+
+int UdpBatchSocket::ReceiveBatch() {
+  ReceiveSlots* batch = SharedReceiveSlots();
+  int count = 0;
+  size_t lens[kBatchSize];
+
+#if defined(__linux__)
+  mmsghdr messages[kBatchSize];
+  iovec iovecs[kBatchSize];
+  memset(messages, 0, sizeof(messages));
+
+  for (int i = 0; i < kBatchSize; ++i) {
+    iovecs[i].iov_base = batch->slot(i);
+    iovecs[i].iov_len = kMaxDatagramSize;
+    messages[i].msg_hdr.msg_iov = &iovecs[i];
+    messages[i].msg_hdr.msg_iovlen = 1;
+    messages[i].msg_hdr.msg_name = &batch->addresses[i];
+    messages[i].msg_hdr.msg_namelen = sizeof(batch->addresses[i]);
+  }
+
+  count = recvmmsg(fd_, messages, kBatchSize, MSG_DONTWAIT, NULL);
+  if (count <= 0) return 0;
+  for (int i = 0; i < count; ++i) lens[i] = messages[i].msg_len;
+#else
+  for (; count < kBatchSize; ++count) {
+    socklen_t address_len = sizeof(batch->addresses[count]);
+    ssize_t result = ::recvfrom(fd_, batch->slot(count), kMaxDatagramSize,
+                                MSG_DONTWAIT,
+                                reinterpret_cast<sockaddr*>(&batch->addresses[count]),
+                                &address_len);
+    if (result < 0) break;
+    lens[count] = result;
+  }
+#endif
+
+  rtc::SocketAddress from;
+  for (int i = 0; i < count && socket_; ++i) {
+    rtc::SocketAddressFromSockAddrStorage(batch->addresses[i], &from);
+    SignalDatagram(this, batch->slot(i), lens[i], from);
+  }
+  return count;
+}
+
+void UdpBatchSocket::OnReadEvent(rtc::AsyncSocket* socket) {
+  for (int i = 0; i < kMaxBatchesPerReadEvent && socket_; ++i) {
+    if (ReceiveBatch() < kBatchSize) break;
+  }
+  if (!socket_) return;
+
+  // The wrapper stops reporting readiness until it sees a receive of its
+  // own. This one re-arms it and picks up anything that raced in.
+  rtc::SocketAddress from;
+  char* buffer = SharedReceiveSlots()->slot(0);
+  int len = socket_->RecvFrom(buffer, kMaxDatagramSize, &from);
+  if (len >= 0) {
+    SignalDatagram(this, buffer, len, from);
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// UdpConnectedStream
+///////////////////////////////////////////////////////////////////////////////
+
+UdpConnectedStream::UdpConnectedStream(UdpBatchSocket* socket,
+                                       const rtc::SocketAddress& remote_address)
+  : UdpSessionStream(socket, remote_address)
+  , socket_(socket) {
+  socket_->SignalDatagram.connect(this, &UdpConnectedStream::OnDatagram);
+}
+
+UdpConnectedStream::~UdpConnectedStream() {
+}
+
+void UdpConnectedStream::Close() {
+  UdpSessionStream::Close();
+  socket_->Close();
+}
+
+void UdpConnectedStream::OnDatagram(UdpBatchSocket* socket, const char* data,
+                                    size_t len, const rtc::SocketAddress& from) {
+  Deliver(data, len);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+} // namespace hotline
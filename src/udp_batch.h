@@ -0,0 +1,126 @@
+#ifndef HOTLINE_TUNNEL_UDP_BATCH_H_
+#define HOTLINE_TUNNEL_UDP_BATCH_H_
+#pragma once
+
+#include "htn_config.h"
+
+#include <vector>
+
+#include "webrtc/base/asyncsocket.h"
+#include "webrtc/base/messagehandler.h"
+#include "webrtc/base/scoped_ptr.h"
+#include "webrtc/base/sigslot.h"
+#include "webrtc/base/socketaddress.h"
+#include "udp_session.h"
+
+
+namespace rtc {
+  class PhysicalSocketServer;
+  class Thread;
+}
+
+
+namespace hotline {
+
+//////////////////////////////////////////////////////////////////////
+// UdpBatchSocket
+// A UDP socket that moves datagrams in batches: up to kBatchSize datagrams
+// per recvmmsg()/sendmmsg() call on Linux, one recvfrom()/sendto() each on
+// other POSIX systems. Outgoing datagrams are queued and flushed when the
+// batch is full or when the thread returns to its message loop, so a burst
+// of data channel messages leaves in a single syscall.
+//
+class UdpBatchSocket : public UdpSessionSender,
+                       public rtc::MessageHandler,
+                       public sigslot::has_slots<> {
+public:
+  enum { kBatchSize = 32 };
+  enum { kMaxDatagramSize = 64 * 1024 };
+
+  enum ThreadMsgId{
+    MsgFlush
+  };
+
+  // Returns NULL if the socket can't be created or bound, or if
+  // socket_server isn't the current thread's; the socket is serviced by that
+  // thread.
+  static UdpBatchSocket* Create(rtc::PhysicalSocketServer* socket_server,
+                                const rtc::SocketAddress& bind_address);
+  virtual ~UdpBatchSocket();
+
+  bool Connect(const rtc::SocketAddress& address);
+  void Close();
+  rtc::SocketAddress GetLocalAddress() const;
+
+  // Datagrams the kernel refused: send buffer full, destination
+  // unreachable and the like.
+  size_t send_dropped() const { return send_dropped_; }
+
+  // Signalled once per received datagram, in arrival order.
+  sigslot::signal4<UdpBatchSocket*, const char*, size_t,
+                   const rtc::SocketAddress&> SignalDatagram;
+
+  //
+  // UdpSessionSender implementation.
+  // Copies the datagram into the send batch; returns -1 once closed.
+  //
+  virtual int SendDatagram(const void* data, size_t len,
+                           const rtc::SocketAddress& to);
+
+  // Sends everything queued so far.
+  void Flush();
+
+  //
+  // implements the MessageHandler interface
+  //
+  void OnMessage(rtc::Message* msg);
+
+private:
+  struct PendingDatagram {
+    std::vector<char> data;
+    rtc::SocketAddress to;
+  };
+
+  UdpBatchSocket(rtc::AsyncSocket* socket, int fd);
+
+  void OnReadEvent(rtc::AsyncSocket* socket);
+  int ReceiveBatch();
+
+  // Wraps fd_ and owns it; only used for bind/connect and read readiness.
+  rtc::scoped_ptr<rtc::AsyncSocket> socket_;
+  int fd_;
+  bool connected_;
+  bool flush_posted_;
+
+  std::vector<PendingDatagram> send_queue_;
+  size_t send_count_;
+  size_t send_dropped_;
+};
+
+
+//////////////////////////////////////////////////////////////////////
+// UdpConnectedStream
+// A UdpSessionStream with its own connected UdpBatchSocket, used for the
+// destination side of a UDP lane.
+//
+class UdpConnectedStream : public UdpSessionStream,
+                           public sigslot::has_slots<> {
+public:
+  UdpConnectedStream(UdpBatchSocket* socket,
+                     const rtc::SocketAddress& remote_address);
+  virtual ~UdpConnectedStream();
+
+  virtual void Close();
+
+private:
+  void OnDatagram(UdpBatchSocket* socket, const char* data, size_t len,
+                  const rtc::SocketAddress& from);
+
+  rtc::scoped_ptr<UdpBatchSocket> socket_;
+};
+
+//////////////////////////////////////////////////////////////////////
+
+} // namespace hotline
+
+#endif  // HOTLINE_TUNNEL_UDP_BATCH_H_
@@ -0,0 +1,91 @@
+#include "htn_config.h"
+
+#include <string.h>
+#include <algorithm>
+
+#include "webrtc/base/common.h"
+#include "webrtc/base/logging.h"
+#include "webrtc/base/timeutils.h"
+#include "udp_session.h"
+
+
+namespace hotline {
+
+///////////////////////////////////////////////////////////////////////////////
+// UdpSessionStream
+///////////////////////////////////////////////////////////////////////////////
+
+UdpSessionStream::UdpSessionStream(UdpSessionSender* sender,
+                                   const rtc::SocketAddress& remote_address)
+  : sender_(sender)
+  , remote_address_(remote_address)
+  , last_activity_(rtc::Time())
+  , dropped_(0)
+  , closed_(false) {
+}
+
+UdpSessionStream::~UdpSessionStream() {
+}
+
+void UdpSessionStream::Deliver(const char* data, size_t len) {
+  if (closed_) return;
+
+  last_activity_ = rtc::Time();
+
+  if (datagrams_.size() >= kMaxQueuedDatagrams) {
+    datagrams_.pop_front();
+    dropped_++;
+  }
+  datagrams_.push_back(std::vector<char>(data, data + len));
+
+  SignalEvent(this, rtc::SE_READ, 0);
+}
+
+rtc::StreamState UdpSessionStream::GetState() const {
+  return closed_ ? rtc::SS_CLOSED : rtc::SS_OPEN;
+}
+
+rtc::StreamResult UdpSessionStream::Read(void* buffer, size_t buffer_len,
+                                         size_t* read, int* error) {
+  if (closed_) return rtc::SR_EOS;
+  if (datagrams_.empty()) return rtc::SR_BLOCK;
+
+  // Like recv() on a datagram socket, an oversized datagram is truncated.
+  std::vector<char>& datagram = datagrams_.front();
+  size_t len = std::min(buffer_len, datagram.size());
+  if (len < datagram.size()) {
+    LOG(LS_WARNING) << "UDP datagram of " << datagram.size() << " bytes truncated to "
+                    << len << ".";
+  }
+  if (len > 0) memcpy(buffer, &datagram[0], len);
+  datagrams_.pop_front();
+
+  if (read) *read = len;
+  return rtc::SR_SUCCESS;
+}
+
+rtc::StreamResult UdpSessionStream::Write(const void* data, size_t data_len,
+                                          size_t* written, int* error) {
+  if (closed_) return rtc::SR_EOS;
+
+  last_activity_ = rtc::Time();
+
+  // A datagram the local socket can't take right now is dropped, the same
+  // as a loss on the network. Blocking here would stall every session
+  // sharing the socket.
+  if (sender_->SendDatagram(data, data_len, remote_address_) < 0) {
+    dropped_++;
+  }
+
+  if (written) *written = data_len;
+  return rtc::SR_SUCCESS;
+}
+
+void UdpSessionStream::Close() {
+  closed_ = true;
+  datagrams_.clear();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+} // namespace hotline
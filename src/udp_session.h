@@ -0,0 +1,75 @@
+#ifndef HOTLINE_TUNNEL_UDP_SESSION_H_
+#define HOTLINE_TUNNEL_UDP_SESSION_H_
+#pragma once
+
+#include <deque>
+#include <vector>
+
+#include "webrtc/base/stream.h"
+#include "webrtc/base/socketaddress.h"
+
+
+namespace hotline {
+
+//////////////////////////////////////////////////////////////////////
+// UdpSessionSender
+// Sends datagrams on behalf of the UDP sessions sharing one local socket.
+//
+class UdpSessionSender {
+public:
+  virtual int SendDatagram(const void* data, size_t len,
+                           const rtc::SocketAddress& to) = 0;
+
+protected:
+  virtual ~UdpSessionSender() {}
+};
+
+
+//////////////////////////////////////////////////////////////////////
+// UdpSessionStream
+// One client of a UDP listen socket, identified by its source address.
+// The owner demultiplexes incoming datagrams and hands them over with
+// Deliver(); every Read() returns exactly one datagram and every Write()
+// is sent as exactly one datagram, so datagram boundaries survive the
+// data channel.
+//
+class UdpSessionStream : public rtc::StreamInterface {
+public:
+  enum { kMaxQueuedDatagrams = 256 };
+
+  UdpSessionStream(UdpSessionSender* sender,
+                   const rtc::SocketAddress& remote_address);
+  virtual ~UdpSessionStream();
+
+  // Queues a datagram received from remote_address() and signals SE_READ.
+  // The oldest datagram is dropped if the lane is not draining the queue.
+  void Deliver(const char* data, size_t len);
+
+  const rtc::SocketAddress& remote_address() const { return remote_address_; }
+  uint32 last_activity() const { return last_activity_; }
+  size_t dropped() const { return dropped_; }
+
+  //
+  // StreamInterface implementation.
+  //
+  virtual rtc::StreamState GetState() const;
+  virtual rtc::StreamResult Read(void* buffer, size_t buffer_len,
+                                 size_t* read, int* error);
+  virtual rtc::StreamResult Write(const void* data, size_t data_len,
+                                  size_t* written, int* error);
+  virtual void Close();
+
+private:
+  UdpSessionSender* sender_;
+  rtc::SocketAddress remote_address_;
+  std::deque<std::vector<char> > datagrams_;
+  uint32 last_activity_;
+  size_t dropped_;
+  bool closed_;
+};
+
+//////////////////////////////////////////////////////////////////////
+
+} // namespace hotline
+
+#endif  // HOTLINE_TUNNEL_UDP_SESSION_H_
@@ -1,6 +1,7 @@
 #include "htn_config.h"
 
-#include <list>
+#include <vector>
+#include <deque>
 #include <mutex>
 #include <thread>
 #include <algorithm>
@@ -9,29 +10,40 @@
 #include "webrtc/base/refcount.h"
 #include "webrtc/base/common.h"
 #include "webrtc/base/logging.h"
+#include "webrtc/base/socketaddress.h"
+#include "webrtc/base/timeutils.h"
 #include "webrtc/system_wrappers/interface/trace.h"
 #ifdef ARRAY_SIZE
 #undef ARRAY_SIZE
 #endif
 #include "libwebsockets.h"
+#include "spsc_ring.h"
 #include "websocket.h"
 
 
 namespace hotline {
 
+// Default largest fragment written at once; see WebSocket::setFragmentSize().
 #define WS_WRITE_BUFFER_SIZE 2048
 
+// While connecting the thread still wakes this often (ms), so that
+// libwebsockets can time out the connect and the handshake. Once open it
+// sleeps until there is traffic or sendMessageToSubThread() wakes it.
+static const int kConnectingServiceTimeout = 1000;
+
+// Messages that may wait for the websocket thread at once.
+static const size_t kSendQueueSize = 1024;
+
+// Messages that may wait behind a full queue before sends fail.
+static const size_t kMaxSendOverflow = 4096;
+
+static uint64 NowMicros() {
+  return rtc::TimeNanos() / 1000;
+}
+
 #define CC_SAFE_DELETE(p)           do { if(p) { delete (p); (p) = nullptr; } } while(0)
 #define CC_SAFE_DELETE_ARRAY(p)     do { if(p) { delete[] (p); (p) = nullptr; } } while(0)
 
-  
-class WsMessage
-{
-public:
-    WsMessage() : what(0), obj(nullptr){}
-    unsigned int what; // message type
-    void* obj;
-};
 
 /**
  *  @brief Websocket thread helper, it's used for sending message between caller and websocket thread.
@@ -47,8 +59,13 @@ public:
   // Quits sub-thread (websocket thread).
   void quitSubThread();
     
-  // Sends message to sub-thread(websocket thread). It's needs to be invoked in UI thread.
-  void sendMessageToSubThread(WsMessage *msg);
+  // Sends message to sub-thread(websocket thread). Any thread may call it;
+  // false if the queue and its overflow are both full.
+  bool sendMessageToSubThread(WsSendBuffer *msg);
+
+  // Moves what it can of the overflow into the queue. Websocket thread only.
+  void refillFromOverflow();
+  bool hasOverflow();
     
   // Waits the sub-thread (websocket thread) to exit,
   void joinSubThread();
@@ -57,8 +74,15 @@ protected:
   void wsThreadEntryFunc();
     
 private:
-  std::list<WsMessage*>* _subThreadWsMessageQueue;
-  std::mutex   _subThreadWsMessageQueueMutex;
+  // Only the websocket thread takes messages out, so it never waits for
+  // a sender, nor a sender for its writes. Senders (the signal thread and
+  // the PeerConnections' signaling threads) take turns on
+  // _sendersMutex, which guards the push and the overflow.
+  SpscRing<WsSendBuffer*> _subThreadSendQueue;
+  std::mutex   _sendersMutex;
+  // Messages that found the queue full, in order. While any wait here the
+  // later ones do too, so nothing overtakes them.
+  std::deque<WsSendBuffer*> _sendOverflow;
   std::thread* _subThreadInstance;
   WebSocket* _ws;
   bool _needQuit;
@@ -84,20 +108,44 @@ public:
   }
 };
 
+// Writes fragments to a libwebsockets connection.
+class LwsFragmentSink : public WsFragmentSink {
+public:
+  explicit LwsFragmentSink(struct libwebsocket *wsi) : _wsi(wsi) {}
+
+  virtual int WriteFragment(unsigned char* buf, size_t len, int write_protocol) {
+    return libwebsocket_write(_wsi, buf, len, (libwebsocket_write_protocol)write_protocol);
+  }
+
+  virtual bool Choked() {
+    return lws_send_pipe_choked(_wsi) != 0;
+  }
+
+private:
+  struct libwebsocket *_wsi;
+};
+
 // Implementation of WsThreadHelper
 WsThreadHelper::WsThreadHelper()
-: _subThreadInstance(nullptr)
+: _subThreadSendQueue(kSendQueueSize)
+, _subThreadInstance(nullptr)
 , _ws(nullptr)
 , _needQuit(false)
 {
-    _subThreadWsMessageQueue = new std::list<WsMessage*>();
 }
 
 WsThreadHelper::~WsThreadHelper()
 {
   joinSubThread();
   CC_SAFE_DELETE(_subThreadInstance);
-  delete _subThreadWsMessageQueue;
+  WsSendBuffer** msg;
+  while ((msg = _subThreadSendQueue.Front()) != nullptr) {
+    delete *msg;
+    _subThreadSendQueue.Pop();
+  }
+  for (size_t i = 0; i < _sendOverflow.size(); ++i) {
+    delete _sendOverflow[i];
+  }
 }
 
 bool WsThreadHelper::createThread(const WebSocket& ws)
@@ -125,10 +173,32 @@ void WsThreadHelper::wsThreadEntryFunc()
   }
 }
 
-void WsThreadHelper::sendMessageToSubThread(WsMessage *msg)
+bool WsThreadHelper::sendMessageToSubThread(WsSendBuffer *msg)
 {
-  std::lock_guard<std::mutex> lk(_subThreadWsMessageQueueMutex);
-  _subThreadWsMessageQueue->push_back(msg);
+  {
+    std::lock_guard<std::mutex> lk(_sendersMutex);
+    if (!_sendOverflow.empty() || !_subThreadSendQueue.Push(msg)) {
+      if (_sendOverflow.size() >= kMaxSendOverflow) return false;
+      _sendOverflow.push_back(msg);
+    }
+  }
+  _ws->wakeSubThread();
+  return true;
+}
+
+void WsThreadHelper::refillFromOverflow()
+{
+  std::lock_guard<std::mutex> lk(_sendersMutex);
+  while (!_sendOverflow.empty() &&
+         _subThreadSendQueue.Push(_sendOverflow.front())) {
+    _sendOverflow.pop_front();
+  }
+}
+
+bool WsThreadHelper::hasOverflow()
+{
+  std::lock_guard<std::mutex> lk(_sendersMutex);
+  return !_sendOverflow.empty();
 }
 
 void WsThreadHelper::joinSubThread()
@@ -138,18 +208,18 @@ void WsThreadHelper::joinSubThread()
   }
 }
 
-enum WS_MSG {
-    WS_MSG_TO_SUBTRHEAD_SENDING_STRING = 0,
-    WS_MSG_TO_SUBTRHEAD_SENDING_BINARY
-};
-
 
 WebSocket::WebSocket()
     : _readyState(State::CLOSED)
     , _port(80)
     , _pendingFrameDataLen(0)
-    , _currentDataLen(0)
-    , _currentData(nullptr)
+    , _fragmentSize(WS_WRITE_BUFFER_SIZE)
+    , _pingInterval(0)
+    , _pingTimeout(0)
+    , _nextPingAt(0)
+    , _pingSentAt(0)
+    , _pingDue(false)
+    , _rtt(-1)
     , _wsHelper(nullptr)
     , _wsInstance(nullptr)
     , _wsContext(nullptr)
@@ -255,37 +325,58 @@ bool WebSocket::init(const std::string& url,
   return ret;
 }
 
-void WebSocket::send(const std::string& message)
+void WebSocket::setFragmentSize(size_t size)
 {
-  if (_readyState == State::OPEN) {
-    // In main thread
-    WsMessage* msg = new WsMessage();
-    msg->what = WS_MSG_TO_SUBTRHEAD_SENDING_STRING;
-    Data* data = new Data();
-    data->bytes = new char[message.length()+1];
-    strcpy(data->bytes, message.c_str());
-    data->len = static_cast<size_t>(message.length());
-    msg->obj = data;
-    _wsHelper->sendMessageToSubThread(msg);
-  }
+  ASSERT(size > 0);
+  _fragmentSize = size;
+}
+
+void WebSocket::setConnectAddress(const std::string& address)
+{
+  _connectAddress = address;
+}
+
+void WebSocket::setKeepalive(int interval, int timeout)
+{
+  _pingInterval = interval > 0 ? (uint64)interval * 1000 : 0;
+  _pingTimeout = (uint64)std::max(timeout, 1) * 1000;
+}
+
+int64 WebSocket::getRtt()
+{
+  return _rtt.load();
+}
+
+std::string WebSocket::getPeerAddress()
+{
+  return _readyState == State::OPEN ? _peerAddress : std::string();
 }
 
-void WebSocket::send(const unsigned char* binaryMsg, unsigned int len)
+bool WebSocket::send(const std::string& message)
+{
+  if (_readyState != State::OPEN) return false;
+
+  return queueMessage(_sendPool.Get(message.data(), message.length(), false));
+}
+
+bool WebSocket::send(const unsigned char* binaryMsg, unsigned int len)
 {
   ASSERT(binaryMsg != nullptr && len > 0);  // parameter invalid.
 
-  if (_readyState == State::OPEN)
-  {
-    // In main thread
-    WsMessage* msg = new WsMessage();
-    msg->what = WS_MSG_TO_SUBTRHEAD_SENDING_BINARY;
-    Data* data = new Data();
-    data->bytes = new char[len];
-    memcpy((void*)data->bytes, (void*)binaryMsg, len);
-    data->len = len;
-    msg->obj = data;
-    _wsHelper->sendMessageToSubThread(msg);
+  if (_readyState != State::OPEN) return false;
+
+  return queueMessage(_sendPool.Get((const char*)binaryMsg, len, true));
+}
+
+bool WebSocket::queueMessage(WsSendBuffer* buffer)
+{
+  if (!_wsHelper->sendMessageToSubThread(buffer)) {
+    webrtc::WEBRTC_TRACE(webrtc::kTraceError, webrtc::kTraceUndefined, -1,
+                         "websocket (%p) send queue overflowed, message dropped", this);
+    _sendPool.Put(buffer);
+    return false;
   }
+  return true;
 }
 
 void WebSocket::close()
@@ -298,7 +389,10 @@ void WebSocket::close()
                       "websocket (%p) connection closed by client", this);
   _readyState = State::CLOSED;
 
-  if (_wsHelper) _wsHelper->joinSubThread();
+  if (_wsHelper) {
+    wakeSubThread();
+    _wsHelper->joinSubThread();
+  }
     
   // onClose callback needs to be invoked at the end of this method
   // since websocket instance may be deleted in 'onClose'.
@@ -310,17 +404,58 @@ WebSocket::State WebSocket::getReadyState()
   return _readyState;
 }
 
+void WebSocket::wakeSubThread()
+{
+  // libwebsocket_service() returns at once; the context is only gone
+  // once the thread is on its way out.
+  std::lock_guard<std::mutex> lk(_contextMutex);
+  if (_wsContext) libwebsocket_cancel_service(_wsContext);
+}
+
 int WebSocket::onSubThreadLoop()
 {
   if (_readyState == State::CLOSED || _readyState == State::CLOSING) {
-    libwebsocket_context_destroy(_wsContext);
+    std::lock_guard<std::mutex> lk(_contextMutex);
+    if (_wsContext) libwebsocket_context_destroy(_wsContext);
+    _wsContext = nullptr;
     // return 1 to exit the loop.
     return 1;
   }
-    
-  if (_wsContext && _readyState != State::CLOSED && _readyState != State::CLOSING) {
-    libwebsocket_service(_wsContext, 10);
+
+  if (!_wsContext) return 1;
+
+  int timeout = kConnectingServiceTimeout;
+  if (_readyState == State::OPEN) {
+    bool pending = !_wsHelper->_subThreadSendQueue.empty() ||
+                   _wsHelper->hasOverflow();
+    timeout = -1;
+
+    if (_pingInterval > 0) {
+      uint64 now = NowMicros();
+      if (_pingSentAt && now - _pingSentAt >= _pingTimeout) {
+        // TCP may not notice for many minutes; the context goes next
+        // loop, and with it the connection.
+        webrtc::WEBRTC_TRACE(webrtc::kTraceError, webrtc::kTraceUndefined, -1,
+                             "websocket (%p) no pong in %d ms, connection dropped",
+                             this, (int)(_pingTimeout / 1000));
+        _readyState = State::CLOSING;
+        return 0;
+      }
+      if (!_pingSentAt && now >= _nextPingAt) {
+        _pingDue = true;
+        pending = true;
+      }
+      // Awake for the next ping, or to give up on the last one.
+      uint64 wake = _pingSentAt ? _pingSentAt + _pingTimeout : _nextPingAt;
+      timeout = (int)std::max<uint64>(wake > now ? (wake - now + 999) / 1000 : 0, 1);
+    }
+
+    // Asked for here rather than by the sender, since libwebsockets
+    // must only be called from this thread.
+    if (pending) libwebsocket_callback_on_writable(_wsContext, _wsInstance);
   }
+
+  libwebsocket_service(_wsContext, timeout);
     
   // return 0 to continue the loop.
   return 0;
@@ -348,7 +483,10 @@ void WebSocket::onSubThreadStarted()
   info.uid = -1;
   info.user = (void*)this;
     
-  _wsContext = libwebsocket_create_context(&info);
+  {
+    std::lock_guard<std::mutex> lk(_contextMutex);
+    _wsContext = libwebsocket_create_context(&info);
+  }
 
   if(nullptr != _wsContext) {
     _readyState = State::CONNECTING;
@@ -358,7 +496,8 @@ void WebSocket::onSubThreadStarted()
 
       if (_wsProtocols[i+1].callback != nullptr) name += ", ";
     }
-    _wsInstance = libwebsocket_client_connect(_wsContext, _host.c_str(), _port, _SSLConnection,
+    const std::string& address = _connectAddress.empty() ? _host : _connectAddress;
+    _wsInstance = libwebsocket_client_connect(_wsContext, address.c_str(), _port, _SSLConnection,
                                               _path.c_str(), _host.c_str(), _host.c_str(),
                                               name.c_str(), -1);
 
@@ -389,7 +528,6 @@ int WebSocket::onSocketCallback(struct libwebsocket_context *ctx,
     case LWS_CALLBACK_PROTOCOL_DESTROY:
     case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
       {
-        WsMessage* msg = nullptr;
         if (reason == LWS_CALLBACK_CLIENT_CONNECTION_ERROR
             || (reason == LWS_CALLBACK_PROTOCOL_DESTROY && _readyState == State::CONNECTING)
             || (reason == LWS_CALLBACK_DEL_POLL_FD && _readyState == State::CONNECTING)
@@ -404,6 +542,17 @@ int WebSocket::onSocketCallback(struct libwebsocket_context *ctx,
       break;
     case LWS_CALLBACK_CLIENT_ESTABLISHED:
       {
+        // Where the host name led, for the next connect to skip resolving.
+        sockaddr_storage peer;
+        socklen_t peerLen = sizeof(peer);
+        rtc::SocketAddress peerAddress;
+        if (getpeername(libwebsocket_get_socket_fd(wsi), (sockaddr*)&peer, &peerLen) == 0 &&
+            rtc::SocketAddressFromSockAddrStorage(peer, &peerAddress)) {
+          _peerAddress = peerAddress.ipaddr().ToString();
+        }
+
+        _nextPingAt = NowMicros() + _pingInterval;
+        _pingSentAt = 0;
         _readyState = State::OPEN;
                 
         /*
@@ -418,82 +567,60 @@ int WebSocket::onSocketCallback(struct libwebsocket_context *ctx,
             
     case LWS_CALLBACK_CLIENT_WRITEABLE:
       {
-        std::lock_guard<std::mutex> lk(_wsHelper->_subThreadWsMessageQueueMutex);
-                                               
-        std::list<WsMessage*>::iterator iter = _wsHelper->_subThreadWsMessageQueue->begin();
-                
-        int bytesWrite = 0;
-        for (; iter != _wsHelper->_subThreadWsMessageQueue->end();) {
-          WsMessage* subThreadMsg = *iter;
-                    
-          if ( WS_MSG_TO_SUBTRHEAD_SENDING_STRING == subThreadMsg->what
-                || WS_MSG_TO_SUBTRHEAD_SENDING_BINARY == subThreadMsg->what) {
-            Data* data = (Data*)subThreadMsg->obj;
-
-            const size_t c_bufferSize = WS_WRITE_BUFFER_SIZE;
+        SpscRing<WsSendBuffer*>& queue = _wsHelper->_subThreadSendQueue;
+        LwsFragmentSink sink(wsi);
+
+        // The ping goes ahead of the messages; its payload is the time it
+        // was sent, which the pong brings back.
+        if (_pingDue) {
+          unsigned char ping[LWS_SEND_BUFFER_PRE_PADDING + sizeof(uint64) +
+                             LWS_SEND_BUFFER_POST_PADDING];
+          uint64 now = NowMicros();
+          memcpy(&ping[LWS_SEND_BUFFER_PRE_PADDING], &now, sizeof(now));
+          libwebsocket_write(wsi, &ping[LWS_SEND_BUFFER_PRE_PADDING], sizeof(now),
+                             LWS_WRITE_PING);
+          _pingSentAt = now;
+          _pingDue = false;
+        }
 
-            size_t remaining = data->len - data->issued;
-            size_t n = std::min(remaining, c_bufferSize );
-            
-            //fixme: the log is not thread safe
-            webrtc::WEBRTC_TRACE(webrtc::kTraceInfo, webrtc::kTraceUndefined, -1,
-                                 "[websocket:send] total: %d, sent: %d, remaining: %d, buffer size: %d"
-                                 , static_cast<int>(data->len), static_cast<int>(data->issued)
-                                 , static_cast<int>(remaining), static_cast<int>(n));
-
-            unsigned char* buf = new unsigned char[LWS_SEND_BUFFER_PRE_PADDING + n + LWS_SEND_BUFFER_POST_PADDING];
-            memcpy((char*)&buf[LWS_SEND_BUFFER_PRE_PADDING], data->bytes + data->issued, n);
-                        
-            int writeProtocol;
-                        
-            if (data->issued == 0) {
-						  if (WS_MSG_TO_SUBTRHEAD_SENDING_STRING == subThreadMsg->what) {
-                writeProtocol = LWS_WRITE_TEXT;
-              }
-						  else {
-                writeProtocol = LWS_WRITE_BINARY;
-							}
-
-							// If we have more than 1 fragment
-							if (data->len > c_bufferSize)
-								writeProtocol |= LWS_WRITE_NO_FIN;
-            } else {
-              // we are in the middle of fragments
-              writeProtocol = LWS_WRITE_CONTINUATION;
-              // and if not in the last fragment
-              if (remaining != n)
-                writeProtocol |= LWS_WRITE_NO_FIN;
+        // Everything ready goes out now, fragment after fragment, until
+        // libwebsockets would only buffer it. A message leaves the queue
+        // once its last fragment is written.
+        WsSendBuffer** front;
+        _wsHelper->refillFromOverflow();
+        while ((front = queue.Front()) != nullptr) {
+          WsSendBuffer* buffer = *front;
+          WsWriteResult result = WsWriteFragment(buffer, _fragmentSize, &sink);
+
+          // The fragment may already be masked in place, so the message
+          // can't be written again; the connection goes with it, next
+          // loop, as on a ping timeout.
+          if (result == kWsWriteError) {
+            webrtc::WEBRTC_TRACE(webrtc::kTraceError, webrtc::kTraceUndefined, -1,
+                                 "websocket (%p) write failed, connection dropped", this);
+            _sendPool.Put(buffer);
+            queue.Pop();
+            _readyState = State::CLOSING;
+            return 0;
+          }
+          // Safely done!
+          if (result == kWsWriteDone) {
+            _sendPool.Put(buffer);
+            queue.Pop();
+            if (queue.empty()) {
+              _wsHelper->refillFromOverflow();
             }
+          }
+          if (sink.Choked()) {
+            break;
+          }
+        }
 
-            bytesWrite = libwebsocket_write(wsi,  &buf[LWS_SEND_BUFFER_PRE_PADDING], n, (libwebsocket_write_protocol)writeProtocol);
-            
-            //fixme: the log is not thread safe
-            webrtc::WEBRTC_TRACE(webrtc::kTraceInfo, webrtc::kTraceUndefined, -1,
-                                  "[websocket:send] bytesWrite => %d", bytesWrite);
+        /* get notified as soon as we can write the rest */
 
-            // Buffer overrun?
-            if (bytesWrite < 0) {
-              break;
-            }
-            // Do we have another fragments to send?
-            else if (remaining != n) {
-              data->issued += n;
-              break;
-            }
-            // Safely done!
-            else {
-              CC_SAFE_DELETE_ARRAY(data->bytes);
-              CC_SAFE_DELETE(data);
-              CC_SAFE_DELETE_ARRAY(buf);
-              _wsHelper->_subThreadWsMessageQueue->erase(iter++);
-              CC_SAFE_DELETE(subThreadMsg);
-            }
-          }
+        if (!queue.empty()) {
+          libwebsocket_callback_on_writable(ctx, wsi);
         }
-                
-        /* get notified as soon as we can write again */
-                
-        libwebsocket_callback_on_writable(ctx, wsi);
       }
       break;
             
@@ -512,23 +639,26 @@ int WebSocket::onSocketCallback(struct libwebsocket_context *ctx,
       }
       break;
             
+    case LWS_CALLBACK_CLIENT_RECEIVE_PONG:
+      {
+        uint64 sent;
+        if (in && len == sizeof(sent) && _pingSentAt) {
+          memcpy(&sent, in, sizeof(sent));
+          if (sent == _pingSentAt) {
+            int64 rtt = (int64)(NowMicros() - sent);
+            _rtt = rtt;
+            _pingSentAt = 0;
+            _nextPingAt = sent + _pingInterval;
+            SignalPongEvent(this, rtt);
+          }
+        }
+      }
+      break;
+
     case LWS_CALLBACK_CLIENT_RECEIVE:
       {
         if (in && len > 0) {
-          // Accumulate the data (increasing the buffer as we go)
-          if (_currentDataLen == 0) {
-            _currentData = new char[len];
-            memcpy (_currentData, in, len);
-            _currentDataLen = len;
-          }
-          else {
-            char *new_data = new char [_currentDataLen + len];
-            memcpy (new_data, _currentData, _currentDataLen);
-            memcpy (new_data + _currentDataLen, in, len);
-            CC_SAFE_DELETE_ARRAY(_currentData);
-            _currentData = new_data;
-            _currentDataLen = _currentDataLen + len;
-          }
+          _receiveMessage.Append((const char*)in, len);
 
           _pendingFrameDataLen = libwebsockets_remaining_packet_payload (wsi);
 
@@ -538,34 +668,17 @@ int WebSocket::onSocketCallback(struct libwebsocket_context *ctx,
                                 , _pendingFrameDataLen);
           }
                     
-          // If no more data pending, send it to the client thread
-          if (_pendingFrameDataLen == 0) {
-            char* bytes = nullptr;
-            Data* data = new Data();
-
-            if (lws_frame_is_binary(wsi)) {
-              bytes = new char[_currentDataLen];
-              data->isBinary = true;
-            }
-					  else {
-              bytes = new char[_currentDataLen+1];
-              bytes[_currentDataLen] = '\0';
-              data->isBinary = false;
-            }
-
-            memcpy(bytes, _currentData, _currentDataLen);
-
-            data->bytes = bytes;
-            data->len = _currentDataLen;
-
-            SignalReadEvent(this, *data);
+          // If no more data pending, send it to the client thread, straight
+          // from the receive buffer; it's reused for the next message.
+          if (_pendingFrameDataLen == 0 && libwebsocket_is_final_fragment(wsi)) {
+            Data data;
+            data.isBinary = lws_frame_is_binary(wsi) != 0;
+            data.bytes = _receiveMessage.data();
+            data.len = _receiveMessage.size();
 
-            CC_SAFE_DELETE_ARRAY(_currentData);
-            _currentData = nullptr;
-            _currentDataLen = 0;
+            SignalReadEvent(this, data);
 
-            CC_SAFE_DELETE_ARRAY(data->bytes);
-            CC_SAFE_DELETE(data);
+            _receiveMessage.Reset();
           }
         }
       }
@@ -2,9 +2,13 @@
 #define HOTLINE_TUNNEL_WEBSOCKET_H_
 #pragma once
 
+#include <atomic>
+#include <mutex>
 #include <string>
 #include <vector>
+#include "webrtc/base/basictypes.h"
 #include "webrtc/base/sigslot.h"
+#include "websocket_framing.h"
 
 struct libwebsocket;
 struct libwebsocket_context;
@@ -14,7 +18,6 @@ struct libwebsocket_protocols;
 namespace hotline {
 
 class WsThreadHelper;
-class WsMessage;
 
 class WebSocket
 {
@@ -61,7 +64,10 @@ public:
   sigslot::signal1<WebSocket*> SignalConnectEvent;
   sigslot::signal1<WebSocket*> SignalCloseEvent;
   sigslot::signal2<WebSocket*, const WebSocket::ErrorCode&> SignalErrorEvent;
+  // The data is NUL terminated and only valid during the call.
   sigslot::signal2<WebSocket*, const Data&, sigslot::multi_threaded_local> SignalReadEvent;
+  // A pong came back, after this many microseconds. On the websocket thread.
+  sigslot::signal2<WebSocket*, int64, sigslot::multi_threaded_local> SignalPongEvent;
 
   /**
    *  @brief  The initialized method for websocket.
@@ -74,14 +80,49 @@ public:
             const std::vector<std::string>* protocols = nullptr);
 
   /**
-   *  @brief Sends string data to websocket server.
+   *  @brief  Sets the largest fragment a message is written in, in bytes.
+   *          It needs to be invoked before init.
    */
-  void send(const std::string& message);
+  void setFragmentSize(size_t size);
 
   /**
-   *  @brief Sends binary data to websocket server.
+   *  @brief  Connects to this numeric address instead of resolving the
+   *          URL's host, which is still sent as the Host header. Not for
+   *          wss://, whose server name indication would be the address.
+   *          It needs to be invoked before init.
    */
-  void send(const unsigned char* binaryMsg, unsigned int len);
+  void setConnectAddress(const std::string& address);
+
+  /**
+   *  @brief  Pings the server every interval ms once open, and drops the
+   *          connection if a pong takes longer than timeout ms, which a
+   *          dead NAT mapping or a stalled server never sends. 0 for no
+   *          pings. It needs to be invoked before init.
+   */
+  void setKeepalive(int interval, int timeout);
+
+  /**
+   *  @brief  Round trip time of the last answered ping, microseconds; -1
+   *          before the first pong.
+   */
+  int64 getRtt();
+
+  /**
+   *  @brief  The numeric address of the server, once open; empty if
+   *          unknown.
+   */
+  std::string getPeerAddress();
+
+  /**
+   *  @brief  Sends string data to websocket server. Any thread may call it.
+   *  @return false if not open or too many messages are waiting.
+   */
+  bool send(const std::string& message);
+
+  /**
+   *  @brief Sends binary data to websocket server. Any thread may call it.
+   */
+  bool send(const unsigned char* binaryMsg, unsigned int len);
 
   /**
    *  @brief Closes the connection to server.
@@ -97,6 +138,10 @@ private:
   virtual void onSubThreadStarted();
   virtual int onSubThreadLoop();
   virtual void onSubThreadEnded();
+  bool queueMessage(WsSendBuffer* buffer);
+  // Makes the websocket thread return from libwebsocket_service(), to
+  // pick up a queued message or a close. Safe from any thread.
+  void wakeSubThread();
 
   friend class WebSocketCallbackWrapper;
   int onSocketCallback(struct libwebsocket_context *ctx,
@@ -109,16 +154,29 @@ private:
   std::string  _host;
   unsigned int _port;
   std::string  _path;
+  std::string  _connectAddress;
+  std::string  _peerAddress;   // written before SignalConnectEvent
 
   size_t _pendingFrameDataLen;
-  size_t _currentDataLen;
-  char *_currentData;
+  WsMessageAssembler _receiveMessage;
+
+  size_t _fragmentSize;
+  WsSendBufferPool _sendPool;
+
+  // Keepalive, in microseconds. The times are the websocket thread's.
+  uint64 _pingInterval;
+  uint64 _pingTimeout;
+  uint64 _nextPingAt;
+  uint64 _pingSentAt;    // of the unanswered ping, 0 if none
+  bool _pingDue;
+  std::atomic<int64> _rtt;
 
   friend class WsThreadHelper;
   WsThreadHelper* _wsHelper;
 
   struct libwebsocket*         _wsInstance;
   struct libwebsocket_context* _wsContext;
+  std::mutex _contextMutex;  // guards _wsContext against wakeSubThread()
   int _SSLConnection;
   struct libwebsocket_protocols* _wsProtocols;
 };
@@ -0,0 +1,218 @@
+#include "htn_config.h"
+
+#include <string.h>
+#include <algorithm>
+
+#include "webrtc/base/common.h"
+#include "webrtc/system_wrappers/interface/trace.h"
+#ifdef ARRAY_SIZE
+#undef ARRAY_SIZE
+#endif
+#include "libwebsockets.h"
+#include "websocket_framing.h"
+
+
+namespace hotline {
+
+///////////////////////////////////////////////////////////////////////////////
+// WsSendBuffer
+///////////////////////////////////////////////////////////////////////////////
+
+WsSendBuffer::WsSendBuffer(size_t capacity)
+  : issued(0)
+  , data_(new unsigned char[LWS_SEND_BUFFER_PRE_PADDING + capacity +
+                            LWS_SEND_BUFFER_POST_PADDING])
+  , pre_padding_(LWS_SEND_BUFFER_PRE_PADDING)
+  , capacity_(capacity)
+  , len_(0)
+  , binary_(false) {
+}
+
+WsSendBuffer::~WsSendBuffer() {
+  delete[] data_;
+}
+
+void WsSendBuffer::Assign(const char* bytes, size_t len, bool binary) {
+  ASSERT(len <= capacity_);
+  memcpy(payload(), bytes, len);
+  len_ = len;
+  binary_ = binary;
+  issued = 0;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// WsSendBufferPool
+///////////////////////////////////////////////////////////////////////////////
+
+WsSendBufferPool::WsSendBufferPool() {
+  for (int i = 0; i < kSizeClasses; ++i) {
+    free_[i].reserve(kMaxFreeBytes / (kMinSize << i));
+  }
+}
+
+WsSendBufferPool::~WsSendBufferPool() {
+  for (int i = 0; i < kSizeClasses; ++i) {
+    for (size_t j = 0; j < free_[i].size(); ++j) {
+      delete free_[i][j];
+    }
+  }
+}
+
+int WsSendBufferPool::SizeClass(size_t len) {
+  if (len > kMaxSize) return -1;
+
+  int size_class = 0;
+  size_t size = kMinSize;
+  while (size < len) {
+    size <<= 1;
+    size_class++;
+  }
+  return size_class;
+}
+
+WsSendBuffer* WsSendBufferPool::Get(const char* bytes, size_t len, bool binary) {
+  int size_class = SizeClass(len);
+  WsSendBuffer* buffer = NULL;
+
+  if (size_class >= 0) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!free_[size_class].empty()) {
+      buffer = free_[size_class].back();
+      free_[size_class].pop_back();
+    }
+  }
+
+  if (!buffer) {
+    buffer = new WsSendBuffer(size_class >= 0 ? (size_t)kMinSize << size_class : len);
+  }
+  buffer->Assign(bytes, len, binary);
+  return buffer;
+}
+
+void WsSendBufferPool::Put(WsSendBuffer* buffer) {
+  int size_class = SizeClass(buffer->capacity());
+
+  if (size_class >= 0 && ((size_t)kMinSize << size_class) == buffer->capacity()) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (free_[size_class].size() < (size_t)kMaxFreeBytes / buffer->capacity()) {
+      free_[size_class].push_back(buffer);
+      return;
+    }
+  }
+  delete buffer;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// WsWriteFragment
+///////////////////////////////////////////////////////////////////////////////
+
+WsWriteResult WsWriteFragment(WsSendBuffer* message, size_t fragment_size,
+                              WsFragmentSink* sink) {
+  size_t len = message->size();
+  size_t remaining = len - message->issued;
+  size_t n = std::min(remaining, fragment_size);
+
+  //fixme: the log is not thread safe
+  webrtc::WEBRTC_TRACE(webrtc::kTraceInfo, webrtc::kTraceUndefined, -1,
+                       "[websocket:send] total: %d, sent: %d, remaining: %d, buffer size: %d"
+                       , static_cast<int>(len), static_cast<int>(message->issued)
+                       , static_cast<int>(remaining), static_cast<int>(n));
+
+  int writeProtocol;
+
+  if (message->issued == 0) {
+    writeProtocol = message->binary() ? LWS_WRITE_BINARY : LWS_WRITE_TEXT;
+
+    // If we have more than 1 fragment
+    if (len > fragment_size)
+      writeProtocol |= LWS_WRITE_NO_FIN;
+  } else {
+    // we are in the middle of fragments
+    writeProtocol = LWS_WRITE_CONTINUATION;
+    // and if not in the last fragment
+    if (remaining != n)
+      writeProtocol |= LWS_WRITE_NO_FIN;
+  }
+
+  // libwebsockets writes the frame header into the bytes in front of the
+  // fragment, which are already sent (or the buffer's headroom), and may
+  // use the ones behind it, which are the next fragment's: keep those.
+  unsigned char* fragment = message->payload() + message->issued;
+  unsigned char tail[LWS_SEND_BUFFER_POST_PADDING];
+  bool last = remaining == n;
+  if (!last) memcpy(tail, fragment + n, sizeof(tail));
+
+  int bytesWrite = sink->WriteFragment(fragment, n, writeProtocol);
+
+  if (!last) memcpy(fragment + n, tail, sizeof(tail));
+
+  //fixme: the log is not thread safe
+  webrtc::WEBRTC_TRACE(webrtc::kTraceInfo, webrtc::kTraceUndefined, -1,
+                       "[websocket:send] bytesWrite => %d", bytesWrite);
+
+  // Buffer overrun?
+  if (bytesWrite < 0) {
+    return kWsWriteError;
+  }
+  // Do we have another fragments to send?
+  else if (!last) {
+    message->issued += n;
+    return kWsWriteMore;
+  }
+  // Safely done!
+  else {
+    message->issued = len;
+    return kWsWriteDone;
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// WsMessageAssembler
+///////////////////////////////////////////////////////////////////////////////
+
+WsMessageAssembler::WsMessageAssembler()
+  : data_(NULL)
+  , len_(0)
+  , capacity_(0) {
+}
+
+WsMessageAssembler::~WsMessageAssembler() {
+  delete[] data_;
+}
+
+void WsMessageAssembler::Reserve(size_t capacity) {
+  if (capacity <= capacity_) return;
+
+  size_t new_capacity = std::max<size_t>(capacity_ * 2, 4096);
+  while (new_capacity < capacity) new_capacity *= 2;
+
+  // One byte more for the NUL.
+  char* new_data = new char[new_capacity + 1];
+  if (len_) memcpy(new_data, data_, len_);
+  delete[] data_;
+  data_ = new_data;
+  capacity_ = new_capacity;
+}
+
+void WsMessageAssembler::Append(const char* in, size_t len) {
+  Reserve(len_ + len);
+  memcpy(data_ + len_, in, len);
+  len_ += len;
+  data_[len_] = '\0';
+}
+
+void WsMessageAssembler::Reset() {
+  len_ = 0;
+  if (capacity_ > kMaxKeptCapacity) {
+    delete[] data_;
+    data_ = NULL;
+    capacity_ = 0;
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+} // namespace hotline
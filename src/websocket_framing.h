@@ -0,0 +1,146 @@
+#ifndef HOTLINE_TUNNEL_WEBSOCKET_FRAMING_H_
+#define HOTLINE_TUNNEL_WEBSOCKET_FRAMING_H_
+#pragma once
+
+#include <stddef.h>
+#include <mutex>
+#include <vector>
+
+
+namespace hotline {
+
+//////////////////////////////////////////////////////////////////////
+// WsSendBuffer
+// One outgoing message, copied once into a buffer with the headroom and
+// tailroom libwebsocket_write() needs around every fragment, so each
+// fragment is written in place. Comes from a WsSendBufferPool.
+//
+class WsSendBuffer {
+public:
+  explicit WsSendBuffer(size_t capacity);
+  ~WsSendBuffer();
+
+  // Copies in a message of at most capacity() bytes and rewinds it.
+  void Assign(const char* bytes, size_t len, bool binary);
+
+  unsigned char* payload() { return data_ + pre_padding_; }
+  size_t size() const { return len_; }
+  size_t capacity() const { return capacity_; }
+  bool binary() const { return binary_; }
+
+  // Bytes already handed to the sink.
+  size_t issued;
+
+private:
+  unsigned char* data_;
+  size_t pre_padding_;
+  size_t capacity_;
+  size_t len_;
+  bool binary_;
+};
+
+
+//////////////////////////////////////////////////////////////////////
+// WsSendBufferPool
+// Recycles WsSendBuffers in power of two sizes from kMinSize to kMaxSize,
+// keeping up to kMaxFreeBytes of each size, so a burst of small messages
+// reuses many; larger messages get a buffer of their own. Get() and Put()
+// may be called from different threads.
+//
+class WsSendBufferPool {
+public:
+  enum {
+    kMinSize = 1024,
+    kMaxSize = 64 * 1024,
+    kMaxFreeBytes = 256 * 1024
+  };
+
+  WsSendBufferPool();
+  ~WsSendBufferPool();
+
+  // A buffer holding a copy of bytes.
+  WsSendBuffer* Get(const char* bytes, size_t len, bool binary);
+  void Put(WsSendBuffer* buffer);
+
+private:
+  enum { kSizeClasses = 7 };  // kMinSize << 0 .. kMaxSize
+
+  // The class of a buffer for len bytes, or -1 if it isn't pooled.
+  static int SizeClass(size_t len);
+
+  std::mutex mutex_;
+  std::vector<WsSendBuffer*> free_[kSizeClasses];
+};
+
+
+//////////////////////////////////////////////////////////////////////
+// WsFragmentSink
+// Where WsWriteFragment() puts a fragment: libwebsocket_write() in
+// WebSocket, or anything else that wants the frames.
+//
+class WsFragmentSink {
+public:
+  // buf has LWS_SEND_BUFFER_PRE_PADDING bytes of headroom in front and
+  // LWS_SEND_BUFFER_POST_PADDING behind. write_protocol is a
+  // libwebsocket_write_protocol. Returns a negative value on error.
+  virtual int WriteFragment(unsigned char* buf, size_t len, int write_protocol) = 0;
+  // True if another write now would only be buffered.
+  virtual bool Choked() { return false; }
+
+protected:
+  virtual ~WsFragmentSink() {}
+};
+
+
+enum WsWriteResult {
+  kWsWriteError,
+  kWsWriteMore,    // more fragments of the message to go
+  kWsWriteDone
+};
+
+// Writes the fragment of message starting at message->issued, at most
+// fragment_size bytes, in place, and advances issued past it. A client
+// sink masks the fragment where it is, so after kWsWriteError the message
+// can't be written again.
+WsWriteResult WsWriteFragment(WsSendBuffer* message, size_t fragment_size,
+                              WsFragmentSink* sink);
+
+
+//////////////////////////////////////////////////////////////////////
+// WsMessageAssembler
+// Collects the fragments of one incoming message until libwebsockets
+// reports no more payload pending, in a buffer that doubles as needed and
+// is kept for the next message, so assembling is linear in its size.
+//
+class WsMessageAssembler {
+public:
+  // Capacity kept between messages; a larger buffer is given back once
+  // its message is done.
+  enum { kMaxKeptCapacity = 1024 * 1024 };
+
+  WsMessageAssembler();
+  ~WsMessageAssembler();
+
+  void Append(const char* in, size_t len);
+  size_t size() const { return len_; }
+
+  // The message so far, NUL terminated (the NUL not counted in size()).
+  // Valid until the next Append() or Reset().
+  char* data() { return data_; }
+
+  // Starts a new message.
+  void Reset();
+
+private:
+  void Reserve(size_t capacity);
+
+  char* data_;
+  size_t len_;
+  size_t capacity_;
+};
+
+//////////////////////////////////////////////////////////////////////
+
+} // namespace hotline
+
+#endif  // HOTLINE_TUNNEL_WEBSOCKET_FRAMING_H_